@@ -0,0 +1,125 @@
+/*
+ * bench_fake.c
+ *
+ * Time the user-space side of event delivery: the reads, the lookups of
+ * the watch records and the dispatch to the callback. The context is put
+ * on the fake backend of fluffy_fake.h and events are injected on a
+ * watched directory of a scratch tree made under the given path; no
+ * kernel event reaches it. They're injected in batches, each one waited
+ * for till the callback has seen it; a batch must stay under
+ * max_queued_events, past that the fake drops events as inotify would.
+ *
+ * usage: bench_fake <scratch dir> [events] [batch]
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fluffy.h>
+#include <fluffy_fake.h>
+
+static unsigned long nevents = 0;
+static unsigned long noverflows = 0;
+
+static int
+bench_event(const struct fluffy_event_info *eventinfo, void *user_data)
+{
+	if (eventinfo->event_mask & FLUFFY_Q_OVERFLOW) {
+		__atomic_add_fetch(&noverflows, 1, __ATOMIC_RELAXED);
+	} else if (eventinfo->event_mask & FLUFFY_CREATE) {
+		__atomic_add_fetch(&nevents, 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static double
+bench_ms(const struct timespec *fromp, const struct timespec *top)
+{
+	return (top->tv_sec - fromp->tv_sec) * 1e3 +
+	    (top->tv_nsec - fromp->tv_nsec) / 1e6;
+}
+
+static int
+bench_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <scratch dir> [events] [batch]\n",
+		    argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *scratch = argv[1];
+	unsigned long ninject = (argc > 2) ? strtoul(argv[2], NULL, 10) :
+	    1000000;
+	unsigned long nbatch = (argc > 3) ? strtoul(argv[3], NULL, 10) : 8192;
+	if (nbatch == 0) {
+		nbatch = 1;
+	}
+
+	char dir[PATH_MAX];
+	if (snprintf(dir, sizeof(dir), "%s/dir", scratch) >=
+	    (int)sizeof(dir) || bench_mkdir(scratch) || bench_mkdir(dir)) {
+		exit(EXIT_FAILURE);
+	}
+
+	int flhandle = fluffy_init(bench_event, NULL);
+	if (flhandle < 1) {
+		fprintf(stderr, "fluffy_init fail\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fluffy_set_fake_backend(flhandle) ||
+	    fluffy_add_watch_path(flhandle, scratch)) {
+		fprintf(stderr, "Couldnot watch %s on the fake backend\n",
+		    scratch);
+		exit(EXIT_FAILURE);
+	}
+
+	/* A batch at a time, kept under max_queued_events */
+	struct timespec t0, t1;
+	struct timespec ts = {0, 50000};
+	char name[32];
+	unsigned long j = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (j < ninject) {
+		unsigned long k;
+		for (k = 0; k < nbatch && j < ninject; k++, j++) {
+			snprintf(name, sizeof(name), "f%lu", j);
+			if (fluffy_fake_inject(flhandle, dir, FLUFFY_CREATE,
+			    0, name)) {
+				fprintf(stderr, "fluffy_fake_inject fail\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		while (__atomic_load_n(&nevents, __ATOMIC_ACQUIRE) < j &&
+		    __atomic_load_n(&noverflows, __ATOMIC_RELAXED) == 0) {
+			nanosleep(&ts, NULL);
+		}
+		if (noverflows > 0) {
+			fprintf(stderr, "Overflowed, try a smaller batch\n");
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double ms = bench_ms(&t0, &t1);
+	printf("%lu events in batches of %lu: %.1f ms, %.0f events/s\n",
+	    nevents, nbatch, ms, (ms > 0) ? nevents * 1e3 / ms : 0.0);
+
+	fluffy_destroy(flhandle);
+	return 0;
+}
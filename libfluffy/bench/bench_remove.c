@@ -0,0 +1,125 @@
+/*
+ * bench_remove.c
+ *
+ * Time fluffy_remove_watch_path() on a large tree. A scratch tree of
+ * top/dN/eM directories is made under the given path, if it isn't there
+ * already, the whole of it is watched, and top is removed; the root path
+ * stays. The tree is left in place for the next run. With -s the inotify
+ * watch removal is stubbed out, leaving what fluffy spends finding and
+ * unlinking the records.
+ *
+ * usage: bench_remove [-s] <scratch dir> [dirs] [subdirs each]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fluffy.h>
+
+static int is_stub = 0;
+
+/* Takes the place of the libc wrapper, fluffy calls it through its backend */
+int
+inotify_rm_watch(int fd, int wd)
+{
+	if (is_stub) {
+		return 0;
+	}
+	return (int)syscall(SYS_inotify_rm_watch, fd, wd);
+}
+
+static int
+bench_event(const struct fluffy_event_info *eventinfo, void *user_data)
+{
+	return 0;
+}
+
+static double
+bench_ms(const struct timespec *fromp, const struct timespec *top)
+{
+	return (top->tv_sec - fromp->tv_sec) * 1e3 +
+	    (top->tv_nsec - fromp->tv_nsec) / 1e6;
+}
+
+static int
+bench_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int argi = 1;
+	if (argi < argc && strcmp(argv[argi], "-s") == 0) {
+		is_stub = 1;
+		argi++;
+	}
+	if (argi >= argc) {
+		fprintf(stderr, "usage: %s [-s] <scratch dir> [dirs] "
+		    "[subdirs each]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *scratch = argv[argi];
+	int ndirs = (argi + 1 < argc) ? atoi(argv[argi + 1]) : 100;
+	int nsubdirs = (argi + 2 < argc) ? atoi(argv[argi + 2]) : 1000;
+
+	char top[PATH_MAX];
+	char path[PATH_MAX];
+	if (snprintf(top, sizeof(top), "%s/top", scratch) >=
+	    (int)sizeof(top) || bench_mkdir(scratch) || bench_mkdir(top)) {
+		exit(EXIT_FAILURE);
+	}
+
+	int j, k;
+	for (j = 0; j < ndirs; j++) {
+		if (snprintf(path, sizeof(path), "%s/d%d", top, j) >=
+		    (int)sizeof(path) || bench_mkdir(path)) {
+			exit(EXIT_FAILURE);
+		}
+		for (k = 0; k < nsubdirs; k++) {
+			if (snprintf(path, sizeof(path), "%s/d%d/e%d", top, j,
+			    k) >= (int)sizeof(path) || bench_mkdir(path)) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	int flhandle = fluffy_init(bench_event, NULL);
+	if (flhandle < 1) {
+		fprintf(stderr, "fluffy_init fail\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct timespec t0, t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (fluffy_add_watch_path(flhandle, scratch)) {
+		fprintf(stderr, "fluffy_add_watch_path %s fail\n", scratch);
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (fluffy_remove_watch_path(flhandle, top)) {
+		fprintf(stderr, "fluffy_remove_watch_path %s fail\n", top);
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	printf("%d directories%s: add %.1f ms, remove %.1f ms\n",
+	    2 + ndirs + ndirs * nsubdirs, is_stub ? ", rm_watch stubbed" : "",
+	    bench_ms(&t0, &t1), bench_ms(&t1, &t2));
+
+	fluffy_destroy(flhandle);
+	return 0;
+}
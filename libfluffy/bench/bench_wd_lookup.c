@@ -0,0 +1,187 @@
+/*
+ * bench_wd_lookup.c
+ *
+ * Cost of resolving events to their watch records, through the paged wd
+ * array of fluffy.c itself. A scratch tree of N directories is watched on
+ * the fake backend of fluffy_fake.h, and events are injected on them at
+ * random, over 64 hot ones, and on a single one. Every event is read and
+ * looked up by its wd on the context thread; the gap between the runs is
+ * what the spread of wds costs. The injecting side, and its own lookup of
+ * the directory path, is the same in all three.
+ *
+ * usage: bench_wd_lookup <scratch dir> [watches] [events] [batch]
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fluffy.h>
+#include <fluffy_fake.h>
+
+#define NHOT		64	/* Hot directories */
+
+static unsigned long nevents = 0;
+static unsigned long noverflows = 0;
+
+static int
+bench_event(const struct fluffy_event_info *eventinfo, void *user_data)
+{
+	if (eventinfo->event_mask & FLUFFY_Q_OVERFLOW) {
+		__atomic_add_fetch(&noverflows, 1, __ATOMIC_RELAXED);
+	} else if (eventinfo->event_mask & FLUFFY_MODIFY) {
+		__atomic_add_fetch(&nevents, 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static double
+bench_ms(const struct timespec *fromp, const struct timespec *top)
+{
+	return (top->tv_sec - fromp->tv_sec) * 1e3 +
+	    (top->tv_nsec - fromp->tv_nsec) / 1e6;
+}
+
+static int
+bench_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Inject ninject events, a batch at a time kept under max_queued_events,
+ * on the directories picked from dirs[] by pickfn, and wait for all of
+ * them to be reported. Returns the time taken in ms, -1 on failure.
+ */
+static double
+bench_run(int flhandle, char **dirs, int ndirs, unsigned long ninject,
+    unsigned long nbatch, int (*pickfn)(unsigned long, int))
+{
+	struct timespec t0, t1;
+	struct timespec ts = {0, 50000};
+	unsigned long base = __atomic_load_n(&nevents, __ATOMIC_ACQUIRE);
+	unsigned long j = 0;
+	char name[32];
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (j < ninject) {
+		unsigned long k;
+		for (k = 0; k < nbatch && j < ninject; k++, j++) {
+			/* Names differ, identical events would coalesce */
+			snprintf(name, sizeof(name), "f%lu", j);
+			if (fluffy_fake_inject(flhandle,
+			    dirs[pickfn(j, ndirs)], FLUFFY_MODIFY, 0, name)) {
+				fprintf(stderr, "fluffy_fake_inject fail\n");
+				return -1;
+			}
+		}
+		while (__atomic_load_n(&nevents, __ATOMIC_ACQUIRE) - base < j &&
+		    __atomic_load_n(&noverflows, __ATOMIC_RELAXED) == 0) {
+			nanosleep(&ts, NULL);
+		}
+		if (noverflows > 0) {
+			fprintf(stderr, "Overflowed, try a smaller batch\n");
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return bench_ms(&t0, &t1);
+}
+
+static int
+bench_pick_random(unsigned long j, int ndirs)
+{
+	return rand() % ndirs;
+}
+
+static int
+bench_pick_hot(unsigned long j, int ndirs)
+{
+	return j % ((ndirs < NHOT) ? ndirs : NHOT);
+}
+
+static int
+bench_pick_one(unsigned long j, int ndirs)
+{
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <scratch dir> [watches] [events] "
+		    "[batch]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *scratch = argv[1];
+	int ndirs = (argc > 2) ? atoi(argv[2]) : 20000;
+	unsigned long ninject = (argc > 3) ? strtoul(argv[3], NULL, 10) :
+	    1000000;
+	unsigned long nbatch = (argc > 4) ? strtoul(argv[4], NULL, 10) : 8192;
+	if (ndirs < 1) {
+		ndirs = 1;
+	}
+	if (nbatch == 0) {
+		nbatch = 1;
+	}
+
+	char **dirs = calloc(ndirs, sizeof(char *));
+	if (dirs == NULL || bench_mkdir(scratch)) {
+		exit(EXIT_FAILURE);
+	}
+
+	int j;
+	char path[PATH_MAX];
+	for (j = 0; j < ndirs; j++) {
+		if (snprintf(path, sizeof(path), "%s/d%d", scratch, j) >=
+		    (int)sizeof(path) || bench_mkdir(path) ||
+		    (dirs[j] = strdup(path)) == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int flhandle = fluffy_init(bench_event, NULL);
+	if (flhandle < 1) {
+		fprintf(stderr, "fluffy_init fail\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fluffy_set_fake_backend(flhandle) ||
+	    fluffy_add_watch_path(flhandle, scratch)) {
+		fprintf(stderr, "Couldnot watch %s on the fake backend\n",
+		    scratch);
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	double ms_random = bench_run(flhandle, dirs, ndirs, ninject, nbatch,
+			       bench_pick_random);
+	double ms_hot = bench_run(flhandle, dirs, ndirs, ninject, nbatch,
+			    bench_pick_hot);
+	double ms_one = bench_run(flhandle, dirs, ndirs, ninject, nbatch,
+			    bench_pick_one);
+	if (ms_random < 0 || ms_hot < 0 || ms_one < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%d watches, %lu events: random wd %.1f ns, %d hot wds "
+	    "%.1f ns, one wd %.1f ns per event\n", ndirs, ninject,
+	    ms_random * 1e6 / ninject, NHOT, ms_hot * 1e6 / ninject,
+	    ms_one * 1e6 / ninject);
+
+	fluffy_destroy(flhandle);
+	for (j = 0; j < ndirs; j++) {
+		free(dirs[j]);
+	}
+	free(dirs);
+	return 0;
+}
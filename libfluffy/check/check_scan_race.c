@@ -0,0 +1,168 @@
+/*
+ * check_scan_race.c
+ *
+ * With FLUFFY_OPT_SCAN_NEW_DIRS, every entry of a new directory tree must
+ * be reported as created once. The race where inotify reports a directory
+ * created within a new directory after the scan of its parent already
+ * watched it is forced on the fake backend of fluffy_fake.h: the scan of
+ * a/ finds a/b/c/f, then the CREATE of a/b/c on a/b is injected.
+ *
+ * usage: check_scan_race <scratch dir>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fluffy.h>
+#include <fluffy_fake.h>
+
+#define CHECK_MAX_PATHS	64
+
+static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *check_paths[CHECK_MAX_PATHS];
+static int check_counts[CHECK_MAX_PATHS];
+static int check_npaths = 0;
+static int check_nsentinels = 0;
+
+static int
+check_event(const struct fluffy_event_info *eventinfo, void *user_data)
+{
+	if (!(eventinfo->event_mask & FLUFFY_CREATE)) {
+		return 0;
+	}
+
+	const char *base = strrchr(eventinfo->path, '/');
+	pthread_mutex_lock(&check_mutex);
+	if (base != NULL && strcmp(base, "/sentinel") == 0) {
+		check_nsentinels++;
+	} else {
+		int j;
+		for (j = 0; j < check_npaths; j++) {
+			if (strcmp(check_paths[j], eventinfo->path) == 0) {
+				break;
+			}
+		}
+		if (j == check_npaths && j < CHECK_MAX_PATHS) {
+			check_paths[j] = strdup(eventinfo->path);
+			check_npaths++;
+		}
+		if (j < check_npaths) {
+			check_counts[j]++;
+		}
+	}
+	pthread_mutex_unlock(&check_mutex);
+	return 0;
+}
+
+/* Events are read in order, once the sentinel is in all before it are */
+static int
+check_sync(int flhandle, const char *dir, int nsentinels)
+{
+	struct timespec ts = {0, 1000000};
+	int j;
+
+	if (fluffy_fake_inject(flhandle, dir, FLUFFY_CREATE, 0, "sentinel")) {
+		return -1;
+	}
+	for (j = 0; j < 5000; j++) {
+		pthread_mutex_lock(&check_mutex);
+		int n = check_nsentinels;
+		pthread_mutex_unlock(&check_mutex);
+		if (n >= nsentinels) {
+			return 0;
+		}
+		nanosleep(&ts, NULL);
+	}
+	return -1;
+}
+
+static int
+check_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <scratch dir>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *scratch = argv[1];
+	const char *names[] = {"a", "a/b", "a/b/c", "a/b/c/f"};
+	char paths[4][PATH_MAX];
+	int j;
+	for (j = 0; j < 4; j++) {
+		if (snprintf(paths[j], PATH_MAX, "%s/%s", scratch, names[j]) >=
+		    PATH_MAX) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int flhandle = fluffy_init(check_event, NULL);
+	if (flhandle < 1) {
+		fprintf(stderr, "fluffy_init fail\n");
+		exit(EXIT_FAILURE);
+	}
+	if (check_mkdir(scratch) || fluffy_set_fake_backend(flhandle) ||
+	    fluffy_set_context_options(flhandle, FLUFFY_OPT_SCAN_NEW_DIRS) ||
+	    fluffy_add_watch_path(flhandle, scratch) ||
+	    check_sync(flhandle, scratch, 1)) {
+		fprintf(stderr, "Couldnot watch %s on the fake backend\n",
+		    scratch);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The tree is made behind the fake backend's back */
+	FILE *fp = NULL;
+	if (check_mkdir(paths[0]) || check_mkdir(paths[1]) ||
+	    check_mkdir(paths[2]) || (fp = fopen(paths[3], "w")) == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+
+	/* a/ is scanned and a/b/c watched before its own CREATE is read */
+	if (fluffy_fake_inject(flhandle, scratch, FLUFFY_CREATE | FLUFFY_ISDIR,
+	    0, "a") || check_sync(flhandle, scratch, 2) ||
+	    fluffy_fake_inject(flhandle, paths[1], FLUFFY_CREATE | FLUFFY_ISDIR,
+	    0, "c") || check_sync(flhandle, scratch, 3)) {
+		fprintf(stderr, "Couldnot inject the events\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int nfail = 0;
+	for (j = 0; j < 4; j++) {
+		int k, count = 0;
+		for (k = 0; k < check_npaths; k++) {
+			if (strcmp(check_paths[k], paths[j]) == 0) {
+				count = check_counts[k];
+			}
+		}
+		if (count != 1) {
+			printf("FAIL: %s created %d times\n", paths[j], count);
+			nfail++;
+		}
+	}
+	if (check_npaths != 4) {
+		printf("FAIL: %d paths created, expected 4\n", check_npaths);
+		nfail++;
+	}
+	if (nfail == 0) {
+		printf("PASS: check_scan_race\n");
+	}
+
+	fluffy_destroy(flhandle);
+	return (nfail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -8,19 +8,28 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <dirent.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <ftw.h>
-#include <glib.h>
-#include <gmodule.h>
 
 #include "fluffy.h"
+#include "fluffy_fake.h"
 
 #define INOTIFY_EVENT_FLAGS	(IN_ALL_EVENTS	| \
 				IN_EXCL_UNLINK	| \
@@ -34,7 +43,110 @@
 				/* FTW_DEPTH	*/
 				/* FTW_CHDIR  	*/
 				
+/* Activity at the frontier of a FLUFFY_ROOT_LAZY root that deepens it */
+#define LAZY_ACTIVITY_FLAGS	(IN_CREATE	| \
+				IN_DELETE	| \
+				IN_MOVED_FROM	| \
+				IN_MOVED_TO	| \
+				IN_MODIFY	| \
+				IN_ATTRIB	| \
+				IN_CLOSE_WRITE)
+				/* Not reads, walks raise those */
+
+/* Changes of directory entries kept by the FLUFFY_OPT_OVERFLOW_RESCAN snaps */
+#define SNAP_EVENT_FLAGS	(IN_CREATE	| \
+				IN_DELETE	| \
+				IN_MOVED_FROM	| \
+				IN_MOVED_TO	| \
+				IN_MODIFY	| \
+				IN_ATTRIB	| \
+				IN_CLOSE_WRITE)
+
+/* Left out of the watch masks under FLUFFY_PRESSURE_SHED */
+#define PRESSURE_SHED_FLAGS	(IN_ACCESS	| \
+				IN_OPEN		| \
+				IN_CLOSE_NOWRITE)
+
+/*
+ * Events the fanotify marks are set for, FLUFFY_FANOTIFY_FILESYSTEM. The
+ * FAN_* bits are those of IN_*, FAN_ONDIR is IN_ISDIR.
+ */
+#define FANOTIFY_EVENT_FLAGS	(FAN_ACCESS	| \
+				FAN_MODIFY	| \
+				FAN_ATTRIB	| \
+				FAN_CLOSE	| \
+				FAN_OPEN	| \
+				FAN_MOVE	| \
+				FAN_CREATE	| \
+				FAN_DELETE	| \
+				FAN_DELETE_SELF	| \
+				FAN_MOVE_SELF	| \
+				FAN_ONDIR)
+
+/* Those a mount mark takes, FLUFFY_FANOTIFY_MOUNT */
+#define FANOTIFY_MOUNT_FLAGS	(FAN_ACCESS	| \
+				FAN_MODIFY	| \
+				FAN_CLOSE	| \
+				FAN_OPEN	| \
+				FAN_ONDIR)
+
+#define PRESSURE_HIGH_WATER	50	/* Default high_water, percent */
+#define PRESSURE_LOW_WATER	10	/* Default low_water, percent */
+#define PRESSURE_RAISE_TIMES	16	/* Default cap of raises, times */
+
+#define BUDGET_POLL_MIN_MS	1000	/* Default poll_min_ms */
+#define BUDGET_POLL_MAX_MS	30000	/* Default poll_max_ms */
+#define BUDGET_PROMOTIONS	8	/* Promotions per poll pass, at most */
+#define BUDGET_COLD_PASSES	2	/* Idle poll passes to be demoted */
+#define POLL_SCAN_THREADS	4	/* Directories listed at once */
+
+#define STORM_INTERVAL_MS	1000	/* Default interval_ms */
+
+#define BACKLOG_MAX_EVENTS	65536	/* Default max_events */
+#define BACKLOG_DROP_FLAGS	(IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE)
+#define BACKLOG_COALESCE_FLAGS	(IN_MODIFY | IN_CLOSE_WRITE)
+#define SPILL_SEGMENT_SIZE	(4 << 20) /* Bytes per spill segment */
+#define SPILL_MAX_BYTES		(1ULL << 30) /* Default max_spill_bytes */
+
+/* Bytes a spilled event of a path of len bytes takes, 8 byte aligned */
+#define SPILL_REC_SIZE(len)	((offsetof(struct fluffy_spill_rec, path) + \
+				(len) + 7) & ~(size_t)7)
+
+#define SLOW_NONE		0	/* Calls return within the deadline */
+#define SLOW_CAUGHT		1	/* Caught running late, not reported */
+#define SLOW_REPORTED		2	/* Reported, none in time since */
+#define WATCHDOG_IDLE_MS	1000	/* Watchdog sampling with no deadline */
+
+/* Events storm detection never holds back */
+#define STORM_EXEMPT_FLAGS	(IN_Q_OVERFLOW | IN_IGNORED | IN_UNMOUNT | \
+				IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define SHARDS_MAX		64	/* Shards of a context, at most */
+#define SHARD_QUEUE_MAX		16384	/* Events a shard gets ahead by */
+#define SHARD_WAIT_MS		100	/* Wait for room before going past */
+#define SHARD_RATE_MS		1000	/* Interval root rates are taken at */
+
+#define WD_PAGE_SLOTS		4096	/* Watch slots per page, power of 2 */
+#define HANDLE_INDEX_BITS	10	/* Handle bits indexing the registry */
+#define MAX_CONTEXTS		(1 << HANDLE_INDEX_BITS) /* Registry slots */
+#define HANDLE_GEN_MAX		((1u << (31 - HANDLE_INDEX_BITS)) - 1)
+#define HANDLE_CLOSING		(1u << 31)	/* Slot state, no more holds */
+#define HANDLE_HOLD		(1ull << 32)	/* A hold in the slot state */
+#define PATH_INDEX_MIN_SLOTS	64	/* Least path index slots, power of 2 */
+#define WD_SLAB_SIZE		16384	/* Bytes per watch record slab */
+#define ARENA_BLOCK_SIZE	65536	/* Bytes per path arena block */
+#define STR_TABLE_MIN_SLOTS	16	/* Least str table slots, power of 2 */
+#define EXCLUDE_LIST_MIN	4	/* Least exclude list length */
+#define SNAP_MIN_SLOTS		8	/* Least snapshot slots, power of 2 */
+#define SNAP_NAMES_MIN		256	/* Least snapshot name bytes */
+
 #define NR_INOTIFY_EVENTS	200
+#define DYING_BATCH		256	/* Dying watches retired per lock */
+#define FANOTIFY_BUF_SIZE	65536	/* Bytes read off fanotify at a time */
+#define FANOTIFY_DIR_CACHE	65536	/* Directories resolved, kept at most */
+#define FANOTIFY_FSID_LEN	(2 * sizeof(fsid_t)) /* fsid of a key, hex */
+#define FANOTIFY_KEY_LEN	(FANOTIFY_FSID_LEN + \
+				2 * (sizeof(int) + MAX_HANDLE_SZ) + 1)
 #define NR_EPOLL_EVENTS		20
 #define PRINT_STDOUT(fmt, ...)	\
                 do { fprintf(stdout, fmt, __VA_ARGS__); \
@@ -49,6 +161,38 @@
 
 /* Structure definitions */
 
+/*
+ * Struct:	fluffy_allocator
+ *
+ * Allocator set by the client with fluffy_set_allocator(), every allocation
+ * of fluffy goes through fluffy_malloc() and co. NULL functions stand for
+ * malloc(3) and co. Changed only while no context is live.
+ */
+struct fluffy_allocator {
+	void	*(*alloc_fn)(size_t size, void *alloc_ctx);
+	void	*(*realloc_fn)(void *ptr, size_t size, void *alloc_ctx);
+	void	(*free_fn)(void *ptr, void *alloc_ctx);
+	void	*alloc_ctx;	/* Passed on to the above */
+};
+
+/*
+ * Struct:	fluffy_handle_slot
+ *
+ * A slot of the handle registry, fluffy_track.handles. A fluffy_handle is
+ * the generation of its slot shifted over the slot index; the generation is
+ * bumped every time the slot is taken. state holds the generation, shifted
+ * by one, and whether the slot is live in its lowest bit. A handle resolves
+ * only while its slot is live with the same generation, so a handle that
+ * was destroyed doesn't resolve to a context that took its slot after.
+ * The upper half of state counts the calls holding the context. Holds are
+ * closed off as the context is destroyed, it's torn down once the calls
+ * holding it are done.
+ */
+struct fluffy_handle_slot {
+	uint64_t	state;		/* nheld, closing, gen, live */
+	struct fluffy_context_info *ctxinfop;	/* Context, atomic */
+};
+
 /*
  * Struct:	fluffy_track_info
  *
@@ -56,36 +200,124 @@
  * context info of every fluffy initiated instance.
  */
 struct fluffy_track_info {
-	int	idx;			/* fluffy_handle incrementer */
+	int	idx;			/* Registry slot to try next */
 	unsigned int	nref;		/* Count of fluffy instances */
 	unsigned int	is_init;	/* Check for first time setup */
 
 	/*
-	 * A hash table that holds context info of all fluffy instances.
+	 * Handle registry that holds context info of all fluffy instances.
+	 * Slots are taken and vacated with fluffy_track.mutex held, handles
+	 * are resolved without it; it's an array access.
 	 *
-	 * key:		type fluffy_context_info.handle
+	 * index:	fluffy_context_info.handle & (MAX_CONTEXTS - 1)
 	 * value:	pointer of fluffy_context_info
 	 */
-	GHashTable 	*context_table;
+	struct fluffy_handle_slot handles[MAX_CONTEXTS];
 
 	/*
-	 * Used as a global reference of fluffy_context_info from within
+	 * Used as a global reference of the walk in progress from within
 	 * function scope where fluffy_handle could not be passed as an
 	 * argument; nftw(). This must be accessed with care.
 	 */
-	struct fluffy_context_info *curr_ctxinfop;
+	struct fluffy_walk_info *curr_walkp;
+
+	struct fluffy_allocator alloc;	/* Client's allocator, if set */
 
 	pthread_mutex_t mutex;	/* Mutex for this struct access */
+
+	/* Instances of the fake backend, of all contexts; fake_mutex held */
+	struct fluffy_fake *fakes;
+	pthread_mutex_t fake_mutex;	/* Taken last, under any other */
+
+	/*
+	 * max_queued_events is system wide; contexts under queue pressure
+	 * share one raise, undone once the last of them lets go of it.
+	 */
+	unsigned int	nraised;	/* Contexts holding it raised */
+	unsigned int	raised_from;	/* Value before it was raised */
+	unsigned int	raised_to;	/* Value it was raised to last */
+	pthread_mutex_t raise_mutex;	/* Taken last, under any other */
 };
 
 /* Global initialization of tracking information */
 struct fluffy_track_info fluffy_track = {
-	1,				/* idx */
+	0,				/* idx */
 	0,				/* nref */
 	0,				/* is_init */
-	NULL,				/* context_table */
-	NULL,				/* fluffy_context_info */
-	PTHREAD_MUTEX_INITIALIZER};	/* pthread_mutex_t */
+	{{0, NULL}},			/* handles */
+	NULL,				/* fluffy_walk_info */
+	{NULL, NULL, NULL, NULL},	/* alloc */
+	PTHREAD_MUTEX_INITIALIZER,	/* pthread_mutex_t */
+	NULL,				/* fakes */
+	PTHREAD_MUTEX_INITIALIZER,	/* fake_mutex */
+	0,				/* nraised */
+	0,				/* raised_from */
+	0,				/* raised_to */
+	PTHREAD_MUTEX_INITIALIZER};	/* raise_mutex */
+
+/*
+ * Struct:	fluffy_exclude_list
+ *
+ * A list of exclude patterns, grown as patterns are added.
+ */
+struct fluffy_exclude_list {
+	struct fluffy_exclude_info **excls;
+	unsigned int	len;		/* Patterns in excls */
+	unsigned int	size;		/* Length of excls */
+};
+
+/*
+ * Struct:	fluffy_pending_queue
+ *
+ * A queue of fluffy_pending_event, linked through their next pointers.
+ */
+struct fluffy_pending_queue {
+	struct fluffy_pending_event *head;
+	struct fluffy_pending_event *tail;
+	unsigned int	length;
+};
+
+/*
+ * Struct:	fluffy_backend
+ *
+ * The calls the inotify handling makes for its instances and watches; those
+ * of inotify(7), or of the fake backend. A descriptor stands for an
+ * instance, it's polled on and read as inotify's would be.
+ */
+struct fluffy_backend {
+	int	(*init_fn)(void);		/* inotify_init1() */
+	int	(*add_watch_fn)(int fd, const char *path, uint32_t mask);
+	int	(*rm_watch_fn)(int fd, int wd);
+	ssize_t	(*read_fn)(int fd, void *buf, size_t len);
+	int	(*nread_fn)(int fd, int *nbytesp); /* ioctl() FIONREAD */
+	int	(*close_fn)(int fd);
+};
+
+/*
+ * Struct:	fluffy_fake
+ *
+ * An instance of the fake backend; an in-memory event queue that reads
+ * like inotify's, with an eventfd to poll on as its descriptor. Events are
+ * queued by fluffy_fake_inject(), and IN_IGNORED as watches are removed.
+ * A watch is of an inode, as with inotify.
+ */
+struct fluffy_fake {
+	int		fd;		/* eventfd, readable while queued */
+	char		*buf;		/* Events, laid out as inotify's */
+	size_t		head;		/* Offset of the first unread */
+	size_t		len;		/* Bytes of buf in use */
+	size_t		size;		/* Bytes of buf */
+	size_t		last;		/* Offset of the last queued */
+	unsigned int	nqueued;	/* Events unread */
+	unsigned int	limit;		/* max_queued_events, 0 for none */
+	int		is_overflow;	/* IN_Q_OVERFLOW is unread */
+	int		nwd;		/* Watch descriptors handed out */
+	size_t		nkeys;		/* Length of keys */
+	char		**keys;		/* Inode key of a wd, NULL if none */
+	struct fluffy_str_table *key_table;  /* Inode key to wd */
+	struct fluffy_str_table *path_table; /* Path last added to wd */
+	struct fluffy_fake *next;
+};
 
 /*
  * Struct:	fluffy_context_info
@@ -93,45 +325,230 @@ struct fluffy_track_info fluffy_track = {
  * Records kept and maintained for a particular fluffy instance
  */
 struct fluffy_context_info {
-	int handle;			/* fluffy_track.idx */
+	int handle;			/* Handle of its registry slot */
 	int is_persist;			/* Persist fluffy instance */
+	uint32_t options;		/* FLUFFY_OPT_* values ORed */
 	int inotify_fd;			/* Associated inotify descriptor */
+	const struct fluffy_backend *backend; /* What inotify_fd is of */
 	int epoll_fd;			/* Associated epoll descriptor */
+	int wake_fd;			/* eventfd to wake the context thread */
 	unsigned long long nwd;		/* Count of watches set up */
+	unsigned long long watch_bytes;	/* Bytes held by the watch records */
+	unsigned long long snapshot_bytes; /* Bytes held by the dir snapshots */
+	unsigned int	snap_clock;	/* Last fluffy_dir_snap.activity */
+	uint32_t	watch_mask;	/* Mask the watches are set with */
+
+	/* Queue pressure, see fluffy_set_queue_pressure() */
+	struct fluffy_queue_pressure pressure; /* Defaults filled in */
+	unsigned int	queue_limit;	/* max_queued_events of inotify_fd */
+	unsigned int	event_bytes;	/* Running average size of an event */
+	int		is_pressured;	/* Past high_water, not yet low_water */
+	int		is_raised;	/* Holds max_queued_events raised */
+
+	/* Watch budget, see fluffy_set_watch_budget() */
+	struct fluffy_watch_budget budget; /* Defaults filled in */
+	int		is_budget;	/* A budget is set, atomic */
+	unsigned int	nwatch_limit;	/* Watches set at ENOSPC, or 0 */
+	unsigned int	ndemoting;	/* Removed, IN_IGNORED unread */
+	uint16_t	budget_pass;	/* Poll passes made, wraps */
+	long long	poll_due_ms;	/* Next poll pass, CLOCK_MONOTONIC */
+
+	/* Storm detection, see fluffy_set_storm_detection() */
+	struct fluffy_storm_detection storm; /* Defaults filled in */
+	int		is_storm;	/* storm.rate isn't 0, atomic */
 
 	/*
-	 * A hash table that holds watch descriptor info of all watch paths.
+	 * Subtrees that events were read in lately, counted since
+	 * storm_from_ms. Both are the context thread's alone.
 	 *
-	 * key:		type fluffy_wd_info.wd
-	 * value:	pointer of fluffy_wd_info
+	 * key:		path of the subtree
+	 * value:	pointer of fluffy_storm_subtree
 	 */
-	GHashTable 	*wd_table;
+	struct fluffy_str_table *storm_table;
+	long long	storm_from_ms;
+
+	/* Backlog, see fluffy_set_backlog() */
+	struct fluffy_backlog backlog;	/* Defaults filled in */
+	int		is_backlog;	/* Its thread is started, atomic */
+	pthread_t	backlog_tid;	/* Thread that calls user_event_fn */
+	pthread_cond_t	backlog_cond;	/* Events held, or room made */
+	struct fluffy_pending_queue backlog_queue; /* Events held */
+	unsigned long long ndropped;	/* Shed off a full backlog */
+	unsigned long long ncoalesced;	/* Merged into one held already */
+	char		*spill_dir;	/* fluffy_backlog.spill_dir, or NULL */
+	struct fluffy_spill_seg *spill_head; /* Handed off from */
+	struct fluffy_spill_seg *spill_tail; /* Appended to */
+	unsigned long long spill_bytes;	/* Of the events spilled */
+	unsigned long long nspilled;	/* Events spilled, after the queue */
 
 	/*
-	 * A hash table that holds watch descriptor info of all watch paths.
+	 * Events on backlog_queue that a later one of the same path may be
+	 * merged into, of fluffy_backlog.coalesce_mask.
 	 *
-	 * key:		type fluffy_wd_info.path
+	 * key:		event path
+	 * value:	pointer of fluffy_pending_event, not owned
+	 */
+	struct fluffy_str_table *coalesce_table;
+
+	/* Callback timing, see fluffy_set_callback_deadline() */
+	struct fluffy_callback_deadline deadline; /* Fields atomic */
+	struct fluffy_latency latency;	/* Fields atomic */
+	long long	call_from_us;	/* Call running since, or 0; atomic */
+	int		slow_state;	/* SLOW_*, atomic */
+	int		is_watchdog;	/* Its thread is started, atomic */
+	pthread_t	watchdog_tid;	/* Thread that samples the callback */
+
+	/* fanotify backend, see fluffy_set_fanotify() */
+	int		fanotify_fd;	/* fanotify descriptor, -1 if none */
+	unsigned int	fan_mark;	/* FAN_MARK_*, 0 with inotify, atomic */
+	uint64_t	fan_mask;	/* Mask the marks are set with */
+	unsigned int	nfan_marks;	/* Marks set */
+
+	/*
+	 * Filesystems the root paths are on, file handles are resolved with
+	 * open_by_handle_at() on them.
+	 *
+	 * key:		fsid, fluffy_fan_key()
+	 * value:	pointer of fluffy_fan_fs
+	 */
+	struct fluffy_str_table *fan_fs_table;
+
+	/*
+	 * Root paths by their file handle, for their self events.
+	 *
+	 * key:		fsid and file handle, fluffy_fan_key()
+	 * value:	root path
+	 */
+	struct fluffy_str_table *fan_root_table;
+
+	/*
+	 * Directories resolved off their file handles. Emptied when one is
+	 * moved, when root paths or excludes change, and once it holds
+	 * FANOTIFY_DIR_CACHE of them; per batch of events with mount marks.
+	 *
+	 * key:		fsid and file handle, fluffy_fan_key()
+	 * value:	pointer of fluffy_fan_dir
+	 */
+	struct fluffy_str_table *fan_dir_table;
+
+	/*
+	 * Directories polled rather than watched, past the watch budget.
+	 *
+	 * key:		path
+	 * value:	pointer of fluffy_poll_dir
+	 */
+	struct fluffy_str_table *poll_table;
+	unsigned int	npolled;	/* Size of poll_table, atomic */
+
+	/*
+	 * The context thread reads wd_dir, path_index and the records they
+	 * point to without taking the mutex. Writers, holding the mutex,
+	 * publish changes with atomic stores and never free anything the
+	 * context thread may be reading; it's put on the retired list instead.
+	 * The context thread frees the list between two batches of events,
+	 * when it holds no reference; a quiescent state.
+	 */
+
+	/* Shards, see fluffy_set_shards() */
+	struct fluffy_shard *shards;	/* nshards of them, NULL if none */
+	unsigned int	nshards;	/* Set once, atomic */
+	unsigned int	hot_rate;	/* fluffy_shard_options.hot_rate */
+	long long	rate_from_ms;	/* Root events counted since */
+	long long	rate_due_ms;	/* Next look at the root rates */
+	int		is_moving;	/* A hot root path is being moved */
+	int		is_ending;	/* Being destroyed, atomic */
+	int		parent;		/* Sharded context of a shard, or 0 */
+	pthread_cond_t	shard_cond;	/* Room on pending_queue for shards */
+
+	/*
+	 * Root paths of a sharded context; they're watched by its shards.
+	 *
+	 * key:		root path
+	 * value:	pointer of fluffy_shard_root
+	 */
+	struct fluffy_str_table *shard_table;
+
+	/*
+	 * Watch descriptor info of all watch paths, indexed by the watch
+	 * descriptor itself. inotify hands out small and dense descriptors,
+	 * wd N is slot N % WD_PAGE_SLOTS of page N / WD_PAGE_SLOTS. A page is
+	 * allocated on first use and retired once it's empty; descriptors keep
+	 * growing as watches come and go. The records are owned here.
+	 *
+	 * index:	type fluffy_wd_info.wd
 	 * value:	pointer of fluffy_wd_info
 	 */
-	GHashTable 	*path_table;
+	struct fluffy_wd_dir *wd_dir;
 
 	/*
-	 * A search tree that's ordered by watch path. This is primarily used
-	 * to lookup descendents of a path.
+	 * An open addressing hash index of all watch paths.
 	 *
 	 * key:		type fluffy_wd_info.path
-	 * value:	NULL
+	 * value:	pointer of fluffy_wd_info
+	 */
+	struct fluffy_path_index *path_index;
+
+	/* Memory to be freed by the context thread at a quiescent state */
+	struct fluffy_retired *retired;
+
+	/*
+	 * Watches being replaced by a reinitiation, NULL when there's none.
+	 * The instance above is new; it's set up while the old one goes on
+	 * delivering. Atomic.
+	 */
+	struct fluffy_watch_gen *old_gen;
+	int		is_building;	/* Its thread is started, atomic */
+	pthread_t	build_tid;	/* Thread that sets the new watches */
+
+	/*
+	 * Slab of the watch records and arena of their paths. It's swapped
+	 * for an empty one on reinitiation, and released in bulk.
 	 */
-	GTree 		*path_tree;
+	struct fluffy_wd_alloc *wd_alloc;
 
 	/*
 	 * A hash table that holds watch descriptor info of root watch paths.
 	 * This contains only what was added through fluffy_add_watch_path().
 	 *
 	 * key:		type fluffy_wd_info.path
+	 * value:	pointer of fluffy_root_info
+	 */
+	struct fluffy_str_table *root_path_table;
+	unsigned int	nroots;		/* Size of root_path_table, atomic */
+
+	/*
+	 * Exclude patterns that apply to every root path of the context.
+	 *
+	 * value:	pointer of fluffy_exclude_info
+	 */
+	struct fluffy_exclude_list exclude_list;
+
+	/*
+	 * A queue of events that fluffy synthesized rather than read from
+	 * inotify. They are handed off in order by the context thread.
+	 *
+	 * value:	pointer of fluffy_pending_event
+	 */
+	struct fluffy_pending_queue pending_queue;
+
+	/*
+	 * A hash table that holds paths of synthesized CREATE events which
+	 * inotify may report again on its own. It's emptied once the inotify
+	 * queue has been drained past the point of synthesis.
+	 *
+	 * key:		event path
 	 * value:	NULL
 	 */
-	GHashTable 	*root_path_table;
+	struct fluffy_str_table *synth_table;
+	unsigned int	nsynth;		/* Size of synth_table, atomic */
+
+	/*
+	 * Count of walks in progress that queue events on pending_queue. The
+	 * context thread waits on walk_cond for these to finish before it
+	 * hands off events read from inotify.
+	 */
+	unsigned int	nreport_walks;
+	pthread_cond_t	walk_cond;
 
 	/* A user defined function that is called on every appropriate event */
 	int (*user_event_fn) (const struct fluffy_event_info *eventinfo,
@@ -150,1084 +567,10893 @@ struct fluffy_context_info {
  */
 struct fluffy_wd_info {
 	int 		wd;		/* Watch descriptor from inotify */
+	uint32_t	gen;		/* fluffy_wd_slot.gen when it was set */
 	uint32_t	mask;		/* Event mask on this wd */
-	char 		*path;		/* Associated path */
-};
+	uint32_t	hash;		/* fluffy_path_hash() of path */
+	uint16_t	depth;		/* Levels below its root path */
+	uint16_t	seen;		/* budget_pass of its last activity */
+	uint8_t		is_frontier;	/* Lazy root, subdirs left unwatched */
+	uint8_t		is_root;	/* It's a root path, atomic */
+	uint8_t		is_dying;	/* IN_IGNORED on its way, atomic */
+	uint8_t		slab_idx;	/* Index in fluffy_wd_slab.recs,
+					   WD_SLAB_RECORDS is below 256 */
+
+	/* Entries of the directory, FLUFFY_OPT_OVERFLOW_RESCAN; NULL if none */
+	struct fluffy_dir_snap *snap;
 
+	/*
+	 * Directory node tree; the watch of the parent directory, if it's
+	 * watched, and the watches of the subdirectories. Descendants of a
+	 * path are looked up through this.
+	 */
+	struct fluffy_wd_info *parent;
+	struct fluffy_wd_info *first_child;
+	struct fluffy_wd_info *prev_sibling;
+	struct fluffy_wd_info *next_sibling;
 
-/* Forward function declarations */
-
-static struct fluffy_context_info *fluffy_context_info_new();
+	/*
+	 * Associated path. Its bytes are held by the path arena of
+	 * fluffy_context_info.wd_alloc, which may move them; atomic.
+	 */
+	char 		*path;
+};
 
-static struct fluffy_wd_info *fluffy_wd_info_new();
+/*
+ * Struct:	fluffy_wd_slot
+ *
+ * A slot of a page of fluffy_context_info.wd_dir. The generation is bumped
+ * every time the slot is taken or vacated, the record keeps the one it was
+ * set with. A record that doesn't match its slot has been replaced, the wd
+ * was handed out again.
+ */
+struct fluffy_wd_slot {
+	struct fluffy_wd_info	*wdinfop;
+	uint32_t		gen;
+};
 
-static void free_wd_table_info_g(struct fluffy_wd_info *wdinfop);
+struct fluffy_wd_page {
+	unsigned int		nused;	/* Slots in use */
+	uint32_t		maxgen;	/* Highest generation of the slots */
+	struct fluffy_wd_slot	slots[WD_PAGE_SLOTS];
+};
 
-static void free_context_table_info_g(struct fluffy_context_info *ctxinfop);
+/*
+ * The generations of a page that's retired live on in gen_bases, a page
+ * set up again at the index starts its slots past them. gen_bases is laid
+ * out after pages, in the same allocation.
+ */
+struct fluffy_wd_dir {
+	unsigned int		npages;	/* Length of pages */
+	uint32_t		*gen_bases; /* Generation a page starts at */
+	struct fluffy_wd_page	*pages[];
+};
 
-static void watch_each_root_path_g(gpointer root_path, gpointer value,
-    gpointer fluffy_handle);
+/*
+ * Struct:	fluffy_path_index
+ *
+ * Open addressing, linear probing hash index of the watch records by path.
+ * Slots hold NULL when empty, &path_index_tomb when deleted. Only a writer
+ * holding the context mutex changes it; it grows by building a new index
+ * which is then published.
+ */
+struct fluffy_path_index {
+	unsigned int		size;	/* Slots, a power of 2 */
+	unsigned int		nused;	/* Slots holding a record */
+	unsigned int		ntomb;	/* Slots holding a tombstone */
+	struct fluffy_wd_info	*slots[];
+};
 
-static void reinit_each_context_g(gpointer root_path, gpointer value,
-    gpointer fluffy_handle);
+/*
+ * Struct:	fluffy_wd_alloc
+ *
+ * Allocator of the watch records and their paths, one per context. Records
+ * are of a fixed size, handed out of slabs of WD_SLAB_SIZE bytes; a record
+ * finds its slab by its index in it. A freed record goes on the free list of
+ * its slab; a slab left empty goes back to the heap, but for one spare. Path
+ * bytes are bumped off arena blocks; a freed path only adds to dead_bytes.
+ * Once those outweigh the live bytes, the live paths move to a new block.
+ * Everything goes at once when the allocator is released.
+ */
+struct fluffy_wd_alloc {
+	struct fluffy_wd_slab	*slabs;		/* Every slab */
+	struct fluffy_wd_slab	*avail;		/* Slabs with a free record */
+	struct fluffy_wd_slab	*spare;		/* An empty slab kept around */
+	struct fluffy_arena_block *blocks;	/* Newest first, bumped off */
+	size_t			live_bytes;	/* Path bytes in use */
+	size_t			dead_bytes;	/* Path bytes freed */
+};
 
-static gint search_tree_g(gpointer pathname, gpointer compare_path);
+struct fluffy_wd_slab {
+	struct fluffy_wd_slab	*prev;		/* fluffy_wd_alloc.slabs */
+	struct fluffy_wd_slab	*next;
+	struct fluffy_wd_slab	*avail_prev;	/* fluffy_wd_alloc.avail */
+	struct fluffy_wd_slab	*avail_next;
+	struct fluffy_wd_info	*free_list;	/* Linked by next_sibling */
+	unsigned int		nused;		/* Records of recs ever used */
+	unsigned int		nlive;		/* Records handed out now */
+	struct fluffy_wd_info	recs[];
+};
 
-static char *form_event_path(char *wdpath, uint32_t ilen, char *iname);
+/* Records that fit in a slab */
+#define WD_SLAB_RECORDS	((WD_SLAB_SIZE - sizeof(struct fluffy_wd_slab)) / \
+			    sizeof(struct fluffy_wd_info))
 
-static int dir_tree_add_watch(const char *pathname, const struct stat *sbuf,
-    int type, struct FTW *ftwb);
+struct fluffy_arena_block {
+	struct fluffy_arena_block *next;
+	size_t			size;	/* Length of bytes */
+	size_t			used;	/* Bytes bumped off */
+	char			bytes[];
+};
 
-static int fluffy_setup_context(int fluffy_handle);
+/*
+ * Struct:	fluffy_str_table
+ *
+ * Open addressing, linear probing hash table with string keys, copied in
+ * and owned by the table. Values are freed by free_fn, if any, when their
+ * entry is replaced or removed. Slots hold a NULL key when empty,
+ * &str_table_tomb when deleted. The context mutex must be held.
+ */
+struct fluffy_str_table {
+	unsigned int	size;		/* Length of slots, power of 2 */
+	unsigned int	nused;		/* Keys held */
+	unsigned int	ntomb;		/* Deleted slots */
+	void		(*free_fn)(void *);	/* Frees values, may be NULL */
+	struct fluffy_str_slot *slots;
+};
 
-static int fluffy_add_watch(int fluffy_handle, const char *pathtoadd, int
-    is_real_path_check, int is_root_path);
+struct fluffy_str_slot {
+	char		*key;
+	void		*value;
+	uint32_t	hash;		/* fluffy_path_hash() of key */
+};
 
-static int fluffy_setup_track();
+/*
+ * Struct:	fluffy_dir_snap
+ *
+ * The entries of a watched directory as last seen, for the rescan of
+ * FLUFFY_OPT_OVERFLOW_RESCAN. An open addressing, linear probing hash table;
+ * a slot refers to its name by offset in names, where it's preceded by a
+ * type byte, 'd' for a directory and 'f' for anything else. Offset
+ * SNAP_EMPTY marks an empty slot, SNAP_TOMB a deleted one. Removed names
+ * are left in place until the table is rebuilt. The context mutex must be
+ * held, unless the snapshot is not yet hung on a record.
+ */
+struct fluffy_snap_slot {
+	uint64_t	ino;		/* Inode, 0 when not known */
+	uint64_t	stamp;		/* fluffy_snap_stamp(), 0 if unknown */
+	uint32_t	hash;		/* fluffy_path_hash() of the name */
+	uint32_t	name;		/* Offset of the type byte in names */
+};
 
-static int fluffy_is_track_setup();
+struct fluffy_dir_snap {
+	unsigned int	size;		/* Length of slots, power of 2 */
+	unsigned int	nused;		/* Entries held */
+	unsigned int	ntomb;		/* Deleted slots */
+	unsigned int	activity;	/* snap_clock at the last event */
+	uint32_t	names_len;	/* Bytes of names in use */
+	uint32_t	names_size;	/* Bytes allocated for names */
+	uint32_t	names_dead;	/* Bytes of removed names */
+	char		*names;
+	struct fluffy_snap_slot slots[];
+};
 
-static int fluffy_ref();
+#define SNAP_EMPTY	0
+#define SNAP_TOMB	1
 
-static int fluffy_unref(int fluffy_handle);
+/*
+ * Struct:	fluffy_watch_gen
+ *
+ * The inotify instance and tables of watches being replaced. The context
+ * thread resolves the events of the old instance through these, and hands
+ * them off, until the new watches are all set. It then reads what's left,
+ * closes the old instance and switches over. Events the new instance
+ * queued in the meantime on directories the old one watched as well were
+ * handed off already; the tables are kept until they're read past. Only
+ * the context thread reads these, and frees them.
+ */
+struct fluffy_watch_gen {
+	int		inotify_fd;	/* Old instance, -1 once switched */
+	const struct fluffy_backend *backend; /* What inotify_fd is of */
+	int		is_ready;	/* New watches are set, atomic */
+	int		is_lossy;	/* Old instance overflowed meanwhile */
+	int		ndup_bytes;	/* New queue left to deduplicate */
+	struct fluffy_wd_dir *wd_dir;
+	struct fluffy_path_index *path_index;
+	struct fluffy_wd_alloc *wd_alloc;
+};
 
-static void fluffy_destroy_context(void *fluffy_handle);
+/*
+ * Struct:	fluffy_path_list
+ *
+ * A growing array of paths, owned
+ */
+struct fluffy_path_list {
+	char		**paths;
+	size_t		len;
+	size_t		size;
+};
 
-static struct fluffy_context_info *fluffy_get_context_info(int fluffy_handle);
+/*
+ * Struct:	fluffy_retired
+ *
+ * Memory that may still be read by the context thread, freed by free_fn at
+ * its next quiescent state.
+ */
+struct fluffy_retired {
+	struct fluffy_retired	*next;
+	void			*ptr;
+	void			(*free_fn)(void *);
+};
 
-static int fluffy_setup_context_info_records(int fluffy_handle);
+/*
+ * Struct:	fluffy_wd_retired
+ *
+ * A watch record that may still be read by the context thread, retired to
+ * be put back on its slab. Freed by fluffy_wd_info_retired().
+ */
+struct fluffy_wd_retired {
+	struct fluffy_context_info *ctxinfop;	/* Context it belongs to */
+	struct fluffy_wd_alloc	*allocp;	/* Allocator it came from */
+	struct fluffy_wd_info	*wdinfop;	/* Record */
+};
 
-static int fluffy_cleanup_context_info_records(int fluffy_handle);
+/*
+ * Struct:	fluffy_root_info
+ *
+ * Records kept and maintained for a root path; the value held by
+ * fluffy_context_info.root_path_table. A walk in progress holds a reference
+ * so that the record outlives its removal from the table.
+ */
+struct fluffy_root_info {
+	unsigned int	nref;		/* References held, freed at zero */
+	uint32_t	flags;		/* FLUFFY_ROOT_* values ORed */
+	unsigned int	depth;		/* Components in the root path */
+	unsigned int	max_depth;	/* fluffy_root_options.max_depth */
+	unsigned int	lazy_depth;	/* fluffy_root_options.lazy_depth */
+	unsigned int	lazy_max_watches; /* Cap on nlazy_watches, 0 none */
+	unsigned int	nlazy_watches;	/* Watches set below lazy_depth */
+	unsigned int	poll_min_ms;	/* FLUFFY_ROOT_POLL, defaults filled */
+	unsigned int	poll_max_ms;	/* FLUFFY_ROOT_POLL, defaults filled */
+	int		fan_fd;		/* fanotify: O_PATH of it, -1 if none */
+	int		fan_mnt_id;	/* fanotify: mount ID of the root */
+	char		*fan_key;	/* fanotify: fluffy_fan_key() of it */
+	unsigned int	nctx_excludes;	/* Context excludes it was walked by */
 
-static int fluffy_initiate_epoll(int fluffy_handle);
+	/*
+	 * Exclude patterns that apply to this root path only.
+	 *
+	 * value:	pointer of fluffy_exclude_info
+	 */
+	struct fluffy_exclude_list exclude_list;
+};
 
-static int fluffy_initiate_inotify(int fluffy_handle);
+/*
+ * Struct:	fluffy_fan_fs
+ *
+ * A filesystem the root paths of a fanotify context are on
+ */
+struct fluffy_fan_fs {
+	int		mount_fd;	/* For open_by_handle_at() */
+	unsigned int	nroots;		/* Root paths on it */
+};
 
-static int fluffy_is_root_path(int fluffy_handle, char *path);
+/*
+ * Struct:	fluffy_fan_dir
+ *
+ * A directory resolved off its file handle by the fanotify backend. The
+ * root record isn't referenced; the cache is emptied as root paths change.
+ */
+struct fluffy_fan_dir {
+	struct fluffy_root_info *rootinfop; /* Its root, NULL if left out */
+	char		path[];
+};
 
-static int fluffy_handle_qoverflow(int fluffy_handle);
+/*
+ * Struct:	fluffy_fan_users
+ *
+ * Root paths that share the fanotify mark of a root path
+ */
+struct fluffy_fan_users {
+	const struct fluffy_root_info *rootinfop; /* Root path to match */
+	unsigned int	fan_mark;	/* fluffy_context_info.fan_mark */
+	unsigned int	nusers;		/* Others found on the same mark */
+};
 
-static int fluffy_handle_removal(int fluffy_handle, char *removethis);
+/*
+ * Struct:	fluffy_exclude_info
+ *
+ * A compiled exclude pattern
+ */
+struct fluffy_exclude_info {
+	int		type;		/* FLUFFY_EXCLUDE_* */
+	char		*pattern;	/* Pattern as received */
+	int		is_path_glob;	/* Glob is matched with the full path */
+	regex_t		regex;		/* Compiled FLUFFY_EXCLUDE_REGEX */
+};
 
-static int fluffy_handle_addition(int fluffy_handle,
-    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+/*
+ * Struct:	fluffy_pending_event
+ *
+ * An event synthesized by fluffy, queued until the context thread hands it
+ * off to the client.
+ */
+struct fluffy_pending_event {
+	struct fluffy_pending_event *next;	/* Queued after this one */
+	uint32_t	mask;		/* Event mask to hand off */
+	unsigned int	shard;		/* fluffy_event_info.shard */
+	unsigned long long seq;		/* fluffy_event_info.seq */
+	char		path[];		/* Event path */
+};
 
-static int fluffy_handle_moved_from(int fluffy_handle,
-    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
-;
-static int fluffy_handle_ignored(int fluffy_handle,
-    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+/*
+ * Struct:	fluffy_spill_seg
+ *
+ * A segment of the backlog spilled to disk; a file in the spill directory,
+ * unlinked, mapped whole.
+ */
+struct fluffy_spill_seg {
+	struct fluffy_spill_seg *next;	/* Spilled after this one */
+	int		fd;
+	char		*base;		/* SPILL_SEGMENT_SIZE bytes mapped */
+	size_t		wr;		/* Bytes appended */
+	size_t		rd;		/* Bytes handed off */
+};
 
-static int fluffy_handoff_event(int fluffy_handle,
-    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+/*
+ * Struct:	fluffy_spill_rec
+ *
+ * An event in a spill segment, SPILL_REC_SIZE() bytes
+ */
+struct fluffy_spill_rec {
+	uint32_t	mask;		/* Event mask to hand off */
+	uint32_t	shard;		/* fluffy_event_info.shard */
+	unsigned long long seq;		/* fluffy_event_info.seq */
+	uint32_t	len;		/* Of path, '\0' included */
+	char		path[];		/* Event path, "" if none */
+};
 
-static int fluffy_process_inotify_queue(int fluffy_handle,
-    struct epoll_event *evlist);
+/*
+ * Struct:	fluffy_shard
+ *
+ * A shard of a sharded context; a context of its own, with an inotify
+ * instance and a thread, that queues its events on the sharded one.
+ */
+struct fluffy_shard {
+	int		handle;		/* Handle of the shard context */
+	int		parent;		/* Handle of the sharded context */
+	unsigned int	index;		/* In fluffy_context_info.shards */
+	pthread_t	tid;		/* Thread of the shard context */
+	unsigned int	nroots;		/* Root paths placed on it */
+	unsigned long long seq;		/* fluffy_event_info.seq, last one */
+	struct fluffy_shard_root *last;	/* Root of the last event, or NULL */
+};
 
-static void fluffy_thread_cleanup_unlock(void *mutex);
+/*
+ * Struct:	fluffy_shard_root
+ *
+ * A root path of a sharded context, the shard it's placed on and the
+ * options it was added with; they're needed again when it's moved.
+ */
+struct fluffy_shard_root {
+	unsigned int	shard;		/* Index of its shard */
+	unsigned long long nevents;	/* Events since rate_from_ms */
+	struct fluffy_root_options opts; /* excludes points to excls */
+	struct fluffy_exclude *excls;	/* Copy of the excludes, or NULL */
+	size_t		len;		/* Length of path */
+	char		path[];		/* Root path */
+};
 
-static void *fluffy_start_context_thread(void *flhandle);
+/*
+ * Struct:	fluffy_shard_move
+ *
+ * A hot root path on its way to a shard of its own
+ */
+struct fluffy_shard_move {
+	int		handle;		/* Sharded context */
+	unsigned int	from;		/* Index of the shard it's on */
+	unsigned int	to;		/* Index of the shard it goes to */
+	int		from_handle;	/* Handle of the shard it's on */
+	int		to_handle;	/* Handle of the shard it goes to */
+	struct fluffy_shard_root *rootp; /* Copy of the root record */
+};
 
-/* Notes & other relevant stuff */
+/*
+ * Struct:	fluffy_walk_info
+ *
+ * Describes the nftw() walk in progress. nftw() offers no way to pass an
+ * argument down to dir_tree_add_watch(), so fluffy_track.curr_walkp refers
+ * to this for the duration of the walk.
+ */
+struct fluffy_walk_info {
+	struct fluffy_context_info *ctxinfop;	/* Context walked for */
+	struct fluffy_root_info *rootinfop;	/* Root path walked under */
+	uint32_t	report_mask;	/* Queue an event per entry if non zero */
+	int		is_report_root;	/* Report the path walked from as well */
+	unsigned int	base_depth;	/* Depth of the path walked from */
+	int		depth_limit;	/* Deepest level watched, -1 for all */
+	int		is_snap;	/* Snapshot the directories walked */
+};
 
 /*
- * NOTE:
+ * Struct:	fluffy_rescan_dir
  *
- * pthread_cleanup_pop() must be in the same lexical scope as that
- * of pthread_cleanup_push(). This means that the convenience of
- * returning from anywhere, regardless of block scope, is lost. Bummer.
+ * A watched directory due for a rescan
+ */
+struct fluffy_rescan_dir {
+	char		*path;
+	unsigned int	activity;	/* fluffy_dir_snap.activity */
+};
+
+/*
+ * Struct:	fluffy_poll_dir
  *
- * Employ do-while(0) to break out and reach the deferred return.
+ * A directory polled for its mtime, past the watch budget, or for its
+ * entries, of a FLUFFY_ROOT_POLL root. Its path is the key of
+ * fluffy_context_info.poll_table.
  */
+struct fluffy_poll_dir {
+	struct timespec	mtime;		/* st_mtim when last listed */
+	ino_t		ino;		/* st_ino when last listed */
+	unsigned int	interval_ms;	/* Till the next poll */
+	long long	due_ms;		/* Next poll, CLOCK_MONOTONIC */
+	struct fluffy_dir_snap *snap;	/* Entries, NULL if not known */
+
+	/* FLUFFY_ROOT_POLL root, referenced; NULL if past the budget */
+	struct fluffy_root_info *rootinfop;
+};
 
+/*
+ * Struct:	fluffy_poll_item
+ *
+ * A directory of a poll pass, stat'd and listed off the context mutex
+ */
+struct fluffy_poll_item {
+	const char	*path;		/* fluffy_poll_pass.due holds it */
+	struct timespec	mtime;		/* fluffy_poll_dir.mtime */
+	ino_t		ino;		/* fluffy_poll_dir.ino */
+	int		is_entries;	/* Listed at every poll, ROOT_POLL */
+	int		is_known;	/* Its entries were listed before */
+	struct stat	sbuf;		/* As of this poll */
+	int		is_gone;	/* Gone, or not a directory now */
+	int		is_changed;	/* Its inode or mtime moved */
+	struct fluffy_dir_snap *snap;	/* Entries listed, NULL if none */
+	int		reterr;		/* Of the listing */
+};
 
-/* function definitions */
+/*
+ * Struct:	fluffy_poll_scan
+ *
+ * The items of a poll pass, shared by the threads that list them
+ */
+struct fluffy_poll_scan {
+	struct fluffy_poll_item *items;
+	size_t		nitems;
+	size_t		next;		/* Next item to take, atomic */
+};
 
 /*
- * fluffy.h contains this function description
+ * Struct:	fluffy_poll_pass
+ *
+ * Directories due for a poll, gathered off fluffy_context_info.poll_table
  */
-int
-fluffy_set_max_queued_events(const char *maxvalp)
-{
-	int fd = -1;
-	ssize_t wrbytes;
+struct fluffy_poll_pass {
+	long long	now_ms;		/* Time of the pass */
+	long long	next_ms;	/* Earliest poll not due yet */
+	struct fluffy_path_list due;
+};
 
-	if (maxvalp == NULL) {
+/*
+ * Struct:	fluffy_storm_subtree
+ *
+ * Events read in a subtree, for storm detection. Its path is the key of
+ * fluffy_context_info.storm_table.
+ */
+struct fluffy_storm_subtree {
+	unsigned int	nevents;	/* Since storm_from_ms */
+	int		is_coarse;	/* Events are held back */
+	int		is_dirty;	/* Some were, since the last report */
+};
+
+/*
+ * Struct:	fluffy_storm_pass
+ *
+ * End of a storm detection interval, gathered off storm_table
+ */
+struct fluffy_storm_pass {
+	unsigned long long limit;	/* Events of the interval at the rate */
+	struct fluffy_path_list dirty;	/* Subtrees to be reported */
+	struct fluffy_path_list calm;	/* Subtrees to be forgotten */
+};
+
+/*
+ * Struct:	fluffy_path_prefix
+ *
+ * Paths gathered off a table, those of a directory and below
+ */
+struct fluffy_path_prefix {
+	const char	*path;
+	size_t		len;		/* Length of path */
+	struct fluffy_path_list *listp;
+};
+
+
+/* Marks a deleted slot of fluffy_path_index */
+static struct fluffy_wd_info path_index_tomb;
+
+/* Marks a deleted slot of fluffy_str_table */
+static char str_table_tomb;
+
+
+/* Forward function declarations */
+
+static void *fluffy_malloc(size_t size);
+
+static void *fluffy_calloc(size_t nmemb, size_t size);
+
+static void *fluffy_realloc(void *ptr, size_t size);
+
+static char *fluffy_strdup(const char *str);
+
+static void fluffy_free(void *ptr);
+
+static struct fluffy_context_info *fluffy_context_info_new();
+
+static struct fluffy_wd_info *fluffy_wd_info_new(
+    struct fluffy_context_info *ctxinfop, const char *path);
+
+static void fluffy_wd_info_free(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static struct fluffy_wd_alloc *fluffy_wd_alloc_new();
+
+static void fluffy_wd_alloc_free(void *alloc);
+
+static char *fluffy_arena_strdup(struct fluffy_wd_alloc *allocp,
+    const char *path);
+
+static void fluffy_arena_drop(struct fluffy_wd_alloc *allocp,
+    const char *path);
+
+static void fluffy_arena_free(void *blocks);
+
+static void fluffy_wd_slab_link_avail(struct fluffy_wd_alloc *allocp,
+    struct fluffy_wd_slab *slabp);
+
+static void fluffy_wd_slab_unlink_avail(struct fluffy_wd_alloc *allocp,
+    struct fluffy_wd_slab *slabp);
+
+static void fluffy_arena_compact(struct fluffy_context_info *ctxinfop);
+
+static struct fluffy_wd_info *fluffy_wd_dir_lookup(
+    struct fluffy_wd_dir *dirp, int wd);
+
+static struct fluffy_wd_info *fluffy_wd_lookup(
+    struct fluffy_context_info *ctxinfop, int wd);
+
+static int fluffy_wd_insert(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static int fluffy_wd_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static void fluffy_wd_remove_all(struct fluffy_context_info *ctxinfop);
+
+static void fluffy_wd_dir_free(void *dir);
+
+static void fluffy_retire(struct fluffy_context_info *ctxinfop, void *ptr,
+    void (*free_fn)(void *));
+
+static void fluffy_reclaim_retired(struct fluffy_context_info *ctxinfop);
+
+static void fluffy_wd_info_retire(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static uint32_t fluffy_path_hash(const char *path);
+
+static struct fluffy_path_index *fluffy_path_index_new(unsigned int size);
+
+static struct fluffy_wd_info *fluffy_path_index_lookup(
+    struct fluffy_path_index *indexp, const char *path);
+
+static struct fluffy_wd_info *fluffy_path_lookup(
+    struct fluffy_context_info *ctxinfop, const char *path);
+
+static int fluffy_path_place(struct fluffy_path_index *indexp,
+    struct fluffy_wd_info *wdinfop);
+
+static struct fluffy_path_index *fluffy_path_rebuild(
+    struct fluffy_context_info *ctxinfop, unsigned int nrecs);
+
+static int fluffy_path_insert(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static int fluffy_path_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static int fluffy_path_reset(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_wd_info_rename(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop, const char *path);
+
+static void fluffy_sync_root(struct fluffy_context_info *ctxinfop,
+    const char *path);
+
+static size_t fluffy_wd_info_size(const struct fluffy_wd_info *wdinfop);
+
+static void fluffy_context_info_free(struct fluffy_context_info *ctxinfop);
+
+static struct fluffy_str_table *fluffy_str_table_new(
+    void (*free_fn)(void *));
+
+static void fluffy_str_table_free(struct fluffy_str_table *tablep);
+
+static struct fluffy_str_slot *fluffy_str_table_find(
+    struct fluffy_str_table *tablep, const char *key, uint32_t hash);
+
+static int fluffy_str_table_rebuild(struct fluffy_str_table *tablep,
+    unsigned int nkeys);
+
+static int fluffy_str_table_lookup(struct fluffy_str_table *tablep,
+    const char *key, void **valuep);
+
+static int fluffy_str_table_replace(struct fluffy_str_table *tablep,
+    const char *key, void *value);
+
+static int fluffy_str_table_remove(struct fluffy_str_table *tablep,
+    const char *key);
+
+static void fluffy_str_table_remove_all(struct fluffy_str_table *tablep);
+
+static void fluffy_str_table_foreach(struct fluffy_str_table *tablep,
+    void (*fn)(const char *key, void *value, void *data), void *data);
+
+static void fluffy_pending_queue_clear(struct fluffy_pending_queue *queuep);
+
+static uint64_t fluffy_snap_stamp(const struct stat *sbuf);
+
+static struct fluffy_dir_snap *fluffy_snap_new(
+    struct fluffy_context_info *ctxinfop, unsigned int nentries);
+
+static void fluffy_snap_free(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap *snap);
+
+static size_t fluffy_snap_size(const struct fluffy_dir_snap *snap);
+
+static int fluffy_snap_list(const char *dirpath,
+    struct fluffy_dir_snap **snapp);
+
+static void fluffy_snap_free_all(struct fluffy_context_info *ctxinfop);
+
+static struct fluffy_snap_slot *fluffy_snap_find(struct fluffy_dir_snap *snap,
+    const char *name, uint32_t hash);
+
+static int fluffy_snap_place(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap *snap, const char *name, uint32_t hash,
+    char type, uint64_t ino, uint64_t stamp);
+
+static int fluffy_snap_rebuild(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, unsigned int nentries);
+
+static int fluffy_snap_set(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, const char *name, int is_dir,
+    uint64_t ino, uint64_t stamp);
+
+static void fluffy_snap_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, const char *name);
+
+static void fluffy_snap_walk_entry(struct fluffy_context_info *ctxinfop,
+    const char *pathname, int base, const struct stat *sbuf);
+
+static void fluffy_snap_event(struct fluffy_context_info *ctxinfop,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+
+static struct fluffy_exclude_info *fluffy_exclude_info_new(int type,
+    const char *pattern);
+
+static void fluffy_exclude_info_free(struct fluffy_exclude_info *exclinfop);
+
+static int fluffy_exclude_list_add(struct fluffy_exclude_list *listp,
+    struct fluffy_exclude_info *exclinfop);
+
+static void fluffy_exclude_list_clear(struct fluffy_exclude_list *listp);
+
+static struct fluffy_root_info *fluffy_root_info_new(
+    const struct fluffy_root_options *rootopts);
+
+static void fluffy_root_info_unref(void *rootinfo);
+
+static struct fluffy_root_info *fluffy_get_root_info(
+    struct fluffy_context_info *ctxinfop, const char *path);
+
+static int fluffy_is_excluded(struct fluffy_context_info *ctxinfop,
+    struct fluffy_root_info *rootinfop, const char *path);
+
+static void collect_each_root_path(const char *root_path, void *value,
+    void *pathlist);
+
+static void fluffy_path_list_add(struct fluffy_path_list *listp,
+    const char *path);
+
+static void fluffy_path_list_clear(struct fluffy_path_list *listp);
+
+static void reinit_each_context(int fluffy_handle);
+
+static void fluffy_link_wd_node(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop);
+
+static void fluffy_unlink_wd_node(struct fluffy_wd_info *wdinfop);
+
+static char *form_event_path(char *wdpath, uint32_t ilen, char *iname);
+
+static int dir_tree_add_watch(const char *pathname, const struct stat *sbuf,
+    int type, struct FTW *ftwb);
+
+static int fluffy_setup_context(int fluffy_handle);
+
+static int fluffy_add_watch(int fluffy_handle, const char *pathtoadd, int
+    is_real_path_check, const struct fluffy_root_options *rootopts,
+    uint32_t report_mask, int depth_limit);
+
+static unsigned int fluffy_path_depth(const char *path);
+
+static void reset_each_root_info(const char *root_path, void *rootinfo,
+    void *user_data);
+
+static int fluffy_setup_track();
+
+static int fluffy_is_track_setup();
+
+static int fluffy_ref();
+
+static int fluffy_unref(int fluffy_handle);
+
+static void fluffy_destroy_context(void *fluffy_handle);
+
+static struct fluffy_context_info *fluffy_get_context_info(int fluffy_handle);
+
+static struct fluffy_context_info *fluffy_hold_context_info(int fluffy_handle);
+
+static void fluffy_release_context_info(
+    struct fluffy_context_info *ctxinfop);
+
+static void fluffy_close_context_info(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_setup_context_info_records(int fluffy_handle);
+
+static int fluffy_cleanup_context_info_records(int fluffy_handle);
+
+static int fluffy_initiate_epoll(int fluffy_handle);
+
+static int fluffy_initiate_inotify(int fluffy_handle);
+
+static void fluffy_watch_gen_free(void *gen);
+
+static int fluffy_rotate_watch_gen(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_build_watch_gen(int fluffy_handle);
+
+static void *fluffy_start_build_thread(void *flhandle);
+
+static void fluffy_build_destroy(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_switch_watch_gen(int fluffy_handle);
+
+static struct fluffy_wd_info *fluffy_event_wd_lookup(
+    struct fluffy_context_info *ctxinfop, int fd, int wd,
+    struct fluffy_watch_gen **genpp);
+
+static int fluffy_is_dup_event(struct fluffy_context_info *ctxinfop,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+
+static int fluffy_handle_qoverflow(int fluffy_handle);
+
+static unsigned int fluffy_read_max_queued_events();
+
+static int fluffy_check_queue_pressure(int fluffy_handle);
+
+static int fluffy_set_watch_mask(struct fluffy_context_info *ctxinfop,
+    uint32_t mask);
+
+static int fluffy_raise_queue_limit(int fluffy_handle, unsigned int limit,
+    unsigned int cap);
+
+static int fluffy_restore_queue_limit(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_inotify_init(void);
+
+static int fluffy_inotify_nread(int fd, int *nbytesp);
+
+static struct fluffy_fake *fluffy_fake_lookup(int fd);
+
+static int fluffy_fake_queue(struct fluffy_fake *fakep, int wd,
+    uint32_t mask, uint32_t cookie, const char *name);
+
+static int fluffy_fake_init(void);
+
+static int fluffy_fake_add_watch(int fd, const char *path, uint32_t mask);
+
+static int fluffy_fake_rm_watch(int fd, int wd);
+
+static ssize_t fluffy_fake_read(int fd, void *buf, size_t len);
+
+static int fluffy_fake_nread(int fd, int *nbytesp);
+
+static int fluffy_fake_close(int fd);
+
+static struct fluffy_shard_root *fluffy_shard_root_new(const char *path,
+    const struct fluffy_root_options *rootopts);
+
+static void fluffy_shard_root_free(void *root);
+
+static struct fluffy_shard_root *fluffy_shard_root_lookup(
+    struct fluffy_context_info *ctxinfop, const char *path);
+
+static struct fluffy_shard_root *fluffy_shard_root_of(
+    struct fluffy_context_info *ctxinfop, struct fluffy_shard *shardp,
+    const char *path);
+
+static void fluffy_shard_forget_root(struct fluffy_context_info *ctxinfop,
+    struct fluffy_shard_root *rootp);
+
+static void fluffy_shard_forget_shard(struct fluffy_context_info *ctxinfop,
+    unsigned int shard);
+
+static int fluffy_shard_event_fn(const struct fluffy_event_info *eventinfo,
+    void *shard);
+
+static struct fluffy_shard_move *fluffy_shard_pick_move(
+    struct fluffy_context_info *ctxinfop);
+
+static void *fluffy_start_shard_move_thread(void *move);
+
+static int fluffy_shard_add(int fluffy_handle, const char *pathtoadd,
+    const struct fluffy_root_options *rootopts);
+
+static int fluffy_shard_remove(int fluffy_handle, const char *pathtoremove);
+
+static void fluffy_shard_destroy_all(struct fluffy_context_info *ctxinfop);
+
+/* inotify(7), what a context is on unless set otherwise */
+static const struct fluffy_backend fluffy_inotify_backend = {
+	fluffy_inotify_init,		/* init_fn */
+	inotify_add_watch,		/* add_watch_fn */
+	inotify_rm_watch,		/* rm_watch_fn */
+	read,				/* read_fn */
+	fluffy_inotify_nread,		/* nread_fn */
+	close				/* close_fn */
+};
+
+/* In-memory events, see fluffy_set_fake_backend() */
+static const struct fluffy_backend fluffy_fake_backend = {
+	fluffy_fake_init,		/* init_fn */
+	fluffy_fake_add_watch,		/* add_watch_fn */
+	fluffy_fake_rm_watch,		/* rm_watch_fn */
+	fluffy_fake_read,		/* read_fn */
+	fluffy_fake_nread,		/* nread_fn */
+	fluffy_fake_close		/* close_fn */
+};
+
+static long long fluffy_now_ms();
+
+static long long fluffy_now_us();
+
+static unsigned long long fluffy_budget_room(
+    struct fluffy_context_info *ctxinfop);
+
+static struct fluffy_poll_dir *fluffy_poll_parent(
+    struct fluffy_context_info *ctxinfop, const char *pathname, int base);
+
+static void fluffy_poll_walk_entry(struct fluffy_context_info *ctxinfop,
+    const char *pathname, int base, const struct stat *sbuf);
+
+static int fluffy_poll_add(struct fluffy_context_info *ctxinfop,
+    const char *path, const struct stat *sbuf, struct fluffy_dir_snap *snap,
+    struct fluffy_root_info *rootinfop);
+
+static void fluffy_poll_remove(struct fluffy_context_info *ctxinfop,
+    const char *path);
+
+static void fluffy_poll_remove_all(struct fluffy_context_info *ctxinfop);
+
+static void fluffy_poll_remove_budget(struct fluffy_context_info *ctxinfop);
+
+static void fluffy_poll_remove_subtree(struct fluffy_context_info *ctxinfop,
+    const char *path);
+
+static int fluffy_poll_remove_root(struct fluffy_context_info *ctxinfop,
+    const char *path, uint32_t self_mask);
+
+static void fluffy_poll_interval(struct fluffy_context_info *ctxinfop,
+    struct fluffy_poll_dir *pollp, long long now_ms, int is_active);
+
+static int fluffy_poll_timeout(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_storm_event(struct fluffy_context_info *ctxinfop,
+    const struct fluffy_storm_detection *stormp,
+    const struct fluffy_wd_info *wdinfop);
+
+static int fluffy_storm_timeout(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_storm_tick(int fluffy_handle);
+
+static int fluffy_poll_dirs(int fluffy_handle);
+
+static void fluffy_poll_scan_item(struct fluffy_poll_item *itemp);
+
+static void *fluffy_start_scan_thread(void *scan);
+
+static void fluffy_poll_scan(struct fluffy_poll_scan *scanp);
+
+static int fluffy_poll_dir(int fluffy_handle, struct fluffy_poll_item *itemp,
+    long long now_ms, int *is_changedp);
+
+static int fluffy_promote_dir(int fluffy_handle, const char *dirpath);
+
+static int fluffy_demote_dir(int fluffy_handle, const char *dirpath);
+
+static unsigned int fluffy_coldest_leaves(
+    struct fluffy_context_info *ctxinfop, struct fluffy_wd_info **coldv,
+    unsigned int ncold);
+
+static void fluffy_fan_key(const void *fsid, const struct file_handle *fhp,
+    char *key);
+
+static void fluffy_fan_fs_free(void *fs);
+
+static void count_each_fan_user(const char *root_path, void *rootinfo,
+    void *users);
+
+static unsigned int fluffy_fan_mark_users(
+    struct fluffy_context_info *ctxinfop,
+    const struct fluffy_root_info *rootinfop);
+
+static int fluffy_fan_add_root(struct fluffy_context_info *ctxinfop,
+    const char *path, const struct fluffy_root_options *rootopts);
+
+static int fluffy_fan_remove_root(struct fluffy_context_info *ctxinfop,
+    const char *path);
+
+static struct fluffy_fan_dir *fluffy_fan_dir_lookup(
+    struct fluffy_context_info *ctxinfop,
+    struct fanotify_event_info_fid *fidp, const char *key);
+
+static int fluffy_fan_event(struct fluffy_context_info *ctxinfop,
+    struct fanotify_event_metadata *metap);
+
+static int fluffy_rescan_cmp(const void *a, const void *b);
+
+static int fluffy_rescan_context(int fluffy_handle);
+
+static int fluffy_rescan_dir(int fluffy_handle, const char *dirpath);
+
+static int fluffy_rescan_diff(struct fluffy_context_info *ctxinfop,
+    const char *dirpath, struct fluffy_dir_snap *oldsnap,
+    struct fluffy_dir_snap *newsnap, char ***newdirsp, size_t *nnewdirsp);
+
+static int fluffy_handle_removal(int fluffy_handle, char *removethis);
+
+static int fluffy_handle_addition(int fluffy_handle,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+
+static int fluffy_handle_moved_from(int fluffy_handle,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+;
+static int fluffy_handle_ignored(int fluffy_handle,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop);
+
+static int fluffy_handle_frontier(int fluffy_handle,
+    struct fluffy_wd_info *wdinfop);
+
+static int fluffy_queue_pending_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath);
+
+static int fluffy_flush_pending_events(int fluffy_handle, int is_wait);
+
+static int fluffy_wake_context(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_dispatch_event(int fluffy_handle, uint32_t event_mask,
+    char *eventpath);
+
+static int fluffy_deliver_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, char *eventpath, unsigned int shard,
+    unsigned long long seq);
+
+static int fluffy_time_callback(struct fluffy_context_info *ctxinfop,
+    long long took_us);
+
+static unsigned int fluffy_latency_bucket(unsigned long long us);
+
+static void fluffy_catch_slow_callback(struct fluffy_context_info *ctxinfop,
+    unsigned long long took_us, int is_running);
+
+static unsigned long long fluffy_queued_events(
+    struct fluffy_context_info *ctxinfop);
+
+static void *fluffy_start_watchdog_thread(void *ctx);
+
+static void fluffy_watchdog_destroy(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_backlog_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath, unsigned int shard,
+    unsigned long long seq);
+
+static void *fluffy_start_backlog_thread(void *ctx);
+
+static struct fluffy_spill_seg *fluffy_spill_seg_new(const char *dirpath);
+
+static void fluffy_spill_seg_free(struct fluffy_spill_seg *segp);
+
+static int fluffy_spill_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath, unsigned int shard,
+    unsigned long long seq);
+
+static struct fluffy_pending_event *fluffy_spill_take(
+    struct fluffy_context_info *ctxinfop);
+
+static void fluffy_spill_clear(struct fluffy_context_info *ctxinfop);
+
+static void fluffy_backlog_destroy(struct fluffy_context_info *ctxinfop);
+
+static int fluffy_dispatch_seq_event(int fluffy_handle, uint32_t event_mask,
+    char *eventpath, unsigned int shard, unsigned long long seq);
+
+static int fluffy_handoff_event(int fluffy_handle,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop,
+    struct fluffy_watch_gen *genp);
+
+static int fluffy_process_inotify_queue(int fluffy_handle,
+    struct epoll_event *evlist);
+
+static int fluffy_process_fanotify_queue(int fluffy_handle,
+    struct epoll_event *evlist);
+
+static void fluffy_thread_cleanup_unlock(void *mutex);
+
+static void *fluffy_start_context_thread(void *flhandle);
+
+/* Notes & other relevant stuff */
+
+/*
+ * NOTE:
+ *
+ * pthread_cleanup_pop() must be in the same lexical scope as that
+ * of pthread_cleanup_push(). This means that the convenience of
+ * returning from anywhere, regardless of block scope, is lost. Bummer.
+ *
+ * Employ do-while(0) to break out and reach the deferred return.
+ */
+
+
+/* function definitions */
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_max_queued_events(const char *maxvalp)
+{
+	int fd = -1;
+	ssize_t wrbytes;
+
+	if (maxvalp == NULL) {
+		return -1;
+	}
+
+	fd = open("/proc/sys/fs/inotify/max_queued_events",
+		O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	wrbytes = write(fd, maxvalp, strlen(maxvalp));
+	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) != 0) {
+		return -1;
+	}
+
+	/* Reinitialize all fluffy context to pick up the newly set value */
+	/*
+	if(fluffy_reinitiate_all_contexts()) {
+		return -1;
+	}
+	*/
+
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_max_user_instances(const char *maxvalp)
+{
+	int fd = -1;
+	ssize_t wrbytes;
+
+	if (maxvalp == NULL) {
+		return -1;
+	}
+
+	fd = open("/proc/sys/fs/inotify/max_user_instances",
+		O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	wrbytes = write(fd, maxvalp, strlen(maxvalp));
+	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_max_user_watches(const char *maxvalp)
+{
+	int fd = -1;
+	ssize_t wrbytes;
+
+	if (maxvalp == NULL) {
+		return -1;
+	}
+
+	fd = open("/proc/sys/fs/inotify/max_user_watches",
+		O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	wrbytes = write(fd, maxvalp, strlen(maxvalp));
+	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_context_options(int fluffy_handle, uint32_t options)
+{
+	if ((options & FLUFFY_OPT_OVERFLOW_TERMINATE) &&
+	    (options & FLUFFY_OPT_OVERFLOW_RESCAN)) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* A sharded context passes it on to its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		int reterr = 0;
+		reterr = fluffy_set_context_options(ctxinfop->shards[j].handle,
+			     options);
+		if (reterr) {
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	ctxinfop->options = options;
+	if (!(options & FLUFFY_OPT_OVERFLOW_RESCAN)) {
+		fluffy_snap_free_all(ctxinfop);
+	}
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_get_stats(int fluffy_handle, struct fluffy_stats *stats)
+{
+	if (stats == NULL) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct fluffy_stats));
+	stats->nwatches = ctxinfop->nwd + ctxinfop->nfan_marks;
+	stats->watch_bytes = ctxinfop->watch_bytes;
+	stats->snapshot_bytes = ctxinfop->snapshot_bytes;
+	stats->npolled = ctxinfop->npolled;
+	stats->backlog = ctxinfop->backlog_queue.length + ctxinfop->nspilled;
+	stats->ndropped = ctxinfop->ndropped;
+	stats->ncoalesced = ctxinfop->ncoalesced;
+	stats->spill_bytes = ctxinfop->spill_bytes;
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	/* The watches of a sharded context are those of its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		struct fluffy_stats shardstats;
+		int reterr = 0;
+		reterr = fluffy_get_stats(ctxinfop->shards[j].handle,
+			     &shardstats);
+		if (reterr) {
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+		stats->nwatches += shardstats.nwatches;
+		stats->watch_bytes += shardstats.watch_bytes;
+		stats->snapshot_bytes += shardstats.snapshot_bytes;
+		stats->npolled += shardstats.npolled;
+		stats->backlog += shardstats.backlog;
+		stats->ndropped += shardstats.ndropped;
+		stats->ncoalesced += shardstats.ncoalesced;
+		stats->spill_bytes += shardstats.spill_bytes;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_get_latency(int fluffy_handle, struct fluffy_latency *latency)
+{
+	if (latency == NULL) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* Counted as calls return, with no lock taken */
+	struct fluffy_latency *latp = &ctxinfop->latency;
+	latency->ncalls = __atomic_load_n(&latp->ncalls, __ATOMIC_RELAXED);
+	latency->total_us = __atomic_load_n(&latp->total_us,
+				__ATOMIC_RELAXED);
+	latency->max_us = __atomic_load_n(&latp->max_us, __ATOMIC_RELAXED);
+	latency->nslow = __atomic_load_n(&latp->nslow, __ATOMIC_RELAXED);
+	latency->slow_queued = __atomic_load_n(&latp->slow_queued,
+				   __ATOMIC_RELAXED);
+	unsigned int j;
+	for (j = 0; j < FLUFFY_LATENCY_BUCKETS; j++) {
+		latency->buckets[j] = __atomic_load_n(&latp->buckets[j],
+					  __ATOMIC_RELAXED);
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_queue_pressure(int fluffy_handle,
+    const struct fluffy_queue_pressure *pressure)
+{
+	struct fluffy_queue_pressure qp = {0};
+	if (pressure != NULL) {
+		qp = *pressure;
+	}
+
+	if (qp.high_water == 0) {
+		qp.high_water = PRESSURE_HIGH_WATER;
+	}
+	if (qp.low_water == 0) {
+		qp.low_water = PRESSURE_LOW_WATER;
+	}
+	if (qp.high_water > 100 || qp.low_water >= qp.high_water) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* A sharded context passes it on to its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		int reterr = 0;
+		reterr = fluffy_set_queue_pressure(ctxinfop->shards[j].handle,
+			     pressure);
+		if (reterr) {
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	if (qp.max_queued_events == 0) {
+		qp.max_queued_events = (ctxinfop->queue_limit >
+		    UINT_MAX / PRESSURE_RAISE_TIMES) ? UINT_MAX :
+		    ctxinfop->queue_limit * PRESSURE_RAISE_TIMES;
+	}
+
+	/* The context thread undoes what's no longer asked for */
+	ctxinfop->pressure = qp;
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_watch_budget(int fluffy_handle,
+    const struct fluffy_watch_budget *budget)
+{
+	struct fluffy_watch_budget wb = {0};
+	if (budget != NULL) {
+		wb = *budget;
+	}
+
+	if (wb.poll_min_ms == 0) {
+		wb.poll_min_ms = BUDGET_POLL_MIN_MS;
+	}
+	if (wb.poll_max_ms == 0) {
+		wb.poll_max_ms = (wb.poll_min_ms > BUDGET_POLL_MAX_MS) ?
+		    wb.poll_min_ms : BUDGET_POLL_MAX_MS;
+	}
+	if (wb.poll_min_ms > wb.poll_max_ms) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* A sharded context passes it on to its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		int reterr = 0;
+		reterr = fluffy_set_watch_budget(ctxinfop->shards[j].handle,
+			     budget);
+		if (reterr) {
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	ctxinfop->budget = wb;
+	__atomic_store_n(&ctxinfop->is_budget, (budget != NULL),
+	    __ATOMIC_RELEASE);
+	if (budget == NULL) {
+		fluffy_poll_remove_budget(ctxinfop);
+	}
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_storm_detection(int fluffy_handle,
+    const struct fluffy_storm_detection *storm)
+{
+	struct fluffy_storm_detection sd = {0};
+	if (storm != NULL) {
+		sd = *storm;
+	}
+
+	if (sd.interval_ms == 0) {
+		sd.interval_ms = STORM_INTERVAL_MS;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* A sharded context passes it on to its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		int reterr = 0;
+		reterr = fluffy_set_storm_detection(
+			     ctxinfop->shards[j].handle, storm);
+		if (reterr) {
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	/* The context thread reports and forgets what's been counted */
+	ctxinfop->storm = sd;
+	__atomic_store_n(&ctxinfop->is_storm, (sd.rate != 0),
+	    __ATOMIC_RELEASE);
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return 0;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_backlog(int fluffy_handle, const struct fluffy_backlog *backlog)
+{
+	if (backlog == NULL) {
+		return EINVAL;
+	}
+
+	struct fluffy_backlog bl = *backlog;
+	if (bl.max_events == 0) {
+		bl.max_events = BACKLOG_MAX_EVENTS;
+	}
+	if (bl.drop_mask == 0) {
+		bl.drop_mask = BACKLOG_DROP_FLAGS;
+	}
+	if (bl.coalesce_mask == 0) {
+		bl.coalesce_mask = BACKLOG_COALESCE_FLAGS;
+	}
+	if (bl.max_spill_bytes == 0) {
+		bl.max_spill_bytes = SPILL_MAX_BYTES;
+	}
+
+	if (bl.spill_dir != NULL) {
+		struct stat sbuf;
+		if (stat(bl.spill_dir, &sbuf) == -1) {
+			return errno;
+		}
+		if (!S_ISDIR(sbuf.st_mode)) {
+			return ENOTDIR;
+		}
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/* Segments spilled already stay where they are */
+		char *spilldir = NULL;
+		if (bl.spill_dir != NULL) {
+			spilldir = fluffy_strdup(bl.spill_dir);
+			if (spilldir == NULL) {
+				reterr = ENOMEM;
+				break;
+			}
+		}
+		fluffy_free(ctxinfop->spill_dir);
+		ctxinfop->spill_dir = spilldir;
+
+		/* A lower limit leaves what's held as it is */
+		bl.spill_dir = NULL;
+		ctxinfop->backlog = bl;
+		pthread_cond_broadcast(&ctxinfop->backlog_cond);
+		if (ctxinfop->is_backlog) {
+			break;
+		}
+
+		ctxinfop->coalesce_table = fluffy_str_table_new(NULL);
+		if (ctxinfop->coalesce_table == NULL) {
+			reterr = ENOMEM;
+			break;
+		}
+
+		reterr = pthread_create(&ctxinfop->backlog_tid, NULL,
+			     fluffy_start_backlog_thread, ctxinfop);
+		if (reterr) {
+			fluffy_str_table_free(ctxinfop->coalesce_table);
+			ctxinfop->coalesce_table = NULL;
+			break;
+		}
+		__atomic_store_n(&ctxinfop->is_backlog, 1, __ATOMIC_RELEASE);
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_callback_deadline(int fluffy_handle,
+    const struct fluffy_callback_deadline *deadline)
+{
+	struct fluffy_callback_deadline cd = {0};
+	if (deadline != NULL) {
+		cd = *deadline;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/* Read with no lock, by the watchdog and the caller alike */
+		__atomic_store_n(&ctxinfop->deadline.actions, cd.actions,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&ctxinfop->deadline.deadline_ms,
+		    cd.deadline_ms, __ATOMIC_RELEASE);
+		if (cd.deadline_ms == 0 || ctxinfop->is_watchdog) {
+			break;
+		}
+
+		reterr = pthread_create(&ctxinfop->watchdog_tid, NULL,
+			     fluffy_start_watchdog_thread, ctxinfop);
+		if (reterr) {
+			break;
+		}
+		__atomic_store_n(&ctxinfop->is_watchdog, 1, __ATOMIC_RELEASE);
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_fanotify(int fluffy_handle, int mark)
+{
+	unsigned int fan_mark = 0;
+	uint64_t fan_mask = 0;
+	switch (mark) {
+	case 0:
+		break;
+	case FLUFFY_FANOTIFY_FILESYSTEM:
+		fan_mark = FAN_MARK_FILESYSTEM;
+		fan_mask = FANOTIFY_EVENT_FLAGS;
+		break;
+	case FLUFFY_FANOTIFY_MOUNT:
+		fan_mark = FAN_MARK_MOUNT;
+		fan_mask = FANOTIFY_MOUNT_FLAGS;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/* The backend of the paths added can't change under them */
+		if (ctxinfop->root_path_table->nused > 0 ||
+		    ctxinfop->nwd > 0 || ctxinfop->nshards > 0) {
+			reterr = EBUSY;
+			break;
+		}
+
+		/* Set up once, kept till the context is destroyed */
+		if (fan_mark != 0 && ctxinfop->fanotify_fd == -1) {
+			int fd = -1;
+			fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+				FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+				O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+			if (fd == -1) {
+				reterr = errno;
+				perror("fanotify_init");
+				break;
+			}
+
+			ctxinfop->fan_fs_table = fluffy_str_table_new(
+						fluffy_fan_fs_free);
+			ctxinfop->fan_root_table = fluffy_str_table_new(
+						fluffy_free);
+			ctxinfop->fan_dir_table = fluffy_str_table_new(
+						fluffy_free);
+
+			struct epoll_event evtmp = {0};
+			evtmp.events	= EPOLLIN;
+			evtmp.data.fd	= fd;
+			if (ctxinfop->fan_fs_table == NULL ||
+			    ctxinfop->fan_root_table == NULL ||
+			    ctxinfop->fan_dir_table == NULL) {
+				reterr = ENOMEM;
+			} else if (epoll_ctl(ctxinfop->epoll_fd,
+			    EPOLL_CTL_ADD, fd, &evtmp) == -1) {
+				reterr = errno;
+			}
+			if (reterr) {
+				close(fd);
+				fluffy_str_table_free(ctxinfop->fan_fs_table);
+				ctxinfop->fan_fs_table = NULL;
+				fluffy_str_table_free(ctxinfop->fan_root_table);
+				ctxinfop->fan_root_table = NULL;
+				fluffy_str_table_free(ctxinfop->fan_dir_table);
+				ctxinfop->fan_dir_table = NULL;
+				break;
+			}
+			__atomic_store_n(&ctxinfop->fanotify_fd, fd,
+			    __ATOMIC_RELEASE);
+		}
+
+		ctxinfop->fan_mask = fan_mask;
+		__atomic_store_n(&ctxinfop->fan_mark, fan_mark,
+		    __ATOMIC_RELEASE);
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_fake_backend(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		if (ctxinfop->backend == &fluffy_fake_backend) {
+			break;
+		}
+
+		/* The backend of the paths added can't change under them */
+		struct fluffy_watch_gen *oldgenp = ctxinfop->old_gen;
+		if (ctxinfop->root_path_table->nused > 0 ||
+		    ctxinfop->nwd > 0 || ctxinfop->fan_mark != 0 ||
+		    ctxinfop->nshards > 0 ||
+		    (oldgenp != NULL && oldgenp->inotify_fd != -1)) {
+			reterr = EBUSY;
+			break;
+		}
+
+		int fd = fluffy_fake_backend.init_fn();
+		if (fd == -1) {
+			reterr = errno;
+			break;
+		}
+
+		struct epoll_event evtmp = {0};
+		evtmp.events	= EPOLLIN;
+		evtmp.data.fd	= fd;
+		if (epoll_ctl(ctxinfop->epoll_fd, EPOLL_CTL_ADD, fd,
+		    &evtmp) == -1) {
+			reterr = errno;
+			perror("epoll_ctl");
+			fluffy_fake_backend.close_fn(fd);
+			break;
+		}
+
+		/* Nothing's watched, there's nothing to be read off it */
+		if (ctxinfop->inotify_fd != -1 &&
+		    ctxinfop->backend->close_fn(ctxinfop->inotify_fd) == -1) {
+			perror("close");
+		}
+		__atomic_store_n(&ctxinfop->backend, &fluffy_fake_backend,
+		    __ATOMIC_RELEASE);
+		__atomic_store_n(&ctxinfop->inotify_fd, fd, __ATOMIC_RELEASE);
+		ctxinfop->queue_limit = fluffy_read_max_queued_events();
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_fake_inject(int fluffy_handle, const char *dirpath, uint32_t mask,
+    uint32_t cookie, const char *name)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+	if (__atomic_load_n(&ctxinfop->backend, __ATOMIC_ACQUIRE) !=
+	    &fluffy_fake_backend) {
+		fluffy_release_context_info(ctxinfop);
+		return EINVAL;
+	}
+
+	int fd = __atomic_load_n(&ctxinfop->inotify_fd, __ATOMIC_ACQUIRE);
+	int reterr = 0;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	do {
+		struct fluffy_fake *fakep = fluffy_fake_lookup(fd);
+		if (fakep == NULL) {
+			reterr = EBADF;
+			break;
+		}
+
+		/* The directory's watch, as of the last time it was added */
+		void *value = NULL;
+		int wd = -1;
+		if (dirpath != NULL) {
+			if (!fluffy_str_table_lookup(fakep->path_table,
+			    dirpath, &value)) {
+				reterr = ENOENT;
+				break;
+			}
+			wd = (int)(intptr_t)value;
+			if (fakep->keys[wd] == NULL) {
+				reterr = ENOENT;
+				break;
+			}
+		}
+
+		reterr = fluffy_fake_queue(fakep, wd, mask, cookie, name);
+	} while (0);
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_shards(int fluffy_handle,
+    const struct fluffy_shard_options *shardopts)
+{
+	if (shardopts == NULL || shardopts->nshards < 2 ||
+	    shardopts->nshards > SHARDS_MAX) {
+		return EINVAL;
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+	if (__atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE) > 0) {
+		fluffy_release_context_info(ctxinfop);
+		return EBUSY;
+	}
+
+	unsigned int j, nshards = shardopts->nshards;
+	struct fluffy_shard *shards;
+	struct fluffy_str_table *tablep;
+	shards = fluffy_calloc(nshards, sizeof(struct fluffy_shard));
+	tablep = fluffy_str_table_new(fluffy_shard_root_free);
+	if (shards == NULL || tablep == NULL) {
+		fluffy_free(shards);
+		fluffy_str_table_free(tablep);
+		fluffy_release_context_info(ctxinfop);
+		return ENOMEM;
+	}
+
+	/* fluffy_init() takes fluffy_track.mutex, the mutex isn't held yet */
+	int reterr = 0;
+	for (j = 0; j < nshards && reterr == 0; j++) {
+		shards[j].parent = fluffy_handle;
+		shards[j].index = j;
+		shards[j].handle = fluffy_init(fluffy_shard_event_fn,
+				       &shards[j]);
+		if (shards[j].handle < 1) {
+			shards[j].handle = -1;
+			reterr = EAGAIN;
+			break;
+		}
+
+		struct fluffy_context_info *shardinfop;
+		shardinfop = fluffy_get_context_info(shards[j].handle);
+		if (shardinfop == NULL ||
+		    pthread_mutex_lock(&shardinfop->mutex) != 0) {
+			reterr = -1;
+			break;
+		}
+		shards[j].tid = shardinfop->tid;
+		shardinfop->parent = fluffy_handle;
+		pthread_mutex_unlock(&shardinfop->mutex);
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		reterr = -1;
+	}
+
+	if (m == 0) {
+		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+		    &ctxinfop->mutex);
+
+		do {
+			if (reterr) {
+				break;
+			}
+
+			/* Neither backend nor paths can change under them */
+			if (ctxinfop->nshards > 0 || ctxinfop->parent != 0 ||
+			    ctxinfop->root_path_table->nused > 0 ||
+			    ctxinfop->nwd > 0 || ctxinfop->fan_mark != 0 ||
+			    ctxinfop->backend != &fluffy_inotify_backend) {
+				reterr = EBUSY;
+				break;
+			}
+
+			/* What's set on the context so far goes for each */
+			for (j = 0; j < nshards && reterr == 0; j++) {
+				int handle = shards[j].handle;
+				unsigned int k;
+				reterr = fluffy_set_context_options(handle,
+					     ctxinfop->options);
+				for (k = 0; k < ctxinfop->exclude_list.len &&
+				    reterr == 0; k++) {
+					struct fluffy_exclude_info *exclp;
+					exclp = ctxinfop->exclude_list.excls[k];
+					reterr = fluffy_add_exclude(handle,
+						     exclp->type,
+						     exclp->pattern);
+				}
+				if (reterr == 0 &&
+				    ctxinfop->pressure.actions != 0) {
+					reterr = fluffy_set_queue_pressure(
+						     handle,
+						     &ctxinfop->pressure);
+				}
+				if (reterr == 0 && ctxinfop->is_budget) {
+					reterr = fluffy_set_watch_budget(
+						     handle,
+						     &ctxinfop->budget);
+				}
+			}
+			if (reterr) {
+				break;
+			}
+
+			ctxinfop->shards = shards;
+			ctxinfop->shard_table = tablep;
+			ctxinfop->hot_rate = shardopts->hot_rate;
+			ctxinfop->rate_from_ms = fluffy_now_ms();
+			ctxinfop->rate_due_ms = ctxinfop->rate_from_ms +
+			    SHARD_RATE_MS;
+			__atomic_store_n(&ctxinfop->nshards, nshards,
+			    __ATOMIC_RELEASE);
+		} while (0);
+
+		pthread_cleanup_pop(1);		/* Unlock mutex */
+	}
+
+	if (reterr == 0) {
+		fluffy_release_context_info(ctxinfop);
+		return 0;
+	}
+
+	/* The shards set up so far go, they refer to the array */
+	for (j = 0; j < nshards; j++) {
+		if (shards[j].handle < 1) {
+			break;
+		}
+		if (fluffy_destroy(shards[j].handle) == 0) {
+			pthread_join(shards[j].tid, NULL);
+		}
+	}
+	fluffy_free(shards);
+	fluffy_str_table_free(tablep);
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_add_exclude(int fluffy_handle, int type, const char *pattern)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	struct fluffy_exclude_info *exclinfop;
+	exclinfop = fluffy_exclude_info_new(type, pattern);
+	if (exclinfop == NULL) {
+		fluffy_release_context_info(ctxinfop);
+		return EINVAL;
+	}
+
+	/* A sharded context passes it on to its shards */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	for (j = 0; j < nshards; j++) {
+		int reterr = 0;
+		reterr = fluffy_add_exclude(ctxinfop->shards[j].handle, type,
+			     pattern);
+		if (reterr) {
+			fluffy_exclude_info_free(exclinfop);
+			fluffy_release_context_info(ctxinfop);
+			return reterr;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_exclude_info_free(exclinfop);
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int reterr = 0;
+	if (fluffy_exclude_list_add(&ctxinfop->exclude_list, exclinfop)) {
+		fluffy_exclude_info_free(exclinfop);
+		reterr = ENOMEM;
+	}
+
+	/* Directories resolved by fanotify are placed afresh */
+	if (ctxinfop->fan_dir_table != NULL) {
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	}
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_set_allocator(void *(*alloc_fn)(size_t size, void *alloc_ctx),
+    void *(*realloc_fn)(void *ptr, size_t size, void *alloc_ctx),
+    void (*free_fn)(void *ptr, void *alloc_ctx), void *alloc_ctx)
+{
+	/* All or none, memory has to go back where it came from */
+	if ((alloc_fn == NULL) != (realloc_fn == NULL) ||
+	    (alloc_fn == NULL) != (free_fn == NULL)) {
+		return EINVAL;
+	}
+
+	int m = -1;
+	int reterr = 0;
+	m = pthread_mutex_lock(&fluffy_track.mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &fluffy_track.mutex);
+
+	do {
+		/*
+		 * A live context holds memory of the allocator in place. None
+		 * is held once the last one is unreferenced, its retired
+		 * memory is reclaimed before that.
+		 */
+		if (fluffy_track.nref > 0) {
+			reterr = EBUSY;
+			break;
+		}
+
+		fluffy_track.alloc.alloc_fn	= alloc_fn;
+		fluffy_track.alloc.realloc_fn	= realloc_fn;
+		fluffy_track.alloc.free_fn	= free_fn;
+		fluffy_track.alloc.alloc_ctx	= alloc_ctx;
+	} while(0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return reterr;
+}
+
+
+/*
+ * Function:	fluffy_malloc
+ *
+ * malloc(3) off the client's allocator, if one is set. Every allocation of
+ * fluffy goes through here or the likes below. errno is ENOMEM on failure,
+ * whatever the client's allocator left in it.
+ */
+static void *
+fluffy_malloc(size_t size)
+{
+	void *ptr;
+	if (fluffy_track.alloc.alloc_fn != NULL) {
+		ptr = fluffy_track.alloc.alloc_fn(size,
+			fluffy_track.alloc.alloc_ctx);
+	} else {
+		ptr = malloc(size);
+	}
+
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+static void *
+fluffy_calloc(size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *ptr;
+	ptr = fluffy_malloc(nmemb * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+	return ptr;
+}
+
+static void *
+fluffy_realloc(void *ptr, size_t size)
+{
+	void *newptr;
+	if (fluffy_track.alloc.realloc_fn != NULL) {
+		newptr = fluffy_track.alloc.realloc_fn(ptr, size,
+			    fluffy_track.alloc.alloc_ctx);
+	} else {
+		newptr = realloc(ptr, size);
+	}
+
+	if (newptr == NULL) {
+		errno = ENOMEM;
+	}
+	return newptr;
+}
+
+static char *
+fluffy_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *dup;
+	dup = fluffy_malloc(len);
+	if (dup != NULL) {
+		memcpy(dup, str, len);
+	}
+	return dup;
+}
+
+static void
+fluffy_free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (fluffy_track.alloc.free_fn != NULL) {
+		fluffy_track.alloc.free_fn(ptr, fluffy_track.alloc.alloc_ctx);
+	} else {
+		free(ptr);
+	}
+}
+
+
+/*
+ * Function:	fluffy_context_info_new
+ *
+ * Allocate memory for a fluffy_context_info and assign appropriate values.
+ *
+ * args:
+ * 	- None
+ * return:
+ * 	- A pointer to fluffy_context_info when successful, NULL otherwise
+ */
+static struct fluffy_context_info *
+fluffy_context_info_new()
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_calloc(1, sizeof(struct fluffy_context_info));
+	if (ctxinfop == NULL) {
+		perror("calloc");
+		/*
+		 * When OOM is not handled, it's a common practice to call
+		 * exit() to bail out. We will return NULL instead of exit()
+		 * to hand off the reponsibility to the caller.
+		 */
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&ctxinfop->mutex, NULL)) {
+		return NULL;
+	}
+
+	if (pthread_cond_init(&ctxinfop->walk_cond, NULL)) {
+		return NULL;
+	}
+
+	if (pthread_cond_init(&ctxinfop->shard_cond, NULL)) {
+		return NULL;
+	}
+
+	if (pthread_cond_init(&ctxinfop->backlog_cond, NULL)) {
+		return NULL;
+	}
+
+	ctxinfop->is_persist	= 0;
+	ctxinfop->inotify_fd	= -1;
+	ctxinfop->backend	= &fluffy_inotify_backend;
+	ctxinfop->epoll_fd	= -1;
+	ctxinfop->wake_fd	= -1;
+	ctxinfop->fanotify_fd	= -1;
+	ctxinfop->nreport_walks	= 0;
+	ctxinfop->nwd		= 0;
+	ctxinfop->watch_bytes	= 0;
+	ctxinfop->handle	= -1;
+
+	ctxinfop->user_data	= NULL;
+	ctxinfop->wd_dir	= NULL;
+	ctxinfop->path_index	= NULL;
+	ctxinfop->retired	= NULL;
+	ctxinfop->wd_alloc	= NULL;
+	ctxinfop->root_path_table = NULL;
+	ctxinfop->nroots	= 0;
+	ctxinfop->synth_table	= NULL;
+	ctxinfop->nsynth	= 0;
+	ctxinfop->options	= 0;
+
+	return ctxinfop;
+}
+
+/*
+ * Function:	fluffy_context_info_free
+ *
+ * Called by fluffy_unref() once the context is out of the handle registry,
+ * or by the last hold released after that. Frees up records.
+ */
+static void
+fluffy_context_info_free(struct fluffy_context_info *ctxinfop)
+{
+	/* Only left over when the context didn't make it past its setup */
+	if (ctxinfop->wd_dir != NULL) {
+		fluffy_wd_dir_free(ctxinfop->wd_dir);
+	}
+	if (ctxinfop->wd_alloc != NULL) {
+		fluffy_wd_alloc_free(ctxinfop->wd_alloc);
+	}
+	fluffy_free(ctxinfop->path_index);
+	fluffy_str_table_free(ctxinfop->root_path_table);
+	fluffy_exclude_list_clear(&ctxinfop->exclude_list);
+	fluffy_pending_queue_clear(&ctxinfop->pending_queue);
+	fluffy_str_table_free(ctxinfop->synth_table);
+	fluffy_free(ctxinfop);
+}
+
+
+/*
+ * Function:	fluffy_wd_info_size
+ *
+ * Bytes allocated for the watch record, its path included.
+ */
+static size_t
+fluffy_wd_info_size(const struct fluffy_wd_info *wdinfop)
+{
+	return sizeof(struct fluffy_wd_info) + strlen(wdinfop->path) + 1;
+}
+
+/*
+ * Function:	fluffy_wd_alloc_new
+ *
+ * Allocate an empty watch record allocator.
+ *
+ * return:
+ * 	- A pointer to fluffy_wd_alloc when successful, NULL otherwise
+ */
+static struct fluffy_wd_alloc *
+fluffy_wd_alloc_new()
+{
+	struct fluffy_wd_alloc *allocp;
+	allocp = fluffy_calloc(1, sizeof(struct fluffy_wd_alloc));
+	if (allocp == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	return allocp;
+}
+
+/*
+ * Function:	fluffy_arena_free
+ *
+ * Free a chain of arena blocks. Passed to fluffy_retire().
+ */
+static void
+fluffy_arena_free(void *blocks)
+{
+	struct fluffy_arena_block *blockp = blocks;
+	while (blockp != NULL) {
+		struct fluffy_arena_block *nextp = blockp->next;
+		fluffy_free(blockp);
+		blockp = nextp;
+	}
+}
+
+/*
+ * Function:	fluffy_wd_alloc_free
+ *
+ * Release an allocator, along with every record and path it handed out, in
+ * bulk. Passed to fluffy_retire().
+ */
+static void
+fluffy_wd_alloc_free(void *alloc)
+{
+	struct fluffy_wd_alloc *allocp = alloc;
+	struct fluffy_wd_slab *slabp = allocp->slabs;
+	while (slabp != NULL) {
+		struct fluffy_wd_slab *nextp = slabp->next;
+		fluffy_free(slabp);
+		slabp = nextp;
+	}
+	fluffy_arena_free(allocp->blocks);
+	fluffy_free(allocp);
+}
+
+static void
+fluffy_wd_slab_link_avail(struct fluffy_wd_alloc *allocp,
+    struct fluffy_wd_slab *slabp)
+{
+	slabp->avail_prev = NULL;
+	slabp->avail_next = allocp->avail;
+	if (allocp->avail != NULL) {
+		allocp->avail->avail_prev = slabp;
+	}
+	allocp->avail = slabp;
+}
+
+static void
+fluffy_wd_slab_unlink_avail(struct fluffy_wd_alloc *allocp,
+    struct fluffy_wd_slab *slabp)
+{
+	if (slabp->avail_prev != NULL) {
+		slabp->avail_prev->avail_next = slabp->avail_next;
+	} else {
+		allocp->avail = slabp->avail_next;
+	}
+	if (slabp->avail_next != NULL) {
+		slabp->avail_next->avail_prev = slabp->avail_prev;
+	}
+	slabp->avail_prev = NULL;
+	slabp->avail_next = NULL;
+}
+
+/*
+ * Function:	fluffy_arena_strdup
+ *
+ * Copy a path to the arena, starting a new block when the current one has
+ * no room for it.
+ *
+ * return:
+ * 	- A pointer to the copy when successful, NULL otherwise
+ */
+static char *
+fluffy_arena_strdup(struct fluffy_wd_alloc *allocp, const char *path)
+{
+	size_t len = strlen(path) + 1;
+	struct fluffy_arena_block *blockp = allocp->blocks;
+	if (blockp == NULL || blockp->size - blockp->used < len) {
+		size_t size = (len > ARENA_BLOCK_SIZE) ? len : ARENA_BLOCK_SIZE;
+		blockp = fluffy_malloc(sizeof(struct fluffy_arena_block) +
+			    size);
+		if (blockp == NULL) {
+			perror("malloc");
+			return NULL;
+		}
+		blockp->size = size;
+		blockp->used = 0;
+		blockp->next = allocp->blocks;
+		allocp->blocks = blockp;
+	}
+
+	char *p = blockp->bytes + blockp->used;
+	memcpy(p, path, len);
+	blockp->used += len;
+	allocp->live_bytes += len;
+	return p;
+}
+
+/*
+ * Function:	fluffy_arena_drop
+ *
+ * Count a path copied to the arena as dead; its bytes stay put until the
+ * arena is compacted or released.
+ */
+static void
+fluffy_arena_drop(struct fluffy_wd_alloc *allocp, const char *path)
+{
+	size_t len = strlen(path) + 1;
+	allocp->live_bytes -= len;
+	allocp->dead_bytes += len;
+}
+
+/*
+ * Function:	fluffy_arena_compact
+ *
+ * Once dropped paths outweigh the live ones, copy the paths of the records
+ * in the wd directory to one new block. The old blocks may still be read by
+ * the context thread; they're retired. The context mutex must be held.
+ */
+static void
+fluffy_arena_compact(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_wd_alloc *allocp = ctxinfop->wd_alloc;
+	if (allocp->dead_bytes < ARENA_BLOCK_SIZE ||
+	    allocp->dead_bytes < allocp->live_bytes) {
+		return;
+	}
+
+	/* All of it fits, copying can't fail halfway */
+	size_t size = allocp->live_bytes;
+	if (size < ARENA_BLOCK_SIZE) {
+		size = ARENA_BLOCK_SIZE;
+	}
+	struct fluffy_arena_block *blockp;
+	blockp = fluffy_malloc(sizeof(struct fluffy_arena_block) + size);
+	if (blockp == NULL) {
+		perror("malloc");
+		return;
+	}
+	blockp->size = size;
+	blockp->used = 0;
+	blockp->next = NULL;
+
+	struct fluffy_arena_block *oldblocksp = allocp->blocks;
+	allocp->blocks = blockp;
+	allocp->live_bytes = 0;
+	allocp->dead_bytes = 0;
+
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	unsigned int j, k;
+	for (j = 0; dirp != NULL && j < dirp->npages; j++) {
+		struct fluffy_wd_page *pagep = dirp->pages[j];
+		if (pagep == NULL) {
+			continue;
+		}
+
+		for (k = 0; k < WD_PAGE_SLOTS; k++) {
+			struct fluffy_wd_info *wdinfop;
+			wdinfop = pagep->slots[k].wdinfop;
+			if (wdinfop != NULL) {
+				__atomic_store_n(&wdinfop->path,
+				    fluffy_arena_strdup(allocp, wdinfop->path),
+				    __ATOMIC_RELEASE);
+			}
+		}
+	}
+
+	fluffy_retire(ctxinfop, oldblocksp, fluffy_arena_free);
+}
+
+/*
+ * Function:	fluffy_wd_info_new
+ *
+ * Take a zeroed watch record off a slab of the context, its path copied to
+ * the arena. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- const char *: watch path
+ * return:
+ * 	- A pointer to fluffy_wd_info when successful, NULL otherwise
+ */
+static struct fluffy_wd_info *
+fluffy_wd_info_new(struct fluffy_context_info *ctxinfop, const char *path)
+{
+	struct fluffy_wd_alloc *allocp = ctxinfop->wd_alloc;
+	char *tp = fluffy_arena_strdup(allocp, path);
+	if (tp == NULL) {
+		return NULL;
+	}
+
+	struct fluffy_wd_slab *slabp = allocp->avail;
+	if (slabp == NULL) {
+		slabp = fluffy_malloc(WD_SLAB_SIZE);
+		if (slabp == NULL) {
+			perror("malloc");
+			fluffy_arena_drop(allocp, tp);
+			return NULL;
+		}
+		memset(slabp, 0, sizeof(struct fluffy_wd_slab));
+		slabp->next = allocp->slabs;
+		if (allocp->slabs != NULL) {
+			allocp->slabs->prev = slabp;
+		}
+		allocp->slabs = slabp;
+		fluffy_wd_slab_link_avail(allocp, slabp);
+	}
+
+	struct fluffy_wd_info *wdinfop;
+	uint16_t idx;
+	if (slabp->free_list != NULL) {
+		wdinfop = slabp->free_list;
+		slabp->free_list = wdinfop->next_sibling;
+		idx = wdinfop->slab_idx;
+	} else {
+		idx = (slabp->nused)++;
+		wdinfop = &slabp->recs[idx];
+	}
+	if (slabp == allocp->spare) {
+		allocp->spare = NULL;
+	}
+	if (++(slabp->nlive) == WD_SLAB_RECORDS) {
+		fluffy_wd_slab_unlink_avail(allocp, slabp);
+	}
+
+	memset(wdinfop, 0, sizeof(struct fluffy_wd_info));
+	wdinfop->slab_idx = idx;
+	wdinfop->path = tp;
+	wdinfop->hash = fluffy_path_hash(path);
+
+	return wdinfop;
+}
+
+/*
+ * Function:	fluffy_wd_info_free
+ *
+ * Put the watch record back on the free list of its slab, its path is
+ * dropped. Only what's out of the wd directory and the path index, and not
+ * being read by the context thread, may be freed. The context mutex must be
+ * held.
+ */
+static void
+fluffy_wd_info_free(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	struct fluffy_wd_alloc *allocp = ctxinfop->wd_alloc;
+	struct fluffy_wd_slab *slabp;
+	slabp = (struct fluffy_wd_slab *)
+	    ((char *)(wdinfop - wdinfop->slab_idx) -
+	    offsetof(struct fluffy_wd_slab, recs));
+
+	fluffy_arena_drop(allocp, wdinfop->path);
+	fluffy_snap_free(ctxinfop, wdinfop->snap);
+	wdinfop->snap = NULL;
+
+	if ((slabp->nlive)-- == WD_SLAB_RECORDS) {
+		fluffy_wd_slab_link_avail(allocp, slabp);
+	}
+	if (slabp->nlive > 0 || allocp->spare == NULL) {
+		wdinfop->next_sibling = slabp->free_list;
+		slabp->free_list = wdinfop;
+
+		/* One empty slab is kept, for watches that come and go */
+		if (slabp->nlive == 0) {
+			allocp->spare = slabp;
+		}
+	} else {
+		fluffy_wd_slab_unlink_avail(allocp, slabp);
+		if (slabp->prev != NULL) {
+			slabp->prev->next = slabp->next;
+		} else {
+			allocp->slabs = slabp->next;
+		}
+		if (slabp->next != NULL) {
+			slabp->next->prev = slabp->prev;
+		}
+		fluffy_free(slabp);
+	}
+
+	fluffy_arena_compact(ctxinfop);
+}
+
+/*
+ * Function:	fluffy_wd_info_retired
+ *
+ * Put a retired watch record back on its slab, with the context mutex.
+ * A record of an allocator that's been replaced since goes along with it.
+ * Passed to fluffy_retire().
+ */
+static void
+fluffy_wd_info_retired(void *retired)
+{
+	struct fluffy_wd_retired *wdretp = retired;
+	struct fluffy_context_info *ctxinfop = wdretp->ctxinfop;
+
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		if (ctxinfop->wd_alloc == wdretp->allocp) {
+			fluffy_wd_info_free(ctxinfop, wdretp->wdinfop);
+		}
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+	fluffy_free(wdretp);
+}
+
+/*
+ * Function:	fluffy_wd_info_retire
+ *
+ * Retire a watch record the context thread may have come across, it's
+ * freed at the next quiescent state. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context the record belongs to
+ * 	- struct fluffy_wd_info *: record, out of the wd directory and the
+ * 	  path index
+ * return:
+ * 	- void
+ */
+static void
+fluffy_wd_info_retire(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	struct fluffy_wd_retired *wdretp;
+	wdretp = fluffy_malloc(sizeof(struct fluffy_wd_retired));
+	if (wdretp == NULL) {
+		/* It's released along with the allocator */
+		perror("malloc");
+		return;
+	}
+	wdretp->ctxinfop = ctxinfop;
+	wdretp->allocp = ctxinfop->wd_alloc;
+	wdretp->wdinfop = wdinfop;
+	fluffy_retire(ctxinfop, wdretp, fluffy_wd_info_retired);
+}
+
+/*
+ * Function:	fluffy_retire
+ *
+ * Put memory that the context thread may still be reading on the retired
+ * list, it's freed at the next quiescent state of the context thread. The
+ * context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context the memory belongs to
+ * 	- void *: memory to be freed
+ * 	- void (*)(void *): function that frees it
+ * return:
+ * 	- void
+ */
+static void
+fluffy_retire(struct fluffy_context_info *ctxinfop, void *ptr,
+    void (*free_fn)(void *))
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	struct fluffy_retired *retp;
+	retp = fluffy_malloc(sizeof(struct fluffy_retired));
+	if (retp == NULL) {
+		/* Leaking it is the only safe option left */
+		perror("malloc");
+		return;
+	}
+	retp->ptr = ptr;
+	retp->free_fn = free_fn;
+	retp->next = ctxinfop->retired;
+	__atomic_store_n(&ctxinfop->retired, retp, __ATOMIC_RELEASE);
+
+	/* Don't let it wait for the next inotify event */
+	if (retp->next == NULL) {
+		fluffy_wake_context(ctxinfop);
+	}
+}
+
+/*
+ * Function:	fluffy_reclaim_retired
+ *
+ * Free the retired list. Only the context thread calls this, when it holds
+ * no reference to the records; or once it's gone.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context to reclaim memory of
+ * return:
+ * 	- void
+ */
+static void
+fluffy_reclaim_retired(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_retired *retp = NULL;
+	if (__atomic_load_n(&ctxinfop->retired, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return;
+	}
+	retp = ctxinfop->retired;
+	ctxinfop->retired = NULL;
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		/* nothing? */
+	}
+
+	/*
+	 * Freed in the order retired; a record goes back to its allocator
+	 * before an allocator retired after it is freed.
+	 */
+	struct fluffy_retired *fifop = NULL;
+	while (retp != NULL) {
+		struct fluffy_retired *nextp = retp->next;
+		retp->next = fifop;
+		fifop = retp;
+		retp = nextp;
+	}
+	retp = fifop;
+
+	while (retp != NULL) {
+		struct fluffy_retired *nextp = retp->next;
+		retp->free_fn(retp->ptr);
+		fluffy_free(retp);
+		retp = nextp;
+	}
+}
+
+/*
+ * Function:	fluffy_wd_lookup
+ *
+ * Look up the watch record of a watch descriptor. The context thread may
+ * call this without the context mutex, others must hold it.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- int: watch descriptor
+ * return:
+ * 	- A pointer to fluffy_wd_info when found, NULL otherwise
+ */
+static struct fluffy_wd_info *
+fluffy_wd_lookup(struct fluffy_context_info *ctxinfop, int wd)
+{
+	return fluffy_wd_dir_lookup(
+	    __atomic_load_n(&ctxinfop->wd_dir, __ATOMIC_ACQUIRE), wd);
+}
+
+/*
+ * Function:	fluffy_wd_dir_lookup
+ *
+ * Look up a watch descriptor in the given pages, see fluffy_wd_lookup().
+ */
+static struct fluffy_wd_info *
+fluffy_wd_dir_lookup(struct fluffy_wd_dir *dirp, int wd)
+{
+	if (wd < 0) {
+		return NULL;
+	}
+
+	unsigned int pgidx = (unsigned int)wd / WD_PAGE_SLOTS;
+	if (dirp == NULL || pgidx >= dirp->npages) {
+		return NULL;
+	}
+
+	struct fluffy_wd_page *pagep;
+	pagep = __atomic_load_n(&dirp->pages[pgidx], __ATOMIC_ACQUIRE);
+	if (pagep == NULL) {
+		return NULL;
+	}
+
+	return __atomic_load_n(&pagep->slots[wd & (WD_PAGE_SLOTS - 1)].wdinfop,
+	    __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Function:	fluffy_wd_insert
+ *
+ * Put the record in the slot of its watch descriptor, growing the pages as
+ * required. The slot must be vacant. A larger page directory replaces the
+ * current one, which is retired. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- struct fluffy_wd_info *: record with its wd set
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_wd_insert(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	if (wdinfop->wd < 0) {
+		return EINVAL;
+	}
+
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	unsigned int pgidx = (unsigned int)wdinfop->wd / WD_PAGE_SLOTS;
+	if (dirp == NULL || pgidx >= dirp->npages) {
+		unsigned int npages = (dirp != NULL) ? dirp->npages : 1;
+		while (npages <= pgidx) {
+			npages *= 2;
+		}
+
+		struct fluffy_wd_dir *newdirp;
+		newdirp = fluffy_calloc(1, sizeof(struct fluffy_wd_dir) +
+				npages * (sizeof(struct fluffy_wd_page *) +
+				sizeof(uint32_t)));
+		if (newdirp == NULL) {
+			perror("calloc");
+			return ENOMEM;
+		}
+		newdirp->npages = npages;
+		newdirp->gen_bases = (uint32_t *)&newdirp->pages[npages];
+		if (dirp != NULL) {
+			memcpy(newdirp->pages, dirp->pages,
+			    dirp->npages * sizeof(struct fluffy_wd_page *));
+			memcpy(newdirp->gen_bases, dirp->gen_bases,
+			    dirp->npages * sizeof(uint32_t));
+		}
+
+		__atomic_store_n(&ctxinfop->wd_dir, newdirp, __ATOMIC_RELEASE);
+		fluffy_retire(ctxinfop, dirp, fluffy_free);
+		dirp = newdirp;
+	}
+
+	struct fluffy_wd_page *pagep = dirp->pages[pgidx];
+	if (pagep == NULL) {
+		pagep = fluffy_malloc(sizeof(struct fluffy_wd_page));
+		if (pagep == NULL) {
+			perror("malloc");
+			return ENOMEM;
+		}
+
+		/* Past whatever a stale record of the index may hold */
+		unsigned int k;
+		pagep->nused = 0;
+		pagep->maxgen = dirp->gen_bases[pgidx];
+		for (k = 0; k < WD_PAGE_SLOTS; k++) {
+			pagep->slots[k].wdinfop = NULL;
+			pagep->slots[k].gen = pagep->maxgen;
+		}
+		__atomic_store_n(&dirp->pages[pgidx], pagep, __ATOMIC_RELEASE);
+	}
+
+	struct fluffy_wd_slot *slotp;
+	slotp = &pagep->slots[wdinfop->wd & (WD_PAGE_SLOTS - 1)];
+	if (slotp->wdinfop != NULL) {
+		return EEXIST;
+	}
+
+	wdinfop->gen = ++(slotp->gen);
+	if (slotp->gen > pagep->maxgen) {
+		pagep->maxgen = slotp->gen;
+	}
+	__atomic_store_n(&slotp->wdinfop, wdinfop, __ATOMIC_RELEASE);
+	(pagep->nused)++;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_wd_remove
+ *
+ * Vacate the slot of the record, only if the slot still holds it. A page
+ * left empty is retired, its generations are kept for the next one of the
+ * index. The record itself isn't freed. The context mutex
+ * must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- struct fluffy_wd_info *: record to remove
+ * return:
+ * 	- int: 1 when the slot held the record, 0 otherwise
+ */
+static int
+fluffy_wd_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	if (fluffy_wd_lookup(ctxinfop, wdinfop->wd) != wdinfop) {
+		return 0;
+	}
+
+	unsigned int pgidx = (unsigned int)wdinfop->wd / WD_PAGE_SLOTS;
+	struct fluffy_wd_page *pagep = ctxinfop->wd_dir->pages[pgidx];
+	struct fluffy_wd_slot *slotp;
+	slotp = &pagep->slots[wdinfop->wd & (WD_PAGE_SLOTS - 1)];
+	if (slotp->gen != wdinfop->gen) {
+		return 0;
+	}
+
+	__atomic_store_n(&slotp->wdinfop, NULL, __ATOMIC_RELEASE);
+	(slotp->gen)++;
+	if (slotp->gen > pagep->maxgen) {
+		pagep->maxgen = slotp->gen;
+	}
+	if (--(pagep->nused) == 0) {
+		ctxinfop->wd_dir->gen_bases[pgidx] = pagep->maxgen;
+		__atomic_store_n(&ctxinfop->wd_dir->pages[pgidx], NULL,
+		    __ATOMIC_RELEASE);
+		fluffy_retire(ctxinfop, pagep, fluffy_free);
+	}
+	return 1;
+}
+
+/*
+ * Function:	fluffy_wd_dir_free
+ *
+ * Free a page directory along with its pages. The records belong to the
+ * allocator. Passed to fluffy_retire().
+ */
+static void
+fluffy_wd_dir_free(void *dir)
+{
+	struct fluffy_wd_dir *dirp = dir;
+	unsigned int j;
+	for (j = 0; j < dirp->npages; j++) {
+		fluffy_free(dirp->pages[j]);
+	}
+	fluffy_free(dirp);
+}
+
+/*
+ * Function:	fluffy_wd_remove_all
+ *
+ * Drop every watch record along with the pages; the pages are retired and
+ * so is the allocator, for an empty one. The context mutex must be held.
+ */
+static void
+fluffy_wd_remove_all(struct fluffy_context_info *ctxinfop)
+{
+	fluffy_snap_free_all(ctxinfop);
+
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	__atomic_store_n(&ctxinfop->wd_dir, NULL, __ATOMIC_RELEASE);
+	fluffy_retire(ctxinfop, dirp, fluffy_wd_dir_free);
+
+	/* Short of memory, the records are left to the current one */
+	struct fluffy_wd_alloc *allocp = fluffy_wd_alloc_new();
+	if (allocp != NULL) {
+		fluffy_retire(ctxinfop, ctxinfop->wd_alloc,
+		    fluffy_wd_alloc_free);
+		ctxinfop->wd_alloc = allocp;
+	}
+}
+
+/*
+ * Function:	fluffy_path_hash
+ *
+ * FNV-1a hash of a path.
+ */
+static uint32_t
+fluffy_path_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+	while (*path != '\0') {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct fluffy_path_index *
+fluffy_path_index_new(unsigned int size)
+{
+	struct fluffy_path_index *indexp;
+	indexp = fluffy_calloc(1, sizeof(struct fluffy_path_index) +
+			size * sizeof(struct fluffy_wd_info *));
+	if (indexp == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	indexp->size = size;
+	return indexp;
+}
+
+/*
+ * Function:	fluffy_path_lookup
+ *
+ * Look up the watch record of a path. The context thread may call this
+ * without the context mutex, others must hold it.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- const char *: watch path
+ * return:
+ * 	- A pointer to fluffy_wd_info when found, NULL otherwise
+ */
+static struct fluffy_wd_info *
+fluffy_path_lookup(struct fluffy_context_info *ctxinfop, const char *path)
+{
+	return fluffy_path_index_lookup(
+	    __atomic_load_n(&ctxinfop->path_index, __ATOMIC_ACQUIRE), path);
+}
+
+/*
+ * Function:	fluffy_path_index_lookup
+ *
+ * Look up a path in the given index, see fluffy_path_lookup().
+ */
+static struct fluffy_wd_info *
+fluffy_path_index_lookup(struct fluffy_path_index *indexp, const char *path)
+{
+	if (indexp == NULL) {
+		return NULL;
+	}
+
+	uint32_t hash = fluffy_path_hash(path);
+	unsigned int mask = indexp->size - 1;
+	unsigned int j, n;
+	for (j = hash & mask, n = 0; n < indexp->size;
+	    j = (j + 1) & mask, n++) {
+		struct fluffy_wd_info *wdinfop;
+		wdinfop = __atomic_load_n(&indexp->slots[j], __ATOMIC_ACQUIRE);
+		if (wdinfop == NULL) {
+			break;
+		}
+		if (wdinfop == &path_index_tomb) {
+			continue;
+		}
+		if (__atomic_load_n(&wdinfop->hash, __ATOMIC_ACQUIRE) == hash &&
+		    strcmp(__atomic_load_n(&wdinfop->path, __ATOMIC_ACQUIRE),
+		    path) == 0) {
+			return wdinfop;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_path_place
+ *
+ * Put the record in the first free slot of its probe sequence, there must
+ * be one. Tells the caller which kind of slot it took.
+ *
+ * return:
+ * 	- int: 1 when a tombstone was reused, 0 otherwise
+ */
+static int
+fluffy_path_place(struct fluffy_path_index *indexp,
+    struct fluffy_wd_info *wdinfop)
+{
+	unsigned int mask = indexp->size - 1;
+	unsigned int j = wdinfop->hash & mask;
+	while (indexp->slots[j] != NULL &&
+	    indexp->slots[j] != &path_index_tomb) {
+		j = (j + 1) & mask;
+	}
+
+	int is_tomb = (indexp->slots[j] == &path_index_tomb);
+	__atomic_store_n(&indexp->slots[j], wdinfop, __ATOMIC_RELEASE);
+	return is_tomb;
+}
+
+/*
+ * Function:	fluffy_path_rebuild
+ *
+ * Build a new path index, half full once it holds the given number of
+ * records, out of the records of the current one. It's published and the
+ * current one retired; tombstones don't carry over. The context mutex must
+ * be held.
+ *
+ * return:
+ * 	- A pointer to the new fluffy_path_index when successful, NULL
+ * 	otherwise
+ */
+static struct fluffy_path_index *
+fluffy_path_rebuild(struct fluffy_context_info *ctxinfop, unsigned int nrecs)
+{
+	struct fluffy_path_index *indexp = ctxinfop->path_index;
+	unsigned int size = PATH_INDEX_MIN_SLOTS;
+	while (size < nrecs * 2) {
+		size *= 2;
+	}
+
+	struct fluffy_path_index *newindexp;
+	newindexp = fluffy_path_index_new(size);
+	if (newindexp == NULL) {
+		return NULL;
+	}
+
+	unsigned int j;
+	for (j = 0; j < indexp->size; j++) {
+		if (indexp->slots[j] != NULL &&
+		    indexp->slots[j] != &path_index_tomb) {
+			fluffy_path_place(newindexp, indexp->slots[j]);
+		}
+	}
+	newindexp->nused = indexp->nused;
+
+	__atomic_store_n(&ctxinfop->path_index, newindexp, __ATOMIC_RELEASE);
+	fluffy_retire(ctxinfop, indexp, fluffy_free);
+	return newindexp;
+}
+
+/*
+ * Function:	fluffy_path_insert
+ *
+ * Index the record by its path, replacing the record that was indexed for
+ * the same path, if any. Once the index is three quarters full, tombstones
+ * included, it's rebuilt to be half full; the new index is published and
+ * the old one retired. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- struct fluffy_wd_info *: record with its path and hash set
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_path_insert(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	struct fluffy_path_index *indexp = ctxinfop->path_index;
+	if (indexp == NULL) {
+		return EINVAL;
+	}
+
+	unsigned int mask = indexp->size - 1;
+	unsigned int j, n;
+	for (j = wdinfop->hash & mask, n = 0; n < indexp->size;
+	    j = (j + 1) & mask, n++) {
+		struct fluffy_wd_info *slotp = indexp->slots[j];
+		if (slotp == NULL) {
+			break;
+		}
+		if (slotp != &path_index_tomb &&
+		    slotp->hash == wdinfop->hash &&
+		    strcmp(slotp->path, wdinfop->path) == 0) {
+			__atomic_store_n(&indexp->slots[j], wdinfop,
+			    __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+
+	if ((indexp->nused + indexp->ntomb + 1) * 4 > indexp->size * 3) {
+		indexp = fluffy_path_rebuild(ctxinfop, indexp->nused + 1);
+		if (indexp == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	if (fluffy_path_place(indexp, wdinfop)) {
+		(indexp->ntomb)--;
+	}
+	(indexp->nused)++;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_path_remove
+ *
+ * Drop the record from the path index, only if it's the record indexed for
+ * its path. An index down to an eighth of its size is rebuilt smaller. The
+ * context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- struct fluffy_wd_info *: record to remove
+ * return:
+ * 	- int: 1 when it was indexed, 0 otherwise
+ */
+static int
+fluffy_path_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	struct fluffy_path_index *indexp = ctxinfop->path_index;
+	if (indexp == NULL) {
+		return 0;
+	}
+
+	unsigned int mask = indexp->size - 1;
+	unsigned int j, n;
+	for (j = wdinfop->hash & mask, n = 0; n < indexp->size;
+	    j = (j + 1) & mask, n++) {
+		if (indexp->slots[j] == NULL) {
+			break;
+		}
+		if (indexp->slots[j] == wdinfop) {
+			__atomic_store_n(&indexp->slots[j], &path_index_tomb,
+			    __ATOMIC_RELEASE);
+			(indexp->nused)--;
+			(indexp->ntomb)++;
+
+			/* Stays as it is when short of memory */
+			if (indexp->size > PATH_INDEX_MIN_SLOTS &&
+			    indexp->nused * 8 < indexp->size) {
+				fluffy_path_rebuild(ctxinfop, indexp->nused);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_path_reset
+ *
+ * Publish an empty path index, the current one is retired. The context
+ * mutex must be held.
+ *
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_path_reset(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_path_index *indexp;
+	indexp = fluffy_path_index_new(PATH_INDEX_MIN_SLOTS);
+	if (indexp == NULL) {
+		return ENOMEM;
+	}
+
+	struct fluffy_path_index *oldindexp = ctxinfop->path_index;
+	__atomic_store_n(&ctxinfop->path_index, indexp, __ATOMIC_RELEASE);
+	fluffy_retire(ctxinfop, oldindexp, fluffy_free);
+	return 0;
+}
+
+/*
+ * Function:	fluffy_wd_info_rename
+ *
+ * Change the path of a watch record, reindexing it. The old path may still
+ * be read by the context thread; its arena bytes are only counted as dead.
+ * The context mutex must be held.
+ *
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_wd_info_rename(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop, const char *path)
+{
+	struct fluffy_wd_alloc *allocp = ctxinfop->wd_alloc;
+	char *tp = fluffy_arena_strdup(allocp, path);
+	if (tp == NULL) {
+		return ENOMEM;
+	}
+
+	ctxinfop->watch_bytes -= strlen(wdinfop->path) + 1;
+	ctxinfop->watch_bytes += strlen(tp) + 1;
+	fluffy_arena_drop(allocp, wdinfop->path);
+
+	fluffy_path_remove(ctxinfop, wdinfop);
+	__atomic_store_n(&wdinfop->hash, fluffy_path_hash(tp),
+	    __ATOMIC_RELEASE);
+	__atomic_store_n(&wdinfop->path, tp, __ATOMIC_RELEASE);
+	if (fluffy_path_insert(ctxinfop, wdinfop)) {
+		return ENOMEM;
+	}
+
+	fluffy_arena_compact(ctxinfop);
+	return 0;
+}
+
+/*
+ * Function:	fluffy_sync_root
+ *
+ * Bring the root mark of the record of a path, and the count of root paths,
+ * in line with fluffy_context_info.root_path_table. The context thread
+ * reads them without the context mutex, which must be held.
+ */
+static void
+fluffy_sync_root(struct fluffy_context_info *ctxinfop, const char *path)
+{
+	struct fluffy_wd_info *wdinfop;
+	wdinfop = fluffy_path_lookup(ctxinfop, path);
+	if (wdinfop != NULL) {
+		__atomic_store_n(&wdinfop->is_root,
+		    fluffy_str_table_lookup(ctxinfop->root_path_table, path,
+		    NULL), __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ctxinfop->nroots,
+	    ctxinfop->root_path_table->nused, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Function:	fluffy_str_table_new
+ *
+ * Allocate an empty string table.
+ *
+ * args:
+ * 	- void (*)(void *): frees the values, NULL when they aren't owned
+ * return:
+ * 	- A pointer to fluffy_str_table when successful, NULL otherwise
+ */
+static struct fluffy_str_table *
+fluffy_str_table_new(void (*free_fn)(void *))
+{
+	struct fluffy_str_table *tablep;
+	tablep = fluffy_calloc(1, sizeof(struct fluffy_str_table));
+	if (tablep == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	tablep->slots = fluffy_calloc(STR_TABLE_MIN_SLOTS,
+			    sizeof(struct fluffy_str_slot));
+	if (tablep->slots == NULL) {
+		perror("calloc");
+		fluffy_free(tablep);
+		return NULL;
+	}
+
+	tablep->size = STR_TABLE_MIN_SLOTS;
+	tablep->free_fn = free_fn;
+	return tablep;
+}
+
+/*
+ * Function:	fluffy_str_table_free
+ *
+ * Free the table along with its keys and values. NULL is let be.
+ */
+static void
+fluffy_str_table_free(struct fluffy_str_table *tablep)
+{
+	if (tablep == NULL) {
+		return;
+	}
+
+	unsigned int j;
+	for (j = 0; j < tablep->size; j++) {
+		struct fluffy_str_slot *slotp = &tablep->slots[j];
+		if (slotp->key == NULL || slotp->key == &str_table_tomb) {
+			continue;
+		}
+		fluffy_free(slotp->key);
+		if (tablep->free_fn != NULL) {
+			tablep->free_fn(slotp->value);
+		}
+	}
+	fluffy_free(tablep->slots);
+	fluffy_free(tablep);
+}
+
+/*
+ * Function:	fluffy_str_table_find
+ *
+ * Find the slot of a key. An empty slot is always left, the probe ends.
+ *
+ * return:
+ * 	- A pointer to the slot holding the key, NULL when there's none
+ */
+static struct fluffy_str_slot *
+fluffy_str_table_find(struct fluffy_str_table *tablep, const char *key,
+    uint32_t hash)
+{
+	unsigned int mask = tablep->size - 1;
+	unsigned int j;
+
+	for (j = hash & mask; tablep->slots[j].key != NULL;
+	    j = (j + 1) & mask) {
+		struct fluffy_str_slot *slotp = &tablep->slots[j];
+		if (slotp->key != &str_table_tomb	&&
+		    slotp->hash == hash			&&
+		    strcmp(slotp->key, key) == 0) {
+			return slotp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_str_table_rebuild
+ *
+ * Move the entries to new slots sized for nkeys, at most half full; the
+ * deleted slots are dropped on the way.
+ *
+ * return:
+ * 	- int: 0 when successful, -1 otherwise; the table is left as it is
+ */
+static int
+fluffy_str_table_rebuild(struct fluffy_str_table *tablep, unsigned int nkeys)
+{
+	unsigned int size = STR_TABLE_MIN_SLOTS;
+	while (size < nkeys * 2) {
+		size <<= 1;
+	}
+
+	struct fluffy_str_slot *slots;
+	slots = fluffy_calloc(size, sizeof(struct fluffy_str_slot));
+	if (slots == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	unsigned int j, k;
+	for (j = 0; j < tablep->size; j++) {
+		struct fluffy_str_slot *slotp = &tablep->slots[j];
+		if (slotp->key == NULL || slotp->key == &str_table_tomb) {
+			continue;
+		}
+		for (k = slotp->hash & (size - 1); slots[k].key != NULL;
+		    k = (k + 1) & (size - 1)) {
+			/* Probe on */
+		}
+		slots[k] = *slotp;
+	}
+
+	fluffy_free(tablep->slots);
+	tablep->slots = slots;
+	tablep->size = size;
+	tablep->ntomb = 0;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_str_table_lookup
+ *
+ * args:
+ * 	- struct fluffy_str_table *: table to look up
+ * 	- const char *: the key
+ * 	- void **: set to the value when found, may be NULL
+ * return:
+ * 	- int: 1 when the key is found, 0 otherwise
+ */
+static int
+fluffy_str_table_lookup(struct fluffy_str_table *tablep, const char *key,
+    void **valuep)
+{
+	struct fluffy_str_slot *slotp;
+	slotp = fluffy_str_table_find(tablep, key, fluffy_path_hash(key));
+	if (slotp == NULL) {
+		return 0;
+	}
+
+	if (valuep != NULL) {
+		*valuep = slotp->value;
+	}
+	return 1;
+}
+
+/*
+ * Function:	fluffy_str_table_replace
+ *
+ * Set the value of a key, the key is copied in if it's new. The value it
+ * replaces, if any, is freed.
+ *
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_str_table_replace(struct fluffy_str_table *tablep, const char *key,
+    void *value)
+{
+	uint32_t hash = fluffy_path_hash(key);
+	struct fluffy_str_slot *slotp;
+	slotp = fluffy_str_table_find(tablep, key, hash);
+	if (slotp != NULL) {
+		void *oldvalue = slotp->value;
+		slotp->value = value;
+		if (tablep->free_fn != NULL && oldvalue != value) {
+			tablep->free_fn(oldvalue);
+		}
+		return 0;
+	}
+
+	/* Deleted slots count, they lengthen the probes all the same */
+	if ((tablep->nused + tablep->ntomb + 1) * 4 > tablep->size * 3) {
+		if (fluffy_str_table_rebuild(tablep, tablep->nused + 1)) {
+			return -1;
+		}
+	}
+
+	char *dup;
+	dup = fluffy_strdup(key);
+	if (dup == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	unsigned int mask = tablep->size - 1;
+	unsigned int j;
+	for (j = hash & mask; tablep->slots[j].key != NULL &&
+	    tablep->slots[j].key != &str_table_tomb; j = (j + 1) & mask) {
+		/* Probe on */
+	}
+
+	slotp = &tablep->slots[j];
+	if (slotp->key == &str_table_tomb) {
+		(tablep->ntomb)--;
+	}
+	slotp->key = dup;
+	slotp->value = value;
+	slotp->hash = hash;
+	(tablep->nused)++;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_str_table_remove
+ *
+ * Remove a key, its value is freed. The table shrinks once it's mostly
+ * empty.
+ *
+ * return:
+ * 	- int: 1 when the key was found and removed, 0 otherwise
+ */
+static int
+fluffy_str_table_remove(struct fluffy_str_table *tablep, const char *key)
+{
+	struct fluffy_str_slot *slotp;
+	slotp = fluffy_str_table_find(tablep, key, fluffy_path_hash(key));
+	if (slotp == NULL) {
+		return 0;
+	}
+
+	void *value = slotp->value;
+	fluffy_free(slotp->key);
+	slotp->key = &str_table_tomb;
+	slotp->value = NULL;
+	(tablep->nused)--;
+	(tablep->ntomb)++;
+
+	if (tablep->free_fn != NULL) {
+		tablep->free_fn(value);
+	}
+
+	if (tablep->size > STR_TABLE_MIN_SLOTS &&
+	    tablep->nused * 8 < tablep->size) {
+		if (fluffy_str_table_rebuild(tablep, tablep->nused)) {
+			/* Stays as large, no harm */
+		}
+	}
+	return 1;
+}
+
+/*
+ * Function:	fluffy_str_table_remove_all
+ *
+ * Remove every key and free the values, the table is back to its least
+ * size.
+ */
+static void
+fluffy_str_table_remove_all(struct fluffy_str_table *tablep)
+{
+	unsigned int j;
+	for (j = 0; j < tablep->size; j++) {
+		struct fluffy_str_slot *slotp = &tablep->slots[j];
+		if (slotp->key != NULL && slotp->key != &str_table_tomb) {
+			fluffy_free(slotp->key);
+			if (tablep->free_fn != NULL) {
+				tablep->free_fn(slotp->value);
+			}
+		}
+		slotp->key = NULL;
+		slotp->value = NULL;
+	}
+	tablep->nused = 0;
+	tablep->ntomb = 0;
+
+	if (tablep->size > STR_TABLE_MIN_SLOTS) {
+		if (fluffy_str_table_rebuild(tablep, 0)) {
+			/* Stays as large, no harm */
+		}
+	}
+}
+
+/*
+ * Function:	fluffy_str_table_foreach
+ *
+ * Call fn on every entry of the table, which must not change meanwhile.
+ */
+static void
+fluffy_str_table_foreach(struct fluffy_str_table *tablep,
+    void (*fn)(const char *key, void *value, void *data), void *data)
+{
+	unsigned int j;
+	for (j = 0; j < tablep->size; j++) {
+		struct fluffy_str_slot *slotp = &tablep->slots[j];
+		if (slotp->key != NULL && slotp->key != &str_table_tomb) {
+			fn(slotp->key, slotp->value, data);
+		}
+	}
+}
+
+/*
+ * Function:	fluffy_pending_queue_clear
+ *
+ * Free every event left on the queue.
+ */
+static void
+fluffy_pending_queue_clear(struct fluffy_pending_queue *queuep)
+{
+	struct fluffy_pending_event *pendp;
+	while ((pendp = queuep->head) != NULL) {
+		queuep->head = pendp->next;
+		fluffy_free(pendp);
+	}
+	queuep->tail = NULL;
+	queuep->length = 0;
+}
+
+/*
+ * Function:	fluffy_snap_stamp
+ *
+ * Fold the mtime and size of an entry into a stamp that changes with
+ * either; 0 is kept for a stamp that's not known.
+ */
+static uint64_t
+fluffy_snap_stamp(const struct stat *sbuf)
+{
+	uint64_t stamp;
+	stamp = (uint64_t)sbuf->st_mtim.tv_sec * 1000000000u +
+	    (uint64_t)sbuf->st_mtim.tv_nsec;
+	stamp ^= (uint64_t)sbuf->st_size * 0x9e3779b97f4a7c15u;
+	return (stamp == 0) ? 1 : stamp;
+}
+
+/*
+ * Function:	fluffy_snap_new
+ *
+ * Allocate an empty snapshot sized for nentries. Its bytes are counted in
+ * fluffy_context_info.snapshot_bytes, unless ctxinfop is NULL; it's then
+ * up to the caller to count it once it's hung on a record.
+ *
+ * return:
+ * 	- A pointer to fluffy_dir_snap when successful, NULL otherwise
+ */
+static struct fluffy_dir_snap *
+fluffy_snap_new(struct fluffy_context_info *ctxinfop, unsigned int nentries)
+{
+	unsigned int size = SNAP_MIN_SLOTS;
+	while (size < nentries * 2) {
+		size <<= 1;
+	}
+
+	struct fluffy_dir_snap *snap;
+	snap = fluffy_calloc(1, sizeof(struct fluffy_dir_snap) +
+		    size * sizeof(struct fluffy_snap_slot));
+	if (snap == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	snap->size = size;
+	/* Offsets SNAP_EMPTY and SNAP_TOMB are never handed out */
+	snap->names_len = SNAP_TOMB + 1;
+	if (ctxinfop != NULL) {
+		ctxinfop->snapshot_bytes += sizeof(struct fluffy_dir_snap) +
+		    size * sizeof(struct fluffy_snap_slot);
+	}
+	return snap;
+}
+
+/*
+ * Function:	fluffy_snap_free
+ *
+ * Free a snapshot, uncounting it from ctxinfop if it's not NULL. NULL is
+ * let be.
+ */
+static void
+fluffy_snap_free(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap *snap)
+{
+	if (snap == NULL) {
+		return;
+	}
+
+	if (ctxinfop != NULL) {
+		ctxinfop->snapshot_bytes -= fluffy_snap_size(snap);
+	}
+	fluffy_free(snap->names);
+	fluffy_free(snap);
+}
+
+/*
+ * Function:	fluffy_snap_size
+ *
+ * Bytes allocated for the snapshot, its names included.
+ */
+static size_t
+fluffy_snap_size(const struct fluffy_dir_snap *snap)
+{
+	return sizeof(struct fluffy_dir_snap) +
+	    snap->size * sizeof(struct fluffy_snap_slot) + snap->names_size;
+}
+
+/*
+ * Function:	fluffy_snap_list
+ *
+ * List a directory into a new snapshot, one that's not counted in the
+ * snapshot_bytes of a context yet. Nothing is listed, *snapp is NULL, if
+ * the directory is gone or unreadable.
+ *
+ * return:
+ * 	- int: 0 when successful, ENOMEM otherwise
+ */
+static int
+fluffy_snap_list(const char *dirpath, struct fluffy_dir_snap **snapp)
+{
+	*snapp = NULL;
+	DIR *dirstreamp = opendir(dirpath);
+	if (dirstreamp == NULL) {
+		/* Gone or unreadable; either way it's not to be listed */
+		return 0;
+	}
+
+	struct fluffy_dir_snap *newsnap = fluffy_snap_new(NULL, 0);
+	if (newsnap == NULL) {
+		closedir(dirstreamp);
+		return ENOMEM;
+	}
+
+	int reterr = 0;
+	struct dirent *dentp;
+	while ((dentp = readdir(dirstreamp)) != NULL) {
+		if (strcmp(dentp->d_name, ".") == 0 ||
+		    strcmp(dentp->d_name, "..") == 0) {
+			continue;
+		}
+
+		struct stat sbuf;
+		if (fstatat(dirfd(dirstreamp), dentp->d_name, &sbuf,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			/* Gone already */
+			continue;
+		}
+
+		if (fluffy_snap_set(NULL, &newsnap, dentp->d_name,
+		    S_ISDIR(sbuf.st_mode), sbuf.st_ino,
+		    fluffy_snap_stamp(&sbuf))) {
+			reterr = ENOMEM;
+			break;
+		}
+	}
+	closedir(dirstreamp);
+	if (reterr) {
+		fluffy_snap_free(NULL, newsnap);
+		return reterr;
+	}
+
+	*snapp = newsnap;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_snap_free_all
+ *
+ * Free the snapshots of all the watch records. The context mutex must be
+ * held.
+ */
+static void
+fluffy_snap_free_all(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	unsigned int j, k;
+	for (j = 0; dirp != NULL && j < dirp->npages &&
+	    ctxinfop->snapshot_bytes > 0; j++) {
+		struct fluffy_wd_page *pagep = dirp->pages[j];
+		if (pagep == NULL) {
+			continue;
+		}
+
+		for (k = 0; k < WD_PAGE_SLOTS; k++) {
+			struct fluffy_wd_info *wdinfop;
+			wdinfop = pagep->slots[k].wdinfop;
+			if (wdinfop != NULL && wdinfop->snap != NULL) {
+				fluffy_snap_free(ctxinfop, wdinfop->snap);
+				wdinfop->snap = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Function:	fluffy_snap_find
+ *
+ * Find the slot of an entry. An empty slot is always left, the probe ends.
+ *
+ * return:
+ * 	- A pointer to the slot holding the name, NULL when there's none
+ */
+static struct fluffy_snap_slot *
+fluffy_snap_find(struct fluffy_dir_snap *snap, const char *name,
+    uint32_t hash)
+{
+	unsigned int mask = snap->size - 1;
+	unsigned int j;
+
+	for (j = hash & mask; snap->slots[j].name != SNAP_EMPTY;
+	    j = (j + 1) & mask) {
+		struct fluffy_snap_slot *slotp = &snap->slots[j];
+		if (slotp->name != SNAP_TOMB				&&
+		    slotp->hash == hash					&&
+		    strcmp(snap->names + slotp->name + 1, name) == 0) {
+			return slotp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_snap_place
+ *
+ * Put a new entry in a free slot, its name is copied in. The caller makes
+ * sure there's room in the slots.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: counts the bytes, may be NULL
+ * 	- struct fluffy_dir_snap *: snapshot to add to
+ * 	- const char *: name of the entry
+ * 	- uint32_t: fluffy_path_hash() of the name
+ * 	- char: type byte of the entry, 'd' or 'f'
+ * 	- uint64_t: inode of the entry, 0 when not known
+ * 	- uint64_t: fluffy_snap_stamp() of the entry, 0 when not known
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_snap_place(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap *snap, const char *name, uint32_t hash,
+    char type, uint64_t ino, uint64_t stamp)
+{
+	size_t len = strlen(name) + 2;
+	if (len > UINT32_MAX - snap->names_len) {
+		return -1;
+	}
+
+	if (snap->names_len + len > snap->names_size) {
+		size_t size = (snap->names_size > 0) ? snap->names_size :
+		    SNAP_NAMES_MIN;
+		while (size < snap->names_len + len) {
+			size *= 2;
+		}
+		if (size > UINT32_MAX) {
+			size = UINT32_MAX;
+		}
+
+		char *names = fluffy_realloc(snap->names, size);
+		if (names == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		if (ctxinfop != NULL) {
+			ctxinfop->snapshot_bytes += size - snap->names_size;
+		}
+		snap->names = names;
+		snap->names_size = size;
+	}
+
+	uint32_t offset = snap->names_len;
+	snap->names[offset] = type;
+	memcpy(snap->names + offset + 1, name, len - 1);
+	snap->names_len += len;
+
+	unsigned int mask = snap->size - 1;
+	unsigned int j;
+	for (j = hash & mask; snap->slots[j].name != SNAP_EMPTY &&
+	    snap->slots[j].name != SNAP_TOMB; j = (j + 1) & mask) {
+		/* Probe on */
+	}
+
+	struct fluffy_snap_slot *slotp = &snap->slots[j];
+	if (slotp->name == SNAP_TOMB) {
+		(snap->ntomb)--;
+	}
+	slotp->ino = ino;
+	slotp->stamp = stamp;
+	slotp->hash = hash;
+	slotp->name = offset;
+	(snap->nused)++;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_snap_rebuild
+ *
+ * Move the entries to a new snapshot sized for nentries, at most half full.
+ * The deleted slots and removed names are dropped on the way.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: counts the bytes, may be NULL
+ * 	- struct fluffy_dir_snap **: the snapshot, replaced on success
+ * 	- unsigned int: entries to make room for
+ * return:
+ * 	- int: 0 when successful, -1 otherwise; the snapshot is left as it is
+ */
+static int
+fluffy_snap_rebuild(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, unsigned int nentries)
+{
+	struct fluffy_dir_snap *snap = *snapp;
+	struct fluffy_dir_snap *newsnap = fluffy_snap_new(ctxinfop, nentries);
+	if (newsnap == NULL) {
+		return -1;
+	}
+
+	unsigned int j;
+	for (j = 0; j < snap->size; j++) {
+		struct fluffy_snap_slot *slotp = &snap->slots[j];
+		if (slotp->name == SNAP_EMPTY || slotp->name == SNAP_TOMB) {
+			continue;
+		}
+		if (fluffy_snap_place(ctxinfop, newsnap,
+		    snap->names + slotp->name + 1, slotp->hash,
+		    snap->names[slotp->name], slotp->ino, slotp->stamp)) {
+			fluffy_snap_free(ctxinfop, newsnap);
+			return -1;
+		}
+	}
+
+	newsnap->activity = snap->activity;
+	fluffy_snap_free(ctxinfop, snap);
+	*snapp = newsnap;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_snap_set
+ *
+ * Set an entry of a snapshot, adding it if it's new.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: counts the bytes, may be NULL
+ * 	- struct fluffy_dir_snap **: the snapshot, replaced if it grows
+ * 	- const char *: name of the entry
+ * 	- int: non zero if the entry is a directory
+ * 	- uint64_t: inode of the entry, 0 when not known
+ * 	- uint64_t: fluffy_snap_stamp() of the entry, 0 when not known
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_snap_set(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, const char *name, int is_dir,
+    uint64_t ino, uint64_t stamp)
+{
+	struct fluffy_dir_snap *snap = *snapp;
+	uint32_t hash = fluffy_path_hash(name);
+	char type = is_dir ? 'd' : 'f';
+
+	struct fluffy_snap_slot *slotp = fluffy_snap_find(snap, name, hash);
+	if (slotp != NULL) {
+		snap->names[slotp->name] = type;
+		slotp->ino = ino;
+		slotp->stamp = stamp;
+		return 0;
+	}
+
+	/* Deleted slots count, they lengthen the probes all the same */
+	if ((snap->nused + snap->ntomb + 1) * 4 > snap->size * 3) {
+		if (fluffy_snap_rebuild(ctxinfop, snapp, snap->nused + 1)) {
+			return -1;
+		}
+		snap = *snapp;
+	}
+
+	return fluffy_snap_place(ctxinfop, snap, name, hash, type, ino, stamp);
+}
+
+/*
+ * Function:	fluffy_snap_remove
+ *
+ * Remove an entry of a snapshot, if it's there. The snapshot is rebuilt
+ * once it's mostly empty or its names mostly removed.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: counts the bytes, may be NULL
+ * 	- struct fluffy_dir_snap **: the snapshot, replaced if it's rebuilt
+ * 	- const char *: name of the entry
+ */
+static void
+fluffy_snap_remove(struct fluffy_context_info *ctxinfop,
+    struct fluffy_dir_snap **snapp, const char *name)
+{
+	struct fluffy_dir_snap *snap = *snapp;
+	struct fluffy_snap_slot *slotp;
+	slotp = fluffy_snap_find(snap, name, fluffy_path_hash(name));
+	if (slotp == NULL) {
+		return;
+	}
+
+	snap->names_dead += strlen(name) + 2;
+	slotp->name = SNAP_TOMB;
+	(snap->nused)--;
+	(snap->ntomb)++;
+
+	/* A failed rebuild is harmless, it's tried again on the next one */
+	if ((snap->size > SNAP_MIN_SLOTS && snap->nused * 8 < snap->size) ||
+	    (snap->names_dead > SNAP_NAMES_MIN &&
+	    snap->names_dead * 2 > snap->names_len)) {
+		fluffy_snap_rebuild(ctxinfop, snapp, snap->nused);
+	}
+}
+
+/*
+ * Function:	fluffy_snap_walk_entry
+ *
+ * Record an entry met by a walk in the snapshot of its directory, if the
+ * directory has one. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context walked for
+ * 	- const char *: path of the entry, as nftw() hands it
+ * 	- int: offset of the entry name in the path, FTW.base
+ * 	- const struct stat *: stat of the entry
+ */
+static void
+fluffy_snap_walk_entry(struct fluffy_context_info *ctxinfop,
+    const char *pathname, int base, const struct stat *sbuf)
+{
+	char dirpath[PATH_MAX];
+	size_t len = (base > 1) ? (size_t)base - 1 : 1;
+	if (base <= 0 || len >= sizeof(dirpath) || pathname[base] == '\0') {
+		return;
+	}
+	memcpy(dirpath, pathname, len);
+	dirpath[len] = '\0';
+
+	struct fluffy_wd_info *wdinfop = fluffy_path_lookup(ctxinfop, dirpath);
+	if (wdinfop == NULL || wdinfop->snap == NULL) {
+		return;
+	}
+
+	if (fluffy_snap_set(ctxinfop, &wdinfop->snap, pathname + base,
+	    S_ISDIR(sbuf->st_mode), sbuf->st_ino, fluffy_snap_stamp(sbuf))) {
+		/* Forget the lot, the next rescan takes a baseline */
+		fluffy_snap_free(ctxinfop, wdinfop->snap);
+		wdinfop->snap = NULL;
+	}
+}
+
+/*
+ * Function:	fluffy_snap_event
+ *
+ * Bring the snapshot of a watched directory up to date with an event read
+ * against one of its entries. Created and written entries are stat'ed, a
+ * modified one is marked unknown until then; the next rescan compares it
+ * as changed. Called by the context thread, which takes the mutex.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the event
+ * 	- struct inotify_event *: event read, with a name
+ * 	- struct fluffy_wd_info *: record of the watched directory
+ */
+static void
+fluffy_snap_event(struct fluffy_context_info *ctxinfop,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop)
+{
+	uint32_t mask = ievent->mask;
+	struct stat sbuf;
+	int is_stat = 0;
+
+	/* The stat goes without the mutex; the path is as read, unlocked */
+	if (mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)) {
+		char path[PATH_MAX];
+		int len = snprintf(path, sizeof(path), "%s/%s",
+			    __atomic_load_n(&wdinfop->path, __ATOMIC_ACQUIRE),
+			    ievent->name);
+		if (len > 0 && (size_t)len < sizeof(path) &&
+		    fstatat(AT_FDCWD, path, &sbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+			is_stat = 1;
+		}
+	}
+
+	if (pthread_mutex_lock(&ctxinfop->mutex) != 0) {
+		return;
+	}
+
+	do {
+		if (wdinfop->snap == NULL) {
+			break;
+		}
+
+		int is_failed = 0;
+		if (is_stat) {
+			is_failed = fluffy_snap_set(ctxinfop, &wdinfop->snap,
+			    ievent->name, S_ISDIR(sbuf.st_mode), sbuf.st_ino,
+			    fluffy_snap_stamp(&sbuf));
+		} else if (mask & (IN_MODIFY | IN_ATTRIB)) {
+			struct fluffy_snap_slot *slotp;
+			slotp = fluffy_snap_find(wdinfop->snap, ievent->name,
+			    fluffy_path_hash(ievent->name));
+			if (slotp != NULL) {
+				slotp->stamp = 0;
+			} else {
+				is_failed = fluffy_snap_set(ctxinfop,
+				    &wdinfop->snap, ievent->name,
+				    (mask & IN_ISDIR) != 0, 0, 0);
+			}
+		} else {
+			/* Deleted, moved away, or gone before the stat */
+			fluffy_snap_remove(ctxinfop, &wdinfop->snap,
+			    ievent->name);
+		}
+
+		if (is_failed) {
+			fluffy_snap_free(ctxinfop, wdinfop->snap);
+			wdinfop->snap = NULL;
+			break;
+		}
+		wdinfop->snap->activity = ++(ctxinfop->snap_clock);
+	} while (0);
+
+	pthread_mutex_unlock(&ctxinfop->mutex);
+}
+
+/*
+ * Function:	fluffy_exclude_info_new
+ *
+ * Compile an exclude pattern. A glob that holds a '/' is matched with the
+ * full path, otherwise with the entry name alone.
+ *
+ * args:
+ * 	- int: FLUFFY_EXCLUDE_* type of the pattern
+ * 	- const char *: the pattern
+ * return:
+ * 	- A pointer to fluffy_exclude_info when successful, NULL otherwise
+ */
+static struct fluffy_exclude_info *
+fluffy_exclude_info_new(int type, const char *pattern)
+{
+	if (pattern == NULL || *pattern == '\0') {
+		return NULL;
+	}
+
+	if (type != FLUFFY_EXCLUDE_BASENAME	&&
+	    type != FLUFFY_EXCLUDE_GLOB		&&
+	    type != FLUFFY_EXCLUDE_REGEX) {
+		return NULL;
+	}
+
+	struct fluffy_exclude_info *exclinfop;
+	exclinfop = fluffy_calloc(1, sizeof(struct fluffy_exclude_info));
+	if (exclinfop == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	exclinfop->type = type;
+	exclinfop->pattern = fluffy_strdup(pattern);
+	if (exclinfop->pattern == NULL) {
+		perror("strdup");
+		fluffy_free(exclinfop);
+		return NULL;
+	}
+
+	if (type == FLUFFY_EXCLUDE_GLOB && strchr(pattern, '/') != NULL) {
+		exclinfop->is_path_glob = 1;
+	}
+
+	if (type == FLUFFY_EXCLUDE_REGEX) {
+		int rc = 0;
+		rc = regcomp(&exclinfop->regex, pattern,
+				REG_EXTENDED | REG_NOSUB);
+		if (rc != 0) {
+			char errbuf[128];
+			regerror(rc, &exclinfop->regex, errbuf, sizeof(errbuf));
+			PRINT_STDERR("Bad exclude pattern %s: %s\n", pattern,
+			    errbuf);
+			fluffy_free(exclinfop->pattern);
+			fluffy_free(exclinfop);
+			return NULL;
+		}
+	}
+
+	return exclinfop;
+}
+
+static void
+fluffy_exclude_info_free(struct fluffy_exclude_info *exclinfop)
+{
+	if (exclinfop->type == FLUFFY_EXCLUDE_REGEX) {
+		regfree(&exclinfop->regex);
+	}
+	fluffy_free(exclinfop->pattern);
+	fluffy_free(exclinfop);
+}
+
+/*
+ * Function:	fluffy_exclude_list_add
+ *
+ * Append a compiled pattern to the list, which then owns it.
+ *
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_exclude_list_add(struct fluffy_exclude_list *listp,
+    struct fluffy_exclude_info *exclinfop)
+{
+	if (listp->len == listp->size) {
+		unsigned int size = (listp->size > 0) ? listp->size * 2 :
+					EXCLUDE_LIST_MIN;
+		struct fluffy_exclude_info **excls;
+		excls = fluffy_realloc(listp->excls,
+			    size * sizeof(struct fluffy_exclude_info *));
+		if (excls == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		listp->excls = excls;
+		listp->size = size;
+	}
+
+	listp->excls[(listp->len)++] = exclinfop;
+	return 0;
+}
+
+/*
+ * Function:	fluffy_exclude_list_clear
+ *
+ * Free every pattern of the list, and the list.
+ */
+static void
+fluffy_exclude_list_clear(struct fluffy_exclude_list *listp)
+{
+	unsigned int j;
+	for (j = 0; j < listp->len; j++) {
+		fluffy_exclude_info_free(listp->excls[j]);
+	}
+	fluffy_free(listp->excls);
+	listp->excls = NULL;
+	listp->len = 0;
+	listp->size = 0;
+}
+
+/*
+ * Function:	fluffy_root_info_new
+ *
+ * Allocate a fluffy_root_info off the options received from the client. One
+ * reference is held on return.
+ *
+ * args:
+ * 	- const struct fluffy_root_options *: root options, may be NULL
+ * return:
+ * 	- A pointer to fluffy_root_info when successful, NULL otherwise
+ */
+static struct fluffy_root_info *
+fluffy_root_info_new(const struct fluffy_root_options *rootopts)
+{
+	struct fluffy_root_info *rootinfop;
+	rootinfop = fluffy_calloc(1, sizeof(struct fluffy_root_info));
+	if (rootinfop == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	rootinfop->nref = 1;
+	rootinfop->fan_fd = -1;
+
+	if (rootopts == NULL) {
+		return rootinfop;
+	}
+
+	rootinfop->flags = rootopts->flags;
+	rootinfop->max_depth = rootopts->max_depth;
+	if (rootopts->flags & FLUFFY_ROOT_LAZY) {
+		rootinfop->lazy_depth = rootopts->lazy_depth;
+		rootinfop->lazy_max_watches = rootopts->lazy_max_watches;
+	}
+	if (rootopts->flags & FLUFFY_ROOT_POLL) {
+		rootinfop->poll_min_ms = (rootopts->poll_min_ms != 0) ?
+		    rootopts->poll_min_ms : BUDGET_POLL_MIN_MS;
+		rootinfop->poll_max_ms = rootopts->poll_max_ms;
+		if (rootinfop->poll_max_ms == 0) {
+			rootinfop->poll_max_ms =
+			    (rootinfop->poll_min_ms > BUDGET_POLL_MAX_MS) ?
+			    rootinfop->poll_min_ms : BUDGET_POLL_MAX_MS;
+		}
+		if (rootinfop->poll_min_ms > rootinfop->poll_max_ms) {
+			fluffy_root_info_unref(rootinfop);
+			return NULL;
+		}
+	}
+
+	unsigned int j;
+	for (j = 0; j < rootopts->nexcludes; j++) {
+		struct fluffy_exclude_info *exclinfop;
+		exclinfop = fluffy_exclude_info_new(rootopts->excludes[j].type,
+				rootopts->excludes[j].pattern);
+		if (exclinfop == NULL) {
+			fluffy_root_info_unref(rootinfop);
+			return NULL;
+		}
+		if (fluffy_exclude_list_add(&rootinfop->exclude_list,
+		    exclinfop)) {
+			fluffy_exclude_info_free(exclinfop);
+			fluffy_root_info_unref(rootinfop);
+			return NULL;
+		}
+	}
+
+	return rootinfop;
+}
+
+/*
+ * Function:	fluffy_root_info_unref
+ *
+ * Drop a reference of the root record, freed when none is left. Called by
+ * fluffy_context_info.root_path_table as well when an entry is removed.
+ * The context mutex must be held.
+ */
+static void
+fluffy_root_info_unref(void *rootinfo)
+{
+	struct fluffy_root_info *rootinfop = rootinfo;
+	if (rootinfop == NULL) {
+		return;
+	}
+
+	if (--(rootinfop->nref) > 0) {
+		return;
+	}
+
+	if (rootinfop->fan_fd != -1 && close(rootinfop->fan_fd) == -1) {
+		perror("close");
+	}
+	fluffy_free(rootinfop->fan_key);
+	fluffy_exclude_list_clear(&rootinfop->exclude_list);
+	fluffy_free(rootinfop);
+}
+
+/*
+ * Function:	fluffy_get_root_info
+ *
+ * Find the root path record that the path falls under; the path itself or
+ * the nearest ancestor that is a root path. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context to look up
+ * 	- const char *: a real path
+ * return:
+ * 	- A pointer to fluffy_root_info when found, NULL otherwise
+ */
+static struct fluffy_root_info *
+fluffy_get_root_info(struct fluffy_context_info *ctxinfop, const char *path)
+{
+	char tp[PATH_MAX];
+	struct fluffy_root_info *rootinfop = NULL;
+
+	if (strlen(path) >= sizeof(tp)) {
+		return NULL;
+	}
+	strcpy(tp, path);
+
+	while (1) {
+		if (fluffy_str_table_lookup(ctxinfop->root_path_table, tp,
+		    (void **)&rootinfop)) {
+			return rootinfop;
+		}
+
+		/* Move on to the parent directory */
+		char *slash = strrchr(tp, '/');
+		if (slash == NULL || slash == tp) {
+			break;
+		}
+		*slash = '\0';
+	}
+
+	/* '/' itself */
+	if (fluffy_str_table_lookup(ctxinfop->root_path_table, "/",
+	    (void **)&rootinfop)) {
+		return rootinfop;
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_path_depth
+ *
+ * Count the components of a real path, 0 for "/".
+ */
+static unsigned int
+fluffy_path_depth(const char *path)
+{
+	unsigned int depth = 0;
+	const char *p;
+
+	for (p = path; *p != '\0'; p++) {
+		if (*p == '/' && *(p + 1) != '\0' && *(p + 1) != '/') {
+			depth++;
+		}
+	}
+	return depth;
+}
+
+/*
+ * Function:	reset_each_root_info
+ *
+ * Called on every entry of fluffy_context_info.root_path_table when the
+ * watches are all gone, forget the watches counted.
+ */
+static void
+reset_each_root_info(const char *root_path, void *rootinfo, void *user_data)
+{
+	struct fluffy_root_info *rootinfop = rootinfo;
+	rootinfop->nlazy_watches = 0;
+}
+
+/*
+ * Function:	fluffy_is_excluded
+ *
+ * Match the path with the exclude patterns of the context and those of the
+ * root path it falls under. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the path
+ * 	- struct fluffy_root_info *: root path record, may be NULL
+ * 	- const char *: path to match
+ * return:
+ * 	- int: 1 when the path is excluded, 0 otherwise
+ */
+static int
+fluffy_is_excluded(struct fluffy_context_info *ctxinfop,
+    struct fluffy_root_info *rootinfop, const char *path)
+{
+	struct fluffy_exclude_list *lists[2] = { &ctxinfop->exclude_list,
+						NULL };
+	if (rootinfop != NULL) {
+		lists[1] = &rootinfop->exclude_list;
+	}
+
+	const char *name = strrchr(path, '/');
+	name = (name == NULL) ? path : name + 1;
+
+	unsigned int k, j;
+	for (k = 0; k < 2; k++) {
+		if (lists[k] == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < lists[k]->len; j++) {
+			struct fluffy_exclude_info *exclinfop;
+			exclinfop = lists[k]->excls[j];
+
+			switch (exclinfop->type) {
+			case FLUFFY_EXCLUDE_BASENAME:
+				if (strcmp(exclinfop->pattern, name) == 0) {
+					return 1;
+				}
+				break;
+			case FLUFFY_EXCLUDE_GLOB:
+				if (fnmatch(exclinfop->pattern,
+				    exclinfop->is_path_glob ? path : name,
+				    0) == 0) {
+					return 1;
+				}
+				break;
+			case FLUFFY_EXCLUDE_REGEX:
+				if (regexec(&exclinfop->regex, path, 0, NULL,
+				    0) == 0) {
+					return 1;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function:	fluffy_queue_pending_event
+ *
+ * Queue an event synthesized by fluffy. The caller must hold the context
+ * mutex. The queued events are handed off by fluffy_flush_pending_events().
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context to queue the event on
+ * 	- uint32_t: event mask to hand off
+ * 	- const char *: event path, copied
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_queue_pending_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath)
+{
+	struct fluffy_pending_queue *queuep = &ctxinfop->pending_queue;
+	struct fluffy_pending_event *pendp;
+	size_t len = strlen(eventpath) + 1;
+	pendp = fluffy_malloc(sizeof(struct fluffy_pending_event) + len);
+	if (pendp == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	pendp->next = NULL;
+	pendp->mask = event_mask;
+	pendp->shard = 0;
+	pendp->seq = 0;
+	memcpy(pendp->path, eventpath, len);
+
+	if (queuep->tail != NULL) {
+		queuep->tail->next = pendp;
+	} else {
+		queuep->head = pendp;
+	}
+	queuep->tail = pendp;
+	(queuep->length)++;
+
+	/* The context thread has to know there's something to hand off */
+	if (queuep->length == 1) {
+		if (fluffy_wake_context(ctxinfop)) {
+			/* It will be picked up on the next wake up anyway */
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_wake_context
+ *
+ * Wake the context thread up from epoll_wait() so that it looks at the
+ * pending event queue.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context to wake
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_wake_context(struct fluffy_context_info *ctxinfop)
+{
+	uint64_t one = 1;
+	if (ctxinfop->wake_fd == -1) {
+		return -1;
+	}
+
+	if (write(ctxinfop->wake_fd, &one, sizeof(one)) == -1 &&
+	    errno != EAGAIN) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_flush_pending_events
+ *
+ * Hand off every queued synthesized event to the client, in the order they
+ * were queued. Must be called only from the context thread so that the
+ * client callback is never run concurrently.
+ *
+ * When is_wait is non zero, also wait for the walks that are still queueing
+ * events, on any thread, to finish and hand those off too. Events read from
+ * inotify afterwards are then strictly ordered after them.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- int: non zero to wait for walks in progress
+ * return:
+ * 	- int: 0 when successful, error value otherwise to terminate context
+ */
+static int
+fluffy_flush_pending_events(int fluffy_handle, int is_wait)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int reterr = 0;
+	while (reterr == 0) {
+		struct fluffy_pending_queue pending = { NULL, NULL, 0 };
+		int is_walking = 0;
+
+		int m = -1;
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m != 0) {
+			return -1;
+		}
+
+		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+		    &ctxinfop->mutex);
+
+		while (is_wait					&&
+		    ctxinfop->nreport_walks > 0			&&
+		    ctxinfop->pending_queue.head == NULL) {
+			/* A cancellation point, the mutex is held again */
+			if (pthread_cond_wait(&ctxinfop->walk_cond,
+			    &ctxinfop->mutex)) {
+				break;
+			}
+		}
+		is_walking = (ctxinfop->nreport_walks > 0);
+
+		/* Take over everything queued so far in one go */
+		pending = ctxinfop->pending_queue;
+		memset(&ctxinfop->pending_queue, 0,
+		    sizeof(struct fluffy_pending_queue));
+
+		/* Shards waiting for room can go on */
+		if (ctxinfop->nshards > 0 &&
+		    pthread_cond_broadcast(&ctxinfop->shard_cond)) {
+			/* They go on after a while anyway */
+		}
+
+		pthread_cleanup_pop(1);		/* Unlock mutex */
+
+		if (pending.head == NULL) {
+			if (is_wait && is_walking) {
+				continue;
+			}
+			break;
+		}
+
+		/* The lock isn't held, the client may take its time */
+		struct fluffy_pending_event *pendp = NULL;
+		while ((pendp = pending.head) != NULL) {
+			pending.head = pendp->next;
+			if (reterr == 0) {
+				/* Only overflows of a shard have no path */
+				reterr = fluffy_dispatch_seq_event(
+						fluffy_handle, pendp->mask,
+						(pendp->path[0] != '\0') ?
+						pendp->path : NULL,
+						pendp->shard, pendp->seq);
+			}
+			fluffy_free(pendp);
+		}
+
+		if (!is_wait) {
+			break;
+		}
+	}
+
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_dispatch_event
+ *
+ * Pass on the event info to the client's callback function. Every event
+ * reported by fluffy, read from inotify or synthesized, goes through here.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- uint32_t: event mask to hand off
+ * 	- char *: event path, NULL when there's none
+ * return:
+ * 	- int: whatever the client callback returned
+ */
+static int
+fluffy_dispatch_event(int fluffy_handle, uint32_t event_mask,
+    char *eventpath)
+{
+	return fluffy_dispatch_seq_event(fluffy_handle, event_mask, eventpath,
+		   0, 0);
+}
+
+/*
+ * Function:	fluffy_dispatch_seq_event
+ *
+ * fluffy_dispatch_event() of an event read on a shard
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- uint32_t: event mask to hand off
+ * 	- char *: event path, NULL when there's none
+ * 	- unsigned int: shard it was read on, from 1; 0 if none
+ * 	- unsigned long long: its sequence on the shard, 0 if none
+ * return:
+ * 	- int: whatever the client callback returned
+ */
+static int
+fluffy_dispatch_seq_event(int fluffy_handle, uint32_t event_mask,
+    char *eventpath, unsigned int shard, unsigned long long seq)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+	if (ctxinfop->user_event_fn == NULL) {
+		return 0;
+	}
+
+	/* Its thread calls the client, see fluffy_set_backlog() */
+	if (__atomic_load_n(&ctxinfop->is_backlog, __ATOMIC_ACQUIRE)) {
+		return fluffy_backlog_event(ctxinfop, event_mask, eventpath,
+			   shard, seq);
+	}
+
+	return fluffy_deliver_event(ctxinfop, event_mask, eventpath, shard,
+		   seq);
+}
+
+/*
+ * Function:	fluffy_deliver_event
+ *
+ * Call the client callback with an event
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- uint32_t: event mask to hand off
+ * 	- char *: event path, NULL when there's none
+ * 	- unsigned int: shard it was read on, from 1; 0 if none
+ * 	- unsigned long long: its sequence on the shard, 0 if none
+ * return:
+ * 	- int: whatever the client callback returned
+ */
+static int
+fluffy_deliver_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, char *eventpath, unsigned int shard,
+    unsigned long long seq)
+{
+	/* Nothing for the allocator to do per event */
+	struct fluffy_event_info evtinfo;
+	memset(&evtinfo, 0, sizeof(struct fluffy_event_info));
+	evtinfo.event_mask = event_mask;
+	evtinfo.path = eventpath;
+	evtinfo.shard = shard;
+	evtinfo.seq = seq;
+
+	int ret = 0;
+	long long from_us = fluffy_now_us();
+	__atomic_store_n(&ctxinfop->call_from_us, from_us, __ATOMIC_RELEASE);
+	ret = (ctxinfop->user_event_fn)(&evtinfo, (void *)ctxinfop->user_data);
+	__atomic_store_n(&ctxinfop->call_from_us, 0, __ATOMIC_RELEASE);
+
+	/* Once the slow call is over, and not timed itself */
+	if (fluffy_time_callback(ctxinfop, fluffy_now_us() - from_us) &&
+	    ret == 0) {
+		memset(&evtinfo, 0, sizeof(struct fluffy_event_info));
+		evtinfo.event_mask = FLUFFY_SLOW_CONSUMER;
+		ret = (ctxinfop->user_event_fn)(&evtinfo,
+			  (void *)ctxinfop->user_data);
+	}
+
+	return ret;	/* return whatever the client returned */
+}
+
+/*
+ * Function:	fluffy_time_callback
+ *
+ * Count a call of the client callback in the latency histogram, and check
+ * it against the deadline. Called by the thread that made the call.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- long long: microseconds the call took
+ * return:
+ * 	- int: 1 if FLUFFY_SLOW_CONSUMER is to be reported, 0 otherwise
+ */
+static int
+fluffy_time_callback(struct fluffy_context_info *ctxinfop, long long took_us)
+{
+	struct fluffy_latency *latp = &ctxinfop->latency;
+	unsigned long long us = (took_us > 0) ? took_us : 0;
+	unsigned long long maxus = 0;
+
+	__atomic_fetch_add(&latp->ncalls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&latp->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&latp->buckets[fluffy_latency_bucket(us)], 1,
+	    __ATOMIC_RELAXED);
+	maxus = __atomic_load_n(&latp->max_us, __ATOMIC_RELAXED);
+	while (us > maxus && !__atomic_compare_exchange_n(&latp->max_us,
+	    &maxus, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* Another thread's call was longer still, or not */
+	}
+
+	unsigned int deadline_ms = __atomic_load_n(
+				       &ctxinfop->deadline.deadline_ms,
+				       __ATOMIC_RELAXED);
+	if (deadline_ms == 0 || us < (unsigned long long)deadline_ms * 1000) {
+		if (__atomic_load_n(&ctxinfop->slow_state,
+		    __ATOMIC_RELAXED) != SLOW_NONE) {
+			__atomic_store_n(&ctxinfop->slow_state, SLOW_NONE,
+			    __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+	__atomic_fetch_add(&latp->nslow, 1, __ATOMIC_RELAXED);
+
+	/* The watchdog may have caught it running, and acted on it */
+	int state = SLOW_NONE;
+	state = __atomic_exchange_n(&ctxinfop->slow_state, SLOW_REPORTED,
+		    __ATOMIC_ACQ_REL);
+	if (state == SLOW_REPORTED) {
+		return 0;
+	}
+	if (state == SLOW_NONE) {
+		fluffy_catch_slow_callback(ctxinfop, us, 0);
+	}
+
+	return (__atomic_load_n(&ctxinfop->deadline.actions,
+		    __ATOMIC_RELAXED) & FLUFFY_SLOW_REPORT) != 0;
+}
+
+/*
+ * Function:	fluffy_latency_bucket
+ *
+ * Bucket of the latency histogram a call of us microseconds is counted
+ * in; four a power of two, see FLUFFY_LATENCY_FLOOR_US()
+ *
+ * args:
+ * 	- unsigned long long: microseconds the call took
+ * return:
+ * 	- unsigned int: index of the bucket
+ */
+static unsigned int
+fluffy_latency_bucket(unsigned long long us)
+{
+	if (us < 4) {
+		return (unsigned int)us;
+	}
+
+	unsigned int log2 = 63 - __builtin_clzll(us);
+	unsigned int b = (log2 - 1) * 4 + ((us >> (log2 - 2)) & 3);
+	return (b < FLUFFY_LATENCY_BUCKETS) ? b : FLUFFY_LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Function:	fluffy_catch_slow_callback
+ *
+ * Note the events queued as a call of the client callback is caught past
+ * the deadline, and print the diagnostic of FLUFFY_SLOW_LOG
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- unsigned long long: microseconds the call took, or has run for
+ * 	- int: 1 if it's still running, 0 if it returned
+ * return:
+ * 	- void
+ */
+static void
+fluffy_catch_slow_callback(struct fluffy_context_info *ctxinfop,
+    unsigned long long took_us, int is_running)
+{
+	unsigned long long nqueued = fluffy_queued_events(ctxinfop);
+	__atomic_store_n(&ctxinfop->latency.slow_queued, nqueued,
+	    __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&ctxinfop->deadline.actions, __ATOMIC_RELAXED) &
+	    FLUFFY_SLOW_LOG) {
+		PRINT_STDERR("fluffy: callback %s %llu ms, past its deadline "
+		    "of %u ms, %llu events queued\n",
+		    is_running ? "running for" : "took", took_us / 1000,
+		    __atomic_load_n(&ctxinfop->deadline.deadline_ms,
+		    __ATOMIC_RELAXED), nqueued);
+	}
+}
+
+/*
+ * Function:	fluffy_queued_events
+ *
+ * Events queued in the inotify instance of the context and those of its
+ * shards, going by the running average size of an event
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	- unsigned long long: events queued, 0 if none or unknown
+ */
+static unsigned long long
+fluffy_queued_events(struct fluffy_context_info *ctxinfop)
+{
+	unsigned long long nqueued = 0;
+	unsigned int j = 0;
+	unsigned int nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+
+	/* The context first, then its shards */
+	struct fluffy_context_info *cip = ctxinfop;
+	while (cip != NULL) {
+		if (pthread_mutex_lock(&cip->mutex) == 0) {
+			int nbytes = 0;
+			if (cip->inotify_fd != -1 && cip->event_bytes != 0 &&
+			    cip->backend->nread_fn(cip->inotify_fd,
+			    &nbytes) == 0) {
+				nqueued += (unsigned int)nbytes /
+				    cip->event_bytes;
+			}
+			pthread_mutex_unlock(&cip->mutex);
+		}
+
+		cip = NULL;
+		while (cip == NULL && j < nshards) {
+			cip = fluffy_get_context_info(
+				  ctxinfop->shards[j].handle);
+			j++;
+		}
+	}
+
+	return nqueued;
+}
+
+/*
+ * Function:	fluffy_start_watchdog_thread
+ *
+ * Sample the call of the client callback in progress, if any, every half
+ * the deadline, and catch one that's past it. It's done from here for a
+ * call that never returns to be caught too.
+ *
+ * args:
+ * 	- void *: pointer of fluffy_context_info
+ * return:
+ * 	- void
+ */
+static void *
+fluffy_start_watchdog_thread(void *ctx)
+{
+	struct fluffy_context_info *ctxinfop = ctx;
+
+	while (1) {
+		unsigned int deadline_ms = __atomic_load_n(
+					       &ctxinfop->deadline.deadline_ms,
+					       __ATOMIC_RELAXED);
+		long long from_us = __atomic_load_n(&ctxinfop->call_from_us,
+				    __ATOMIC_ACQUIRE);
+		long long ran_us = fluffy_now_us() - from_us;
+
+		int state = SLOW_NONE;
+		if (deadline_ms != 0 && from_us != 0 &&
+		    ran_us >= (long long)deadline_ms * 1000 &&
+		    __atomic_compare_exchange_n(&ctxinfop->slow_state,
+		    &state, SLOW_CAUGHT, 0, __ATOMIC_ACQ_REL,
+		    __ATOMIC_RELAXED)) {
+			fluffy_catch_slow_callback(ctxinfop, ran_us, 1);
+		}
+
+		long long wait_ms = WATCHDOG_IDLE_MS;
+		if (deadline_ms != 0) {
+			wait_ms = (deadline_ms + 1) / 2;
+		}
+		struct timespec ts = {wait_ms / 1000,
+				      (wait_ms % 1000) * 1000000};
+		nanosleep(&ts, NULL);
+	}
+
+	return (void *)0;
+}
+
+/*
+ * Function:	fluffy_watchdog_destroy
+ *
+ * End the watchdog thread of a context. Called by the context thread as it
+ * ends, before its shards are taken down.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	- void
+ */
+static void
+fluffy_watchdog_destroy(struct fluffy_context_info *ctxinfop)
+{
+	if (!__atomic_load_n(&ctxinfop->is_watchdog, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	if (pthread_cancel(ctxinfop->watchdog_tid)) {
+		/* Ended already, it's joined all the same */
+	}
+	if (pthread_join(ctxinfop->watchdog_tid, NULL)) {
+		/* nothing? */
+	}
+	__atomic_store_n(&ctxinfop->is_watchdog, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:	fluffy_backlog_event
+ *
+ * Hold an event on the backlog for its thread to hand off. Once the
+ * backlog is full, events of drop_mask are dropped and events of
+ * coalesce_mask are merged into one held for the same path; the rest wait
+ * for room. Called by the context thread, without the mutex.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- uint32_t: event mask to hand off
+ * 	- const char *: event path, NULL when there's none
+ * 	- unsigned int: shard it was read on, from 1; 0 if none
+ * 	- unsigned long long: its sequence on the shard, 0 if none
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_backlog_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath, unsigned int shard,
+    unsigned long long seq)
+{
+	const char *pathp = (eventpath != NULL) ? eventpath : "";
+
+	int reterr = 0;
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		struct fluffy_pending_queue *queuep = &ctxinfop->backlog_queue;
+		const struct fluffy_backlog *blp = &ctxinfop->backlog;
+		uint32_t bits = event_mask & ~IN_ISDIR;
+		int is_drop = ((bits & ~blp->drop_mask) == 0);
+		int is_coalesce = !is_drop && pathp[0] != '\0' &&
+		    (bits & ~(blp->drop_mask | blp->coalesce_mask)) == 0;
+
+		/* Spilled rather than shed, after what's spilled already */
+		if ((queuep->length >= blp->max_events ||
+		    ctxinfop->nspilled > 0) && ctxinfop->spill_dir != NULL &&
+		    fluffy_spill_event(ctxinfop, event_mask, pathp, shard,
+		    seq) == 0) {
+			pthread_cond_broadcast(&ctxinfop->backlog_cond);
+			break;
+		}
+
+		if (queuep->length >= blp->max_events ||
+		    ctxinfop->nspilled > 0) {
+			struct fluffy_pending_event *heldp = NULL;
+			if (is_drop) {
+				(ctxinfop->ndropped)++;
+				break;
+			}
+			if (is_coalesce &&
+			    fluffy_str_table_lookup(ctxinfop->coalesce_table,
+			    pathp, (void **)&heldp)) {
+				heldp->mask |= event_mask;
+				(ctxinfop->ncoalesced)++;
+				break;
+			}
+		}
+
+		/* What's held from before is not to be moved past this one */
+		if (!is_drop && !is_coalesce) {
+			if (event_mask & IN_ISDIR) {
+				fluffy_str_table_remove_all(
+				    ctxinfop->coalesce_table);
+			} else {
+				fluffy_str_table_remove(
+				    ctxinfop->coalesce_table, pathp);
+			}
+		}
+
+		while (queuep->length >= blp->max_events ||
+		    ctxinfop->nspilled > 0) {
+			pthread_cond_wait(&ctxinfop->backlog_cond,
+			    &ctxinfop->mutex);
+		}
+
+		struct fluffy_pending_event *pendp;
+		size_t len = strlen(pathp) + 1;
+		pendp = fluffy_malloc(sizeof(struct fluffy_pending_event) +
+			    len);
+		if (pendp == NULL) {
+			perror("malloc");
+			reterr = -1;
+			break;
+		}
+
+		pendp->next = NULL;
+		pendp->mask = event_mask;
+		pendp->shard = shard;
+		pendp->seq = seq;
+		memcpy(pendp->path, pathp, len);
+
+		if (queuep->tail != NULL) {
+			queuep->tail->next = pendp;
+		} else {
+			queuep->head = pendp;
+		}
+		queuep->tail = pendp;
+		(queuep->length)++;
+
+		if (is_coalesce) {
+			fluffy_str_table_replace(ctxinfop->coalesce_table,
+			    pathp, pendp);
+		}
+		pthread_cond_broadcast(&ctxinfop->backlog_cond);
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_start_backlog_thread
+ *
+ * Hand off the events held on the backlog, in order. A non-zero return of
+ * the client callback ends the context, as it would on the context thread.
+ *
+ * args:
+ * 	- void *: pointer of fluffy_context_info
+ * return:
+ * 	- void
+ */
+static void *
+fluffy_start_backlog_thread(void *ctx)
+{
+	struct fluffy_context_info *ctxinfop = ctx;
+
+	while (1) {
+		struct fluffy_pending_event *pendp = NULL;
+		int m = -1;
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m != 0) {
+			break;
+		}
+
+		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+		    &ctxinfop->mutex);
+		struct fluffy_pending_queue *queuep = &ctxinfop->backlog_queue;
+		while (queuep->head == NULL && ctxinfop->nspilled == 0) {
+			pthread_cond_wait(&ctxinfop->backlog_cond,
+			    &ctxinfop->mutex);
+		}
+
+		if (queuep->head != NULL) {
+			pendp = queuep->head;
+			queuep->head = pendp->next;
+			if (queuep->head == NULL) {
+				queuep->tail = NULL;
+			}
+			(queuep->length)--;
+
+			struct fluffy_pending_event *heldp = NULL;
+			if (fluffy_str_table_lookup(ctxinfop->coalesce_table,
+			    pendp->path, (void **)&heldp) && heldp == pendp) {
+				fluffy_str_table_remove(
+				    ctxinfop->coalesce_table, pendp->path);
+			}
+		} else {
+			/* What's spilled comes after all that was queued */
+			pendp = fluffy_spill_take(ctxinfop);
+		}
+		pthread_cond_broadcast(&ctxinfop->backlog_cond);
+		pthread_cleanup_pop(1);		/* Unlock mutex */
+
+		if (pendp == NULL) {
+			continue;
+		}
+
+		int ret = 0;
+		pthread_cleanup_push(fluffy_free, pendp);
+		ret = fluffy_deliver_event(ctxinfop, pendp->mask,
+			  (pendp->path[0] != '\0') ? pendp->path : NULL,
+			  pendp->shard, pendp->seq);
+		pthread_cleanup_pop(1);		/* Free the event */
+
+		/* The context thread takes it from here */
+		if (ret != 0) {
+			if (!__atomic_load_n(&ctxinfop->is_ending,
+			    __ATOMIC_ACQUIRE) &&
+			    pthread_cancel(ctxinfop->tid)) {
+				/* It's ending already */
+			}
+			break;
+		}
+	}
+
+	return (void *)0;
+}
+
+/*
+ * Function:	fluffy_backlog_destroy
+ *
+ * End the backlog thread of a context and drop what it held. Called by the
+ * context thread as it ends, without the mutex.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	- void
+ */
+static void
+fluffy_backlog_destroy(struct fluffy_context_info *ctxinfop)
+{
+	if (!__atomic_load_n(&ctxinfop->is_backlog, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	/* It doesn't end the context along, not now */
+	__atomic_store_n(&ctxinfop->is_ending, 1, __ATOMIC_RELEASE);
+	if (pthread_cancel(ctxinfop->backlog_tid)) {
+		/* Ended already, it's joined all the same */
+	}
+	if (pthread_join(ctxinfop->backlog_tid, NULL)) {
+		/* nothing? */
+	}
+
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		__atomic_store_n(&ctxinfop->is_backlog, 0, __ATOMIC_RELEASE);
+		fluffy_pending_queue_clear(&ctxinfop->backlog_queue);
+		fluffy_str_table_free(ctxinfop->coalesce_table);
+		ctxinfop->coalesce_table = NULL;
+		fluffy_spill_clear(ctxinfop);
+		fluffy_free(ctxinfop->spill_dir);
+		ctxinfop->spill_dir = NULL;
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+}
+
+/*
+ * Function:	fluffy_spill_seg_new
+ *
+ * Set up a spill segment, a file in the directory unlinked right away and
+ * mapped whole. Its blocks are allocated up front; a full disk fails here
+ * rather than faulting a write to the mapping.
+ *
+ * args:
+ * 	- const char *: spill directory
+ * return:
+ * 	- A pointer to fluffy_spill_seg when successful, NULL otherwise
+ */
+static struct fluffy_spill_seg *
+fluffy_spill_seg_new(const char *dirpath)
+{
+	int fd = -1;
+	fd = open(dirpath, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		/* Not every filesystem does O_TMPFILE */
+		char tp[PATH_MAX];
+		if ((size_t)snprintf(tp, sizeof(tp), "%s/.fluffy-spill-XXXXXX",
+		    dirpath) < sizeof(tp)) {
+			fd = mkstemp(tp);
+		}
+		if (fd != -1 && unlink(tp) == -1) {
+			perror("unlink");
+		}
+	}
+	if (fd == -1) {
+		perror("open");
+		return NULL;
+	}
+
+	int reterr = 0;
+	reterr = posix_fallocate(fd, 0, SPILL_SEGMENT_SIZE);
+	if (reterr) {
+		errno = reterr;
+		perror("posix_fallocate");
+		close(fd);
+		return NULL;
+	}
+
+	char *base;
+	base = mmap(NULL, SPILL_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return NULL;
+	}
+
+	struct fluffy_spill_seg *segp;
+	segp = fluffy_calloc(1, sizeof(struct fluffy_spill_seg));
+	if (segp == NULL) {
+		perror("calloc");
+		munmap(base, SPILL_SEGMENT_SIZE);
+		close(fd);
+		return NULL;
+	}
+	segp->fd = fd;
+	segp->base = base;
+
+	return segp;
+}
+
+/*
+ * Function:	fluffy_spill_seg_free
+ *
+ * Unmap and close a spill segment; its blocks go along with the file.
+ */
+static void
+fluffy_spill_seg_free(struct fluffy_spill_seg *segp)
+{
+	if (munmap(segp->base, SPILL_SEGMENT_SIZE) == -1) {
+		perror("munmap");
+	}
+	if (close(segp->fd) == -1) {
+		perror("close");
+	}
+	fluffy_free(segp);
+}
+
+/*
+ * Function:	fluffy_spill_event
+ *
+ * Append an event to the backlog spilled to disk, a new segment is set up
+ * when the last one is full. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- uint32_t: event mask to hand off
+ * 	- const char *: event path, "" when there's none
+ * 	- unsigned int: shard it was read on, from 1; 0 if none
+ * 	- unsigned long long: its sequence on the shard, 0 if none
+ * return:
+ * 	- int: 0 when spilled, -1 if max_spill_bytes are spilled or a
+ * 	  segment couldn't be set up
+ */
+static int
+fluffy_spill_event(struct fluffy_context_info *ctxinfop,
+    uint32_t event_mask, const char *eventpath, unsigned int shard,
+    unsigned long long seq)
+{
+	size_t len = strlen(eventpath) + 1;
+	size_t reclen = SPILL_REC_SIZE(len);
+	if (ctxinfop->spill_bytes + reclen >
+	    ctxinfop->backlog.max_spill_bytes) {
+		return -1;
+	}
+
+	struct fluffy_spill_seg *segp = ctxinfop->spill_tail;
+	if (segp == NULL || segp->wr + reclen > SPILL_SEGMENT_SIZE) {
+		segp = fluffy_spill_seg_new(ctxinfop->spill_dir);
+		if (segp == NULL) {
+			return -1;
+		}
+		if (ctxinfop->spill_tail != NULL) {
+			ctxinfop->spill_tail->next = segp;
+		} else {
+			ctxinfop->spill_head = segp;
+		}
+		ctxinfop->spill_tail = segp;
+	}
+
+	/* Nothing queued is to be merged into past what's spilled */
+	if (ctxinfop->nspilled == 0) {
+		fluffy_str_table_remove_all(ctxinfop->coalesce_table);
+	}
+
+	struct fluffy_spill_rec *recp;
+	recp = (struct fluffy_spill_rec *)(segp->base + segp->wr);
+	recp->mask = event_mask;
+	recp->shard = shard;
+	recp->seq = seq;
+	recp->len = len;
+	memcpy(recp->path, eventpath, len);
+
+	segp->wr += reclen;
+	ctxinfop->spill_bytes += reclen;
+	(ctxinfop->nspilled)++;
+
+	return 0;
+}
+
+/*
+ * Function:	fluffy_spill_take
+ *
+ * Take the oldest event off the backlog spilled to disk, a segment handed
+ * off whole is released. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	- A pointer to fluffy_pending_event, NULL if none is spilled or it
+ * 	  couldn't be allocated
+ */
+static struct fluffy_pending_event *
+fluffy_spill_take(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_spill_seg *segp = ctxinfop->spill_head;
+	if (segp == NULL || ctxinfop->nspilled == 0) {
+		return NULL;
+	}
+
+	struct fluffy_spill_rec *recp;
+	recp = (struct fluffy_spill_rec *)(segp->base + segp->rd);
+	size_t reclen = SPILL_REC_SIZE(recp->len);
+
+	struct fluffy_pending_event *pendp;
+	pendp = fluffy_malloc(sizeof(struct fluffy_pending_event) +
+		    recp->len);
+	if (pendp == NULL) {
+		perror("malloc");
+	} else {
+		pendp->next = NULL;
+		pendp->mask = recp->mask;
+		pendp->shard = recp->shard;
+		pendp->seq = recp->seq;
+		memcpy(pendp->path, recp->path, recp->len);
+	}
+
+	segp->rd += reclen;
+	ctxinfop->spill_bytes -= reclen;
+	(ctxinfop->nspilled)--;
+	if (segp->rd == segp->wr) {
+		ctxinfop->spill_head = segp->next;
+		if (ctxinfop->spill_tail == segp) {
+			ctxinfop->spill_tail = NULL;
+		}
+		fluffy_spill_seg_free(segp);
+	}
+
+	return pendp;
+}
+
+/*
+ * Function:	fluffy_spill_clear
+ *
+ * Drop the backlog spilled to disk. The context mutex must be held.
+ */
+static void
+fluffy_spill_clear(struct fluffy_context_info *ctxinfop)
+{
+	struct fluffy_spill_seg *segp;
+	while ((segp = ctxinfop->spill_head) != NULL) {
+		ctxinfop->spill_head = segp->next;
+		fluffy_spill_seg_free(segp);
+	}
+	ctxinfop->spill_tail = NULL;
+	ctxinfop->spill_bytes = 0;
+	ctxinfop->nspilled = 0;
+}
+
+/*
+ * Function:	fluffy_handoff_event
+ *
+ * Each inotify event is handed off to the client callback function
+ * before internal processing. Since the event processing within a context is
+ * serial, the client will have to fork/thread and return as soon as a possible
+ * in order to avoid event queue overflows; that is if event order isn't a
+ * concern. To main event order, serial processing is the only way.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- struct inotify_event *: a pointer to the inotify event
+ * 	- struct fluffy_wd_info *: a pointer to the associated watch info. Null
+ * 		when the event is a queue overflow
+ * 	- struct fluffy_watch_gen *: the old generation the record is of, NULL
+ * 		when it's current
+ * return:
+ * 	- int: 0 when successful, error value otherwise to terminate context
+ */
+static int
+fluffy_handoff_event(int fluffy_handle, struct inotify_event *ie,
+    struct fluffy_wd_info *wdinfop, struct fluffy_watch_gen *genp)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+	if (ctxinfop->user_event_fn == NULL) {
+		return 0;
+	}
+
+	/*
+	 * Along with the appropriate inotify event mask, OR fluffy context
+	 * event mask when required. This mask will be passed on to the client
+	 * event callback function.
+	 */
+	uint32_t handoff_mask = ie->mask;
+	
+	int is_not_root = 0;	/* Positive when it isn't a root path */
+	char *eventpathp = NULL;
+
+	/* No event path when it's a queue overflow event */
+	if (!(ie->mask & IN_Q_OVERFLOW)) {
+		is_not_root = !__atomic_load_n(&wdinfop->is_root,
+				__ATOMIC_ACQUIRE);
+
+		/* Demoted to polling by the watch budget, it's still covered */
+		if (is_not_root && (ie->mask & IN_IGNORED) &&
+		    wdinfop->mask == 0) {
+			return 0;
+		}
+
+		/*
+		 * Ignore IN_MOVE_SELF & IN_DELETE_SELF unless it's on the root
+		 * path. The parent watch path will catch these events and
+		 * report them, including this regardless is redundant.
+		 */
+		if ((is_not_root)		&&
+		    ((ie->mask & IN_MOVE_SELF)	||
+		    (ie->mask & IN_DELETE_SELF))) {
+			return 0;
+		}
+
+		eventpathp = form_event_path(wdinfop->path,
+				ie->len,
+				ie->name);
+		if (eventpathp == NULL) {
+			return -1;
+		}
+
+		/*
+		 * If event path is a root path and the watch on it is removed,
+		 * send a FLUFFY_ROOT_IGNORED event. If there's no more paths
+		 * to watch, send a FLUFFY_WATCH_EMPTY event as well.
+		 */
+		if ((is_not_root == 0)	&&
+		    (ie->mask & IN_IGNORED)) {
+			handoff_mask |= FLUFFY_ROOT_IGNORED;
+			if (__atomic_load_n(&ctxinfop->nroots,
+			    __ATOMIC_ACQUIRE) == 1) {
+				handoff_mask |= FLUFFY_WATCH_EMPTY;
+			}
+		}
+
+		/*
+		 * A CREATE that was already synthesized while scanning a new
+		 * directory must not be reported again. Once the entry goes
+		 * away, a later CREATE of the same path is a genuine one. This
+		 * goes first so that the entry is consumed even when the check
+		 * below drops the event.
+		 */
+		if ((ie->len > 0) &&
+		    __atomic_load_n(&ctxinfop->nsynth, __ATOMIC_ACQUIRE) > 0 &&
+		    (ie->mask & (IN_CREATE | IN_MOVED_TO |
+		    IN_DELETE | IN_MOVED_FROM))) {
+			int is_dup = 0;
+			int m = -1;
+			m = pthread_mutex_lock(&ctxinfop->mutex);
+			if (m != 0) {
+				fluffy_free(eventpathp);
+				return -1;
+			}
+
+			pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+			    &ctxinfop->mutex);
+			if (fluffy_str_table_remove(ctxinfop->synth_table,
+			    eventpathp)) {
+				is_dup = ((ie->mask & IN_CREATE) ||
+				    (ie->mask & IN_MOVED_TO));
+				__atomic_store_n(&ctxinfop->nsynth,
+				    ctxinfop->synth_table->nused,
+				    __ATOMIC_RELEASE);
+			}
+			pthread_cleanup_pop(1);		/* Unlock mutex */
+
+			if (is_dup) {
+				fluffy_free(eventpathp);
+				return 0;
+			}
+		}
+
+		/*
+		 * If there's an event on a dir, and there's a watch set on its
+		 * parent directory, then the events are reported twice- one by
+		 * the child, one by the parent. Don't report twice.
+		 */
+		if (!(ie->mask & IN_MODIFY)	&&
+		    !(ie->mask & IN_MOVED_FROM)	&&
+		    !(ie->mask & IN_MOVED_TO)	&&
+		    (ie->mask & IN_ISDIR)	&&
+		    (ie->len > 0)) {
+			if ((genp != NULL) ?
+			    fluffy_path_index_lookup(genp->path_index,
+			    eventpathp) != NULL :
+			    fluffy_path_lookup(ctxinfop, eventpathp) != NULL) {
+				fluffy_free(eventpathp);
+				return 0;
+			}
+		}
+	}
+
+	int ret = 0;
+	ret = fluffy_dispatch_event(fluffy_handle, handoff_mask, eventpathp);
+
+	fluffy_free(eventpathp);
+	return ret;	/* return whatever the client returned */
+
+}
+
+/*
+ * Function:	dir_tree_add_watch
+ *
+ * This function must not be called directly, rather passed as a function
+ * pointer to nftw() which in turn calls this function on every path it
+ * encounters.
+ *
+ * args:
+ * 	nftw() provides the arguments
+ * return:
+ * 	- int: 0 to continue the tree walk, none zero to terminate the walk
+ */
+static int
+dir_tree_add_watch(const char *pathname, const struct stat *sbuf, int type,
+    struct FTW *ftwb)
+{
+	struct fluffy_walk_info *walkp = fluffy_track.curr_walkp;
+	int is_dir = (type == FTW_DP || type == FTW_D || type == FTW_DNR);
+
+	struct fluffy_context_info *ctxinfop = NULL;
+	ctxinfop = fluffy_get_context_info(walkp->ctxinfop->handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int reterr = 0;
+	int iwd = -1;
+	int m = -1;
+	int is_excluded = 0;
+	int is_unwatch = 0;
+
+	/*
+	 * Directories are matched against the exclude patterns before they are
+	 * watched or descended into, files only matter when they're reported.
+	 * The path walked from has been checked by the caller already.
+	 * Queue an event for the entry if the walk has been asked to report
+	 * what it finds, and note it in the snapshot of its directory if
+	 * they're kept. Entries that couldn't be stat'd are left out.
+	 */
+	if ((is_dir || walkp->report_mask || walkp->is_snap ||
+	    __atomic_load_n(&ctxinfop->npolled, __ATOMIC_ACQUIRE) > 0) &&
+	    type != FTW_NS) {
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m != 0) {
+			return -1;
+		}
+
+		if (ftwb->level != 0) {
+			is_excluded = fluffy_is_excluded(ctxinfop,
+					walkp->rootinfop, pathname);
+		}
+
+		/*
+		 * Watched from before the pattern applied to it, by an old
+		 * root that's now below this one, or before the pattern was
+		 * added. An old root that's excluded stays a root path.
+		 */
+		if (is_excluded && is_dir &&
+		    fluffy_path_lookup(ctxinfop, pathname) != NULL &&
+		    !fluffy_str_table_lookup(ctxinfop->root_path_table,
+		    pathname, NULL)) {
+			is_unwatch = 1;
+		}
+
+		if (!is_excluded			&&
+		    walkp->report_mask			&&
+		    (ftwb->level != 0 || walkp->is_report_root)) {
+			uint32_t report_mask = walkp->report_mask;
+			if (is_dir) {
+				report_mask |= IN_ISDIR;
+			}
+
+			reterr = fluffy_queue_pending_event(ctxinfop,
+					report_mask, pathname);
+			/* Best effort, a missed one is reported twice */
+			if (reterr == 0 && (report_mask & IN_CREATE)) {
+				if (fluffy_str_table_replace(
+				    ctxinfop->synth_table, pathname, NULL)) {
+					/* Nothing */
+				}
+				__atomic_store_n(&ctxinfop->nsynth,
+				    ctxinfop->synth_table->nused,
+				    __ATOMIC_RELEASE);
+			}
+		}
+
+		if (!is_excluded && walkp->is_snap && ftwb->level != 0) {
+			fluffy_snap_walk_entry(ctxinfop, pathname, ftwb->base,
+			    sbuf);
+		}
+
+		if (!is_excluded && ctxinfop->npolled > 0 &&
+		    ftwb->level != 0) {
+			fluffy_poll_walk_entry(ctxinfop, pathname, ftwb->base,
+			    sbuf);
+		}
+
+		m = pthread_mutex_unlock(&ctxinfop->mutex);
+		if (m != 0 || reterr != 0) {
+			return -1;
+		}
+	}
+
+	/* Excluded subtrees are neither watched nor descended into */
+	if (is_unwatch &&
+	    fluffy_handle_removal(ctxinfop->handle, (char *)pathname)) {
+		PRINT_STDERR("Couldnot unwatch excluded %s\n", pathname);
+	}
+	if (is_excluded) {
+		return (type == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	}
+
+	/* Process only if the entry is a directory */
+	if (!(type == FTW_DP || type == FTW_D)) {
+		return FTW_CONTINUE;
+	}
+
+	/*
+	 * Directories past the depth limit aren't watched. Having been
+	 * reported above, as an entry of a watched parent, they're done with.
+	 */
+	unsigned int depth = walkp->base_depth + ftwb->level;
+	if (walkp->depth_limit >= 0 && depth > (unsigned int)walkp->depth_limit) {
+		return FTW_SKIP_SUBTREE;
+	}
+
+	struct fluffy_root_info *rootinfop = walkp->rootinfop;
+	int is_lazy = (rootinfop != NULL &&
+	    (rootinfop->flags & FLUFFY_ROOT_LAZY));
+	int is_poll = (rootinfop != NULL &&
+	    (rootinfop->flags & FLUFFY_ROOT_POLL));
+	int is_skip = 0;
+	int is_covered = 0;
+	int is_root_walk = 0;
+
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	struct fluffy_root_info *walkrootp = NULL;
+	is_root_walk = (ftwb->level == 0 && fluffy_str_table_lookup(
+			    ctxinfop->root_path_table, pathname,
+			    (void **)&walkrootp));
+
+	/* What its subtree is walked by, for a later root to go by */
+	if (is_root_walk && walkrootp != NULL) {
+		walkrootp->nctx_excludes = ctxinfop->exclude_list.len;
+	}
+
+	struct fluffy_root_info *oldrootinfop = NULL;
+	if (ftwb->level != 0) {
+		if (fluffy_str_table_lookup(ctxinfop->root_path_table,
+		    pathname, (void **)&oldrootinfop)) {
+			/*
+			 * The whole subtree of an old root is watched already,
+			 * unless it was cut short by its options. Nothing to
+			 * be done there, don't descend. The walk has to go
+			 * through it all if entries are to be reported or the
+			 * depth is limited, or if patterns the old root wasn't
+			 * walked by apply: those of this root, or of the
+			 * context added since.
+			 */
+			if (walkp->report_mask == 0			&&
+			    walkp->depth_limit < 0			&&
+			    oldrootinfop->max_depth == 0		&&
+			    !(oldrootinfop->flags & FLUFFY_ROOT_LAZY)	&&
+			    oldrootinfop->exclude_list.len == 0	&&
+			    (rootinfop == NULL ||
+			    rootinfop->exclude_list.len == 0)		&&
+			    oldrootinfop->nctx_excludes ==
+			    ctxinfop->exclude_list.len			&&
+			    fluffy_path_lookup(ctxinfop, pathname) != NULL) {
+				is_covered = 1;
+			}
+
+			/*
+			 * This had been a root watch path previously.
+			 * Since it is a regular descendant path now, remove
+			 * it from the root path list.
+			 */
+			if (!fluffy_str_table_remove(ctxinfop->root_path_table,
+			    pathname)) {
+				PRINT_STDERR("Couldnot remove %s from the " \
+				    "root table\n", pathname);
+			}
+		} else {
+			/*
+			 * This path is not in the root path list, don't
+			 * have to remove anything now.
+			 */
+		}
+	}
+
+	do {
+		if (is_covered) {
+			/* Hook the old root under the new one */
+			struct fluffy_wd_info *oldwdinfop = NULL;
+			oldwdinfop = fluffy_path_lookup(ctxinfop, pathname);
+			fluffy_link_wd_node(ctxinfop, oldwdinfop);
+			is_skip = 1;
+			break;
+		}
+
+		/*
+		 * Watches beyond the levels a lazy root starts off with come
+		 * off its budget. Once spent, the subtree is left as it is,
+		 * and the parent stays a frontier to be deepened again once
+		 * the budget is given back.
+		 */
+		if (is_lazy				&&
+		    depth > rootinfop->lazy_depth	&&
+		    rootinfop->lazy_max_watches	&&
+		    rootinfop->nlazy_watches >= rootinfop->lazy_max_watches &&
+		    fluffy_path_lookup(ctxinfop, pathname) == NULL) {
+			char dirpath[PATH_MAX];
+			size_t len = 1;
+			struct fluffy_wd_info *parentp = NULL;
+			if (ftwb->base > 1) {
+				len = (size_t)ftwb->base - 1;
+			}
+			if (ftwb->base > 0 && len < sizeof(dirpath)) {
+				memcpy(dirpath, pathname, len);
+				dirpath[len] = '\0';
+				parentp = fluffy_path_lookup(ctxinfop, dirpath);
+			}
+			if (parentp != NULL) {
+				__atomic_store_n(&parentp->is_frontier, 1,
+				    __ATOMIC_RELEASE);
+			}
+			is_skip = 1;
+			break;
+		}
+
+		/*
+		 * Every directory of a FLUFFY_ROOT_POLL root is polled, the
+		 * root path too. One that's watched, an old root say, or
+		 * polled already, is left as it is, subtree and all.
+		 */
+		struct fluffy_poll_dir *pollp = NULL;
+		if (ctxinfop->npolled > 0 &&
+		    !fluffy_str_table_lookup(ctxinfop->poll_table, pathname,
+		    (void **)&pollp)) {
+			pollp = NULL;
+		}
+		if (is_poll && (pollp != NULL ||
+		    fluffy_path_lookup(ctxinfop, pathname) != NULL)) {
+			is_skip = 1;
+			break;
+		}
+		if (is_poll) {
+			reterr = fluffy_poll_add(ctxinfop, pathname, sbuf,
+				    fluffy_snap_new(NULL, 0), rootinfop);
+			break;
+		}
+
+		/*
+		 * Past the watch budget the directory is polled, and so is
+		 * all below a polled one; root paths are always watched. One
+		 * polled already is left as it is, subtree and all.
+		 */
+		int is_budget = (ctxinfop->is_budget && !is_root_walk &&
+		    fluffy_path_lookup(ctxinfop, pathname) == NULL);
+		if (is_budget && pollp != NULL && pollp->rootinfop == NULL) {
+			is_skip = 1;
+			break;
+		}
+		if (is_budget && (fluffy_budget_room(ctxinfop) == 0 ||
+		    fluffy_poll_parent(ctxinfop, pathname, ftwb->base))) {
+			reterr = fluffy_poll_add(ctxinfop, pathname, sbuf,
+				    fluffy_snap_new(NULL, 0), NULL);
+			break;
+		}
+
+		iwd = ctxinfop->backend->add_watch_fn(ctxinfop->inotify_fd,
+				pathname, ctxinfop->watch_mask);
+		if (iwd == -1 && errno == ENOSPC && is_budget) {
+			/* The user's watches are spent; that's the budget */
+			ctxinfop->nwatch_limit = ctxinfop->nwd -
+			    ctxinfop->ndemoting;
+			reterr = fluffy_poll_add(ctxinfop, pathname, sbuf,
+				    fluffy_snap_new(NULL, 0), NULL);
+			break;
+		}
+		if (iwd == -1) {
+			perror("inotify_add_watch");
+			reterr = -1;
+			break;
+		}
+
+		struct fluffy_wd_info *oldwdinfop = NULL;
+		oldwdinfop = fluffy_wd_lookup(ctxinfop, iwd);
+		if (oldwdinfop != NULL) {
+			/* Entry already exists */
+			if (oldwdinfop->wd != iwd) {
+				oldwdinfop->wd = iwd;
+			}
+
+			if (oldwdinfop->mask != ctxinfop->watch_mask) {
+				oldwdinfop->mask = ctxinfop->watch_mask;
+			}
+
+			if (strcmp(oldwdinfop->path, pathname) != 0 &&
+			    fluffy_wd_info_rename(ctxinfop, oldwdinfop,
+			    pathname)) {
+				reterr = -1;
+				break;
+			}
+
+			/* The parent may have been watched after this one */
+			fluffy_link_wd_node(ctxinfop, oldwdinfop);
+
+			/* The walk goes through all of its entries */
+			if (walkp->is_snap && oldwdinfop->snap == NULL) {
+				oldwdinfop->snap = fluffy_snap_new(ctxinfop, 0);
+			}
+
+			oldwdinfop->depth = depth;
+			__atomic_store_n(&oldwdinfop->is_frontier, (is_lazy &&
+			    depth == (unsigned int)walkp->depth_limit &&
+			    (rootinfop->max_depth == 0 ||
+			    depth < rootinfop->max_depth)), __ATOMIC_RELEASE);
+			oldwdinfop = NULL;
+
+			break;
+		}
+
+		/* Table does not hold this entry already, add the new entry */
+		struct fluffy_wd_info *wdinfop;
+		wdinfop = fluffy_wd_info_new(ctxinfop, pathname);
+		if (wdinfop == NULL) {
+			reterr = -1;
+			break;
+		}
+		wdinfop->wd = iwd;
+		wdinfop->mask = ctxinfop->watch_mask;
+		wdinfop->depth = depth;
+		wdinfop->seen = ctxinfop->budget_pass;
+		wdinfop->is_frontier = (is_lazy &&
+		    depth == (unsigned int)walkp->depth_limit &&
+		    (rootinfop->max_depth == 0 ||
+		    depth < rootinfop->max_depth));
+
+		/* Fully set up before it's published */
+		if (fluffy_path_insert(ctxinfop, wdinfop)) {
+			fluffy_wd_info_free(ctxinfop, wdinfop);
+			reterr = -1;
+			break;
+		}
+		if (fluffy_wd_insert(ctxinfop, wdinfop)) {
+			/*
+			 * The context thread may have come across it through
+			 * the path index; it's freed once it's past that.
+			 */
+			fluffy_path_remove(ctxinfop, wdinfop);
+			fluffy_wd_info_retire(ctxinfop, wdinfop);
+			reterr = -1;
+			break;
+		}
+		(ctxinfop->nwd)++;
+		ctxinfop->watch_bytes += fluffy_wd_info_size(wdinfop);
+
+		if (is_lazy && depth > rootinfop->lazy_depth) {
+			(rootinfop->nlazy_watches)++;
+		}
+
+		fluffy_link_wd_node(ctxinfop, wdinfop);
+
+		/* Short of memory, it's taken at the next rescan */
+		if (walkp->is_snap) {
+			wdinfop->snap = fluffy_snap_new(ctxinfop, 0);
+		}
+	} while(0);
+
+	/* A root path, or an old one that's a descendant now */
+	if (reterr == 0 && (ftwb->level == 0 || oldrootinfop != NULL)) {
+		fluffy_sync_root(ctxinfop, pathname);
+	}
+
+	/*
+	 * Watched now, it's no longer polled; a root path that was below
+	 * another one, or a directory of a FLUFFY_ROOT_POLL root that's below
+	 * a root path added since.
+	 */
+	if (reterr == 0 && iwd != -1 && ctxinfop->npolled > 0) {
+		fluffy_poll_remove(ctxinfop, pathname);
+	}
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	if (reterr) {
+		return reterr;
+	} else if (is_skip) {
+		return FTW_SKIP_SUBTREE;
+	} else {
+		return FTW_CONTINUE;
+	}
+}
+
+
+/*
+ * Function:	collect_each_root_path
+ *
+ * str table foreach callback, append a copy of the root path to a
+ * fluffy_path_list.
+ */
+static void
+collect_each_root_path(const char *root_path, void *value, void *pathlist)
+{
+	fluffy_path_list_add(pathlist, root_path);
+}
+
+/*
+ * Function:	fluffy_path_list_add
+ *
+ * Append a copy of the path to the list. A copy that fails is left out.
+ */
+static void
+fluffy_path_list_add(struct fluffy_path_list *listp, const char *path)
+{
+	if (listp->len == listp->size) {
+		size_t size = (listp->size > 0) ? listp->size * 2 : 16;
+		char **paths = fluffy_realloc(listp->paths,
+				    size * sizeof(char *));
+		if (paths == NULL) {
+			perror("realloc");
+			return;
+		}
+		listp->paths = paths;
+		listp->size = size;
+	}
+
+	listp->paths[listp->len] = fluffy_strdup(path);
+	if (listp->paths[listp->len] == NULL) {
+		perror("strdup");
+		return;
+	}
+	(listp->len)++;
+}
+
+/*
+ * Function:	fluffy_path_list_clear
+ *
+ * Free the paths of the list along with its array
+ */
+static void
+fluffy_path_list_clear(struct fluffy_path_list *listp)
+{
+	size_t j;
+	for (j = 0; j < listp->len; j++) {
+		fluffy_free(listp->paths[j]);
+	}
+	fluffy_free(listp->paths);
+	memset(listp, 0, sizeof(struct fluffy_path_list));
+}
+
+
+static void
+reinit_each_context(int fluffy_handle)
+{
+	/* Shards are reinitiated along with their sharded context */
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL || ctxinfop->parent != 0) {
+		return;
+	}
+
+	int reterr = 0;
+	reterr = fluffy_reinitiate_context(fluffy_handle);
+	if (reterr) {
+		/* nothing? */
+	}
+}
+
+/*
+ * Function:	fluffy_link_wd_node
+ *
+ * Hook the watch into the directory node tree, as a child of the watch on
+ * its parent directory. If the parent directory isn't watched, the watch
+ * stays a top node. Linking again moves the node to its current parent. The
+ * context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the watch
+ * 	- struct fluffy_wd_info *: the watch to link
+ * return:
+ * 	- void
+ */
+static void
+fluffy_link_wd_node(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop)
+{
+	if (wdinfop == NULL) {
+		return;
+	}
+
+	fluffy_unlink_wd_node(wdinfop);
+
+	/* Parent path; /hogwarts of /hogwarts/dungeons, / of /hogwarts */
+	char tp[PATH_MAX];
+	char *slash = strrchr(wdinfop->path, '/');
+	size_t len = 0;
+	if (slash == NULL || strcmp(wdinfop->path, "/") == 0) {
+		return;
+	}
+	len = (slash == wdinfop->path) ? 1 : (size_t)(slash - wdinfop->path);
+	if (len >= sizeof(tp)) {
+		return;
+	}
+	memcpy(tp, wdinfop->path, len);
+	tp[len] = '\0';
+
+	struct fluffy_wd_info *parentp;
+	parentp = fluffy_path_lookup(ctxinfop, tp);
+	if (parentp == NULL || parentp == wdinfop) {
+		return;
+	}
+
+	wdinfop->parent = parentp;
+	wdinfop->next_sibling = parentp->first_child;
+	if (parentp->first_child != NULL) {
+		parentp->first_child->prev_sibling = wdinfop;
+	}
+	parentp->first_child = wdinfop;
+}
+
+/*
+ * Function:	fluffy_unlink_wd_node
+ *
+ * Detach the watch from its parent in the directory node tree. Its
+ * descendants go along with it. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_wd_info *: the watch to unlink
+ * return:
+ * 	- void
+ */
+static void
+fluffy_unlink_wd_node(struct fluffy_wd_info *wdinfop)
+{
+	if (wdinfop->parent != NULL) {
+		if (wdinfop->prev_sibling != NULL) {
+			wdinfop->prev_sibling->next_sibling =
+			    wdinfop->next_sibling;
+		} else {
+			wdinfop->parent->first_child = wdinfop->next_sibling;
+		}
+
+		if (wdinfop->next_sibling != NULL) {
+			wdinfop->next_sibling->prev_sibling =
+			    wdinfop->prev_sibling;
+		}
+	}
+
+	wdinfop->parent = NULL;
+	wdinfop->prev_sibling = NULL;
+	wdinfop->next_sibling = NULL;
+}
+
+/*
+ * Function:	form_event_path
+ *
+ * Form the event path by appending the filename where the action occured with
+ * the path which is reporting it. inotify watch descriptor is on the reporting
+ * path. If the action occured on the reporting path itself, then there's
+ * nothing to append because ilen will be zero and iname will point to nothing.
+ *
+ * args:
+ * 	- char *:	pointer to the reporting path
+ * 	- uint32_t:	length of the filename in concern if it's a descendant
+ * 	- char *:	pointer to the descendant filename if any
+ * return:
+ * 	- char *:	pointer to the event path, must be freed by the caller
+ */
+static char *
+form_event_path(char *wdpath, uint32_t ilen, char *iname)
+{
+	char *currpath = NULL;
+	currpath = fluffy_calloc(1, (size_t) (strlen(wdpath) + 1 
+				+ ((ilen) ?  ilen : 0) + 2));
+	if (currpath == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	currpath = strncpy(currpath, wdpath, strlen(wdpath) + 1);
+	if (ilen) {
+		/* Action was on a descendant file, so, append it. */
+		currpath = strncat(currpath, "/", 2);
+		currpath = strncat(currpath, iname, strlen(iname) + 1);
+	}
+	return currpath;
+}
+
+/*
+ * Function:	fluffy_add_watch
+ *
+ * Watch a path recursively.
+ *
+ * args:
+ * 	- int: fluffy_context handle
+ * 	- const char *: path to watch recursively
+ * 	- int is_real_path_check: non zero value when the path needs to be a 
+ * 		canonicalized absolute path
+ * 	- const struct fluffy_root_options *rootopts: non NULL if the path
+ * 		is a root path
+ * 	- uint32_t report_mask: when non zero, an event with this mask is
+ * 		queued for every descendant entry the walk finds
+ * 	- int depth_limit: deepest level below the root path to watch, -1 to
+ * 		go by the options of the root path
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_add_watch(int fluffy_handle, const char *pathtoadd,
+    int is_real_path_check, const struct fluffy_root_options *rootopts,
+    uint32_t report_mask, int depth_limit)
+{
+	char *addpath = NULL;
+	int reterr = 0;
+
+	/*
+	 * Check whether the path is an input argument received from the user.
+	 * All paths received from the client/user directly must be checked &
+	 * transformed to a real path.
+	 */
+	if (is_real_path_check) {
+		/* Resolved in place, realpath(3) would malloc(3) it */
+		char rp[PATH_MAX];
+		if (realpath(pathtoadd, rp) == NULL) {
+			reterr = errno;
+			perror("realpath");
+			return reterr;
+		}
+
+		addpath = fluffy_strdup(rp);
+		if (addpath == NULL) {
+			reterr = errno;
+			perror("strdup");
+			return reterr;
+		}
+	} else {
+		/*
+		 * This path need not be resolved. It's assumed that it has
+		 * been resolved already.
+		 */
+		addpath = fluffy_strdup(pathtoadd);
+		if (addpath == NULL) {
+			reterr = errno;
+			perror("strdup");
+			return reterr;
+		}
+	}
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		fluffy_free(addpath);
+		return -1;
+	}
+
+	/* A fanotify mark covers the tree, there's nothing to walk */
+	if (__atomic_load_n(&ctxinfop->fan_mark, __ATOMIC_ACQUIRE) != 0) {
+		reterr = fluffy_fan_add_root(ctxinfop, addpath, rootopts);
+		fluffy_free(addpath);
+		return reterr;
+	}
+
+	unsigned int base_depth = 0;
+	int is_snap = 0;
+	struct fluffy_root_info *rootinfop = NULL;
+	if (rootopts != NULL) {
+		rootinfop = fluffy_root_info_new(rootopts);
+		if (rootinfop == NULL) {
+			fluffy_free(addpath);
+			return EINVAL;
+		}
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_root_info_unref(rootinfop);
+		fluffy_free(addpath);
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	/* Add appropriate records if it's a root path */
+	if (rootinfop != NULL) {
+		rootinfop->depth = fluffy_path_depth(addpath);
+
+		/* Add only if the path is not in the watch list already */
+		if (fluffy_path_lookup(ctxinfop, addpath) == NULL) {
+			/* The table holds a reference of its own */
+			(rootinfop->nref)++;
+			if (fluffy_str_table_replace(ctxinfop->root_path_table,
+			    addpath, rootinfop)) {
+				/* Watched all the same, as a plain path */
+				(rootinfop->nref)--;
+			}
+			fluffy_sync_root(ctxinfop, addpath);
+		} else {
+			/*
+			 * This path is already a descendent of another root
+			 * path, so, don't add a new root path entry. The
+			 * exclude patterns received still apply to this walk.
+			 */
+		}
+	} else {
+		/* Hold the root record the path falls under till walked */
+		rootinfop = fluffy_get_root_info(ctxinfop, addpath);
+		if (rootinfop != NULL) {
+			(rootinfop->nref)++;
+		}
+	}
+
+	/* The context thread holds off inotify events until this is done */
+	if (report_mask) {
+		(ctxinfop->nreport_walks)++;
+	}
+
+	is_snap = (ctxinfop->options & FLUFFY_OPT_OVERFLOW_RESCAN) ? 1 : 0;
+
+	/*
+	 * Depths are counted from the root path. A lazy root watches its top
+	 * levels; a directory that turns up deeper, a new one or one moved
+	 * in, is watched by itself and deepened on activity.
+	 */
+	base_depth = 0;
+	if (rootinfop != NULL) {
+		unsigned int depth = fluffy_path_depth(addpath);
+		if (depth > rootinfop->depth) {
+			base_depth = depth - rootinfop->depth;
+		}
+
+		if (depth_limit < 0 && (rootinfop->flags & FLUFFY_ROOT_LAZY)) {
+			depth_limit = rootinfop->lazy_depth;
+			if ((unsigned int)depth_limit < base_depth) {
+				depth_limit = base_depth;
+			}
+		}
+
+		if (rootinfop->max_depth > 0 &&
+		    (depth_limit < 0 ||
+		    (unsigned int)depth_limit > rootinfop->max_depth)) {
+			depth_limit = rootinfop->max_depth;
+		}
+	}
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	struct fluffy_walk_info walk = {0};
+	walk.ctxinfop = ctxinfop;
+	walk.rootinfop = rootinfop;
+	walk.base_depth = base_depth;
+	walk.depth_limit = depth_limit;
+	walk.report_mask = report_mask;
+	walk.is_snap = is_snap;
+	/*
+	 * An inventory covers the root path as well. A new directory on the
+	 * other hand has already been reported by inotify.
+	 */
+	walk.is_report_root = (report_mask & FLUFFY_EXISTS) ? 1 : 0;
+
+	m = pthread_mutex_lock(&fluffy_track.mutex);
+	if (m == 0) {
+		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+		    &fluffy_track.mutex);
+
+		do {
+			fluffy_track.curr_walkp = &walk;
+
+			/* Watch the path recursively */
+			if (nftw(addpath, dir_tree_add_watch, 30,
+			    FTW_FLAGS) == -1) {
+				reterr = errno;
+				perror("nftw");
+				break;
+			}
+		} while(0);
+		fluffy_track.curr_walkp = NULL;
+		pthread_cleanup_pop(1);		/* Unlock mutex */
+	} else {
+		reterr = -1;
+	}
+	fluffy_free(addpath);
+
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	fluffy_root_info_unref(rootinfop);
+	if (report_mask) {
+		/* Let the context thread know that this walk is through */
+		(ctxinfop->nreport_walks)--;
+		if (pthread_cond_broadcast(&ctxinfop->walk_cond)) {
+			/* nothing? */
+		}
+		if (fluffy_wake_context(ctxinfop)) {
+			/* best effort */
+		}
+	}
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_cleanup_context_info_records
+ *
+ * The intention is to clean up the context records, not to destroy them.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_cleanup_context_info_records(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	int reterr = 0;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/* Close inotify. This will be reinitiated if required */
+		if (ctxinfop->backend->close_fn(ctxinfop->inotify_fd) == -1) {
+			reterr = errno;
+			perror("close");
+			break;
+		}
+		ctxinfop->nwd = 0;
+		ctxinfop->watch_bytes = 0;
+		
+		/* The context thread may be reading these, they're retired */
+		if (fluffy_path_reset(ctxinfop)) {
+			reterr = ENOMEM;
+			break;
+		}
+		fluffy_wd_remove_all(ctxinfop);
+		fluffy_str_table_remove_all(ctxinfop->synth_table);
+		__atomic_store_n(&ctxinfop->nsynth, 0, __ATOMIC_RELEASE);
+		fluffy_str_table_foreach(ctxinfop->root_path_table,
+		    reset_each_root_info, NULL);
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return reterr;
+}
+
+
+/*
+ * Function:	fluffy_setup_context_info_records
+ *
+ * Setup the required bookkeeping records(tables & trees) of a fluffy context.
+ *
+ * args:
+ * 	int - fluffy_context_info.handle
+ * return:
+ * 	int - 0 if successful, error value otherwise
+ */
+static int
+fluffy_setup_context_info_records(int fluffy_handle)
+{
+	int ret = 0;
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/*
+		 * All records required for the context are created here.
+		 * For more info, refer fluffy_context_info structure
+		 * definition block.
+		 */
+		ctxinfop->wd_dir	= NULL;
+		ctxinfop->path_index	= NULL;
+		ctxinfop->retired	= NULL;
+		ctxinfop->old_gen	= NULL;
+		ctxinfop->wd_alloc	= NULL;
+		ctxinfop->watch_mask	= INOTIFY_EVENT_FLAGS;
+		ctxinfop->event_bytes	= sizeof(struct inotify_event) * 2;
+		ctxinfop->root_path_table = NULL;
+		ctxinfop->nroots	= 0;
+		ctxinfop->synth_table	= NULL;
+		ctxinfop->nsynth	= 0;
+		ctxinfop->poll_table	= NULL;
+		ctxinfop->npolled	= 0;
+		ctxinfop->storm_table	= NULL;
+		ctxinfop->fan_fs_table	= NULL;
+		ctxinfop->fan_root_table = NULL;
+		ctxinfop->fan_dir_table	= NULL;
+		memset(&ctxinfop->exclude_list, 0,
+		    sizeof(struct fluffy_exclude_list));
+		memset(&ctxinfop->pending_queue, 0,
+		    sizeof(struct fluffy_pending_queue));
+
+		ctxinfop->path_index = fluffy_path_index_new(
+					PATH_INDEX_MIN_SLOTS);
+		if (ctxinfop->path_index == NULL) {
+			ret = 1;
+			break;
+		}
+
+		ctxinfop->wd_alloc = fluffy_wd_alloc_new();
+		if (ctxinfop->wd_alloc == NULL) {
+			ret = 1;
+			break;
+		}
+
+		ctxinfop->root_path_table = fluffy_str_table_new(
+						fluffy_root_info_unref);
+		if (ctxinfop->root_path_table == NULL) {
+			ret = 1;
+			break;
+		}
+
+		ctxinfop->synth_table = fluffy_str_table_new(NULL);
+		if (ctxinfop->synth_table == NULL) {
+			ret = 1;
+			break;
+		}
+
+		ctxinfop->poll_table = fluffy_str_table_new(fluffy_free);
+		if (ctxinfop->poll_table == NULL) {
+			ret = 1;
+			break;
+		}
+
+		ctxinfop->storm_table = fluffy_str_table_new(fluffy_free);
+		if (ctxinfop->storm_table == NULL) {
+			ret = 1;
+			break;
+		}
+	} while(0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return ret;
+}
+
+
+/*
+ * Function:	fluffy_initiate_inotify
+ *
+ * Initiate an inotify instance for this fluffy context identified by
+ * the fluffy_handle. Also, add the received descriptor to the context's
+ * epoll instance.
+ *
+ * args:
+ * 	int - fluffy_context_info.handle
+ * return:
+ * 	int - 0 if successful, error value otherwise
+ */
+static int
+fluffy_initiate_inotify(int fluffy_handle) 
+{
+	int ret = 0;
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		/* Initialize inotify, get its descriptor */
+		ctxinfop->inotify_fd = ctxinfop->backend->init_fn();
+		if (ctxinfop->inotify_fd == -1) {
+			ret = errno;
+			break;
+		}
+		ctxinfop->queue_limit = fluffy_read_max_queued_events();
+
+		/* Poll for activity on the inotify descriptor */
+		struct epoll_event evtmp = {0};
+		evtmp.events	   = EPOLLIN;
+		evtmp.data.fd	   = ctxinfop->inotify_fd;
+		if (epoll_ctl(
+		    ctxinfop->epoll_fd,
+		    EPOLL_CTL_ADD,
+		    ctxinfop->inotify_fd,
+		    &evtmp) == -1) {
+			ret = errno;
+			break;
+		}
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return ret;
+}
+
+/*
+ * Function:	fluffy_destroy_context
+ *
+ * Releases resources attached with a fluffy context
+ *
+ * args:
+ * 	- void *: fluffy context handle carrying integer value
+ * return:
+ * 	- void
+ */
+static void
+fluffy_destroy_context(void *flhandle)
+{
+	int m = -1;
+	int fluffy_handle = *(int *)flhandle;	/* extract int value */
+
+	do {
+		struct fluffy_context_info *ctxinfop;
+		ctxinfop = fluffy_get_context_info(fluffy_handle);
+		if (ctxinfop == NULL) {
+			break;
+		}
+
+		/* Calls under way on other threads finish before teardown */
+		fluffy_close_context_info(ctxinfop);
+
+		/* Shards go first, they queue on this context */
+		fluffy_watchdog_destroy(ctxinfop);
+		fluffy_build_destroy(ctxinfop);
+		fluffy_shard_destroy_all(ctxinfop);
+		fluffy_backlog_destroy(ctxinfop);
+
+		/* A shard that ends on its own takes its sharded context */
+		struct fluffy_context_info *parentp = NULL;
+		if (ctxinfop->parent != 0) {
+			parentp = fluffy_get_context_info(ctxinfop->parent);
+		}
+		if (parentp != NULL &&
+		    __atomic_load_n(&parentp->nshards, __ATOMIC_ACQUIRE) > 0 &&
+		    !__atomic_load_n(&parentp->is_ending, __ATOMIC_ACQUIRE)) {
+			if (pthread_cancel(parentp->tid)) {
+				/* It's ending already */
+			}
+		}
+
+		/* Clean up the records */
+		if (fluffy_cleanup_context_info_records(fluffy_handle)) {
+			/* best effort */
+		}
+
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m != 0) {
+			break;
+		}
+
+		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+		    &ctxinfop->mutex);
+
+		if (close(ctxinfop->epoll_fd) == -1) {
+			perror("close");
+			/* best effort */
+		}
+
+		if (close(ctxinfop->wake_fd) == -1) {
+			perror("close");
+			/* best effort */
+		}
+		ctxinfop->wake_fd = -1;
+
+		if (ctxinfop->is_raised) {
+			fluffy_restore_queue_limit(ctxinfop);
+		}
+
+		/* Destroy the cleaned up resources */
+		fluffy_wd_remove_all(ctxinfop);
+		fluffy_watch_gen_free(ctxinfop->old_gen);
+		ctxinfop->old_gen = NULL;
+		fluffy_retire(ctxinfop, ctxinfop->path_index, fluffy_free);
+		ctxinfop->path_index = NULL;
+		fluffy_str_table_free(ctxinfop->root_path_table);
+		ctxinfop->root_path_table = NULL;
+		fluffy_exclude_list_clear(&ctxinfop->exclude_list);
+		fluffy_pending_queue_clear(&ctxinfop->pending_queue);
+		fluffy_str_table_free(ctxinfop->synth_table);
+		ctxinfop->synth_table = NULL;
+		fluffy_poll_remove_all(ctxinfop);
+		fluffy_str_table_free(ctxinfop->poll_table);
+		ctxinfop->poll_table = NULL;
+		fluffy_str_table_free(ctxinfop->storm_table);
+		ctxinfop->storm_table = NULL;
+
+		/* Marks go along with the descriptor */
+		if (ctxinfop->fanotify_fd != -1 &&
+		    close(ctxinfop->fanotify_fd) == -1) {
+			perror("close");
+		}
+		ctxinfop->fanotify_fd = -1;
+		fluffy_str_table_free(ctxinfop->fan_fs_table);
+		ctxinfop->fan_fs_table = NULL;
+		fluffy_str_table_free(ctxinfop->fan_root_table);
+		ctxinfop->fan_root_table = NULL;
+		fluffy_str_table_free(ctxinfop->fan_dir_table);
+		ctxinfop->fan_dir_table = NULL;
+		pthread_cleanup_pop(1);
+
+		/* No reader is left */
+		fluffy_reclaim_retired(ctxinfop);
+	} while(0);
+
+	m = fluffy_unref(fluffy_handle);
+	if (m != 0) {
+		/* can't do anything about it */
+	}
+}
+
+
+int
+fluffy_reinitiate_all_contexts()
+{
+	if (fluffy_is_track_setup()) {
+		return -1;
+	}
+
+	/*
+	 * Reinitiation takes fluffy_track.mutex, go by the handles of the live
+	 * slots. A context destroyed meanwhile fails to resolve, that's all.
+	 */
+	int j;
+	for (j = 0; j < MAX_CONTEXTS; j++) {
+		uint32_t state = (uint32_t)__atomic_load_n(
+				     &fluffy_track.handles[j].state,
+				     __ATOMIC_ACQUIRE) & ~HANDLE_CLOSING;
+		if (state & 1) {
+			reinit_each_context((int)((state >> 1) <<
+			    HANDLE_INDEX_BITS) | j);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function:	fluffy_reinitate_context
+ *
+ * Set up the watches of the root paths on a fresh inotify instance, with
+ * fresh records, while the old instance goes on delivering. The context
+ * thread switches over once they're all set; this returns after that.
+ * Called from the context thread, the watches are set up by a thread of
+ * their own and this returns right away.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful, error value otherwise; EALREADY if a
+ * 	  reinitiation is under way
+ */
+int
+fluffy_reinitiate_context(int fluffy_handle)
+{
+	int reterr = 0;
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* A sharded context has its shards reinitiated, one by one */
+	unsigned int j, nshards;
+	nshards = __atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE);
+	if (nshards > 0) {
+		for (j = 0; j < nshards && reterr == 0; j++) {
+			reterr = fluffy_reinitiate_context(
+				     ctxinfop->shards[j].handle);
+		}
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_release_context_info(ctxinfop);
+		return -1;
+	}
+
+	int is_fanotify = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	/* fanotify marks have nothing to set again, paths to resolve anew */
+	is_fanotify = (ctxinfop->fan_mark != 0);
+	if (is_fanotify) {
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	} else {
+		reterr = fluffy_rotate_watch_gen(ctxinfop);
+	}
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	if (reterr || is_fanotify) {
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
+	/* The context thread must go on reading while the watches are set */
+	if (pthread_equal(pthread_self(), ctxinfop->tid)) {
+		int *flhandlep = fluffy_malloc(sizeof(int));
+		if (flhandlep != NULL) {
+			*flhandlep = fluffy_handle;
+
+			/* The last one has switched over, it's done */
+			fluffy_build_destroy(ctxinfop);
+			reterr = pthread_create(&ctxinfop->build_tid, NULL,
+				    fluffy_start_build_thread, flhandlep);
+			if (reterr == 0) {
+				__atomic_store_n(&ctxinfop->is_building, 1,
+				    __ATOMIC_RELEASE);
+				fluffy_release_context_info(ctxinfop);
+				return 0;
+			}
+			fluffy_free(flhandlep);
+		}
+		/* No thread, the watches are set up right here */
+		reterr = fluffy_build_watch_gen(fluffy_handle);
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
+	reterr = fluffy_build_watch_gen(fluffy_handle);
+	fluffy_release_context_info(ctxinfop);
+	if (reterr) {
+		return reterr;
+	}
+
+	/*
+	 * Back to back reinitiations must not find this one under way. The
+	 * switch over is polled for; the context may be destroyed meanwhile,
+	 * its handle then fails to resolve.
+	 */
+	while ((ctxinfop = fluffy_hold_context_info(fluffy_handle)) != NULL) {
+		int is_done = 1;
+		if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+			is_done = (ctxinfop->old_gen == NULL ||
+			    ctxinfop->old_gen->inotify_fd == -1);
+			pthread_mutex_unlock(&ctxinfop->mutex);
+		}
+		fluffy_release_context_info(ctxinfop);
+		if (is_done) {
+			break;
+		}
+
+		struct timespec ts = {0, 1000000};
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_watch_gen_free
+ *
+ * Close the old instance, if still open, and free the old records
+ */
+static void
+fluffy_watch_gen_free(void *gen)
+{
+	struct fluffy_watch_gen *genp = gen;
+	if (genp == NULL) {
+		return;
+	}
+
+	if (genp->inotify_fd != -1 &&
+	    genp->backend->close_fn(genp->inotify_fd) == -1) {
+		perror("close");
+	}
+	if (genp->wd_dir != NULL) {
+		fluffy_wd_dir_free(genp->wd_dir);
+	}
+	fluffy_wd_alloc_free(genp->wd_alloc);
+	fluffy_free(genp->path_index);
+	fluffy_free(genp);
+}
+
+/*
+ * Function:	fluffy_rotate_watch_gen
+ *
+ * Put the inotify instance and the watch records of the context aside as
+ * its old generation, and start afresh with an empty instance and empty
+ * tables. The new instance isn't polled until the context thread switches
+ * over to it; its events are queued till then. The context mutex must be
+ * held.
+ *
+ * return:
+ * 	- int: 0 when successful, error value otherwise; the context is then
+ * 	  left as it is
+ */
+static int
+fluffy_rotate_watch_gen(struct fluffy_context_info *ctxinfop)
+{
+	/* One that's been switched over from is only kept for duplicates */
+	struct fluffy_watch_gen *oldgenp = ctxinfop->old_gen;
+	if (oldgenp != NULL && oldgenp->inotify_fd != -1) {
+		return EALREADY;
+	}
+
+	struct fluffy_watch_gen *genp;
+	genp = fluffy_calloc(1, sizeof(struct fluffy_watch_gen));
+	if (genp == NULL) {
+		perror("calloc");
+		return ENOMEM;
+	}
+
+	struct fluffy_path_index *indexp;
+	indexp = fluffy_path_index_new(PATH_INDEX_MIN_SLOTS);
+	struct fluffy_wd_alloc *allocp = fluffy_wd_alloc_new();
+	int ifd = ctxinfop->backend->init_fn();
+	if (indexp == NULL || allocp == NULL || ifd == -1) {
+		int reterr = (ifd == -1) ? errno : ENOMEM;
+		if (ifd == -1) {
+			perror("inotify_init1");
+		} else {
+			ctxinfop->backend->close_fn(ifd);
+		}
+		fluffy_free(indexp);
+		if (allocp != NULL) {
+			fluffy_wd_alloc_free(allocp);
+		}
+		fluffy_free(genp);
+		return reterr;
+	}
+
+	/*
+	 * The walks take new snapshots, and poll what they can't watch. The
+	 * directories of FLUFFY_ROOT_POLL roots are polled all the same,
+	 * their snapshots are kept.
+	 */
+	fluffy_snap_free_all(ctxinfop);
+	fluffy_poll_remove_budget(ctxinfop);
+	ctxinfop->ndemoting = 0;
+
+	genp->inotify_fd = ctxinfop->inotify_fd;
+	genp->backend = ctxinfop->backend;
+	genp->wd_dir = ctxinfop->wd_dir;
+	genp->path_index = ctxinfop->path_index;
+	genp->wd_alloc = ctxinfop->wd_alloc;
+
+	/*
+	 * In this order; the context thread tells an event of the old
+	 * instance by its descriptor, having looked up the pages.
+	 */
+	__atomic_store_n(&ctxinfop->old_gen, genp, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctxinfop->inotify_fd, ifd, __ATOMIC_RELEASE);
+	ctxinfop->queue_limit = fluffy_read_max_queued_events();
+	__atomic_store_n(&ctxinfop->wd_dir, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctxinfop->path_index, indexp, __ATOMIC_RELEASE);
+	ctxinfop->wd_alloc = allocp;
+	ctxinfop->nwd = 0;
+	ctxinfop->watch_bytes = 0;
+	fluffy_str_table_foreach(ctxinfop->root_path_table,
+	    reset_each_root_info, NULL);
+
+	if (oldgenp != NULL) {
+		fluffy_retire(ctxinfop, oldgenp, fluffy_watch_gen_free);
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_build_watch_gen
+ *
+ * Set watches on the root paths, on the new instance of a reinitiation,
+ * then have the context thread switch over to it. A root path that can't
+ * be watched is left out, as it would be on a fresh start.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_build_watch_gen(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	struct fluffy_path_list roots = {0};
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	fluffy_str_table_foreach(ctxinfop->root_path_table,
+	    collect_each_root_path, &roots);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	size_t j;
+	for (j = 0; j < roots.len; j++) {
+		if (fluffy_add_watch(fluffy_handle, roots.paths[j], 0, NULL,
+		    0, -1)) {
+			PRINT_STDERR("Couldnot rewatch %s\n", roots.paths[j]);
+		}
+	}
+	fluffy_path_list_clear(&roots);
+
+	/* The context may have gone meanwhile */
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	if (ctxinfop->old_gen != NULL) {
+		__atomic_store_n(&ctxinfop->old_gen->is_ready, 1,
+		    __ATOMIC_RELEASE);
+	}
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	return fluffy_wake_context(ctxinfop);
+}
+
+/*
+ * Function:	fluffy_start_build_thread
+ *
+ * Thread start routine that runs fluffy_build_watch_gen(); detached.
+ */
+static void *
+fluffy_start_build_thread(void *flhandle)
+{
+	int fluffy_handle = *(int *)flhandle;
+	fluffy_free(flhandle);
+
+	if (fluffy_build_watch_gen(fluffy_handle)) {
+		PRINT_STDERR("Reinitiation failed!\n", "");
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_build_destroy
+ *
+ * End the build thread of a reinitiation, if one was started, and join it.
+ * Called by the context thread, without the mutex; as it ends, or before it
+ * starts another one.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	- void
+ */
+static void
+fluffy_build_destroy(struct fluffy_context_info *ctxinfop)
+{
+	if (!__atomic_load_n(&ctxinfop->is_building, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	if (pthread_cancel(ctxinfop->build_tid)) {
+		/* Ended already, it's joined all the same */
+	}
+	if (pthread_join(ctxinfop->build_tid, NULL)) {
+		/* nothing? */
+	}
+	__atomic_store_n(&ctxinfop->is_building, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:	fluffy_switch_watch_gen
+ *
+ * Once the new watches of a reinitiation are set, read what's left on the
+ * old instance, close it and start polling the new one. The size of the
+ * new queue at that point is noted; events up to there that the old
+ * instance may have delivered as well are dropped as they're read, unless
+ * it overflowed. Called by the context thread between batches of events.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful or there's nothing to switch, -1 otherwise
+ */
+static int
+fluffy_switch_watch_gen(int fluffy_handle)
+{
+	int reterr = 0;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	struct fluffy_watch_gen *genp;
+	genp = __atomic_load_n(&ctxinfop->old_gen, __ATOMIC_ACQUIRE);
+	if (genp == NULL || genp->inotify_fd == -1 ||
+	    !__atomic_load_n(&genp->is_ready, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	/*
+	 * Noted before the old instance is drained; what's queued after is
+	 * handed off even if the old one has it as well. Better twice than
+	 * never.
+	 */
+	int nqueued = 0;
+	if (ctxinfop->backend->nread_fn(ctxinfop->inotify_fd, &nqueued) == -1) {
+		perror("ioctl");
+		genp->is_lossy = 1;
+	}
+
+	struct epoll_event evtmp = {0};
+	evtmp.events	= EPOLLIN;
+	evtmp.data.fd	= genp->inotify_fd;
+	int nold = 0;
+	while (genp->backend->nread_fn(genp->inotify_fd, &nold) == 0 &&
+	    nold > 0) {
+		reterr = fluffy_process_inotify_queue(fluffy_handle, &evtmp);
+		if (reterr) {
+			return -1;
+		}
+	}
+
+	evtmp.data.fd	= ctxinfop->inotify_fd;
+	if (epoll_ctl(ctxinfop->epoll_fd, EPOLL_CTL_ADD, ctxinfop->inotify_fd,
+	    &evtmp) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	/* Off the epoll set as it's closed */
+	if (genp->backend->close_fn(genp->inotify_fd) == -1) {
+		perror("close");
+	}
+	genp->inotify_fd = -1;
+
+	/* Its watches counted against the user's, ENOSPC is to be relearnt */
+	ctxinfop->nwatch_limit = 0;
+	genp->ndup_bytes = genp->is_lossy ? 0 : nqueued;
+	if (genp->ndup_bytes == 0) {
+		__atomic_store_n(&ctxinfop->old_gen, NULL, __ATOMIC_RELEASE);
+	} else {
+		genp = NULL;
+	}
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	fluffy_watch_gen_free(genp);
+	if (m != 0) {
+		return -1;
+	}
+
+	/* A fresh queue, it may not wake the context thread for a while */
+	if (ctxinfop->is_pressured &&
+	    fluffy_check_queue_pressure(fluffy_handle)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_event_wd_lookup
+ *
+ * Look up the watch record of an event read from the given inotify
+ * descriptor; that of the old generation if it's the old instance. Called
+ * by the context thread.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context of the event
+ * 	- int: inotify descriptor the event was read from
+ * 	- int: watch descriptor of the event
+ * 	- struct fluffy_watch_gen **: set to the old generation if the event
+ * 	  is of the old instance, NULL otherwise
+ * return:
+ * 	- A pointer to fluffy_wd_info when found, NULL otherwise
+ */
+static struct fluffy_wd_info *
+fluffy_event_wd_lookup(struct fluffy_context_info *ctxinfop, int fd, int wd,
+    struct fluffy_watch_gen **genpp)
+{
+	/* Pages first; if they're new, so is the descriptor */
+	struct fluffy_wd_dir *dirp;
+	dirp = __atomic_load_n(&ctxinfop->wd_dir, __ATOMIC_ACQUIRE);
+	*genpp = NULL;
+	if (fd != __atomic_load_n(&ctxinfop->inotify_fd, __ATOMIC_ACQUIRE)) {
+		*genpp = __atomic_load_n(&ctxinfop->old_gen, __ATOMIC_ACQUIRE);
+		if (*genpp == NULL) {
+			return NULL;
+		}
+		dirp = (*genpp)->wd_dir;
+	}
+
+	return fluffy_wd_dir_lookup(dirp, wd);
+}
+
+/*
+ * Function:	fluffy_is_dup_event
+ *
+ * Tell whether an event of the new instance, queued before the switch
+ * over, was delivered by the old instance as well; it was if the old one
+ * watched the same directory. So was anything the new queue may have
+ * dropped on overflowing; the walks setting the new watches flood it on
+ * a large tree. Only events of directories created meanwhile, with the
+ * old instance unaware of them, may have been lost. The old records are
+ * freed once the queue is read past that point. Called by the context
+ * thread.
+ *
+ * return:
+ * 	- int: 1 if the event is a duplicate, 0 otherwise
+ */
+static int
+fluffy_is_dup_event(struct fluffy_context_info *ctxinfop,
+    struct inotify_event *ievent, struct fluffy_wd_info *wdinfop)
+{
+	struct fluffy_watch_gen *genp;
+	genp = __atomic_load_n(&ctxinfop->old_gen, __ATOMIC_ACQUIRE);
+	if (genp == NULL || genp->inotify_fd != -1 || genp->ndup_bytes <= 0) {
+		return 0;
+	}
+
+	int is_dup = 0;
+	if (ievent->mask & IN_Q_OVERFLOW) {
+		is_dup = 1;
+	} else if (wdinfop != NULL) {
+		is_dup = (fluffy_path_index_lookup(genp->path_index,
+		    __atomic_load_n(&wdinfop->path, __ATOMIC_ACQUIRE)) != NULL);
+	}
+
+	genp->ndup_bytes -= sizeof(struct inotify_event) + ievent->len;
+	if (genp->ndup_bytes <= 0) {
+		int m = -1;
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m == 0) {
+			/* Unless a reinitiation retired it already */
+			if (ctxinfop->old_gen == genp) {
+				__atomic_store_n(&ctxinfop->old_gen, NULL,
+				    __ATOMIC_RELEASE);
+				fluffy_retire(ctxinfop, genp,
+				    fluffy_watch_gen_free);
+			}
+			pthread_mutex_unlock(&ctxinfop->mutex);
+		}
+	}
+
+	return is_dup;
+}
+
+
+/*
+ * Function:	fluffy_initiate_epoll
+ *
+ * Creates an epoll instance for this fluffy context. Only the eventfd that
+ * wakes the context thread is polled on yet, inotify is added later.
+ *
+ * args:
+ * 	int - fluffy_context_info.handle
+ * return:
+ * 	int - 0 if successful, error value otherwise
+ */
+static int
+fluffy_initiate_epoll(int fluffy_handle)
+{
+	int ret = 0;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		ctxinfop->epoll_fd = epoll_create(3);
+		if (ctxinfop->epoll_fd == -1) {
+			ret = errno;
+			break;
+		}
+
+		/* Poll for wake ups of the context thread as well */
+		ctxinfop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (ctxinfop->wake_fd == -1) {
+			ret = errno;
+			break;
+		}
+
+		struct epoll_event evtmp = {0};
+		evtmp.events	= EPOLLIN;
+		evtmp.data.fd	= ctxinfop->wake_fd;
+		if (epoll_ctl(
+		    ctxinfop->epoll_fd,
+		    EPOLL_CTL_ADD,
+		    ctxinfop->wake_fd,
+		    &evtmp) == -1) {
+			ret = errno;
+			break;
+		}
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return ret;
+}
+
+
+/*
+ * Function:	fluffy_setup_context
+ *
+ * Initialize/create context records, epoll instance to listen on the
+ * initialized inotify instance for this fluffy_context_info.
+ *
+ * args:
+ * 	int - fluffy_context_info.handle
+ * return:
+ * 	int - 0 on success, error value otherwise
+ */
+static int
+fluffy_setup_context(int fluffy_handle)
+{
+	int reterr = 0;
+
+	reterr = fluffy_setup_context_info_records(fluffy_handle);
+	if (reterr) {
+		return reterr;
+	}
+
+	reterr = fluffy_initiate_epoll(fluffy_handle);
+	if (reterr) {
+		return reterr;
+	}
+
+	reterr = fluffy_initiate_inotify(fluffy_handle);
+	if (reterr) {
+		return reterr;
+	}
+
+	return 0;
+}
+
+/*
+ * Function:	fluffy_handle_qoverflow
+ *
+ * On an IN_Q_OVERFLOW event, events were possibly dropped when the queue
+ * overflowed. Act as the context is set to; terminate it, rescan the
+ * watched directories for what was missed, or by default reinitiate the
+ * inotify instance and the associated records to set up the watches from
+ * scratch. A failed rescan falls back to reinitiation.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful, error value otherwise; -1 to terminate
+ */
+static int
+fluffy_handle_qoverflow(int fluffy_handle)
+{
+	int reterr = 0;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	uint32_t options = ctxinfop->options;
+	if (options & FLUFFY_OPT_OVERFLOW_TERMINATE) {
+		PRINT_STDERR("Queue overflow, terminating the context\n", "");
+		return -1;
+	}
+
+	if (options & FLUFFY_OPT_OVERFLOW_RESCAN) {
+		PRINT_STDERR("Queue overflow, rescanning all watches\n", "");
+		reterr = fluffy_rescan_context(fluffy_handle);
+		if (reterr == 0) {
+			return 0;
+		} else if (reterr == -1) {
+			/* The client asked for the context to be terminated */
+			return -1;
+		}
+		PRINT_STDERR("Rescan failed, falling back to reinitiation\n",
+		    "");
+	}
+
+	PRINT_STDERR("Queue overflow, reinitiating all watches!\n", "");
+	reterr = fluffy_reinitiate_context(fluffy_handle);
+	if (reterr && reterr != EALREADY) {
+		PRINT_STDERR("Reinitiation failed!\n", "");
+		return reterr;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_read_max_queued_events
+ *
+ * Read the max_queued_events an inotify instance created now would get
+ *
+ * return:
+ * 	- unsigned int: the limit, 0 if it couldn't be read
+ */
+static unsigned int
+fluffy_read_max_queued_events()
+{
+	int fd = -1;
+	fd = open("/proc/sys/fs/inotify/max_queued_events",
+		O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return 0;
+	}
+
+	char buf[32] = {0};
+	ssize_t nrbytes = read(fd, buf, sizeof(buf) - 1);
+	if (close(fd) != 0 || nrbytes <= 0) {
+		return 0;
+	}
+
+	unsigned long val = strtoul(buf, NULL, 10);
+	return (val > UINT_MAX) ? UINT_MAX : (unsigned int)val;
+}
+
+/*
+ * Function:	fluffy_check_queue_pressure
+ *
+ * Sample the inotify queue of the context and take, or undo, the actions
+ * of fluffy_set_queue_pressure() as it crosses the water marks. Called by
+ * the context thread before it reads the queue.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful, whatever else the client returned
+ */
+static int
+fluffy_check_queue_pressure(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	struct fluffy_queue_pressure qp = ctxinfop->pressure;
+	unsigned int limit = ctxinfop->queue_limit;
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	int is_pressured = ctxinfop->is_pressured;
+	if (qp.actions == 0 && !is_pressured) {
+		return 0;
+	}
+
+	/* FIONREAD counts bytes, the limit is in events */
+	int nqueued = 0;
+	if (qp.actions != 0 && limit != 0 &&
+	    ctxinfop->backend->nread_fn(ctxinfop->inotify_fd, &nqueued) == -1) {
+		perror("ioctl");
+		return 0;
+	}
+	unsigned long long fill = 0;
+	if (limit != 0) {
+		fill = (unsigned long long)nqueued * 100 /
+		    ctxinfop->event_bytes / limit;
+	}
+
+	if (!is_pressured && qp.actions != 0 && fill >= qp.high_water) {
+		ctxinfop->is_pressured = 1;
+		if (qp.actions & FLUFFY_PRESSURE_SHED) {
+			fluffy_set_watch_mask(ctxinfop,
+			    INOTIFY_EVENT_FLAGS & ~PRESSURE_SHED_FLAGS);
+		}
+		if (qp.actions & FLUFFY_PRESSURE_RAISE) {
+			fluffy_raise_queue_limit(fluffy_handle, limit,
+			    qp.max_queued_events);
+		}
+		if (qp.actions & FLUFFY_PRESSURE_REPORT) {
+			return fluffy_dispatch_event(fluffy_handle,
+				    FLUFFY_QUEUE_PRESSURE, NULL);
+		}
+	} else if (is_pressured && (qp.actions == 0 || fill <= qp.low_water)) {
+		ctxinfop->is_pressured = 0;
+		if (ctxinfop->watch_mask != INOTIFY_EVENT_FLAGS) {
+			fluffy_set_watch_mask(ctxinfop, INOTIFY_EVENT_FLAGS);
+		}
+		if (ctxinfop->is_raised) {
+			fluffy_restore_queue_limit(ctxinfop);
+		}
+		if (qp.actions & FLUFFY_PRESSURE_REPORT) {
+			return fluffy_dispatch_event(fluffy_handle,
+				    FLUFFY_QUEUE_RELIEVED, NULL);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function:	fluffy_set_watch_mask
+ *
+ * Change the mask of every watch of the context, and of the watches set
+ * from now on. A record whose path has come to name another directory is
+ * left as it is; the watch that got set there instead is removed.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * 	- uint32_t: the new inotify mask
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_set_watch_mask(struct fluffy_context_info *ctxinfop, uint32_t mask)
+{
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	ctxinfop->watch_mask = mask;
+
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	unsigned int j, k;
+	for (j = 0; dirp != NULL && j < dirp->npages; j++) {
+		struct fluffy_wd_page *pagep = dirp->pages[j];
+		if (pagep == NULL) {
+			continue;
+		}
+
+		for (k = 0; k < WD_PAGE_SLOTS; k++) {
+			struct fluffy_wd_info *wdinfop;
+			wdinfop = pagep->slots[k].wdinfop;
+			/* Demoted ones have no watch left to change */
+			if (wdinfop == NULL || wdinfop->mask == mask ||
+			    wdinfop->mask == 0) {
+				continue;
+			}
+
+			/* Gone meanwhile, its IN_IGNORED is on the way */
+			int iwd = ctxinfop->backend->add_watch_fn(
+				    ctxinfop->inotify_fd, wdinfop->path, mask);
+			if (iwd == -1) {
+				continue;
+			}
+
+			if (iwd != wdinfop->wd &&
+			    fluffy_wd_lookup(ctxinfop, iwd) == NULL) {
+				ctxinfop->backend->rm_watch_fn(
+				    ctxinfop->inotify_fd, iwd);
+				continue;
+			}
+			wdinfop->mask = mask;
+		}
+	}
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return 0;
+}
+
+/*
+ * Function:	fluffy_raise_queue_limit
+ *
+ * Double max_queued_events, up to the cap, and reinitiate the context to
+ * get an instance with it. The raise is shared by the contexts that asked
+ * for it; the value it had before the first of them is kept to be
+ * restored.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- unsigned int: max_queued_events of the context's instance
+ * 	- unsigned int: cap on max_queued_events
+ * return:
+ * 	- int: 0 when successful or there's no room to raise, error value
+ * 	  otherwise
+ */
+static int
+fluffy_raise_queue_limit(int fluffy_handle, unsigned int limit,
+    unsigned int cap)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	unsigned int raised = (limit > cap / 2) ? cap : limit * 2;
+	if (limit == 0 || raised <= limit) {
+		return 0;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&fluffy_track.raise_mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &fluffy_track.raise_mutex);
+
+	do {
+		/* Raised higher already, by another context or by hand */
+		unsigned int current = fluffy_read_max_queued_events();
+		if (current < raised) {
+			char maxval[32];
+			snprintf(maxval, sizeof(maxval), "%u", raised);
+			if (fluffy_set_max_queued_events(maxval)) {
+				PRINT_STDERR("Couldnot raise "
+				    "max_queued_events\n", "");
+				reterr = -1;
+				break;
+			}
+			if (fluffy_track.nraised == 0) {
+				fluffy_track.raised_from = current;
+			}
+			fluffy_track.raised_to = raised;
+		} else if (fluffy_track.nraised == 0) {
+			break;
+		}
+
+		/* Held till it's restored, whoever raised it last */
+		if (!ctxinfop->is_raised) {
+			ctxinfop->is_raised = 1;
+			(fluffy_track.nraised)++;
+		}
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	if (reterr) {
+		return reterr;
+	}
+
+	reterr = fluffy_reinitiate_context(fluffy_handle);
+	if (reterr && reterr != EALREADY) {
+		PRINT_STDERR("Reinitiation failed!\n", "");
+		return reterr;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_restore_queue_limit
+ *
+ * Let go of the raise of max_queued_events. The last context to let go of
+ * it sets it back to what it was before it was raised, unless it's been
+ * changed since.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_restore_queue_limit(struct fluffy_context_info *ctxinfop)
+{
+	if (!ctxinfop->is_raised) {
+		return 0;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&fluffy_track.raise_mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	int reterr = 0;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &fluffy_track.raise_mutex);
+
+	ctxinfop->is_raised = 0;
+	(fluffy_track.nraised)--;
+	if (fluffy_track.nraised == 0 &&
+	    fluffy_read_max_queued_events() == fluffy_track.raised_to) {
+		char maxval[32];
+		snprintf(maxval, sizeof(maxval), "%u",
+		    fluffy_track.raised_from);
+		if (fluffy_set_max_queued_events(maxval)) {
+			PRINT_STDERR("Couldnot restore max_queued_events\n",
+			    "");
+			reterr = -1;
+		}
+	}
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_inotify_init
+ *
+ * init_fn of fluffy_inotify_backend
+ */
+static int
+fluffy_inotify_init(void)
+{
+	return inotify_init1(IN_CLOEXEC);
+}
+
+/*
+ * Function:	fluffy_inotify_nread
+ *
+ * nread_fn of fluffy_inotify_backend, bytes queued on an instance
+ */
+static int
+fluffy_inotify_nread(int fd, int *nbytesp)
+{
+	return ioctl(fd, FIONREAD, nbytesp);
+}
+
+/*
+ * Function:	fluffy_fake_lookup
+ *
+ * Find the fake backend instance of a descriptor. fluffy_track.fake_mutex
+ * must be held.
+ *
+ * return:
+ * 	- A pointer to fluffy_fake, NULL if the descriptor isn't of one
+ */
+static struct fluffy_fake *
+fluffy_fake_lookup(int fd)
+{
+	struct fluffy_fake *fakep = fluffy_track.fakes;
+	while (fakep != NULL && fakep->fd != fd) {
+		fakep = fakep->next;
+	}
+	return fakep;
+}
+
+/*
+ * Function:	fluffy_fake_queue
+ *
+ * Queue an event on a fake instance the way inotify does. It's dropped if
+ * it's the same as the last one unread, and past max_queued_events; an
+ * IN_Q_OVERFLOW is queued instead, unless one is unread already.
+ * fluffy_track.fake_mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_fake *: instance to queue on
+ * 	- int: watch descriptor, -1 for IN_Q_OVERFLOW
+ * 	- uint32_t: event mask
+ * 	- uint32_t: cookie that ties a pair of moves
+ * 	- const char *: name of the entry, NULL for the directory itself
+ * return:
+ * 	- int: 0 when queued or dropped, error value otherwise
+ */
+static int
+fluffy_fake_queue(struct fluffy_fake *fakep, int wd, uint32_t mask,
+    uint32_t cookie, const char *name)
+{
+	if (fakep->limit != 0 && fakep->nqueued >= fakep->limit) {
+		if (fakep->is_overflow) {
+			return 0;
+		}
+		wd = -1;
+		mask = IN_Q_OVERFLOW;
+		cookie = 0;
+		name = NULL;
+	}
+
+	/* Names are padded to whole records, as inotify has them */
+	size_t namelen = (name != NULL) ? strlen(name) + 1 : 0;
+	if (namelen > NAME_MAX + 1) {
+		return ENAMETOOLONG;
+	}
+	namelen = (namelen + sizeof(struct inotify_event) - 1) /
+	    sizeof(struct inotify_event) * sizeof(struct inotify_event);
+
+	struct inotify_event ie = {0};
+	ie.wd = wd;
+	ie.mask = mask;
+	ie.cookie = cookie;
+	ie.len = namelen;
+
+	/* Coalesced with the last one, if it's unread and the same */
+	if (fakep->last >= fakep->head && fakep->last < fakep->len) {
+		struct inotify_event lastie;
+		memcpy(&lastie, fakep->buf + fakep->last, sizeof(lastie));
+		const char *lastname = fakep->buf + fakep->last +
+		    sizeof(lastie);
+		if (lastie.wd == wd && lastie.mask == mask &&
+		    lastie.cookie == cookie && lastie.len == namelen &&
+		    (namelen == 0 || strcmp(lastname, name) == 0)) {
+			return 0;
+		}
+	}
+
+	size_t evlen = sizeof(struct inotify_event) + namelen;
+	if (fakep->len + evlen > fakep->size) {
+		/* Read ones make room first */
+		memmove(fakep->buf, fakep->buf + fakep->head,
+		    fakep->len - fakep->head);
+		fakep->len -= fakep->head;
+		fakep->last -= (fakep->last >= fakep->head) ? fakep->head :
+		    fakep->last;
+		fakep->head = 0;
+	}
+	if (fakep->len + evlen > fakep->size) {
+		size_t size = (fakep->size > 0) ? fakep->size * 2 :
+		    NR_INOTIFY_EVENTS * sizeof(struct inotify_event);
+		while (size < fakep->len + evlen) {
+			size *= 2;
+		}
+		char *buf = fluffy_realloc(fakep->buf, size);
+		if (buf == NULL) {
+			perror("realloc");
+			return ENOMEM;
+		}
+		fakep->buf = buf;
+		fakep->size = size;
+	}
+
+	memcpy(fakep->buf + fakep->len, &ie, sizeof(ie));
+	memset(fakep->buf + fakep->len + sizeof(ie), 0, namelen);
+	if (name != NULL) {
+		memcpy(fakep->buf + fakep->len + sizeof(ie), name,
+		    strlen(name));
+	}
+	fakep->last = fakep->len;
+	fakep->len += evlen;
+	(fakep->nqueued)++;
+	if (mask & IN_Q_OVERFLOW) {
+		fakep->is_overflow = 1;
+	}
+
+	/* Readable till it's all read */
+	uint64_t one = 1;
+	if (write(fakep->fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		perror("write");
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_fake_init
+ *
+ * init_fn of fluffy_fake_backend, a new instance with nothing queued
+ */
+static int
+fluffy_fake_init(void)
+{
+	struct fluffy_fake *fakep;
+	fakep = fluffy_calloc(1, sizeof(struct fluffy_fake));
+	if (fakep == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	fakep->key_table = fluffy_str_table_new(NULL);
+	fakep->path_table = fluffy_str_table_new(NULL);
+	fakep->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fakep->key_table == NULL || fakep->path_table == NULL ||
+	    fakep->fd == -1) {
+		int reterr = (fakep->fd == -1) ? errno : ENOMEM;
+		if (fakep->fd != -1) {
+			close(fakep->fd);
+		}
+		fluffy_str_table_free(fakep->key_table);
+		fluffy_str_table_free(fakep->path_table);
+		fluffy_free(fakep);
+		errno = reterr;
+		return -1;
+	}
+	fakep->last = SIZE_MAX;
+	fakep->limit = fluffy_read_max_queued_events();
+
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		close(fakep->fd);
+		fluffy_str_table_free(fakep->key_table);
+		fluffy_str_table_free(fakep->path_table);
+		fluffy_free(fakep);
+		errno = EAGAIN;
+		return -1;
+	}
+	fakep->next = fluffy_track.fakes;
+	fluffy_track.fakes = fakep;
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+	return fakep->fd;
+}
+
+/*
+ * Function:	fluffy_fake_add_watch
+ *
+ * add_watch_fn of fluffy_fake_backend. The path must be there; a watch is
+ * of its inode, one that's watched already keeps its descriptor. The mask
+ * isn't looked at, events are queued as they're injected.
+ */
+static int
+fluffy_fake_add_watch(int fd, const char *path, uint32_t mask)
+{
+	struct stat sbuf;
+	if (lstat(path, &sbuf) == -1) {
+		return -1;
+	}
+	if ((mask & IN_ONLYDIR) && !S_ISDIR(sbuf.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	char key[64];
+	snprintf(key, sizeof(key), "%llx:%llx",
+	    (unsigned long long)sbuf.st_dev, (unsigned long long)sbuf.st_ino);
+
+	int wd = -1;
+	int reterr = 0;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	do {
+		struct fluffy_fake *fakep = fluffy_fake_lookup(fd);
+		if (fakep == NULL) {
+			reterr = EBADF;
+			break;
+		}
+
+		void *value = NULL;
+		if (fluffy_str_table_lookup(fakep->key_table, key, &value)) {
+			wd = (int)(intptr_t)value;
+		} else {
+			if ((size_t)fakep->nwd + 1 >= fakep->nkeys) {
+				size_t nkeys = (fakep->nkeys > 0) ?
+				    fakep->nkeys * 2 : WD_PAGE_SLOTS;
+				char **keys = fluffy_realloc(fakep->keys,
+						nkeys * sizeof(char *));
+				if (keys == NULL) {
+					reterr = ENOMEM;
+					break;
+				}
+				memset(keys + fakep->nkeys, 0,
+				    (nkeys - fakep->nkeys) * sizeof(char *));
+				fakep->keys = keys;
+				fakep->nkeys = nkeys;
+			}
+
+			char *keydup = fluffy_strdup(key);
+			if (keydup == NULL || fluffy_str_table_replace(
+			    fakep->key_table, key,
+			    (void *)(intptr_t)(fakep->nwd + 1))) {
+				fluffy_free(keydup);
+				reterr = ENOMEM;
+				break;
+			}
+			wd = ++(fakep->nwd);
+			fakep->keys[wd] = keydup;
+		}
+
+		if (fluffy_str_table_replace(fakep->path_table, path,
+		    (void *)(intptr_t)wd)) {
+			/* Only injections by this path go amiss */
+		}
+	} while (0);
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	if (reterr) {
+		errno = reterr;
+		return -1;
+	}
+	return wd;
+}
+
+/*
+ * Function:	fluffy_fake_rm_watch
+ *
+ * rm_watch_fn of fluffy_fake_backend; IN_IGNORED is queued for the watch
+ */
+static int
+fluffy_fake_rm_watch(int fd, int wd)
+{
+	int reterr = 0;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	do {
+		struct fluffy_fake *fakep = fluffy_fake_lookup(fd);
+		if (fakep == NULL) {
+			reterr = EBADF;
+			break;
+		}
+		if (wd <= 0 || wd > fakep->nwd || fakep->keys[wd] == NULL) {
+			reterr = EINVAL;
+			break;
+		}
+
+		fluffy_str_table_remove(fakep->key_table, fakep->keys[wd]);
+		fluffy_free(fakep->keys[wd]);
+		fakep->keys[wd] = NULL;
+		reterr = fluffy_fake_queue(fakep, wd, IN_IGNORED, 0, NULL);
+	} while (0);
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	if (reterr) {
+		errno = reterr;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_fake_read
+ *
+ * read_fn of fluffy_fake_backend; as many whole events as fit, EAGAIN if
+ * none is queued.
+ */
+static ssize_t
+fluffy_fake_read(int fd, void *buf, size_t len)
+{
+	ssize_t nrbytes = -1;
+	int reterr = 0;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	do {
+		struct fluffy_fake *fakep = fluffy_fake_lookup(fd);
+		if (fakep == NULL) {
+			reterr = EBADF;
+			break;
+		}
+
+		size_t n = 0;
+		while (fakep->head + n < fakep->len) {
+			struct inotify_event ie;
+			memcpy(&ie, fakep->buf + fakep->head + n, sizeof(ie));
+			size_t evlen = sizeof(struct inotify_event) + ie.len;
+			if (n + evlen > len) {
+				break;
+			}
+			if (ie.mask & IN_Q_OVERFLOW) {
+				fakep->is_overflow = 0;
+			}
+			(fakep->nqueued)--;
+			n += evlen;
+		}
+		if (n == 0) {
+			reterr = (fakep->head < fakep->len) ? EINVAL : EAGAIN;
+			break;
+		}
+
+		memcpy(buf, fakep->buf + fakep->head, n);
+		fakep->head += n;
+		nrbytes = n;
+		if (fakep->head == fakep->len) {
+			uint64_t nwake = 0;
+			fakep->head = 0;
+			fakep->len = 0;
+			fakep->last = SIZE_MAX;
+			if (read(fakep->fd, &nwake, sizeof(nwake)) == -1 &&
+			    errno != EAGAIN) {
+				perror("read");
+			}
+		}
+	} while (0);
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	if (reterr) {
+		errno = reterr;
+		return -1;
+	}
+	return nrbytes;
+}
+
+/*
+ * Function:	fluffy_fake_nread
+ *
+ * nread_fn of fluffy_fake_backend, bytes queued on an instance
+ */
+static int
+fluffy_fake_nread(int fd, int *nbytesp)
+{
+	int reterr = 0;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct fluffy_fake *fakep = fluffy_fake_lookup(fd);
+	if (fakep == NULL) {
+		reterr = EBADF;
+	} else {
+		*nbytesp = (int)(fakep->len - fakep->head);
+	}
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	if (reterr) {
+		errno = reterr;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_fake_close
+ *
+ * close_fn of fluffy_fake_backend, the instance is freed
+ */
+static int
+fluffy_fake_close(int fd)
+{
+	struct fluffy_fake *fakep = NULL;
+	if (pthread_mutex_lock(&fluffy_track.fake_mutex) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct fluffy_fake **nextp = &fluffy_track.fakes;
+	while (*nextp != NULL && (*nextp)->fd != fd) {
+		nextp = &(*nextp)->next;
+	}
+	if (*nextp != NULL) {
+		fakep = *nextp;
+		*nextp = fakep->next;
+	}
+	pthread_mutex_unlock(&fluffy_track.fake_mutex);
+
+	if (fakep == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+
+	int j;
+	for (j = 1; j <= fakep->nwd; j++) {
+		fluffy_free(fakep->keys[j]);
+	}
+	fluffy_free(fakep->keys);
+	fluffy_str_table_free(fakep->key_table);
+	fluffy_str_table_free(fakep->path_table);
+	fluffy_free(fakep->buf);
+	fluffy_free(fakep);
+	return close(fd);
+}
+
+/*
+ * Function:	fluffy_shard_root_new
+ *
+ * A root record of a sharded context, with a copy of the options the root
+ * path was added with; the client's excludes needn't outlive the call.
+ *
+ * args:
+ * 	- const char *: root path, resolved
+ * 	- const struct fluffy_root_options *: options it's added with
+ * return:
+ * 	- A pointer to fluffy_shard_root, NULL if out of memory
+ */
+static struct fluffy_shard_root *
+fluffy_shard_root_new(const char *path,
+    const struct fluffy_root_options *rootopts)
+{
+	size_t len = strlen(path);
+	struct fluffy_shard_root *rootp;
+	rootp = fluffy_calloc(1, sizeof(struct fluffy_shard_root) + len + 1);
+	if (rootp == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	memcpy(rootp->path, path, len + 1);
+	rootp->len = len;
+	rootp->opts = *rootopts;
+	rootp->opts.excludes = NULL;
+	rootp->opts.nexcludes = 0;
+
+	if (rootopts->excludes == NULL || rootopts->nexcludes == 0) {
+		return rootp;
+	}
+
+	rootp->excls = fluffy_calloc(rootopts->nexcludes,
+			   sizeof(struct fluffy_exclude));
+	if (rootp->excls == NULL) {
+		perror("calloc");
+		fluffy_free(rootp);
+		return NULL;
+	}
+	rootp->opts.excludes = rootp->excls;
+
+	unsigned int j;
+	for (j = 0; j < rootopts->nexcludes; j++) {
+		const char *pattern = rootopts->excludes[j].pattern;
+		rootp->excls[j].type = rootopts->excludes[j].type;
+		/* A NULL pattern is passed on, it's refused by the shard */
+		if (pattern != NULL) {
+			rootp->excls[j].pattern = fluffy_strdup(pattern);
+			if (rootp->excls[j].pattern == NULL) {
+				fluffy_shard_root_free(rootp);
+				return NULL;
+			}
+		}
+		rootp->opts.nexcludes = j + 1;
+	}
+	return rootp;
+}
+
+/*
+ * Function:	fluffy_shard_root_free
+ *
+ * Free a fluffy_shard_root; free_fn of fluffy_context_info.shard_table
+ */
+static void
+fluffy_shard_root_free(void *root)
+{
+	struct fluffy_shard_root *rootp = root;
+	if (rootp == NULL) {
+		return;
+	}
+
+	unsigned int j;
+	for (j = 0; j < rootp->opts.nexcludes; j++) {
+		fluffy_free((void *)rootp->excls[j].pattern);
+	}
+	fluffy_free(rootp->excls);
+	fluffy_free(rootp);
+}
+
+/*
+ * Function:	fluffy_shard_root_lookup
+ *
+ * Find the root record of a path of a sharded context, the nearest root
+ * path that's the path itself or above it. The mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: sharded context
+ * 	- const char *: path
+ * return:
+ * 	- A pointer to fluffy_shard_root, NULL if the path is under none
+ */
+static struct fluffy_shard_root *
+fluffy_shard_root_lookup(struct fluffy_context_info *ctxinfop,
+    const char *path)
+{
+	char buf[PATH_MAX];
+	size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(buf)) {
+		return NULL;
+	}
+	memcpy(buf, path, len + 1);
+
+	while (1) {
+		void *value = NULL;
+		if (fluffy_str_table_lookup(ctxinfop->shard_table, buf,
+		    &value)) {
+			return value;
+		}
+
+		/* Up a component, up to "/" */
+		char *slash = strrchr(buf, '/');
+		if (slash == NULL || strcmp(buf, "/") == 0) {
+			break;
+		}
+		if (slash == buf) {
+			slash[1] = '\0';
+		} else {
+			slash[0] = '\0';
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function:	fluffy_shard_root_of
+ *
+ * fluffy_shard_root_lookup() for an event read on a shard. Events come in
+ * runs off the same root, the root of the last one is tried first. The
+ * mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: sharded context
+ * 	- struct fluffy_shard *: shard the event was read on
+ * 	- const char *: event path
+ * return:
+ * 	- A pointer to fluffy_shard_root, NULL if the path is under none
+ */
+static struct fluffy_shard_root *
+fluffy_shard_root_of(struct fluffy_context_info *ctxinfop,
+    struct fluffy_shard *shardp, const char *path)
+{
+	struct fluffy_shard_root *rootp = shardp->last;
+	if (rootp != NULL && strncmp(path, rootp->path, rootp->len) == 0 &&
+	    (path[rootp->len] == '\0' || path[rootp->len] == '/' ||
+	    rootp->len == 1)) {
+		return rootp;
+	}
+
+	rootp = fluffy_shard_root_lookup(ctxinfop, path);
+	if (rootp != NULL) {
+		shardp->last = rootp;
+	}
+	return rootp;
+}
+
+/*
+ * Function:	fluffy_shard_forget_root
+ *
+ * Drop the record of a root path that's no longer watched. The mutex must
+ * be held.
+ */
+static void
+fluffy_shard_forget_root(struct fluffy_context_info *ctxinfop,
+    struct fluffy_shard_root *rootp)
+{
+	unsigned int j;
+	for (j = 0; j < ctxinfop->nshards; j++) {
+		if (ctxinfop->shards[j].last == rootp) {
+			ctxinfop->shards[j].last = NULL;
+		}
+	}
+	(ctxinfop->shards[rootp->shard].nroots)--;
+	fluffy_str_table_remove(ctxinfop->shard_table, rootp->path);
+}
+
+/*
+ * Struct:	fluffy_shard_collect
+ *
+ * Argument of collect_each_shard_root
+ */
+struct fluffy_shard_collect {
+	unsigned int	shard;		/* Index of the shard */
+	struct fluffy_path_list list;	/* Its root paths */
+};
+
+/*
+ * Function:	collect_each_shard_root
+ *
+ * str table foreach callback, append a copy of the root path to a
+ * fluffy_path_list if it's on the shard
+ */
+static void
+collect_each_shard_root(const char *path, void *value, void *collect)
+{
+	struct fluffy_shard_collect *collectp = collect;
+	const struct fluffy_shard_root *rootp = value;
+	if (rootp->shard == collectp->shard) {
+		fluffy_path_list_add(&collectp->list, path);
+	}
+}
+
+/*
+ * Function:	fluffy_shard_forget_shard
+ *
+ * Drop the records of the root paths of a shard that watches none. The
+ * mutex must be held.
+ */
+static void
+fluffy_shard_forget_shard(struct fluffy_context_info *ctxinfop,
+    unsigned int shard)
+{
+	struct fluffy_shard_collect collect = {0};
+	collect.shard = shard;
+	fluffy_str_table_foreach(ctxinfop->shard_table,
+	    collect_each_shard_root, &collect);
+
+	size_t j;
+	for (j = 0; j < collect.list.len; j++) {
+		void *value = NULL;
+		if (fluffy_str_table_lookup(ctxinfop->shard_table,
+		    collect.list.paths[j], &value)) {
+			fluffy_shard_forget_root(ctxinfop, value);
+		}
+	}
+	fluffy_path_list_clear(&collect.list);
+}
+
+/*
+ * Function:	fluffy_shard_event_fn
+ *
+ * user_event_fn of a shard. Queues the event on the sharded context, to be
+ * handed off by its thread; waits a while for the thread to catch up if
+ * it's far behind. Events of a root path being moved are reported by the
+ * shard it's placed on alone.
+ *
+ * args:
+ * 	- const struct fluffy_event_info *: the event, as for the client
+ * 	- void *: pointer of the fluffy_shard
+ * return:
+ * 	- int: 0 to go on, -1 to end the shard
+ */
+static int
+fluffy_shard_event_fn(const struct fluffy_event_info *eventinfo,
+    void *shard)
+{
+	struct fluffy_shard *shardp = shard;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(shardp->parent);
+	if (ctxinfop == NULL) {
+		return -1;	/* Goes along with the sharded context */
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	int reterr = 0;
+	struct fluffy_shard_move *movep = NULL;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		if (ctxinfop->pending_queue.length >= SHARD_QUEUE_MAX) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += SHARD_WAIT_MS * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+
+			/* A cancellation point, the mutex is held again */
+			while (ctxinfop->pending_queue.length >=
+			    SHARD_QUEUE_MAX) {
+				if (pthread_cond_timedwait(
+				    &ctxinfop->shard_cond, &ctxinfop->mutex,
+				    &ts)) {
+					break;
+				}
+			}
+		}
+
+		uint32_t mask = eventinfo->event_mask & ~FLUFFY_WATCH_EMPTY;
+		struct fluffy_shard_root *rootp = NULL;
+		if (eventinfo->path != NULL) {
+			rootp = fluffy_shard_root_of(ctxinfop, shardp,
+				    eventinfo->path);
+		}
+		if (rootp != NULL && rootp->shard != shardp->index) {
+			break;		/* Moved here, or away, meanwhile */
+		}
+
+		if (rootp != NULL) {
+			(rootp->nevents)++;
+			if ((mask & FLUFFY_ROOT_IGNORED) &&
+			    strcmp(eventinfo->path, rootp->path) == 0) {
+				fluffy_shard_forget_root(ctxinfop, rootp);
+			}
+		}
+
+		/* Empty once every shard is; nested roots went along */
+		if (eventinfo->event_mask & FLUFFY_WATCH_EMPTY) {
+			fluffy_shard_forget_shard(ctxinfop, shardp->index);
+			if (ctxinfop->shard_table->nused == 0) {
+				mask |= FLUFFY_WATCH_EMPTY;
+			}
+		}
+
+		reterr = fluffy_queue_pending_event(ctxinfop, mask,
+			     (eventinfo->path != NULL) ? eventinfo->path : "");
+		if (reterr) {
+			break;
+		}
+		ctxinfop->pending_queue.tail->shard = shardp->index + 1;
+		ctxinfop->pending_queue.tail->seq = ++(shardp->seq);
+
+		movep = fluffy_shard_pick_move(ctxinfop);
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	if (movep != NULL) {
+		pthread_t tid;
+		pthread_attr_t attr;
+		int is_started = 0;
+		if (pthread_attr_init(&attr) == 0) {
+			pthread_attr_setdetachstate(&attr,
+			    PTHREAD_CREATE_DETACHED);
+			is_started = (pthread_create(&tid, &attr,
+					  fluffy_start_shard_move_thread,
+					  movep) == 0);
+			pthread_attr_destroy(&attr);
+		}
+		if (!is_started) {
+			/* No thread, it's moved right here */
+			fluffy_start_shard_move_thread(movep);
+		}
+	}
+
+	return reterr;
+}
+
+/*
+ * Struct:	fluffy_shard_rate
+ *
+ * Argument of rate_each_shard_root
+ */
+struct fluffy_shard_rate {
+	struct fluffy_context_info *ctxinfop;	/* Sharded context */
+	long long	elapsed_ms;	/* Since the events were counted */
+	unsigned long long rate;	/* Events a second of hotp */
+	struct fluffy_shard_root *hotp;	/* Hottest that may move, or NULL */
+	const struct fluffy_shard_root *nestp; /* Nested with it, or NULL */
+};
+
+/*
+ * Function:	rate_each_shard_root
+ *
+ * str table foreach callback, take the rate of a root path and start its
+ * count over. The hottest one at hot_rate, that shares its shard, is kept.
+ */
+static void
+rate_each_shard_root(const char *path, void *value, void *rate)
+{
+	struct fluffy_shard_rate *ratep = rate;
+	struct fluffy_shard_root *rootp = value;
+	struct fluffy_context_info *ctxinfop = ratep->ctxinfop;
+
+	unsigned long long nrate = rootp->nevents * 1000 /
+		(unsigned long long)ratep->elapsed_ms;
+	rootp->nevents = 0;
+	if (nrate < ctxinfop->hot_rate || nrate <= ratep->rate ||
+	    ctxinfop->shards[rootp->shard].nroots < 2) {
+		return;
+	}
+	ratep->rate = nrate;
+	ratep->hotp = rootp;
+}
+
+/*
+ * Function:	find_each_nested_root
+ *
+ * str table foreach callback, note a root path that's above or below the
+ * hot one; they're kept on the same shard.
+ */
+static void
+find_each_nested_root(const char *path, void *value, void *rate)
+{
+	struct fluffy_shard_rate *ratep = rate;
+	const struct fluffy_shard_root *rootp = value;
+	const struct fluffy_shard_root *hotp = ratep->hotp;
+	if (rootp == hotp) {
+		return;
+	}
+
+	const struct fluffy_shard_root *upp = hotp;
+	const struct fluffy_shard_root *downp = rootp;
+	if (rootp->len < hotp->len) {
+		upp = rootp;
+		downp = hotp;
+	}
+	if (strncmp(downp->path, upp->path, upp->len) == 0 &&
+	    (downp->path[upp->len] == '/' || upp->len == 1)) {
+		ratep->nestp = rootp;
+	}
+}
+
+/*
+ * Function:	fluffy_shard_pick_move
+ *
+ * Take the rates of the root paths once they're due, and pick the hottest
+ * one at hot_rate to be moved to a shard that has no root path. Nested
+ * root paths aren't moved. The mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: sharded context
+ * return:
+ * 	- A pointer to fluffy_shard_move to be carried out, NULL if none
+ */
+static struct fluffy_shard_move *
+fluffy_shard_pick_move(struct fluffy_context_info *ctxinfop)
+{
+	if (ctxinfop->hot_rate == 0) {
+		return NULL;
+	}
+
+	long long now_ms = fluffy_now_ms();
+	if (now_ms < ctxinfop->rate_due_ms) {
+		return NULL;
+	}
+
+	struct fluffy_shard_rate rate = {0};
+	rate.ctxinfop = ctxinfop;
+	rate.elapsed_ms = now_ms - ctxinfop->rate_from_ms;
+	if (rate.elapsed_ms < 1) {
+		rate.elapsed_ms = 1;
+	}
+	fluffy_str_table_foreach(ctxinfop->shard_table, rate_each_shard_root,
+	    &rate);
+	ctxinfop->rate_from_ms = now_ms;
+	ctxinfop->rate_due_ms = now_ms + SHARD_RATE_MS;
+	if (rate.hotp == NULL || ctxinfop->is_moving) {
+		return NULL;
+	}
+
+	fluffy_str_table_foreach(ctxinfop->shard_table, find_each_nested_root,
+	    &rate);
+	if (rate.nestp != NULL) {
+		return NULL;
+	}
+
+	unsigned int j;
+	for (j = 0; j < ctxinfop->nshards; j++) {
+		if (ctxinfop->shards[j].nroots == 0) {
+			break;
+		}
+	}
+	if (j == ctxinfop->nshards) {
+		return NULL;
+	}
+
+	struct fluffy_shard_move *movep;
+	movep = fluffy_calloc(1, sizeof(struct fluffy_shard_move));
+	if (movep == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	movep->rootp = fluffy_shard_root_new(rate.hotp->path,
+			   &rate.hotp->opts);
+	if (movep->rootp == NULL) {
+		fluffy_free(movep);
+		return NULL;
+	}
+	movep->handle = ctxinfop->handle;
+	movep->from = rate.hotp->shard;
+	movep->to = j;
+	movep->from_handle = ctxinfop->shards[movep->from].handle;
+	movep->to_handle = ctxinfop->shards[j].handle;
+
+	/* Taken, another root path added meanwhile goes elsewhere */
+	(ctxinfop->shards[j].nroots)++;
+	ctxinfop->is_moving = 1;
+	return movep;
+}
+
+/*
+ * Function:	fluffy_start_shard_move_thread
+ *
+ * Move a hot root path to the shard picked for it. It's added there first,
+ * then the shard it's on is switched over, then it's removed from the one
+ * it was on.
+ *
+ * args:
+ * 	- void *: pointer of fluffy_shard_move, freed here
+ * return:
+ * 	- void
+ */
+static void *
+fluffy_start_shard_move_thread(void *move)
+{
+	struct fluffy_shard_move *movep = move;
+	struct fluffy_shard_root *copyp = movep->rootp;
+
+	int reterr = 0;
+	reterr = fluffy_add_watch_path_opts(movep->to_handle, copyp->path,
+		     &copyp->opts);
+
+	int is_moved = 0;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(movep->handle);
+	if (ctxinfop != NULL && pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		/* It may have been removed meanwhile */
+		void *value = NULL;
+		if (reterr == 0 && ctxinfop->shard_table != NULL &&
+		    fluffy_str_table_lookup(ctxinfop->shard_table,
+		    copyp->path, &value) &&
+		    ((struct fluffy_shard_root *)value)->shard == movep->from) {
+			((struct fluffy_shard_root *)value)->shard = movep->to;
+			(ctxinfop->shards[movep->from].nroots)--;
+			is_moved = 1;
+		} else if (ctxinfop->shards != NULL) {
+			(ctxinfop->shards[movep->to].nroots)--;
+		}
+		ctxinfop->is_moving = 0;
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+
+	/* The shard it's not on reports nothing of it from now on */
+	if (is_moved) {
+		fluffy_remove_watch_path(movep->from_handle, copyp->path);
+	} else if (reterr == 0) {
+		fluffy_remove_watch_path(movep->to_handle, copyp->path);
+	}
+
+	fluffy_shard_root_free(copyp);
+	fluffy_free(movep);
+	return NULL;
+}
+
+/*
+ * Struct:	fluffy_shard_place
+ *
+ * Argument of place_each_shard_root
+ */
+struct fluffy_shard_place {
+	struct fluffy_shard_root *rootp;	/* Root path being added */
+	const struct fluffy_shard_root *nestp;	/* Root nested with it */
+};
+
+/*
+ * Function:	place_each_shard_root
+ *
+ * str table foreach callback, note a root path below the one being added
+ */
+static void
+place_each_shard_root(const char *path, void *value, void *place)
+{
+	struct fluffy_shard_place *placep = place;
+	const struct fluffy_shard_root *rootp = value;
+	const struct fluffy_shard_root *newp = placep->rootp;
+	if (rootp->len > newp->len &&
+	    strncmp(rootp->path, newp->path, newp->len) == 0 &&
+	    (rootp->path[newp->len] == '/' || newp->len == 1)) {
+		placep->nestp = rootp;
+	}
+}
+
+/*
+ * Function:	fluffy_shard_add
+ *
+ * Add a root path of a sharded context to its shard. It goes to the shard
+ * of a root path it's nested with, to the shard with the fewest root paths
+ * otherwise.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- const char *: path to add, as received from the client
+ * 	- const struct fluffy_root_options *: options it's added with
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_shard_add(int fluffy_handle, const char *pathtoadd,
+    const struct fluffy_root_options *rootopts)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	char rp[PATH_MAX];
+	if (realpath(pathtoadd, rp) == NULL) {
+		int reterr = errno;
+		perror("realpath");
+		return reterr;
+	}
+
+	struct fluffy_shard_place place = {0};
+	place.rootp = fluffy_shard_root_new(rp, rootopts);
+	if (place.rootp == NULL) {
+		return ENOMEM;
+	}
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_shard_root_free(place.rootp);
+		return -1;
+	}
+
+	int reterr = 0;
+	int handle = -1;
+	int is_new = 1;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		unsigned int j, idx = 0;
+		struct fluffy_shard_root *oldp;
+		oldp = fluffy_shard_root_lookup(ctxinfop, rp);
+		if (oldp == NULL) {
+			fluffy_str_table_foreach(ctxinfop->shard_table,
+			    place_each_shard_root, &place);
+		}
+
+		if (oldp != NULL) {
+			idx = oldp->shard;
+		} else if (place.nestp != NULL) {
+			idx = place.nestp->shard;
+		} else {
+			for (j = 1; j < ctxinfop->nshards; j++) {
+				if (ctxinfop->shards[j].nroots <
+				    ctxinfop->shards[idx].nroots) {
+					idx = j;
+				}
+			}
+		}
+		handle = ctxinfop->shards[idx].handle;
+
+		/* Added again, the options are those it's added with now */
+		if (oldp != NULL && strcmp(oldp->path, rp) == 0) {
+			is_new = 0;
+			place.rootp->nevents = oldp->nevents;
+			fluffy_shard_forget_root(ctxinfop, oldp);
+		}
+		place.rootp->shard = idx;
+		if (fluffy_str_table_replace(ctxinfop->shard_table, rp,
+		    place.rootp)) {
+			fluffy_shard_root_free(place.rootp);
+			reterr = ENOMEM;
+			break;
+		}
+		(ctxinfop->shards[idx].nroots)++;
+	} while (0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	if (reterr) {
+		return reterr;
+	}
+
+	reterr = fluffy_add_watch_path_opts(handle, rp, rootopts);
+	if (reterr == 0) {
+		return 0;
+	}
+
+	/* Not added; the record goes, unless it was there before */
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		void *value = NULL;
+		if (is_new && fluffy_str_table_lookup(ctxinfop->shard_table,
+		    rp, &value) && value == place.rootp) {
+			fluffy_shard_forget_root(ctxinfop, place.rootp);
+		}
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_shard_remove
+ *
+ * Remove a path of a sharded context from the shard its root path is on.
+ * The root record goes once the shard reports it's no longer watched.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * 	- const char *: path to remove
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_shard_remove(int fluffy_handle, const char *pathtoremove)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
 		return -1;
 	}
 
-	fd = open("/proc/sys/fs/inotify/max_queued_events",
-		O_WRONLY | O_TRUNC | O_CLOEXEC);
-	if (fd == -1) {
+	int handle = -1;
+	if (pthread_mutex_lock(&ctxinfop->mutex) != 0) {
 		return -1;
 	}
+	struct fluffy_shard_root *rootp;
+	rootp = fluffy_shard_root_lookup(ctxinfop, pathtoremove);
+	if (rootp != NULL) {
+		handle = ctxinfop->shards[rootp->shard].handle;
+	}
+	pthread_mutex_unlock(&ctxinfop->mutex);
 
-	wrbytes = write(fd, maxvalp, strlen(maxvalp));
-	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
-		close(fd);
+	if (handle == -1) {
+		PRINT_STDERR("Could not lookup path %s\n", pathtoremove);
+		return -1;
+	}
+	return fluffy_remove_watch_path(handle, pathtoremove);
+}
+
+/*
+ * Function:	fluffy_shard_destroy_all
+ *
+ * Destroy the shards of a sharded context and join their threads. Called
+ * by its context thread as it ends, without the mutex; a shard may be
+ * waiting on it.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: sharded context
+ * return:
+ * 	- void
+ */
+static void
+fluffy_shard_destroy_all(struct fluffy_context_info *ctxinfop)
+{
+	unsigned int nshards = __atomic_load_n(&ctxinfop->nshards,
+				   __ATOMIC_ACQUIRE);
+	if (nshards == 0) {
+		return;
+	}
+
+	/* A shard that ends takes the sharded context along, not now */
+	__atomic_store_n(&ctxinfop->is_ending, 1, __ATOMIC_RELEASE);
+
+	unsigned int j;
+	for (j = 0; j < nshards; j++) {
+		if (pthread_cancel(ctxinfop->shards[j].tid)) {
+			/* Ended already, it's joined all the same */
+		}
+	}
+	for (j = 0; j < nshards; j++) {
+		if (pthread_join(ctxinfop->shards[j].tid, NULL)) {
+			/* nothing? */
+		}
+	}
+
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		__atomic_store_n(&ctxinfop->nshards, 0, __ATOMIC_RELEASE);
+		fluffy_str_table_free(ctxinfop->shard_table);
+		ctxinfop->shard_table = NULL;
+		fluffy_free(ctxinfop->shards);
+		ctxinfop->shards = NULL;
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+}
+
+/*
+ * Function:	fluffy_now_ms
+ *
+ * Milliseconds of CLOCK_MONOTONIC, what the poll times are kept in
+ */
+static long long
+fluffy_now_ms()
+{
+	struct timespec ts = {0};
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		perror("clock_gettime");
+	}
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function:	fluffy_now_us
+ *
+ * Microseconds of CLOCK_MONOTONIC, what callbacks are timed in
+ */
+static long long
+fluffy_now_us()
+{
+	struct timespec ts = {0};
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		perror("clock_gettime");
+	}
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Function:	fluffy_budget_room
+ *
+ * Watches left in the budget; of max_watches, or of the watches inotify
+ * allowed before it failed with ENOSPC. Watches being demoted don't count.
+ * The context mutex must be held.
+ *
+ * return:
+ * 	- unsigned long long: watches that may be set, ULLONG_MAX if there's
+ * 	  no telling
+ */
+static unsigned long long
+fluffy_budget_room(struct fluffy_context_info *ctxinfop)
+{
+	unsigned int limit = ctxinfop->budget.max_watches;
+	if (limit == 0 ||
+	    (ctxinfop->nwatch_limit != 0 && ctxinfop->nwatch_limit < limit)) {
+		limit = ctxinfop->nwatch_limit;
+	}
+	if (limit == 0) {
+		return ULLONG_MAX;
+	}
+
+	unsigned long long nwd = ctxinfop->nwd;
+	nwd -= (ctxinfop->ndemoting < nwd) ? ctxinfop->ndemoting : nwd;
+	return (nwd >= limit) ? 0 : limit - nwd;
+}
+
+/*
+ * Function:	fluffy_poll_parent
+ *
+ * Look up the polled directory an entry met on a walk is in. The context
+ * mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * 	- const char *: path of the entry
+ * 	- int: offset of its name in the path, FTW.base
+ * return:
+ * 	- A pointer to fluffy_poll_dir, NULL if the directory isn't polled
+ */
+static struct fluffy_poll_dir *
+fluffy_poll_parent(struct fluffy_context_info *ctxinfop, const char *pathname,
+    int base)
+{
+	char dirpath[PATH_MAX];
+	size_t len = (base > 1) ? (size_t)base - 1 : 1;
+	if (base <= 0 || len >= sizeof(dirpath)) {
+		return NULL;
+	}
+	memcpy(dirpath, pathname, len);
+	dirpath[len] = '\0';
+
+	struct fluffy_poll_dir *pollp = NULL;
+	if (!fluffy_str_table_lookup(ctxinfop->poll_table, dirpath,
+	    (void **)&pollp)) {
+		return NULL;
+	}
+	return pollp;
+}
+
+/*
+ * Function:	fluffy_poll_walk_entry
+ *
+ * Note an entry met on a walk in the snapshot of its directory, if it's
+ * polled. Only a directory polled since the walk began is walked through;
+ * the snapshot is its first. The context mutex must be held.
+ */
+static void
+fluffy_poll_walk_entry(struct fluffy_context_info *ctxinfop,
+    const char *pathname, int base, const struct stat *sbuf)
+{
+	struct fluffy_poll_dir *pollp;
+	pollp = fluffy_poll_parent(ctxinfop, pathname, base);
+	if (pollp == NULL || pollp->snap == NULL) {
+		return;
+	}
+
+	if (fluffy_snap_set(ctxinfop, &pollp->snap, pathname + base,
+	    S_ISDIR(sbuf->st_mode), sbuf->st_ino, fluffy_snap_stamp(sbuf))) {
+		/* Forget the lot, the next poll takes a baseline */
+		fluffy_snap_free(ctxinfop, pollp->snap);
+		pollp->snap = NULL;
+	}
+}
+
+/*
+ * Function:	fluffy_poll_add
+ *
+ * Poll a directory rather than watch it. The snapshot, not yet counted in
+ * snapshot_bytes, is taken over; NULL for one to be taken at the first
+ * poll. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * 	- const char *: path of the directory
+ * 	- const struct stat *: its stat, as of the snapshot
+ * 	- struct fluffy_dir_snap *: its entries, or NULL
+ * 	- struct fluffy_root_info *: its FLUFFY_ROOT_POLL root, NULL if it's
+ * 	  past the watch budget
+ * return:
+ * 	- int: 0 when successful, -1 otherwise
+ */
+static int
+fluffy_poll_add(struct fluffy_context_info *ctxinfop, const char *path,
+    const struct stat *sbuf, struct fluffy_dir_snap *snap,
+    struct fluffy_root_info *rootinfop)
+{
+	/* Its old snapshot isn't to be left uncounted */
+	fluffy_poll_remove(ctxinfop, path);
+
+	struct fluffy_poll_dir *pollp;
+	pollp = fluffy_calloc(1, sizeof(struct fluffy_poll_dir));
+	if (pollp == NULL) {
+		perror("calloc");
+		fluffy_snap_free(NULL, snap);
+		return -1;
+	}
+
+	pollp->mtime = sbuf->st_mtim;
+	pollp->ino = sbuf->st_ino;
+	pollp->interval_ms = (rootinfop != NULL) ? rootinfop->poll_min_ms :
+	    ctxinfop->budget.poll_min_ms;
+	pollp->due_ms = fluffy_now_ms() + pollp->interval_ms;
+	if (fluffy_str_table_replace(ctxinfop->poll_table, path, pollp)) {
+		fluffy_snap_free(NULL, snap);
+		fluffy_free(pollp);
+		return -1;
+	}
+
+	if (rootinfop != NULL) {
+		(rootinfop->nref)++;
+		pollp->rootinfop = rootinfop;
+	}
+
+	if (snap != NULL) {
+		ctxinfop->snapshot_bytes += fluffy_snap_size(snap);
+		pollp->snap = snap;
+	}
+	if (pollp->due_ms < ctxinfop->poll_due_ms) {
+		ctxinfop->poll_due_ms = pollp->due_ms;
+	}
+	__atomic_store_n(&ctxinfop->npolled, ctxinfop->poll_table->nused,
+	    __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Function:	fluffy_poll_remove
+ *
+ * Stop polling a directory. The context mutex must be held.
+ */
+static void
+fluffy_poll_remove(struct fluffy_context_info *ctxinfop, const char *path)
+{
+	struct fluffy_poll_dir *pollp = NULL;
+	if (!fluffy_str_table_lookup(ctxinfop->poll_table, path,
+	    (void **)&pollp)) {
+		return;
+	}
+
+	fluffy_snap_free(ctxinfop, pollp->snap);
+	pollp->snap = NULL;
+	fluffy_root_info_unref(pollp->rootinfop);
+	pollp->rootinfop = NULL;
+	fluffy_str_table_remove(ctxinfop->poll_table, path);
+	__atomic_store_n(&ctxinfop->npolled, ctxinfop->poll_table->nused,
+	    __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:	free_each_poll_snap
+ *
+ * str table foreach callback, free the snapshot of a polled directory and
+ * let go of its root
+ */
+static void
+free_each_poll_snap(const char *path, void *value, void *ctxinfo)
+{
+	struct fluffy_poll_dir *pollp = value;
+	fluffy_snap_free(ctxinfo, pollp->snap);
+	pollp->snap = NULL;
+	fluffy_root_info_unref(pollp->rootinfop);
+	pollp->rootinfop = NULL;
+}
+
+/*
+ * Function:	fluffy_poll_remove_all
+ *
+ * Stop polling every directory. The context mutex must be held.
+ */
+static void
+fluffy_poll_remove_all(struct fluffy_context_info *ctxinfop)
+{
+	if (ctxinfop->poll_table == NULL) {
+		return;
+	}
+
+	fluffy_str_table_foreach(ctxinfop->poll_table, free_each_poll_snap,
+	    ctxinfop);
+	fluffy_str_table_remove_all(ctxinfop->poll_table);
+	__atomic_store_n(&ctxinfop->npolled, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:	collect_each_budget_poll
+ *
+ * str table foreach callback, append the path of a directory polled past
+ * the watch budget to a fluffy_path_list.
+ */
+static void
+collect_each_budget_poll(const char *path, void *value, void *pathlist)
+{
+	struct fluffy_poll_dir *pollp = value;
+	if (pollp->rootinfop == NULL) {
+		fluffy_path_list_add(pathlist, path);
+	}
+}
+
+/*
+ * Function:	fluffy_poll_remove_budget
+ *
+ * Stop polling the directories polled past the watch budget; those of
+ * FLUFFY_ROOT_POLL roots are polled on. The context mutex must be held.
+ */
+static void
+fluffy_poll_remove_budget(struct fluffy_context_info *ctxinfop)
+{
+	if (ctxinfop->poll_table == NULL || ctxinfop->npolled == 0) {
+		return;
+	}
+
+	struct fluffy_path_list budget = {0};
+	fluffy_str_table_foreach(ctxinfop->poll_table,
+	    collect_each_budget_poll, &budget);
+
+	size_t j;
+	for (j = 0; j < budget.len; j++) {
+		fluffy_poll_remove(ctxinfop, budget.paths[j]);
+	}
+	fluffy_path_list_clear(&budget);
+}
+
+/*
+ * Function:	collect_each_poll_below
+ *
+ * str table foreach callback, append the path of a polled directory to a
+ * fluffy_path_prefix list if it's the directory or below it.
+ */
+static void
+collect_each_poll_below(const char *path, void *value, void *prefix)
+{
+	struct fluffy_path_prefix *pfxp = prefix;
+	if (strncmp(path, pfxp->path, pfxp->len) == 0 &&
+	    (path[pfxp->len] == '\0' || path[pfxp->len] == '/' ||
+	    pfxp->path[pfxp->len - 1] == '/')) {
+		fluffy_path_list_add(pfxp->listp, path);
+	}
+}
+
+/*
+ * Function:	fluffy_poll_remove_subtree
+ *
+ * Stop polling a directory and all below it. The context mutex must be
+ * held.
+ */
+static void
+fluffy_poll_remove_subtree(struct fluffy_context_info *ctxinfop,
+    const char *path)
+{
+	if (ctxinfop->npolled == 0 || path[0] == '\0') {
+		return;
+	}
+
+	struct fluffy_path_list below = {0};
+	struct fluffy_path_prefix pfx = {0};
+	pfx.path = path;
+	pfx.len = strlen(path);
+	pfx.listp = &below;
+	fluffy_str_table_foreach(ctxinfop->poll_table,
+	    collect_each_poll_below, &pfx);
+
+	size_t j;
+	for (j = 0; j < below.len; j++) {
+		fluffy_poll_remove(ctxinfop, below.paths[j]);
+	}
+	fluffy_path_list_clear(&below);
+}
+
+/*
+ * Function:	fluffy_poll_remove_root
+ *
+ * Remove a FLUFFY_ROOT_POLL root path, and stop polling its directories.
+ * FLUFFY_IGNORED is queued for it, after self_mask if that's set, as
+ * inotify would report. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * 	- const char *: root path to remove
+ * 	- uint32_t: FLUFFY_ROOT_DELETE if it's gone, 0 otherwise
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_poll_remove_root(struct fluffy_context_info *ctxinfop,
+    const char *path, uint32_t self_mask)
+{
+	uint32_t mask = IN_IGNORED | FLUFFY_ROOT_IGNORED;
+	if (ctxinfop->root_path_table->nused == 1) {
+		mask |= FLUFFY_WATCH_EMPTY;
+	}
+
+	int reterr = 0;
+	if (self_mask) {
+		reterr = fluffy_queue_pending_event(ctxinfop, self_mask, path);
+	}
+	if (reterr == 0) {
+		reterr = fluffy_queue_pending_event(ctxinfop, mask, path);
+	}
+
+	fluffy_poll_remove_subtree(ctxinfop, path);
+	fluffy_str_table_remove(ctxinfop->root_path_table, path);
+	fluffy_sync_root(ctxinfop, path);
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_poll_interval
+ *
+ * Set when a directory is polled next. The interval is back to the least
+ * if it's active, it doubles otherwise; within the bounds of its root, or
+ * of the watch budget. The context mutex must be held.
+ */
+static void
+fluffy_poll_interval(struct fluffy_context_info *ctxinfop,
+    struct fluffy_poll_dir *pollp, long long now_ms, int is_active)
+{
+	unsigned int min_ms = ctxinfop->budget.poll_min_ms;
+	unsigned int max_ms = ctxinfop->budget.poll_max_ms;
+	if (pollp->rootinfop != NULL) {
+		min_ms = pollp->rootinfop->poll_min_ms;
+		max_ms = pollp->rootinfop->poll_max_ms;
+	}
+
+	unsigned int interval_ms = pollp->interval_ms * 2;
+	if (is_active) {
+		interval_ms = min_ms;
+	} else if (interval_ms > max_ms || interval_ms < pollp->interval_ms) {
+		interval_ms = max_ms;
+	}
+	pollp->interval_ms = interval_ms;
+	pollp->due_ms = now_ms + interval_ms;
+	if (pollp->due_ms < ctxinfop->poll_due_ms) {
+		ctxinfop->poll_due_ms = pollp->due_ms;
+	}
+}
+
+/*
+ * Function:	fluffy_poll_timeout
+ *
+ * Milliseconds till the next poll pass, an epoll_wait() timeout
+ *
+ * return:
+ * 	- int: the timeout, 0 if a pass is due, -1 if nothing is polled
+ */
+static int
+fluffy_poll_timeout(struct fluffy_context_info *ctxinfop)
+{
+	if (__atomic_load_n(&ctxinfop->npolled, __ATOMIC_ACQUIRE) == 0) {
+		return -1;
+	}
+
+	long long due_ms = 0;
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		due_ms = ctxinfop->poll_due_ms;
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+
+	long long now_ms = fluffy_now_ms();
+	if (due_ms <= now_ms) {
+		return 0;
+	}
+	return (due_ms - now_ms > INT_MAX) ? INT_MAX : (int)(due_ms - now_ms);
+}
+
+/*
+ * Function:	collect_each_due_dir
+ *
+ * str table foreach callback, append the path of a polled directory to a
+ * fluffy_poll_pass if it's due, note how soon it is otherwise.
+ */
+static void
+collect_each_due_dir(const char *path, void *value, void *pass)
+{
+	struct fluffy_poll_dir *pollp = value;
+	struct fluffy_poll_pass *passp = pass;
+	if (pollp->due_ms <= passp->now_ms) {
+		fluffy_path_list_add(&passp->due, path);
+	} else if (pollp->due_ms < passp->next_ms) {
+		passp->next_ms = pollp->due_ms;
+	}
+}
+
+/*
+ * Function:	fluffy_poll_dirs
+ *
+ * Poll the directories that are due, report what changed in them and
+ * promote the ones past the budget that did to watches, so far as the
+ * budget goes. The directories are stat'd and listed by a few threads at
+ * once, off the context mutex; a network mount may take a while to
+ * answer. Called by the context thread between batches of events.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful or nothing is due, error value otherwise
+ */
+static int
+fluffy_poll_dirs(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
 		return -1;
 	}
 
-	if (close(fd) != 0) {
-		return -1;
-	}
+	struct fluffy_poll_pass pass = {0};
+	struct fluffy_poll_scan scan = {0};
+	pass.now_ms = fluffy_now_ms();
 
-	/* Reinitialize all fluffy context to pick up the newly set value */
-	/*
-	if(fluffy_reinitiate_all_contexts()) {
+	int reterr = 0;
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
 		return -1;
 	}
-	*/
 
-	return 0;
-}
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	do {
+		if (pass.now_ms < ctxinfop->poll_due_ms) {
+			break;
+		}
 
-/*
- * fluffy.h contains this function description
- */
-int
-fluffy_set_max_user_instances(const char *maxvalp)
-{
-	int fd = -1;
-	ssize_t wrbytes;
+		/* Each one polled sets the next pass no later than it's due */
+		(ctxinfop->budget_pass)++;
+		pass.next_ms = LLONG_MAX;
+		fluffy_str_table_foreach(ctxinfop->poll_table,
+		    collect_each_due_dir, &pass);
+		ctxinfop->poll_due_ms = pass.next_ms;
+		if (pass.due.len == 0) {
+			break;
+		}
 
-	if (maxvalp == NULL) {
-		return -1;
-	}
+		scan.items = fluffy_calloc(pass.due.len,
+				sizeof(struct fluffy_poll_item));
+		if (scan.items == NULL) {
+			perror("calloc");
+			reterr = ENOMEM;
+			break;
+		}
+		scan.nitems = pass.due.len;
+
+		/* What its last listing was, to be compared with */
+		size_t j;
+		for (j = 0; j < scan.nitems; j++) {
+			struct fluffy_poll_item *itemp = &scan.items[j];
+			struct fluffy_poll_dir *pollp = NULL;
+			itemp->path = pass.due.paths[j];
+			if (!fluffy_str_table_lookup(ctxinfop->poll_table,
+			    itemp->path, (void **)&pollp)) {
+				continue;
+			}
+			itemp->mtime = pollp->mtime;
+			itemp->ino = pollp->ino;
+			itemp->is_entries = (pollp->rootinfop != NULL);
+			itemp->is_known = (pollp->snap != NULL);
+		}
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
 
-	fd = open("/proc/sys/fs/inotify/max_user_instances",
-		O_WRONLY | O_TRUNC | O_CLOEXEC);
-	if (fd == -1) {
-		return -1;
+	if (reterr || scan.nitems == 0) {
+		fluffy_path_list_clear(&pass.due);
+		return reterr;
 	}
 
-	wrbytes = write(fd, maxvalp, strlen(maxvalp));
-	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
-		close(fd);
-		return -1;
+	fluffy_poll_scan(&scan);
+
+	struct fluffy_path_list changed = {0};
+	size_t j;
+	for (j = 0; j < scan.nitems; j++) {
+		int is_changed = 0;
+		if (reterr == 0) {
+			reterr = fluffy_poll_dir(fluffy_handle, &scan.items[j],
+				    pass.now_ms, &is_changed);
+		}
+		fluffy_snap_free(NULL, scan.items[j].snap);
+		if (is_changed && changed.len < BUDGET_PROMOTIONS) {
+			fluffy_path_list_add(&changed, scan.items[j].path);
+		}
 	}
+	fluffy_free(scan.items);
+	fluffy_path_list_clear(&pass.due);
 
-	if (close(fd) != 0) {
-		return -1;
+	/* The busiest pick their watches first, the rest wait their turn */
+	for (j = 0; j < changed.len && reterr == 0; j++) {
+		if (fluffy_promote_dir(fluffy_handle, changed.paths[j])) {
+			PRINT_STDERR("Couldnot watch %s\n", changed.paths[j]);
+		}
 	}
+	fluffy_path_list_clear(&changed);
 
-	return 0;
+	if (reterr) {
+		return reterr;
+	}
+	return fluffy_flush_pending_events(fluffy_handle, 0) ? -1 : 0;
 }
 
 /*
- * fluffy.h contains this function description
+ * Function:	fluffy_poll_scan_item
+ *
+ * Stat a directory of a poll pass, and list it if it may have changed; a
+ * FLUFFY_ROOT_POLL one always is, a file written in place leaves the mtime
+ * of its directory as it was. Touches no context record.
  */
-int
-fluffy_set_max_user_watches(const char *maxvalp)
+static void
+fluffy_poll_scan_item(struct fluffy_poll_item *itemp)
 {
-	int fd = -1;
-	ssize_t wrbytes;
-
-	if (maxvalp == NULL) {
-		return -1;
+	if (lstat(itemp->path, &itemp->sbuf) == -1 ||
+	    !S_ISDIR(itemp->sbuf.st_mode)) {
+		itemp->is_gone = 1;
+		return;
 	}
 
-	fd = open("/proc/sys/fs/inotify/max_user_watches",
-		O_WRONLY | O_TRUNC | O_CLOEXEC);
-	if (fd == -1) {
-		return -1;
+	itemp->is_changed = (itemp->is_known &&
+	    (itemp->sbuf.st_ino != itemp->ino ||
+	    itemp->sbuf.st_mtim.tv_sec != itemp->mtime.tv_sec ||
+	    itemp->sbuf.st_mtim.tv_nsec != itemp->mtime.tv_nsec));
+	if (itemp->is_known && !itemp->is_changed && !itemp->is_entries) {
+		return;
 	}
 
-	wrbytes = write(fd, maxvalp, strlen(maxvalp));
-	if(wrbytes == -1 || (size_t)wrbytes != strlen(maxvalp)) {
-		close(fd);
-		return -1;
-	}
+	/* Listed after its stat; a change meanwhile shows at the next poll */
+	itemp->reterr = fluffy_snap_list(itemp->path, &itemp->snap);
+}
 
-	if (close(fd) != 0) {
-		return -1;
+/*
+ * Function:	fluffy_start_scan_thread
+ *
+ * Thread start routine that takes the items of a poll pass one at a time
+ * and scans them, till none is left.
+ */
+static void *
+fluffy_start_scan_thread(void *scan)
+{
+	struct fluffy_poll_scan *scanp = scan;
+	size_t j;
+	while ((j = __atomic_fetch_add(&scanp->next, 1, __ATOMIC_RELAXED)) <
+	    scanp->nitems) {
+		fluffy_poll_scan_item(&scanp->items[j]);
 	}
-
-	return 0;
+	return NULL;
 }
 
-
-static struct fluffy_wd_info *
-fluffy_wd_info_new()
+/*
+ * Function:	fluffy_poll_scan
+ *
+ * Scan the items of a poll pass, up to POLL_SCAN_THREADS at once; the
+ * calling thread takes its share. Should a thread not start, those that
+ * did take the lot. Cancellation is held off till they're all joined.
+ */
+static void
+fluffy_poll_scan(struct fluffy_poll_scan *scanp)
 {
-	struct fluffy_wd_info *wdinfop;
-	wdinfop = calloc(1, sizeof(struct fluffy_wd_info));
-	if (wdinfop == NULL) {
-		perror("calloc");
-		return NULL;
+	pthread_t tids[POLL_SCAN_THREADS - 1];
+	size_t nthreads = 0;
+	int oldstate = 0;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	while (nthreads < POLL_SCAN_THREADS - 1 &&
+	    nthreads + 1 < scanp->nitems) {
+		if (pthread_create(&tids[nthreads], NULL,
+		    fluffy_start_scan_thread, scanp) != 0) {
+			break;
+		}
+		nthreads++;
 	}
-	wdinfop->wd	= 0;
-	wdinfop->mask	= 0;
-	wdinfop->path	= NULL;
 
-	return wdinfop;
+	fluffy_start_scan_thread(scanp);
+
+	size_t j;
+	for (j = 0; j < nthreads; j++) {
+		if (pthread_join(tids[j], NULL) != 0) {
+			perror("pthread_join");
+		}
+	}
+	pthread_setcancelstate(oldstate, NULL);
 }
 
 /*
- * Function:	fluffy_context_info_new
+ * Function:	fluffy_poll_dir
  *
- * Allocate memory for a fluffy_context_info and assign appropriate values.
+ * Bring a polled directory up to date with its scan; queue events for
+ * what changed since its last listing, if it was listed. The interval
+ * backs off while it's idle. A directory that's gone is no longer polled,
+ * the one it was in reports it; a root path that's gone is removed.
  *
  * args:
- * 	- None
+ * 	- int: fluffy context handle
+ * 	- struct fluffy_poll_item *: its scan, the listing is taken over
+ * 	- long long: time of the poll pass
+ * 	- int *: set to 1 if a directory past the budget changed
  * return:
- * 	- A pointer to fluffy_context_info when successful, NULL otherwise
+ * 	- int: 0 when successful, error value otherwise
  */
-static struct fluffy_context_info *
-fluffy_context_info_new()
+static int
+fluffy_poll_dir(int fluffy_handle, struct fluffy_poll_item *itemp,
+    long long now_ms, int *is_changedp)
 {
 	struct fluffy_context_info *ctxinfop;
-	ctxinfop = calloc(1, sizeof(struct fluffy_context_info));
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
-		perror("calloc");
-		/*
-		 * When OOM is not handled, it's a common practice to call
-		 * exit() to bail out. We will return NULL instead of exit()
-		 * to hand off the reponsibility to the caller.
-		 */
-		return NULL;
+		return -1;
 	}
 
-	if (pthread_mutex_init(&ctxinfop->mutex, NULL)) {
-		return NULL;
+	*is_changedp = 0;
+	if (itemp->reterr) {
+		return itemp->reterr;
 	}
 
-	ctxinfop->is_persist	= 0;
-	ctxinfop->inotify_fd	= -1;
-	ctxinfop->epoll_fd	= -1;
-	ctxinfop->nwd		= 0;
-	ctxinfop->handle	= -1;
+	const char *dirpath = itemp->path;
+	char **newdirs = NULL;
+	size_t nnewdirs = 0;
+	int reterr = 0;
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
 
-	ctxinfop->user_data	= NULL;
-	ctxinfop->wd_table	= NULL;
-	ctxinfop->path_table	= NULL;
-	ctxinfop->path_tree	= NULL;
-	ctxinfop->root_path_table = NULL;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	do {
+		/* Promoted or removed in the meantime */
+		struct fluffy_poll_dir *pollp = NULL;
+		if (!fluffy_str_table_lookup(ctxinfop->poll_table, dirpath,
+		    (void **)&pollp)) {
+			break;
+		}
 
-	return ctxinfop;
-}
+		if (itemp->is_gone) {
+			if (pollp->rootinfop != NULL &&
+			    fluffy_str_table_lookup(ctxinfop->root_path_table,
+			    dirpath, NULL)) {
+				reterr = fluffy_poll_remove_root(ctxinfop,
+					    dirpath, IN_DELETE_SELF);
+			} else {
+				fluffy_poll_remove(ctxinfop, dirpath);
+			}
+			break;
+		}
 
-/*
- * Function:	free_context_table_info_g
- *
- * Called by glib when an entry is removed from
- * fluffy_track.context_table. Frees up records.
- */
-static void
-free_context_table_info_g(struct fluffy_context_info *ctxinfop)
-{
-	free(ctxinfop->wd_table);
-	free(ctxinfop->path_table);
-	free(ctxinfop->path_tree);
-	free(ctxinfop->root_path_table);
-	free(ctxinfop);
-}
+		/* A baseline, if it's the first; nothing to compare it with */
+		unsigned int nqueued = ctxinfop->pending_queue.length;
+		int is_baseline = (pollp->snap == NULL);
+		if (itemp->snap != NULL) {
+			if (pollp->snap != NULL) {
+				reterr = fluffy_rescan_diff(ctxinfop, dirpath,
+					    pollp->snap, itemp->snap, &newdirs,
+					    &nnewdirs);
+				if (reterr) {
+					break;
+				}
+				fluffy_snap_free(ctxinfop, pollp->snap);
+			}
 
+			ctxinfop->snapshot_bytes +=
+			    fluffy_snap_size(itemp->snap);
+			pollp->snap = itemp->snap;
+			itemp->snap = NULL;
+			pollp->mtime = itemp->sbuf.st_mtim;
+			pollp->ino = itemp->sbuf.st_ino;
+		}
 
-static void
-free_wd_table_info_g(struct fluffy_wd_info *wdinfop)
-{
-	free(wdinfop->path);
-	free(wdinfop);
+		fluffy_poll_interval(ctxinfop, pollp, now_ms,
+		    (itemp->is_changed || is_baseline ||
+		    ctxinfop->pending_queue.length != nqueued));
+		*is_changedp = (itemp->is_changed && pollp->rootinfop == NULL);
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	/* Polled as well, being below a polled one; what they hold reported */
+	size_t j;
+	for (j = 0; j < nnewdirs; j++) {
+		if (reterr == 0 && fluffy_add_watch(fluffy_handle, newdirs[j],
+		    0, NULL, IN_CREATE, -1)) {
+			PRINT_STDERR("Couldnot watch %s\n", newdirs[j]);
+		}
+		fluffy_free(newdirs[j]);
+	}
+	fluffy_free(newdirs);
+
+	return reterr;
 }
 
 /*
- * Function:	fluffy_handoff_event
+ * Function:	fluffy_promote_dir
  *
- * Each inotify event is handed off to the client callback function
- * before internal processing. Since the event processing within a context is
- * serial, the client will have to fork/thread and return as soon as a possible
- * in order to avoid event queue overflows; that is if event order isn't a
- * concern. To main event order, serial processing is the only way.
+ * Watch a polled directory again, along with the polled directories
+ * between it and the nearest watched one; a watch is never set below a
+ * polled directory. Past the budget, the watched directories idle the
+ * longest are demoted to make room; if too few have been idle long
+ * enough, it all stays polled.
  *
  * args:
  * 	- int: fluffy context handle
- * 	- struct inotify_event *: a pointer to the inotify event
- * 	- struct fluffy_wd_info *: a pointer to the associated watch info. Null
- * 		when the event is a queue overflow
+ * 	- const char *: path of the polled directory
  * return:
- * 	- int: 0 when successful, error value otherwise to terminate context
+ * 	- int: 0 when successful or it stays polled, error value otherwise
  */
 static int
-fluffy_handoff_event(int fluffy_handle, struct inotify_event *ie,
-    struct fluffy_wd_info *wdinfop)
+fluffy_promote_dir(int fluffy_handle, const char *dirpath)
 {
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
-	if (ctxinfop->user_event_fn == NULL) {
+
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s", dirpath) >= (int)sizeof(path)) {
 		return 0;
 	}
 
-	/*
-	 * Along with the appropriate inotify event mask, OR fluffy context
-	 * event mask when required. This mask will be passed on to the client
-	 * event callback function.
-	 */
-	uint32_t handoff_mask = ie->mask;
-	
-	int is_not_root = 0;	/* Positive when it isn't a root path */
-	char *eventpathp = NULL;
-
-	/* No event path when it's a queue overflow event */
-	if (!(ie->mask & IN_Q_OVERFLOW)) {
-		is_not_root = fluffy_is_root_path(fluffy_handle,
-				wdinfop->path);
+	/* From the directory up, the ones to be watched */
+	struct fluffy_path_list chain = {0};
+	int is_stay = 1;
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
 
-		eventpathp = form_event_path(wdinfop->path,
-				ie->len,
-				ie->name);
-		if (eventpathp == NULL) {
-			return -1;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	do {
+		while (chain.len < BUDGET_PROMOTIONS &&
+		    fluffy_str_table_lookup(ctxinfop->poll_table, path,
+		    NULL)) {
+			fluffy_path_list_add(&chain, path);
+			char *slashp = strrchr(path, '/');
+			if (slashp == NULL) {
+				break;
+			}
+			slashp[(slashp == path) ? 1 : 0] = '\0';
 		}
 
-		/*
-		 * Ignore IN_MOVE_SELF & IN_DELETE_SELF unless it's on the root
-		 * path. The parent watch path will catch these events and
-		 * report them, including this regardless is redundant.
-		 */
-		if ((is_not_root)		&&
-		    ((ie->mask & IN_MOVE_SELF)	||
-		    (ie->mask & IN_DELETE_SELF))) {
-			free(eventpathp);
-			return 0;
+		struct fluffy_wd_info *wdinfop;
+		wdinfop = fluffy_path_lookup(ctxinfop, path);
+		if (chain.len == 0 || wdinfop == NULL || wdinfop->mask == 0) {
+			break;
 		}
+		is_stay = 0;
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
 
-		/*
-		 * If event path is a root path and the watch on it is removed,
-		 * send a FLUFFY_ROOT_IGNORED event. If there's no more paths
-		 * to watch, send a FLUFFY_WATCH_EMPTY event as well.
-		 */
-		if ((is_not_root == 0)	&&
-		    (ie->mask & IN_IGNORED)) {
-			handoff_mask |= FLUFFY_ROOT_IGNORED;
-			if(g_hash_table_size(ctxinfop->root_path_table) == 1) {
-				handoff_mask |= FLUFFY_WATCH_EMPTY;
+	/* Room for them all, the coldest found at once and demoted */
+	while (!is_stay) {
+		struct fluffy_path_list victims = {0};
+		int is_room = 0;
+		m = pthread_mutex_lock(&ctxinfop->mutex);
+		if (m != 0) {
+			fluffy_path_list_clear(&chain);
+			return -1;
+		}
+		unsigned long long room = fluffy_budget_room(ctxinfop);
+		is_room = (room >= chain.len);
+		if (!is_room) {
+			struct fluffy_wd_info *coldv[BUDGET_PROMOTIONS];
+			unsigned int k, ncold;
+			ncold = fluffy_coldest_leaves(ctxinfop, coldv,
+				    chain.len - (unsigned int)room);
+			for (k = 0; k < ncold; k++) {
+				fluffy_path_list_add(&victims, coldv[k]->path);
 			}
 		}
+		pthread_mutex_unlock(&ctxinfop->mutex);
 
-		/*
-		 * If there's an event on a dir, and there's a watch set on its
-		 * parent directory, then the events are reported twice- one by
-		 * the child, one by the parent. Don't report twice.
-		 */
-		if (!(ie->mask & IN_MODIFY)	&&
-		    !(ie->mask & IN_MOVED_FROM)	&&
-		    !(ie->mask & IN_MOVED_TO)	&&
-		    (ie->mask & IN_ISDIR)	&&
-		    (ie->len > 0)) {
-			if (g_hash_table_contains(ctxinfop->path_table,
-			    eventpathp)) {
-				free(eventpathp);
-				return 0;
+		if (is_room) {
+			break;
+		}
+
+		/* Another round only if one of them did make room */
+		size_t k;
+		is_stay = 1;
+		for (k = 0; k < victims.len; k++) {
+			if (fluffy_demote_dir(fluffy_handle,
+			    victims.paths[k]) == 0) {
+				is_stay = 0;
 			}
 		}
+		fluffy_path_list_clear(&victims);
+	}
+
+	if (is_stay) {
+		fluffy_path_list_clear(&chain);
+		return 0;
+	}
+
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_path_list_clear(&chain);
+		return -1;
 	}
-
-	/* Pass on the event info to the client's callback function. */
-	struct fluffy_event_info *evtinfop;
-	evtinfop = calloc(1, sizeof(struct fluffy_event_info));
-	if (evtinfop == NULL) {
-		pthread_exit((void *)-1);
+	size_t j;
+	for (j = 0; j < chain.len; j++) {
+		fluffy_poll_remove(ctxinfop, chain.paths[j]);
 	}
-	evtinfop->event_mask = handoff_mask;
-	evtinfop->path = eventpathp;
-
-	int ret = 0;
-	ret = (ctxinfop->user_event_fn)(evtinfop, (void *)ctxinfop->user_data);
-
-	free(eventpathp);
-	free(evtinfop);
-	return ret;	/* return whatever the client returned */
+	pthread_mutex_unlock(&ctxinfop->mutex);
 
+	/* Other subdirectories stay polled till they're busy themselves */
+	int reterr = 0;
+	reterr = fluffy_add_watch(fluffy_handle, chain.paths[chain.len - 1], 0,
+		    NULL, 0, -1);
+	fluffy_path_list_clear(&chain);
+	return reterr;
 }
 
 /*
- * Function:	dir_tree_add_watch
+ * Function:	fluffy_demote_dir
  *
- * This function must not be called directly, rather passed as a function
- * pointer to nftw() which in turn calls this function on every path it
- * encounters.
+ * Have a watched directory polled instead. It's listed first; what
+ * happens before the watch is removed may be reported twice, not missed.
+ * The IN_IGNORED of the watch isn't handed off, the record is marked with
+ * a mask of 0.
  *
  * args:
- * 	nftw() provides the arguments
+ * 	- int: fluffy context handle
+ * 	- const char *: path of the watched directory
  * return:
- * 	- int: 0 to continue the tree walk, none zero to terminate the walk
+ * 	- int: 0 when successful, -1 otherwise
  */
 static int
-dir_tree_add_watch(const char *pathname, const struct stat *sbuf, int type,
-    struct FTW *ftwb)
+fluffy_demote_dir(int fluffy_handle, const char *dirpath)
 {
-	/* Process only if the entry is a directory */
-	if (!(type == FTW_DP || type == FTW_D)) {
-		return FTW_CONTINUE;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
 	}
 
-	struct fluffy_context_info *ctxinfop = NULL;
-	ctxinfop = fluffy_get_context_info(fluffy_track.curr_ctxinfop->handle);
-	if (ctxinfop == NULL) {
+	struct stat sbuf;
+	if (lstat(dirpath, &sbuf) == -1) {
+		return -1;
+	}
+
+	struct fluffy_dir_snap *snap = NULL;
+	if (fluffy_snap_list(dirpath, &snap) || snap == NULL) {
 		return -1;
 	}
 
 	int reterr = 0;
-	int iwd = -1;
 	int m = -1;
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
+		fluffy_snap_free(NULL, snap);
 		return -1;
 	}
 
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
-
-	if (ftwb->level != 0) {
-		if (g_hash_table_contains(ctxinfop->root_path_table,
-		    pathname)) {
-			/*
-			 * This had been a root watch path previously.
-			 * Since it is a regular descendant path now, remove
-			 * it from the root path list.
-			 */
-			if (!g_hash_table_remove(ctxinfop->root_path_table,
-			    (const char *)pathname)) {
-				PRINT_STDERR("Couldnot remove %s from the " \
-				    "root table\n", pathname);
-			}
-		} else {
-			/*
-			 * This path is not in the root path list, don't
-			 * have to remove anything now.
-			 */
+	do {
+		/* Still a watched leaf that's not a root */
+		struct fluffy_wd_info *wdinfop;
+		wdinfop = fluffy_path_lookup(ctxinfop, dirpath);
+		if (wdinfop == NULL || wdinfop->mask == 0 ||
+		    wdinfop->first_child != NULL ||
+		    __atomic_load_n(&wdinfop->is_root, __ATOMIC_ACQUIRE)) {
+			reterr = -1;
+			break;
 		}
-	}
 
-	do {
-		iwd = inotify_add_watch(ctxinfop->inotify_fd, pathname,
-				INOTIFY_EVENT_FLAGS);
-		if (iwd == -1) {
-			perror("inotify_add_watch");
+		if (ctxinfop->backend->rm_watch_fn(ctxinfop->inotify_fd,
+		    wdinfop->wd) == -1) {
+			perror("inotify_rm_watch");
 			reterr = -1;
 			break;
 		}
+		wdinfop->mask = 0;
+		(ctxinfop->ndemoting)++;
 
-		if(g_hash_table_contains(ctxinfop->wd_table,
-		    GINT_TO_POINTER(iwd))) {
-			/* Entry already exists */
-			struct fluffy_wd_info *oldwdinfop = NULL;
-			oldwdinfop = (struct fluffy_wd_info *)
-					g_hash_table_lookup(ctxinfop->wd_table,
-						GINT_TO_POINTER(iwd));
-			if (oldwdinfop->wd != iwd) {
-				oldwdinfop->wd = iwd;
-			}
+		reterr = fluffy_poll_add(ctxinfop, dirpath, &sbuf, snap,
+			    NULL);
+		snap = NULL;
+	} while (0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
 
-			if (oldwdinfop->mask != INOTIFY_EVENT_FLAGS) {
-				oldwdinfop->mask = INOTIFY_EVENT_FLAGS;
-			}
+	fluffy_snap_free(NULL, snap);
+	return reterr;
+}
 
-			if (oldwdinfop->path != pathname) {
-				oldwdinfop->path = strdup(pathname);
-			}
-			oldwdinfop = NULL;
+/*
+ * Function:	fluffy_coldest_leaves
+ *
+ * Find the watched directories, without watched subdirectories and not
+ * root paths, that have been idle the longest; in one pass over the
+ * watches. The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: context info
+ * 	- struct fluffy_wd_info **: filled in, coldest first
+ * 	- unsigned int: how many are wanted, BUDGET_PROMOTIONS at most
+ * return:
+ * 	- unsigned int: how many were found; only those idle for
+ * 	  BUDGET_COLD_PASSES poll passes are
+ */
+static unsigned int
+fluffy_coldest_leaves(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info **coldv, unsigned int ncold)
+{
+	uint16_t idlev[BUDGET_PROMOTIONS];
+	unsigned int nfound = 0;
+	if (ncold > BUDGET_PROMOTIONS) {
+		ncold = BUDGET_PROMOTIONS;
+	}
 
-			break;
+	struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+	unsigned int j, k;
+	for (j = 0; dirp != NULL && j < dirp->npages; j++) {
+		struct fluffy_wd_page *pagep = dirp->pages[j];
+		if (pagep == NULL) {
+			continue;
 		}
 
-		/* Table does not hold this entry already */
-		(ctxinfop->nwd)++;
+		for (k = 0; k < WD_PAGE_SLOTS; k++) {
+			struct fluffy_wd_info *wdinfop;
+			wdinfop = pagep->slots[k].wdinfop;
+			if (wdinfop == NULL || wdinfop->mask == 0 ||
+			    wdinfop->first_child != NULL || wdinfop->is_root) {
+				continue;
+			}
 
-		/* Add the new entry */
-		struct fluffy_wd_info *wdinfop;
-		wdinfop = fluffy_wd_info_new();
-		if (wdinfop == NULL) {
-			reterr = -1;
-			break;
-		}
+			uint16_t idle = ctxinfop->budget_pass - __atomic_load_n(
+					    &wdinfop->seen, __ATOMIC_RELAXED);
+			if (idle < BUDGET_COLD_PASSES || (nfound == ncold &&
+			    idle <= idlev[nfound - 1])) {
+				continue;
+			}
 
-		wdinfop->wd = iwd;
-		wdinfop->mask = INOTIFY_EVENT_FLAGS;
-		wdinfop->path = strdup(pathname);
-		if (wdinfop->path == NULL) {
-			perror("strdup");
-			reterr = -1;
-			break;
+			/* Kept in order, the warmest drops off a full list */
+			unsigned int n = (nfound < ncold) ? nfound++ :
+			    nfound - 1;
+			while (n > 0 && idlev[n - 1] < idle) {
+				idlev[n] = idlev[n - 1];
+				coldv[n] = coldv[n - 1];
+				n--;
+			}
+			idlev[n] = idle;
+			coldv[n] = wdinfop;
 		}
+	}
+	return nfound;
+}
 
-		g_hash_table_replace(ctxinfop->wd_table,
-		    GINT_TO_POINTER(wdinfop->wd), wdinfop);
-		g_hash_table_replace(ctxinfop->path_table,
-		    strdup(wdinfop->path), wdinfop);
-		g_tree_replace(ctxinfop->path_tree,
-		    strdup(wdinfop->path),
-		    GINT_TO_POINTER(wdinfop->wd));
-	} while(0);
+/*
+ * Function:	fluffy_fan_key
+ *
+ * Form the key a filesystem, or a file of it, goes by in the fanotify
+ * tables; the fsid, then the type and bytes of the file handle, in hex.
+ *
+ * args:
+ * 	- const void *:	fsid, a fsid_t
+ * 	- const struct file_handle *: file handle, NULL for the fsid alone
+ * 	- char *:	the key, FANOTIFY_KEY_LEN bytes
+ * return:
+ * 	- void
+ */
+static void
+fluffy_fan_key(const void *fsid, const struct file_handle *fhp, char *key)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = fsid;
+	unsigned int j;
 
-	pthread_cleanup_pop(1);		/* Unlock mutex */
+	for (j = 0; j < sizeof(fsid_t); j++) {
+		*key++ = hex[p[j] >> 4];
+		*key++ = hex[p[j] & 0xf];
+	}
 
-	if (reterr) {
-		return reterr;
-	} else {
-		return FTW_CONTINUE;
+	if (fhp != NULL && fhp->handle_bytes <= MAX_HANDLE_SZ) {
+		p = (const unsigned char *)&fhp->handle_type;
+		for (j = 0; j < sizeof(int); j++) {
+			*key++ = hex[p[j] >> 4];
+			*key++ = hex[p[j] & 0xf];
+		}
+		for (j = 0; j < fhp->handle_bytes; j++) {
+			*key++ = hex[fhp->f_handle[j] >> 4];
+			*key++ = hex[fhp->f_handle[j] & 0xf];
+		}
 	}
+	*key = '\0';
 }
 
-
+/*
+ * Function:	fluffy_fan_fs_free
+ *
+ * Frees a fluffy_fan_fs, the value of fluffy_context_info.fan_fs_table
+ */
 static void
-watch_each_root_path_g(gpointer root_path, gpointer value,
-    gpointer fluffy_handle)
+fluffy_fan_fs_free(void *fs)
 {
-	if (root_path == NULL) {
-		pthread_exit((void *)-1);
+	struct fluffy_fan_fs *fsp = fs;
+	if (fsp == NULL) {
+		return;
 	}
 
-	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(GPOINTER_TO_INT(fluffy_handle));
-	if (ctxinfop == NULL) {
-		pthread_exit((void *)-1);
+	if (fsp->mount_fd != -1 && close(fsp->mount_fd) == -1) {
+		perror("close");
 	}
+	fluffy_free(fsp);
+}
 
-	int reterr = 0;
-	reterr = fluffy_add_watch(GPOINTER_TO_INT(fluffy_handle),
-			(char *)root_path,
-			0,
-			0);
-	if (reterr) {
-		pthread_exit((void *)-1);
+/*
+ * Function:	count_each_fan_user
+ *
+ * Called on every entry of fluffy_context_info.root_path_table, count the
+ * other root paths on the filesystem, or the mount, of the one looked for.
+ */
+static void
+count_each_fan_user(const char *root_path, void *rootinfo, void *users)
+{
+	struct fluffy_root_info *rootinfop = rootinfo;
+	struct fluffy_fan_users *usersp = users;
+
+	if (rootinfop == usersp->rootinfop || rootinfop->fan_key == NULL) {
+		return;
+	}
+	if (strncmp(rootinfop->fan_key, usersp->rootinfop->fan_key,
+	    FANOTIFY_FSID_LEN) != 0) {
+		return;
 	}
+	if (usersp->fan_mark == FAN_MARK_MOUNT &&
+	    rootinfop->fan_mnt_id != usersp->rootinfop->fan_mnt_id) {
+		return;
+	}
+	(usersp->nusers)++;
 }
 
+/*
+ * Function:	fluffy_fan_mark_users
+ *
+ * Count the root paths, other than this one, that share its fanotify mark.
+ * The context mutex must be held.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: fanotify context
+ * 	- const struct fluffy_root_info *: root path record
+ * return:
+ * 	- unsigned int: count of the other root paths, 0 if there's none
+ */
+static unsigned int
+fluffy_fan_mark_users(struct fluffy_context_info *ctxinfop,
+    const struct fluffy_root_info *rootinfop)
+{
+	struct fluffy_fan_users users = {0};
+	users.rootinfop = rootinfop;
+	users.fan_mark = ctxinfop->fan_mark;
+	fluffy_str_table_foreach(ctxinfop->root_path_table,
+	    count_each_fan_user, &users);
+	return users.nusers;
+}
 
-static void
-reinit_each_context_g(gpointer fluffy_handle, gpointer value,
-    gpointer user_data)
+/*
+ * Function:	fluffy_fan_add_root
+ *
+ * Add a root path to a fanotify context. Its filesystem, or mount, is
+ * marked unless another root path has it marked already. A path that falls
+ * under a root path is covered already.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: fanotify context
+ * 	- const char *: a real path
+ * 	- const struct fluffy_root_options *: root options, may be NULL
+ * return:
+ * 	- int: 0 when successful, error value otherwise
+ */
+static int
+fluffy_fan_add_root(struct fluffy_context_info *ctxinfop, const char *path,
+    const struct fluffy_root_options *rootopts)
 {
 	int reterr = 0;
-	reterr = fluffy_reinitiate_context(GPOINTER_TO_INT(fluffy_handle));
-	if (reterr) {
-		/* nothing? */
+	if (rootopts != NULL &&
+	    (rootopts->flags & (FLUFFY_ROOT_INVENTORY | FLUFFY_ROOT_POLL))) {
+		return EINVAL;
+	}
+
+	/* Covered already; it's not opened, that would be reported */
+	int m = -1;
+	int is_covered = 0;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+	is_covered = (fluffy_get_root_info(ctxinfop, path) != NULL);
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0 || is_covered) {
+		return (m != 0) ? -1 : 0;
 	}
+
+	struct file_handle *fhp;
+	fhp = fluffy_malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+	if (fhp == NULL) {
+		perror("malloc");
+		return ENOMEM;
+	}
+	fhp->handle_bytes = MAX_HANDLE_SZ;
+
+	/* The file handle of the root path tells its self events apart */
+	int mnt_id = 0;
+	struct statfs sfs;
+	if (name_to_handle_at(AT_FDCWD, path, fhp, &mnt_id, 0) == -1 ||
+	    statfs(path, &sfs) == -1) {
+		reterr = errno;
+		perror("name_to_handle_at");
+		fluffy_free(fhp);
+		return reterr;
+	}
+
+	char key[FANOTIFY_KEY_LEN];
+	char fsidkey[FANOTIFY_KEY_LEN];
+	fluffy_fan_key(&sfs.f_fsid, fhp, key);
+	fluffy_fan_key(&sfs.f_fsid, NULL, fsidkey);
+	fluffy_free(fhp);
+
+	struct fluffy_root_info *rootinfop;
+	rootinfop = fluffy_root_info_new(rootopts);
+	if (rootinfop == NULL) {
+		return EINVAL;
+	}
+
+	rootinfop->depth = fluffy_path_depth(path);
+	rootinfop->fan_mnt_id = mnt_id;
+	rootinfop->fan_key = fluffy_strdup(key);
+	/* O_PATH, an open would be reported under the marks */
+	rootinfop->fan_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (rootinfop->fan_fd == -1) {
+		reterr = errno;
+		perror("open");
+	} else if (rootinfop->fan_key == NULL) {
+		reterr = ENOMEM;
+	}
+
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	do {
+		if (reterr) {
+			break;
+		}
+
+		/* Covered since */
+		if (fluffy_get_root_info(ctxinfop, path) != NULL) {
+			break;
+		}
+
+		struct fluffy_fan_fs *fsp = NULL;
+		if (!fluffy_str_table_lookup(ctxinfop->fan_fs_table, fsidkey,
+		    (void **)&fsp)) {
+			fsp = fluffy_calloc(1, sizeof(struct fluffy_fan_fs));
+			if (fsp == NULL) {
+				reterr = ENOMEM;
+				break;
+			}
+			/* Not marked yet, nothing's reported */
+			fsp->mount_fd = open(path, O_RDONLY | O_DIRECTORY |
+					    O_CLOEXEC);
+			if (fsp->mount_fd == -1 ||
+			    fluffy_str_table_replace(ctxinfop->fan_fs_table,
+			    fsidkey, fsp)) {
+				reterr = (fsp->mount_fd == -1) ? errno : ENOMEM;
+				fluffy_fan_fs_free(fsp);
+				break;
+			}
+		}
+
+		/* The root paths on a filesystem, or mount, share its mark */
+		if (fluffy_fan_mark_users(ctxinfop, rootinfop) == 0) {
+			if (fanotify_mark(ctxinfop->fanotify_fd,
+			    FAN_MARK_ADD | ctxinfop->fan_mark,
+			    ctxinfop->fan_mask, rootinfop->fan_fd, ".") == -1) {
+				reterr = errno;
+				perror("fanotify_mark");
+				if (fsp->nroots == 0) {
+					fluffy_str_table_remove(
+					    ctxinfop->fan_fs_table, fsidkey);
+				}
+				break;
+			}
+			(ctxinfop->nfan_marks)++;
+		}
+		(fsp->nroots)++;
+
+		/* The table holds a reference of its own */
+		(rootinfop->nref)++;
+		if (fluffy_str_table_replace(ctxinfop->root_path_table, path,
+		    rootinfop)) {
+			(rootinfop->nref)--;
+			reterr = ENOMEM;
+		}
+		char *rootpath = fluffy_strdup(path);
+		if (rootpath == NULL ||
+		    fluffy_str_table_replace(ctxinfop->fan_root_table, key,
+		    rootpath)) {
+			/* Only its self events go unreported */
+			fluffy_free(rootpath);
+		}
+		fluffy_sync_root(ctxinfop, path);
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	} while (0);
+
+	fluffy_root_info_unref(rootinfop);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return reterr;
 }
 
 /*
- * Function:	search_tree_g
+ * Function:	fluffy_fan_remove_root
  *
- * This function is not called directly, rather glib g_search_tree function
- * calls this on every entry it encounters from the tree. The return value
- * decides the search path because the tree is a search tree; ordered.
+ * Remove a root path from a fanotify context, and the mark of its
+ * filesystem, or mount, if no other root path is on it. FLUFFY_IGNORED is
+ * queued for it, as inotify would report. The context mutex must be held.
  *
  * args:
- * 	- gpointer: entry from the search tree
- * 	- gpointer: string to compare the path prefix
+ * 	- struct fluffy_context_info *: fanotify context
+ * 	- const char *: root path to remove
  * return:
- *	- gint: 0,-1 or 1 appropriately. Same logic as that of strmp()'s
+ * 	- int: 0 when successful, error value otherwise
  */
-static gint
-search_tree_g(gpointer pathname, gpointer compare_path)
+static int
+fluffy_fan_remove_root(struct fluffy_context_info *ctxinfop, const char *path)
 {
-	char *cmp_for_each_path = (char *)compare_path;
-	char *tocmp = NULL;
-	size_t cmp_size = 0;
-	tocmp = calloc(1, strlen(cmp_for_each_path) + 2);
-	if (tocmp == NULL) {
-		perror("calloc");
-		pthread_exit((void *)-1);
+	struct fluffy_root_info *rootinfop = NULL;
+	if (!fluffy_str_table_lookup(ctxinfop->root_path_table, path,
+	    (void **)&rootinfop)) {
+		PRINT_STDERR("Could not lookup path %s\n", path);
+		return -1;
 	}
 
-	/*
-	 * compare_path is the prefix string that we will match with pathname.
-	 * Each descendant will be a directory, so, '/' is the separator we
-	 * must concatenate before performing the comparison.
-	 */
-	tocmp = strncpy(tocmp, cmp_for_each_path, strlen(cmp_for_each_path) +
-		    1);
-	tocmp = strncat(tocmp, "/", 2);
-	cmp_size = strlen(tocmp);
-
-	int cmp_ret = 0;
-	cmp_ret = strncmp(tocmp, (char *)pathname, cmp_size);
-	free(tocmp);
-	tocmp = NULL;
-	if (cmp_ret == 0) {
-		return 0;
-	} else if (cmp_ret < 0) {
-		return -1;
-	} else if (cmp_ret > 0) {
-		return 1;
+	uint32_t mask = IN_IGNORED | FLUFFY_ROOT_IGNORED;
+	if (ctxinfop->root_path_table->nused == 1) {
+		mask |= FLUFFY_WATCH_EMPTY;
 	}
-	return cmp_ret;
+
+	if (fluffy_fan_mark_users(ctxinfop, rootinfop) == 0) {
+		/* The root itself may be gone, its descriptor isn't */
+		if (fanotify_mark(ctxinfop->fanotify_fd,
+		    FAN_MARK_REMOVE | ctxinfop->fan_mark, ctxinfop->fan_mask,
+		    rootinfop->fan_fd, ".") == -1) {
+			perror("fanotify_mark");
+		}
+		(ctxinfop->nfan_marks)--;
+	}
+
+	char fsidkey[FANOTIFY_KEY_LEN];
+	memcpy(fsidkey, rootinfop->fan_key, FANOTIFY_FSID_LEN);
+	fsidkey[FANOTIFY_FSID_LEN] = '\0';
+
+	struct fluffy_fan_fs *fsp = NULL;
+	if (fluffy_str_table_lookup(ctxinfop->fan_fs_table, fsidkey,
+	    (void **)&fsp) && --(fsp->nroots) == 0) {
+		fluffy_str_table_remove(ctxinfop->fan_fs_table, fsidkey);
+	}
+	fluffy_str_table_remove(ctxinfop->fan_root_table, rootinfop->fan_key);
+
+	int reterr = 0;
+	reterr = fluffy_queue_pending_event(ctxinfop, mask, path);
+
+	fluffy_str_table_remove(ctxinfop->root_path_table, path);
+	fluffy_sync_root(ctxinfop, path);
+	fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	return reterr;
 }
 
 /*
- * Function:	form_event_path
+ * Function:	fluffy_fan_dir_lookup
  *
- * Form the event path by appending the filename where the action occured with
- * the path which is reporting it. inotify watch descriptor is on the reporting
- * path. If the action occured on the reporting path itself, then there's
- * nothing to append because ilen will be zero and iname will point to nothing.
+ * Resolve the directory an event came with off its file handle, the cache
+ * first. A directory that isn't under a root path, or that its excludes or
+ * max_depth leave out, is cached as well, without a root record. The
+ * context mutex must be held.
  *
  * args:
- * 	- char *:	pointer to the reporting path
- * 	- uint32_t:	length of the filename in concern if it's a descendant
- * 	- char *:	pointer to the descendant filename if any
+ * 	- struct fluffy_context_info *: fanotify context
+ * 	- struct fanotify_event_info_fid *: fsid and file handle of the dir
+ * 	- const char *: fluffy_fan_key() of it
  * return:
- * 	- char *:	pointer to the event path, must be freed by the caller
+ * 	- A pointer to fluffy_fan_dir, NULL if it couldn't be resolved
  */
-static char *
-form_event_path(char *wdpath, uint32_t ilen, char *iname)
+static struct fluffy_fan_dir *
+fluffy_fan_dir_lookup(struct fluffy_context_info *ctxinfop,
+    struct fanotify_event_info_fid *fidp, const char *key)
 {
-	char *currpath = NULL;
-	currpath = calloc(1, (size_t) (strlen(wdpath) + 1 
-				+ ((ilen) ?  ilen : 0) + 2));
-	if (currpath == NULL) {
-		perror("calloc");
+	struct fluffy_fan_dir *dirp = NULL;
+	if (fluffy_str_table_lookup(ctxinfop->fan_dir_table, key,
+	    (void **)&dirp)) {
+		return dirp;
+	}
+
+	char fsidkey[FANOTIFY_KEY_LEN];
+	fluffy_fan_key(&fidp->fsid, NULL, fsidkey);
+
+	struct fluffy_fan_fs *fsp = NULL;
+	if (!fluffy_str_table_lookup(ctxinfop->fan_fs_table, fsidkey,
+	    (void **)&fsp)) {
+		return NULL;
+	}
+
+	/* Gone by now, ESTALE; its events can't be placed */
+	int fd = -1;
+	fd = open_by_handle_at(fsp->mount_fd,
+		(struct file_handle *)fidp->handle, O_PATH | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	char fdpath[32];
+	char path[PATH_MAX];
+	ssize_t len = 0;
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+	len = readlink(fdpath, path, sizeof(path) - 1);
+	if (close(fd) == -1) {
+		perror("close");
+	}
+	if (len <= 0 || path[0] != '/') {
+		return NULL;
+	}
+	path[len] = '\0';
+
+	dirp = fluffy_malloc(sizeof(struct fluffy_fan_dir) + len + 1);
+	if (dirp == NULL) {
+		perror("malloc");
 		return NULL;
 	}
+	memcpy(dirp->path, path, len + 1);
+
+	/* Left out unless every directory from the root down is watched */
+	dirp->rootinfop = fluffy_get_root_info(ctxinfop, path);
+	if (dirp->rootinfop != NULL) {
+		unsigned int depth = fluffy_path_depth(path) -
+				    dirp->rootinfop->depth;
+		if (dirp->rootinfop->max_depth > 0 &&
+		    depth > dirp->rootinfop->max_depth) {
+			dirp->rootinfop = NULL;
+		}
 
-	currpath = strncpy(currpath, wdpath, strlen(wdpath) + 1);
-	if (ilen) {
-		/* Action was on a descendant file, so, append it. */
-		currpath = strncat(currpath, "/", 2);
-		currpath = strncat(currpath, iname, strlen(iname) + 1);
+		unsigned int k;
+		for (k = 0; dirp->rootinfop != NULL && k < depth; k++) {
+			if (fluffy_is_excluded(ctxinfop, dirp->rootinfop,
+			    path)) {
+				dirp->rootinfop = NULL;
+				break;
+			}
+			char *slash = strrchr(path, '/');
+			if (slash == NULL || slash == path) {
+				break;
+			}
+			*slash = '\0';
+		}
 	}
-	return currpath;
+
+	if (ctxinfop->fan_dir_table->nused >= FANOTIFY_DIR_CACHE) {
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	}
+	if (fluffy_str_table_replace(ctxinfop->fan_dir_table, key, dirp)) {
+		fluffy_free(dirp);
+		return NULL;
+	}
+	return dirp;
 }
 
 /*
- * Function:	fluffy_add_watch
+ * Function:	fluffy_fan_event
  *
- * Watch a path recursively.
+ * Resolve an event read from fanotify to its path and queue it, unless it
+ * falls outside the root paths. Self events are only queued for root
+ * paths, which are removed then. The context mutex must be held.
  *
  * args:
- * 	- int: fluffy_context handle
- * 	- const char *: path to watch recursively
- * 	- int is_real_path_check: non zero value when the path needs to be a 
- * 		canonicalized absolute path
- * 	- int is_root_path: non zero value if the path is a root path
+ * 	- struct fluffy_context_info *: fanotify context
+ * 	- struct fanotify_event_metadata *: the event
  * return:
  * 	- int: 0 when successful, error value otherwise
  */
 static int
-fluffy_add_watch(int fluffy_handle, const char *pathtoadd,
-    int is_real_path_check, int is_root_path)
+fluffy_fan_event(struct fluffy_context_info *ctxinfop,
+    struct fanotify_event_metadata *metap)
 {
-	char *addpath = NULL;
-	int reterr = 0;
+	struct fanotify_event_info_fid *fidp;
+	fidp = (struct fanotify_event_info_fid *)(metap + 1);
+	if (metap->event_len < sizeof(struct fanotify_event_metadata) +
+	    sizeof(struct fanotify_event_info_fid) +
+	    sizeof(struct file_handle) ||
+	    fidp->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+		return 0;
+	}
 
-	/*
-	 * Check whether the path is an input argument received from the user.
-	 * All paths received from the client/user directly must be checked &
-	 * transformed to a real path.
-	 */
-	if (is_real_path_check) {
-		addpath = realpath(pathtoadd, NULL);
-		if (addpath == NULL) {
-			reterr = errno;
-			perror("realpath");
-			return reterr;
+	struct file_handle *fhp = (struct file_handle *)fidp->handle;
+	if (fhp->handle_bytes > MAX_HANDLE_SZ) {
+		return 0;
+	}
+	const char *name = (const char *)fhp->f_handle + fhp->handle_bytes;
+	int is_self = (strcmp(name, ".") == 0);
+
+	uint32_t mask = (uint32_t)metap->mask & (IN_ALL_EVENTS | IN_ISDIR);
+	char key[FANOTIFY_KEY_LEN];
+	fluffy_fan_key(&fidp->fsid, fhp, key);
+
+	if (mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		char *rootpath = NULL;
+		if (is_self && fluffy_str_table_lookup(
+		    ctxinfop->fan_root_table, key, (void **)&rootpath)) {
+			/* Done with the root path, it's removed */
+			char tp[PATH_MAX];
+			snprintf(tp, sizeof(tp), "%s", rootpath);
+			if (fluffy_queue_pending_event(ctxinfop, mask, tp)) {
+				return -1;
+			}
+			return fluffy_fan_remove_root(ctxinfop, tp);
 		}
-	} else {
-		/*
-		 * This path need not be resolved. It's assumed that it has
-		 * been resolved already.
-		 */
-		addpath = strdup(pathtoadd);
-		if (addpath == NULL) {
-			reterr = errno;
-			perror("strdup");
-			return reterr;
+
+		mask &= ~(IN_DELETE_SELF | IN_MOVE_SELF);
+		if ((mask & ~IN_ISDIR) == 0) {
+			return 0;
 		}
 	}
 
-	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(fluffy_handle);
-	if (ctxinfop == NULL) {
-		return -1;
+	struct fluffy_fan_dir *dirp;
+	dirp = fluffy_fan_dir_lookup(ctxinfop, fidp, key);
+	if (dirp == NULL || dirp->rootinfop == NULL) {
+		return 0;
 	}
 
-	int m = -1;
-	m = pthread_mutex_lock(&ctxinfop->mutex);
-	if (m != 0) {
-		return -1;
+	char path[PATH_MAX];
+	int len = 0;
+	if (is_self) {
+		len = snprintf(path, sizeof(path), "%s", dirp->path);
+	} else {
+		len = snprintf(path, sizeof(path), "%s%s%s", dirp->path,
+			(dirp->path[1] != '\0') ? "/" : "", name);
 	}
-
-	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
-	    &ctxinfop->mutex);
-
-	/* Add appropriate records if it's a root path */
-	if (is_root_path) {
-		/* Add only if the path is not in the watch list already */
-		if (!g_hash_table_contains(ctxinfop->path_table,
-		    addpath)) {
-			g_hash_table_replace(ctxinfop->root_path_table,
-			    strdup(addpath), NULL);
-		} else {
-			/*
-			 * This path is already a descendent of another root
-			 * path, so, don't add a new root path entry
-			 */
-		}
+	if (len < 0 || (size_t)len >= sizeof(path)) {
+		return 0;
 	}
 
-	pthread_cleanup_pop(1);		/* Unlock mutex */
-
-	m = pthread_mutex_lock(&fluffy_track.mutex);
-	if (m != 0) {
-		return -1;
+	/* Paths resolved below a directory that moved are stale */
+	if ((mask & IN_ISDIR) && (mask & (IN_MOVED_FROM | IN_MOVED_TO))) {
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
 	}
 
-	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
-	    &fluffy_track.mutex);
-
-	do {
-		fluffy_track.curr_ctxinfop = ctxinfop;
-
-		/* Watch the path recursively */
-		if (nftw(addpath, dir_tree_add_watch, 30, FTW_FLAGS) == -1) {
-			reterr = errno;
-			perror("nftw");
-			break;
-		}
-	} while(0);
-	fluffy_track.curr_ctxinfop = NULL;
-	pthread_cleanup_pop(1);		/* Unlock mutex */
-	free(addpath);
-	return reterr;
+	return fluffy_queue_pending_event(ctxinfop, mask, path);
 }
 
 /*
- * Function:	fluffy_cleanup_context_info_records
- *
- * The intention is to clean up the context records, not to destroy them.
+ * Function:	fluffy_rescan_cmp
  *
- * args:
- * 	- int: fluffy context handle
- * return:
- * 	- int: 0 when successful, error value otherwise
+ * qsort() comparator of fluffy_rescan_dir, the most recently active
+ * directories come first.
  */
 static int
-fluffy_cleanup_context_info_records(int fluffy_handle)
+fluffy_rescan_cmp(const void *a, const void *b)
 {
-	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(fluffy_handle);
-	if (ctxinfop == NULL) {
-		return -1;
-	}
-
-	int m = -1;
-	int reterr = 0;
-	m = pthread_mutex_lock(&ctxinfop->mutex);
-	if (m != 0) {
-		return -1;
+	const struct fluffy_rescan_dir *x = a;
+	const struct fluffy_rescan_dir *y = b;
+	if (x->activity != y->activity) {
+		return (x->activity > y->activity) ? -1 : 1;
 	}
-	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
-	    &ctxinfop->mutex);
-
-	do {
-		/* Close inotify. This will be reinitiated if required */
-		if (close(ctxinfop->inotify_fd) == -1) {
-			reterr = errno;
-			perror("close");
-			break;
-		}
-		ctxinfop->nwd = 0;
-		
-		g_hash_table_remove_all(ctxinfop->wd_table);
-		g_hash_table_remove_all(ctxinfop->path_table);
-		/* There's is no 'remove all' function call for glib trees */
-		g_tree_destroy(ctxinfop->path_tree);
-		ctxinfop->path_tree = NULL;
-		ctxinfop->path_tree = g_tree_new_full((GCompareDataFunc)strcmp,
-					NULL, (GDestroyNotify)free, NULL);
-	} while (0);
-	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return reterr;
+	return 0;
 }
 
-
 /*
- * Function:	fluffy_setup_context_info_records
+ * Function:	fluffy_rescan_context
  *
- * Setup the required bookkeeping records(tables & trees) of a fluffy context.
+ * Rescan every watched directory of the context against its snapshot, the
+ * most recently active first; they're the likeliest to have changed while
+ * events were dropped. Called by the context thread.
  *
  * args:
- * 	int - fluffy_context_info.handle
+ * 	- int: fluffy context handle
  * return:
- * 	int - 0 if successful, error value otherwise
+ * 	- int: 0 when successful, -1 if the client asked to terminate, error
+ * 	  value otherwise
  */
 static int
-fluffy_setup_context_info_records(int fluffy_handle)
+fluffy_rescan_context(int fluffy_handle)
 {
-	int ret = 0;
-
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
-		return -1;
+		return ESRCH;
 	}
 
+	struct fluffy_rescan_dir *dirs = NULL;
+	size_t ndirs = 0;
+	int reterr = 0;
 	int m = -1;
+
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
-		return -1;
+		return m;
 	}
 
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
-
 	do {
-		/*
-		 * All records required for the context are created here.
-		 * For more info, refer fluffy_context_info structure
-		 * definition block.
-		 */
-		ctxinfop->wd_table	= NULL;
-		ctxinfop->path_table	= NULL;
-		ctxinfop->path_tree	= NULL;
-		ctxinfop->root_path_table = NULL;
-
-		ctxinfop->wd_table = g_hash_table_new_full(
-					g_direct_hash,
-					g_direct_equal,
-					NULL,
-					(GDestroyNotify)free_wd_table_info_g);
-		if (ctxinfop->wd_table == NULL) {
-			ret = 1;
+		dirs = fluffy_calloc(ctxinfop->nwd + 1,
+			    sizeof(struct fluffy_rescan_dir));
+		if (dirs == NULL) {
+			perror("calloc");
+			reterr = ENOMEM;
 			break;
 		}
 
-		ctxinfop->path_table = g_hash_table_new_full(
-					g_str_hash,
-					g_str_equal,
-					(GDestroyNotify)free,
-					NULL);
-		if (ctxinfop->path_table == NULL) {
-			ret = 1;
-			break;
-		}
+		struct fluffy_wd_dir *dirp = ctxinfop->wd_dir;
+		unsigned int j, k;
+		for (j = 0; dirp != NULL && j < dirp->npages &&
+		    reterr == 0; j++) {
+			struct fluffy_wd_page *pagep = dirp->pages[j];
+			if (pagep == NULL) {
+				continue;
+			}
 
-		ctxinfop->root_path_table = g_hash_table_new_full(
-						g_str_hash,
-						g_str_equal,
-						(GDestroyNotify)free,
-						NULL);
-		if (ctxinfop->root_path_table == NULL) {
-			ret = 1;
-			break;
-		}
+			for (k = 0; k < WD_PAGE_SLOTS &&
+			    ndirs < ctxinfop->nwd; k++) {
+				struct fluffy_wd_info *wdinfop;
+				wdinfop = pagep->slots[k].wdinfop;
+				if (wdinfop == NULL) {
+					continue;
+				}
 
-		ctxinfop->path_tree = g_tree_new_full(
-					(GCompareDataFunc)strcmp,
-					NULL,
-					(GDestroyNotify)free,
-					NULL);
-		if (ctxinfop->path_tree == NULL) {
-			ret = 1;
-			break;
+				dirs[ndirs].path = fluffy_strdup(wdinfop->path);
+				if (dirs[ndirs].path == NULL) {
+					perror("strdup");
+					reterr = ENOMEM;
+					break;
+				}
+				dirs[ndirs].activity = (wdinfop->snap != NULL) ?
+				    wdinfop->snap->activity : 0;
+				ndirs++;
+			}
 		}
-	} while(0);
-
+	} while (0);
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return ret;
-}
 
+	if (reterr == 0) {
+		qsort(dirs, ndirs, sizeof(struct fluffy_rescan_dir),
+		    fluffy_rescan_cmp);
+	}
+
+	size_t j;
+	for (j = 0; j < ndirs && reterr == 0; j++) {
+		reterr = fluffy_rescan_dir(fluffy_handle, dirs[j].path);
+	}
+
+	for (j = 0; j < ndirs; j++) {
+		fluffy_free(dirs[j].path);
+	}
+	fluffy_free(dirs);
+	return reterr;
+}
 
 /*
- * Function:	fluffy_initiate_inotify
+ * Function:	fluffy_rescan_dir
  *
- * Initiate an inotify instance for this fluffy context identified by
- * the fluffy_handle. Also, add the received descriptor to the context's
- * epoll instance.
+ * List a watched directory afresh and report how it differs from its
+ * snapshot, which it then replaces. Subdirectories that turn up are
+ * watched with their entries reported, as in FLUFFY_OPT_SCAN_NEW_DIRS. A
+ * directory without a snapshot has one taken, nothing is reported. A
+ * directory that's gone is left to the events of its removal. Called by
+ * the context thread.
  *
  * args:
- * 	int - fluffy_context_info.handle
+ * 	- int: fluffy context handle
+ * 	- const char *: path of the watched directory
  * return:
- * 	int - 0 if successful, error value otherwise
+ * 	- int: 0 when successful, -1 if the client asked to terminate, error
+ * 	  value otherwise
  */
 static int
-fluffy_initiate_inotify(int fluffy_handle) 
+fluffy_rescan_dir(int fluffy_handle, const char *dirpath)
 {
-	int ret = 0;
-
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
-		return -1;
+		return ESRCH;
 	}
 
+	/* Listed without the mutex, it's hung on the record once done */
+	struct fluffy_dir_snap *newsnap = NULL;
+	int reterr = 0;
+	reterr = fluffy_snap_list(dirpath, &newsnap);
+	if (reterr || newsnap == NULL) {
+		return reterr;
+	}
+
+	char **newdirs = NULL;
+	size_t nnewdirs = 0;
 	int m = -1;
+
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
-		return -1;
+		fluffy_snap_free(NULL, newsnap);
+		return m;
 	}
 
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
-
 	do {
-		/* Initialize inotify, get its descriptor */
-		ctxinfop->inotify_fd = inotify_init1(IN_CLOEXEC);
-		if (ctxinfop->inotify_fd == -1) {
-			ret = errno;
+		/* Removed or renamed in the meantime */
+		struct fluffy_wd_info *wdinfop;
+		wdinfop = fluffy_path_lookup(ctxinfop, dirpath);
+		if (wdinfop == NULL) {
 			break;
 		}
 
-		/* Poll for activity on the inotify descriptor */
-		struct epoll_event evtmp = {0};
-		evtmp.events	   = EPOLLIN;
-		evtmp.data.fd	   = ctxinfop->inotify_fd;
-		if (epoll_ctl(
-		    ctxinfop->epoll_fd,
-		    EPOLL_CTL_ADD,
-		    ctxinfop->inotify_fd,
-		    &evtmp) == -1) {
-			ret = errno;
-			break;
+		struct fluffy_dir_snap *oldsnap = wdinfop->snap;
+		if (oldsnap != NULL) {
+			reterr = fluffy_rescan_diff(ctxinfop, dirpath, oldsnap,
+			    newsnap, &newdirs, &nnewdirs);
+			if (reterr) {
+				break;
+			}
+			newsnap->activity = oldsnap->activity;
+			fluffy_snap_free(ctxinfop, oldsnap);
 		}
-	} while (0);
 
+		ctxinfop->snapshot_bytes += fluffy_snap_size(newsnap);
+		wdinfop->snap = newsnap;
+		newsnap = NULL;
+	} while (0);
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return ret;
+
+	fluffy_snap_free(NULL, newsnap);
+
+	/* Watch the new subdirectories, reporting what they hold */
+	size_t j;
+	for (j = 0; j < nnewdirs; j++) {
+		if (reterr == 0 && fluffy_add_watch(fluffy_handle, newdirs[j],
+		    0, NULL, IN_CREATE, -1)) {
+			PRINT_STDERR("Couldnot watch %s\n", newdirs[j]);
+		}
+		fluffy_free(newdirs[j]);
+	}
+	fluffy_free(newdirs);
+
+	if (reterr) {
+		return reterr;
+	}
+	return fluffy_flush_pending_events(fluffy_handle, 0) ? -1 : 0;
 }
 
 /*
- * Function:	fluffy_destroy_context
+ * Function:	fluffy_rescan_diff
  *
- * Releases resources attached with a fluffy context
+ * Queue an event for every difference between the old and the new
+ * snapshot of a directory. An entry that's new is created, one whose inode
+ * changed is deleted and created, and a file whose size or mtime changed,
+ * or was left unknown, is modified. An entry that's missing is deleted.
+ * Excluded entries are left out. The context mutex must be held.
  *
  * args:
- * 	- void *: fluffy context handle carrying integer value
+ * 	- struct fluffy_context_info *: context rescanned
+ * 	- const char *: path of the directory
+ * 	- struct fluffy_dir_snap *: snapshot kept so far
+ * 	- struct fluffy_dir_snap *: snapshot just taken
+ * 	- char ***: array of paths of the new subdirectories, grown
+ * 	- size_t *: length of that array, updated
  * return:
- * 	- void
+ * 	- int: 0 when successful, error value otherwise
  */
-static void
-fluffy_destroy_context(void *flhandle)
+static int
+fluffy_rescan_diff(struct fluffy_context_info *ctxinfop,
+    const char *dirpath, struct fluffy_dir_snap *oldsnap,
+    struct fluffy_dir_snap *newsnap, char ***newdirsp, size_t *nnewdirsp)
 {
-	int m = -1;
-	int fluffy_handle = *(int *)flhandle;	/* extract int value */
-
-	do {
-		struct fluffy_context_info *ctxinfop;
-		ctxinfop = fluffy_get_context_info(fluffy_handle);
-		if (ctxinfop == NULL) {
-			break;
+	struct fluffy_root_info *rootinfop;
+	rootinfop = fluffy_get_root_info(ctxinfop, dirpath);
+	const char *sep = (dirpath[strlen(dirpath) - 1] == '/') ? "" : "/";
+	char path[PATH_MAX];
+	unsigned int j;
+
+	for (j = 0; j < newsnap->size; j++) {
+		struct fluffy_snap_slot *slotp = &newsnap->slots[j];
+		if (slotp->name == SNAP_EMPTY || slotp->name == SNAP_TOMB) {
+			continue;
 		}
 
-		/* Clean up the records */
-		if (fluffy_cleanup_context_info_records(fluffy_handle)) {
-			/* best effort */
+		const char *name = newsnap->names + slotp->name + 1;
+		int is_dir = (newsnap->names[slotp->name] == 'd');
+		struct fluffy_snap_slot *oldslotp;
+		oldslotp = fluffy_snap_find(oldsnap, name, slotp->hash);
+
+		uint32_t deleted = 0;
+		uint32_t mask = 0;
+		if (oldslotp == NULL) {
+			mask = IN_CREATE;
+		} else if (oldslotp->ino != 0 && oldslotp->ino != slotp->ino) {
+			deleted = IN_DELETE;
+			if (oldsnap->names[oldslotp->name] == 'd') {
+				deleted |= IN_ISDIR;
+			}
+			mask = IN_CREATE;
+		} else if (!is_dir && (oldslotp->stamp == 0 ||
+		    oldslotp->stamp != slotp->stamp)) {
+			mask = IN_MODIFY;
 		}
-
-		m = pthread_mutex_lock(&ctxinfop->mutex);
-		if (m != 0) {
-			break;
+		if (mask == 0) {
+			continue;
 		}
 
-		pthread_cleanup_push(fluffy_thread_cleanup_unlock,
-		    &ctxinfop->mutex);
+		int len = snprintf(path, sizeof(path), "%s%s%s", dirpath,
+			    sep, name);
+		if (len < 0 || (size_t)len >= sizeof(path) ||
+		    fluffy_is_excluded(ctxinfop, rootinfop, path)) {
+			continue;
+		}
 
-		if (close(ctxinfop->epoll_fd) == -1) {
-			perror("close");
-			/* best effort */
+		if (deleted && fluffy_queue_pending_event(ctxinfop, deleted,
+		    path)) {
+			return ENOMEM;
+		}
+		if (fluffy_queue_pending_event(ctxinfop,
+		    is_dir ? (mask | IN_ISDIR) : mask, path)) {
+			return ENOMEM;
 		}
 
-		/* Destroy the cleaned up resources */
-		g_hash_table_destroy(ctxinfop->wd_table);
-		ctxinfop->wd_table = NULL;
-		g_hash_table_destroy(ctxinfop->path_table);
-		ctxinfop->path_table = NULL;
-		g_hash_table_destroy(ctxinfop->root_path_table);
-		ctxinfop->root_path_table = NULL;
-		g_tree_destroy(ctxinfop->path_tree);
-		ctxinfop->path_tree = NULL;
-		pthread_cleanup_pop(1);
-	} while(0);
+		if (mask & IN_CREATE) {
+			/* Best effort, a missed one is reported twice */
+			if (fluffy_str_table_replace(ctxinfop->synth_table,
+			    path, NULL)) {
+				/* Nothing */
+			}
+			__atomic_store_n(&ctxinfop->nsynth,
+			    ctxinfop->synth_table->nused, __ATOMIC_RELEASE);
+		}
 
-	m = fluffy_unref(fluffy_handle);
-	if (m != 0) {
-		/* can't do anything about it */
+		if (is_dir && (mask & IN_CREATE)) {
+			char **newdirs = fluffy_realloc(*newdirsp,
+					    (*nnewdirsp + 1) * sizeof(char *));
+			if (newdirs == NULL) {
+				perror("realloc");
+				return ENOMEM;
+			}
+			*newdirsp = newdirs;
+			newdirs[*nnewdirsp] = fluffy_strdup(path);
+			if (newdirs[*nnewdirsp] == NULL) {
+				perror("strdup");
+				return ENOMEM;
+			}
+			(*nnewdirsp)++;
+		}
 	}
-}
 
+	for (j = 0; j < oldsnap->size; j++) {
+		struct fluffy_snap_slot *slotp = &oldsnap->slots[j];
+		if (slotp->name == SNAP_EMPTY || slotp->name == SNAP_TOMB) {
+			continue;
+		}
 
-int
-fluffy_reinitiate_all_contexts()
-{
-	if (fluffy_is_track_setup()) {
-		return -1;
-	}
+		const char *name = oldsnap->names + slotp->name + 1;
+		if (fluffy_snap_find(newsnap, name, slotp->hash) != NULL) {
+			continue;
+		}
+
+		int len = snprintf(path, sizeof(path), "%s%s%s", dirpath,
+			    sep, name);
+		if (len < 0 || (size_t)len >= sizeof(path) ||
+		    fluffy_is_excluded(ctxinfop, rootinfop, path)) {
+			continue;
+		}
 
-	if(g_hash_table_size(fluffy_track.context_table) > 0) {
-		g_hash_table_foreach(fluffy_track.context_table,
-		    (GHFunc) reinit_each_context_g, NULL);
+		uint32_t mask = IN_DELETE;
+		if (oldsnap->names[slotp->name] == 'd') {
+			mask |= IN_ISDIR;
+		}
+		if (fluffy_queue_pending_event(ctxinfop, mask, path)) {
+			return ENOMEM;
+		}
 	}
 
 	return 0;
 }
 
+
 /*
- * Function:	fluffy_reinitate_context
+ * Function:	fluffy_handle_addition
  *
- * Cleanup the records and reset watches on the root paths
+ * Set watch on the path. A wrapper function of fluffy_add_watch. With
+ * FLUFFY_OPT_SCAN_NEW_DIRS set, entries found within a newly created
+ * directory are reported as created.
  *
  * args:
  * 	- int: fluffy context handle
+ * 	- struct inotify_event *: a pointer to the inotify event
+ * 	- struct fluffy_wd_info *: a pointer to the associated watch info
  * return:
- * 	- int: 0 when successful, error value otherwise
+ * 	- int: 0 when successful, error value otherwise to terminate context
  */
-int
-fluffy_reinitiate_context(int fluffy_handle)
+static int
+fluffy_handle_addition(int fluffy_handle, struct inotify_event *ievent,
+    struct fluffy_wd_info *wdinfop)
 {
-	int reterr = 0;
-
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
 
-	/* Cleanup the context records and close the inotify instance */
-	reterr = fluffy_cleanup_context_info_records(fluffy_handle);
+	int reterr = 0;
+	char *currpath = NULL;
+	currpath = form_event_path(wdinfop->path,
+			ievent->len,
+			ievent->name);
+	if (currpath == NULL) {
+		return -1;
+	}
+
+	/*
+	 * Entries may have been created within a new directory before the
+	 * watch was set on it; mkdir -p, tar -x, cp -r. inotify will never
+	 * report them. When asked to, report whatever the walk finds as
+	 * created. Entries created after the watch was set are reported by
+	 * inotify as well, fluffy_handoff_event() drops those duplicates.
+	 */
+	uint32_t report_mask = 0;
+	if ((ctxinfop->options & FLUFFY_OPT_SCAN_NEW_DIRS) &&
+	    (ievent->mask & IN_CREATE)) {
+		report_mask = IN_CREATE;
+	}
+
+	/* Don't bother with the walk if the directory is excluded */
+	int m = -1;
+	int is_excluded = 0;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_free(currpath);
+		return -1;
+	}
+	is_excluded = fluffy_is_excluded(ctxinfop,
+			fluffy_get_root_info(ctxinfop, currpath),
+			currpath);
+
+	/*
+	 * A directory already watched, or synthesized, by the scan of its
+	 * parent has had its entries reported by that scan. Only pick up
+	 * the watches.
+	 */
+	if (report_mask &&
+	    (fluffy_path_lookup(ctxinfop, currpath) != NULL ||
+	    fluffy_str_table_lookup(ctxinfop->synth_table, currpath,
+	    NULL))) {
+		report_mask = 0;
+	}
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0 || is_excluded) {
+		fluffy_free(currpath);
+		return (m != 0) ? -1 : 0;
+	}
+
+	/* Since this path is already in our records, it's a real path */
+	reterr = fluffy_add_watch(fluffy_handle, currpath, 0, NULL,
+			report_mask, -1);
 	if (reterr) {
-		return reterr;
+		PRINT_STDERR("%s\n", strerror(reterr));
 	}
 
-	/* Acquire a fresh queue */
-	reterr = fluffy_initiate_inotify(fluffy_handle);
+	fluffy_free(currpath);
+	currpath = NULL;
 	if (reterr) {
 		return reterr;
 	}
 
-	/* Set watches on the root paths */
-	g_hash_table_foreach(ctxinfop->root_path_table,
-	    (GHFunc) watch_each_root_path_g, GINT_TO_POINTER(fluffy_handle));
-
-	return 0;
+	return fluffy_flush_pending_events(fluffy_handle, 0);
 }
 
-
 /*
- * Function:	fluffy_initiate_epoll
+ * Function:	fluffy_handle_frontier
  *
- * Creates an epoll instance for this fluffy context. Does not poll on
- * a fd yet, no epoll_ctl.
+ * Activity within a directory at the frontier of a FLUFFY_ROOT_LAZY root,
+ * deepen the watches by one level; its subdirectories are watched and
+ * become the frontier instead. Nothing is done once the lazy watch budget
+ * of the root is spent.
  *
  * args:
- * 	int - fluffy_context_info.handle
+ * 	- int: fluffy context handle
+ * 	- struct fluffy_wd_info *: a pointer to the frontier watch info
  * return:
- * 	int - 0 if successful, error value otherwise
+ * 	- int: 0 when successful, error value otherwise to terminate context
  */
 static int
-fluffy_initiate_epoll(int fluffy_handle)
+fluffy_handle_frontier(int fluffy_handle, struct fluffy_wd_info *wdinfop)
 {
-	int ret = 0;
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
 
+	char *tp = NULL;
+	unsigned int depth = 0;
+
 	int m = -1;
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
@@ -1237,64 +11463,143 @@ fluffy_initiate_epoll(int fluffy_handle)
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
 
-	ctxinfop->epoll_fd = epoll_create(3);
-	if (ctxinfop->epoll_fd == -1) {
-		ret = errno;
-	}
+	do {
+		if (!wdinfop->is_frontier) {
+			break;
+		}
+
+		struct fluffy_root_info *rootinfop;
+		rootinfop = fluffy_get_root_info(ctxinfop, wdinfop->path);
+		if (rootinfop == NULL) {
+			wdinfop->is_frontier = 0;
+			break;
+		}
+
+		/* Stays a frontier, the budget may be given back later */
+		if (rootinfop->lazy_max_watches &&
+		    rootinfop->nlazy_watches >= rootinfop->lazy_max_watches) {
+			break;
+		}
+
+		wdinfop->is_frontier = 0;
+		depth = wdinfop->depth;
+		tp = fluffy_strdup(wdinfop->path);
+		if (tp == NULL) {
+			perror("strdup");
+		}
+	} while (0);
 
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return ret;
-}
 
+	if (tp == NULL) {
+		return 0;
+	}
+
+	/*
+	 * Best effort, the directory may be gone by now. Its removal is
+	 * reported anyway.
+	 */
+	int reterr = 0;
+	reterr = fluffy_add_watch(fluffy_handle, tp, 0, NULL, 0,
+			(int)depth + 1);
+	if (reterr) {
+		PRINT_STDERR("Couldnot deepen %s\n", tp);
+	}
+	fluffy_free(tp);
+
+	return 0;
+}
 
 /*
- * Function:	fluffy_setup_context
+ * Function:	fluffy_retire_wd
  *
- * Initialize/create context records, epoll instance to listen on the
- * initialized inotify instance for this fluffy_context_info.
+ * Drop the records of a watch inotify is done with. The context mutex must
+ * be held.
  *
  * args:
- * 	int - fluffy_context_info.handle
- * return:
- * 	int - 0 on success, error value otherwise
+ * 	- struct fluffy_context_info *: the context
+ * 	- struct fluffy_wd_info *: the watch, its wd was read off the event
+ * 	- const char *: a copy of its path, or its path if it's dying
  */
-static int
-fluffy_setup_context(int fluffy_handle)
+static void
+fluffy_retire_wd(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop, const char *tp)
 {
-	int reterr = 0;
+	/*
+	 * The records may have been dropped, all of them, by a reinitiation
+	 * since the event was read; this one is retired then. Leave it be.
+	 */
+	if (fluffy_wd_lookup(ctxinfop, wdinfop->wd) != wdinfop) {
+		PRINT_STDERR("Couldnot remove %d from the table\n", \
+				wdinfop->wd);
+		return;
+	}
 
-	reterr = fluffy_setup_context_info_records(fluffy_handle);
-	if (reterr) {
-		return reterr;
+	/* The watch budget demoted it */
+	if (wdinfop->mask == 0 && ctxinfop->ndemoting > 0) {
+		(ctxinfop->ndemoting)--;
 	}
 
-	reterr = fluffy_initiate_epoll(fluffy_handle);
-	if (reterr) {
-		return reterr;
+	/*
+	 * Out of the directory node tree. Watches of the subdirectories, if
+	 * any are left, are on their way out as well; leave them be as top
+	 * nodes until their turn comes.
+	 */
+	fluffy_unlink_wd_node(wdinfop);
+	while (wdinfop->first_child != NULL) {
+		struct fluffy_wd_info *childp = wdinfop->first_child;
+		wdinfop->first_child = childp->next_sibling;
+		childp->parent = NULL;
+		childp->prev_sibling = NULL;
+		childp->next_sibling = NULL;
 	}
 
-	reterr = fluffy_initiate_inotify(fluffy_handle);
-	if (reterr) {
-		return reterr;
+	/*
+	 * Give the watch back to the lazy root it was spent from; a dying one
+	 * gave it back when it was marked.
+	 */
+	struct fluffy_root_info *rootinfop = NULL;
+	if (!wdinfop->is_dying) {
+		rootinfop = fluffy_get_root_info(ctxinfop, tp);
+	}
+	if (rootinfop != NULL				&&
+	    (rootinfop->flags & FLUFFY_ROOT_LAZY)	&&
+	    wdinfop->depth > rootinfop->lazy_depth	&&
+	    rootinfop->nlazy_watches > 0) {
+		(rootinfop->nlazy_watches)--;
 	}
 
-	return 0;
+	/* A later watch of the same path may have replaced it */
+	fluffy_path_remove(ctxinfop, wdinfop);
+	ctxinfop->watch_bytes -= fluffy_wd_info_size(wdinfop);
+	if (fluffy_str_table_remove(ctxinfop->root_path_table, tp)) {
+		fluffy_sync_root(ctxinfop, tp);
+	}
+
+	/* Only the context thread reads without the mutex, it's done */
+	fluffy_wd_remove(ctxinfop, wdinfop);
+	fluffy_wd_info_free(ctxinfop, wdinfop);
+
+	(ctxinfop->nwd)--;
 }
 
 /*
- * Function:	fluffy_is_root_path
+ * Function:	fluffy_handle_ignored
  *
- * Check whether the path is a root path. Root paths are what the client
- * adds to the watch.
+ * When an ignored event is caught, it means the path is not under inotify's
+ * watch anymore. Cleanup fluffy records to remove the path to prevent holding
+ * stale entries.
  *
  * args:
- * 	- int:	fluffy context handle
- * 	- char *: a char pointer to the path
+ * 	- int: fluffy context handle
+ * 	- struct inotify_event *: a pointer to the inotify event
+ * 	- struct fluffy_wd_info *: a pointer to the associated watch info
  * return:
- * 	- int:	0 when it's a root path, error value otherwise
+ * 	- int: 0 when successful, error value otherwise to terminate context
  */
 static int
-fluffy_is_root_path(int fluffy_handle, char *path)
+fluffy_handle_ignored(int fluffy_handle, struct inotify_event *ievent,
+    struct fluffy_wd_info *wdinfop)
 {
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
@@ -1302,111 +11607,130 @@ fluffy_is_root_path(int fluffy_handle, char *path)
 		return -1;
 	}
 
+	char *tp;
+	tp = fluffy_strdup(wdinfop->path);
+	if (tp == NULL) {
+		return -1;
+	}
+
 	int m = -1;
-	int reterr = 0;
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
+		fluffy_free(tp);
 		return -1;
 	}
 
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
-
-	do {
-		if (!g_hash_table_contains(ctxinfop->root_path_table, path)) {
-			reterr = 1;
-			break;
-		}
-	} while(0);
+	fluffy_retire_wd(ctxinfop, wdinfop, tp);
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return reterr;
+	fluffy_free(tp);
+
+	return 0;
 }
 
 /*
- * Function:	fluffy_handle_qoverflow
+ * Function:	fluffy_mark_dying
  *
- * On an IN_Q_OVERFLOW event, reinitate inotify instance and the associated
- * records. This is to setup watches from scratch again because events were
- * possibly dropped when the queue was overflow. 
+ * Mark a watch whose IN_IGNORED is on its way, or soon will be, as dying.
+ * The event is swallowed when it's read and the records are retired along
+ * with the rest of the dying watches read in a row, under one lock. The
+ * watch is given back to the lazy root it was spent from right away. The
+ * context mutex must be held.
  *
  * args:
- * 	- int: fluffy context handle
- * return:
- * 	- int: 0 when successful, error value otherwise
+ * 	- struct fluffy_context_info *: the context
+ * 	- struct fluffy_wd_info *: the watch, not a root path
+ * 	- struct fluffy_root_info *: root info of the topmost node above it in
+ * 		the directory node tree, NULL to have it looked up
  */
-static int
-fluffy_handle_qoverflow(int fluffy_handle)
+static void
+fluffy_mark_dying(struct fluffy_context_info *ctxinfop,
+    struct fluffy_wd_info *wdinfop, struct fluffy_root_info *toprootp)
 {
-	int reterr = 0;
-	/*
-	 * TODO:
-	 * This decision must be made by the user. Bring in a field to
-	 * accommodate this preference. Context termination probably makes
-	 * more sense than reinitation as a default action unless otherwise the
-	 * user prefers to reinitiate.
-	 */
-	reterr = fluffy_reinitiate_context(fluffy_handle);
-	if (reterr) {
-		PRINT_STDERR("Reinitiation failed!\n", "");
-		return reterr;
+	if (wdinfop->is_dying) {
+		return;
+	}
+
+	/* The nearest root path above it, there may be nested ones */
+	struct fluffy_wd_info *topp = wdinfop;
+	while (topp->parent != NULL && !topp->is_root) {
+		topp = topp->parent;
+	}
+
+	struct fluffy_root_info *rootinfop = toprootp;
+	if (topp->is_root) {
+		rootinfop = NULL;
+		fluffy_str_table_lookup(ctxinfop->root_path_table,
+		    topp->path, (void **)&rootinfop);
+	} else if (rootinfop == NULL) {
+		rootinfop = fluffy_get_root_info(ctxinfop, topp->path);
+	}
+	if (rootinfop != NULL				&&
+	    (rootinfop->flags & FLUFFY_ROOT_LAZY)	&&
+	    wdinfop->depth > rootinfop->lazy_depth	&&
+	    rootinfop->nlazy_watches > 0) {
+		(rootinfop->nlazy_watches)--;
 	}
-	return 0;
-}
 
+	__atomic_store_n(&wdinfop->is_dying, 1, __ATOMIC_RELEASE);
+}
 
 /*
- * Function:	fluffy_handle_addition
+ * Function:	fluffy_retire_dying
  *
- * Set watch on the path. A wrapper function of fluffy_add_watch
+ * Retire the records of dying watches whose IN_IGNORED events were read, all
+ * of them under one lock.
  *
  * args:
  * 	- int: fluffy context handle
- * 	- struct inotify_event *: a pointer to the inotify event
- * 	- struct fluffy_wd_info *: a pointer to the associated watch info
+ * 	- struct fluffy_wd_info **: the dying watches, in the order read
+ * 	- size_t: number of them
  * return:
  * 	- int: 0 when successful, error value otherwise to terminate context
  */
 static int
-fluffy_handle_addition(int fluffy_handle, struct inotify_event *ievent,
-    struct fluffy_wd_info *wdinfop)
+fluffy_retire_dying(int fluffy_handle, struct fluffy_wd_info **dyingv,
+    size_t ndying)
 {
-	int reterr = 0;
-	char *currpath = NULL;
-	currpath = form_event_path(wdinfop->path,
-			ievent->len,
-			ievent->name);
-	if (currpath == NULL) {
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
 		return -1;
 	}
 
-	/* Since this path is already in our records, it's a real path */
-	reterr = fluffy_add_watch(fluffy_handle, currpath, 0, 0);
-	if (reterr) {
-		PRINT_STDERR("%s\n", strerror(reterr));
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
 	}
 
-	free(currpath);
-	currpath = NULL;
-	return reterr;
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+	size_t j;
+	for (j = 0; j < ndying; j++) {
+		fluffy_retire_wd(ctxinfop, dyingv[j], dyingv[j]->path);
+	}
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	return 0;
 }
 
 /*
- * Function:	fluffy_handle_ignored
+ * Function:	fluffy_handle_delete_self
  *
- * When an ignored event is caught, it means the path is not under inotify's
- * watch anymore. Cleanup fluffy records to remove the path to prevent holding
- * stale entries.
+ * A watched directory below a root path was deleted; the parent directory
+ * reported it already. Its IN_IGNORED follows, mark it dying so that a
+ * rm -rf of a large tree isn't a storm of events.
  *
  * args:
  * 	- int: fluffy context handle
- * 	- struct inotify_event *: a pointer to the inotify event
  * 	- struct fluffy_wd_info *: a pointer to the associated watch info
  * return:
  * 	- int: 0 when successful, error value otherwise to terminate context
  */
 static int
-fluffy_handle_ignored(int fluffy_handle, struct inotify_event *ievent,
-    struct fluffy_wd_info *wdinfop)
+fluffy_handle_delete_self(int fluffy_handle, struct fluffy_wd_info *wdinfop)
 {
 	struct fluffy_context_info *ctxinfop;
 	ctxinfop = fluffy_get_context_info(fluffy_handle);
@@ -1414,9 +11738,6 @@ fluffy_handle_ignored(int fluffy_handle, struct inotify_event *ievent,
 		return -1;
 	}
 
-	char *tp;
-	tp = strdup(wdinfop->path);
-
 	int m = -1;
 	m = pthread_mutex_lock(&ctxinfop->mutex);
 	if (m != 0) {
@@ -1425,22 +11746,10 @@ fluffy_handle_ignored(int fluffy_handle, struct inotify_event *ievent,
 
 	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
 	    &ctxinfop->mutex);
-
-	if (!g_hash_table_remove(ctxinfop->path_table, (const char *)tp)) {
-		PRINT_STDERR("Couldnot remove %s from the table\n", \
-				tp);
+	if (!__atomic_load_n(&wdinfop->is_root, __ATOMIC_ACQUIRE)) {
+		fluffy_mark_dying(ctxinfop, wdinfop, NULL);
 	}
-	if (!g_hash_table_remove(ctxinfop->wd_table,
-	    GINT_TO_POINTER(ievent->wd))) {
-		PRINT_STDERR("Couldnot remove %d from the table\n", \
-				ievent->wd);
-	}
-
-	g_hash_table_remove(ctxinfop->root_path_table, (const char *)tp);
-
-	(ctxinfop->nwd)--;
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	free(tp);
 
 	return 0;
 }
@@ -1474,7 +11783,7 @@ fluffy_handle_moved_from(int fluffy_handle, struct inotify_event *ievent,
 		/* Nothing? */
 	}
 
-	free(movepath);
+	fluffy_free(movepath);
 	movepath = NULL;
 
 	return  reterr;
@@ -1502,7 +11811,6 @@ fluffy_handle_removal(int fluffy_handle, char *removethis)
 
 	int reterr = 0;
 	struct fluffy_wd_info *toremwd;
-	gpointer wdtp = NULL;
 
 	int m = -1;
 	m = pthread_mutex_lock(&ctxinfop->mutex);
@@ -1523,61 +11831,64 @@ fluffy_handle_removal(int fluffy_handle, char *removethis)
 	 * 		- /hogwarts/dungeons/lakeside
 	 * 		- /hogwarts/dungeons/southwing
 	 *
-	 * First /hogwarts/dungeons will be removed from fluffy records. After
-	 * which, the path tree will be searched for strings that start with
-	 * /hogwarts/dungeons/. One by one, each of the descendants are
-	 * removed until there's none left.
+	 * /hogwarts/dungeons is detached from the directory node tree, its
+	 * descendants go along with it. The detached subtree is then walked
+	 * in pre-order, removing the inotify watch of every node. The records
+	 * are removed as the IN_IGNORED events of these watches are caught.
 	 */
 	do {
-		/* Get the watch descriptor of the path to be removed */
-		toremwd = (struct fluffy_wd_info *)g_hash_table_lookup(
-				ctxinfop->path_table, cmp_for_each_path);
-		if (toremwd == NULL) {
-			PRINT_STDERR("Could not lookup path %s\n", \
-			    cmp_for_each_path);
-			cmp_for_each_path = NULL;
-			reterr = -1;
+		/* A fanotify context has marks rather than watches */
+		if (ctxinfop->fan_mark != 0) {
+			reterr = fluffy_fan_remove_root(ctxinfop,
+					cmp_for_each_path);
 			break;
 		}
 
-		/* Remove fluffy records of /hogwarts/dungeons */
-		if (!g_tree_remove(ctxinfop->path_tree,
-		    (const char *)cmp_for_each_path)) {
-			PRINT_STDERR("Couldnot remove %s from the tree\n", \
-					cmp_for_each_path);
+		/* Get the watch descriptor of the path to be removed */
+		toremwd = fluffy_path_lookup(ctxinfop, cmp_for_each_path);
+
+		/* Polled rather than watched; nothing for inotify to report */
+		if (toremwd == NULL && ctxinfop->npolled > 0 &&
+		    fluffy_str_table_lookup(ctxinfop->poll_table,
+		    cmp_for_each_path, NULL)) {
+			if (fluffy_str_table_lookup(ctxinfop->root_path_table,
+			    cmp_for_each_path, NULL)) {
+				reterr = fluffy_poll_remove_root(ctxinfop,
+						cmp_for_each_path, 0);
+			} else {
+				fluffy_poll_remove_subtree(ctxinfop,
+				    cmp_for_each_path);
+			}
+			break;
 		}
 
-		int iwdtmp = -1;
-		/* Remove inotify watch on /hogwarts/dungeons */
-		iwdtmp = inotify_rm_watch(ctxinfop->inotify_fd, toremwd->wd);
-		if (iwdtmp == -1) {
-			reterr = errno;
-			perror("inotify_rm_watch");
+		if (toremwd == NULL) {
+			PRINT_STDERR("Could not lookup path %s\n", \
+			    cmp_for_each_path);
 			cmp_for_each_path = NULL;
+			reterr = -1;
 			break;
 		}
-		toremwd = NULL;
 
-		/* Lookup for descendants one after another and remove */
-		while (1) {
-			/* Return the first descendant entry that matches */
-			wdtp = g_tree_search(ctxinfop->path_tree,
-					(GCompareFunc)search_tree_g,
-					(gpointer)cmp_for_each_path);
-			if (wdtp == NULL) {
-				break;
-			}
+		/* A later removal of an ancestor must not come across these */
+		fluffy_unlink_wd_node(toremwd);
 
-			/*
-			 * On the first iteration /hogwarts/dungeons/eastwing
-			 * will be returned. On consequent iterations, other
-			 * descendants will be found and returned as well.
-			 */
+		struct fluffy_root_info *toprootp = NULL;
+		if (!toremwd->is_root) {
+			toprootp = fluffy_get_root_info(ctxinfop,
+			    toremwd->path);
+		}
 
-			int iwd = -1;
-			/* Remove the inotify watch on the returned entry */
-			iwd = inotify_rm_watch(ctxinfop->inotify_fd,
-					GPOINTER_TO_INT(wdtp));
+		size_t ndying = 0;
+		struct fluffy_wd_info *nodep = toremwd;
+		while (nodep != NULL) {
+			int iwd = 0;
+			/* Remove the watch on this node, if it's left */
+			if (nodep->mask != 0) {
+				iwd = ctxinfop->backend->rm_watch_fn(
+					    ctxinfop->inotify_fd,
+					    nodep->wd);
+			}
 			if (iwd == -1) {
 				reterr = errno;
 				perror("inotify_rm_watch");
@@ -1585,33 +11896,47 @@ fluffy_handle_removal(int fluffy_handle, char *removethis)
 				break;
 			}
 
-			struct fluffy_wd_info *thiswd;
-			thiswd = (struct fluffy_wd_info *)g_hash_table_lookup(
-					ctxinfop->wd_table, wdtp);
-			if (thiswd == NULL) {
-				PRINT_STDERR("Could not lookup wd %d\n", \
-						GPOINTER_TO_INT(wdtp));
-				cmp_for_each_path = NULL;
-				reterr = -1;
-				break;
-			}
-			/* Remove fluffy records of the returned entry */
-			if (!g_tree_remove(ctxinfop->path_tree,
-			    (const char *)thiswd->path)) {
-				PRINT_STDERR("Couldnot remove %s " \
-				    "from the tree\n", thiswd->path);
+			/*
+			 * Only the IN_IGNORED of the path itself and of the
+			 * root paths within are reported, the rest die quietly
+			 */
+			if (nodep != toremwd && !nodep->is_root) {
+				fluffy_mark_dying(ctxinfop, nodep, toprootp);
+				ndying++;
 			}
-			thiswd = NULL;
 
 			/*
-			 * Now that this entry has been removed, continue to
-			 * lookup for descendants. No more dungeons in the
-			 * eastwing, move along to find the other dungeons.
+			 * Next in pre-order, never beyond /hogwarts/dungeons.
+			 * Down to the first child if there's one, otherwise to
+			 * the next sibling of the nearest node that has one.
 			 */
+			if (nodep->first_child != NULL) {
+				nodep = nodep->first_child;
+				continue;
+			}
+			while (nodep != toremwd &&
+			    nodep->next_sibling == NULL) {
+				nodep = nodep->parent;
+			}
+			nodep = (nodep == toremwd) ? NULL :
+			    nodep->next_sibling;
+		}
+		toremwd = NULL;
+
+		/* Directories below it that are polled go along */
+		if (reterr == 0) {
+			fluffy_poll_remove_subtree(ctxinfop, removethis);
+		}
+
+		/* One event for the watches that died quietly */
+		if (reterr == 0 && ndying > 0 &&
+		    (ctxinfop->options & FLUFFY_OPT_SUBTREE_SUMMARY)) {
+			reterr = fluffy_queue_pending_event(ctxinfop,
+				     FLUFFY_SUBTREE_REMOVED | FLUFFY_ISDIR,
+				     removethis);
 		}
 	} while(0);
 	pthread_cleanup_pop(1);		/* Unlock mutex */
-	wdtp = NULL;
 	cmp_for_each_path = NULL;
 
 	return reterr;
@@ -1643,12 +11968,30 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 		return -1;
 	}
 
+	/* A raise of the queue limit puts this one aside, look after it */
+	if (evlist->data.fd == ctxinfop->inotify_fd &&
+	    (evlist->events & EPOLLIN)) {
+		reterr = fluffy_check_queue_pressure(fluffy_handle);
+		if (reterr) {
+			return reterr;
+		}
+	}
 
-	if (evlist->data.fd != ctxinfop->inotify_fd) {
+	struct fluffy_watch_gen *oldgenp;
+	oldgenp = __atomic_load_n(&ctxinfop->old_gen, __ATOMIC_ACQUIRE);
+	int is_old_fd = (oldgenp != NULL &&
+	    evlist->data.fd == oldgenp->inotify_fd);
+	if (evlist->data.fd != ctxinfop->inotify_fd && !is_old_fd) {
 		PRINT_STDERR("Incorrect file descriptor\n", "");
 		return 1;
 	}
 
+	/* The old instance is on its way out anyway */
+	if (is_old_fd &&
+	    ((evlist->events & EPOLLERR) || (evlist->events & EPOLLHUP))) {
+		return 0;
+	}
+
 	if ((evlist->events & EPOLLERR) || (evlist->events & EPOLLHUP)) {
 		reterr = fluffy_cleanup_context_info_records(fluffy_handle);
 		if (reterr) {
@@ -1663,7 +12006,7 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 	}
 
 	char *iebuf;	/* inotify events buffer */
-	iebuf = calloc(NR_INOTIFY_EVENTS,
+	iebuf = fluffy_calloc(NR_INOTIFY_EVENTS,
 			sizeof(struct inotify_event) + NAME_MAX + 1);
 	if (iebuf == NULL) {
 		reterr = errno;
@@ -1672,12 +12015,19 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 	}
 
 	/* Get the inotify event */
-	nrbytes = read(evlist->data.fd, iebuf,
+	const struct fluffy_backend *backendp = is_old_fd ?
+	    oldgenp->backend : ctxinfop->backend;
+	nrbytes = backendp->read_fn(evlist->data.fd, iebuf,
 			NR_INOTIFY_EVENTS *
 			(sizeof(struct inotify_event) +
 			 NAME_MAX + 1));
 	if (nrbytes == -1) {
 		reterr = errno;
+		/* The fake backend's, read off by an earlier wakeup */
+		if (reterr == EAGAIN) {
+			fluffy_free(iebuf);
+			return 0;
+		}
 		perror("read");
 		return  reterr;
 	}
@@ -1685,22 +12035,50 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 		return -1;
 	}
 
+	/*
+	 * Entries reported by a walk, an inventory especially, must reach the
+	 * client before any event that inotify raised on them. Whatever was
+	 * just read may be such an event if a walk is still in progress.
+	 */
+	reterr = fluffy_flush_pending_events(fluffy_handle, 1);
+	if (reterr) {
+		fluffy_free(iebuf);
+		return reterr;
+	}
+
 	/*
 	 * inotify event pointer to traverse the events in the buffer, maximum
 	 * of NR_INOTIFY_EVENTS events.
 	 */
 	struct inotify_event *ievent = NULL;
 	char *p = NULL;
+	size_t nevents = 0;
+	struct fluffy_wd_info *dyingv[DYING_BATCH];
+	size_t ndying = 0;
+
+	/* Storm detection as it is for this batch */
+	struct fluffy_storm_detection storm = {0};
+	if (__atomic_load_n(&ctxinfop->is_storm, __ATOMIC_ACQUIRE)) {
+		if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+			storm = ctxinfop->storm;
+			pthread_mutex_unlock(&ctxinfop->mutex);
+		}
+	}
+
 	for (p = iebuf; p < iebuf + nrbytes; ) {
 		ievent = (struct inotify_event *) p;
 		/* Prepare the pointer for the next event processing */
 		p += sizeof(struct inotify_event) + ievent->len;
+		nevents++;
 
-		/* Get the associated info of this inotify watch descriptor */
+		/*
+		 * Get the associated info of this inotify watch descriptor,
+		 * of the old generation if a reinitiation is under way.
+		 */
 		struct fluffy_wd_info *wdinfop = NULL;
-		wdinfop = (struct fluffy_wd_info *)g_hash_table_lookup(
-				ctxinfop->wd_table,
-				GINT_TO_POINTER(ievent->wd));
+		struct fluffy_watch_gen *genp = NULL;
+		wdinfop = fluffy_event_wd_lookup(ctxinfop, evlist->data.fd,
+				ievent->wd, &genp);
 		/*
 		 * If the event is a IN_Q_OVERFLOW, there will be no associated
 		 * watch descriptor. The lookup will fail, so rule out this
@@ -1713,16 +12091,76 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 			continue;
 		}
 
+		/*
+		 * The IN_IGNORED of a dying watch is swallowed, its records
+		 * are retired along with the rest of the dying ones read in a
+		 * row. Anything else has them retired first, in order.
+		 */
+		int is_dying = 0;
+		if (genp == NULL && (ievent->mask & IN_IGNORED) &&
+		    __atomic_load_n(&wdinfop->is_dying, __ATOMIC_ACQUIRE)) {
+			dyingv[ndying++] = wdinfop;
+			if (ndying < DYING_BATCH) {
+				continue;
+			}
+			is_dying = 1;
+		}
+		if (ndying > 0) {
+			reterr = fluffy_retire_dying(fluffy_handle, dyingv,
+					ndying);
+			if (reterr) {
+				return reterr;
+			}
+			ndying = 0;
+			if (is_dying) {
+				continue;
+			}
+		}
+
 		/*
 		 * Even if it's a IN_Q_OVERFLOW event, handoff regardless. The
 		 * fluffy_handoff_event will take care of it. Do not have to
-		 * worry about wdinfop being NULL.
+		 * worry about wdinfop being NULL. Events that the old instance
+		 * of a reinitiation delivered already are not handed off.
 		 */
-		if(fluffy_handoff_event(fluffy_handle,
-		    ievent, wdinfop) != 0) {
+		int is_dup = 0;
+		if (genp == NULL) {
+			is_dup = fluffy_is_dup_event(ctxinfop, ievent, wdinfop);
+		}
+
+		/* Held back while its subtree is in a storm, still acted on */
+		int is_held = 0;
+		if (!is_dup && genp == NULL && storm.rate != 0	&&
+		    !(ievent->mask & STORM_EXEMPT_FLAGS)) {
+			is_held = fluffy_storm_event(ctxinfop, &storm,
+				      wdinfop);
+		}
+
+		if (!is_dup && !is_held && fluffy_handoff_event(fluffy_handle,
+		    ievent, wdinfop, genp) != 0) {
 			return -1; /* A non-zero return terminates context */
 		}
 
+		/*
+		 * The old instance only delivers, and has new directories
+		 * watched; the new instance, set up in the meantime, sees to
+		 * the rest. If the old one overflows, there's no telling what
+		 * it dropped.
+		 */
+		if (genp != NULL) {
+			if (ievent->mask & IN_Q_OVERFLOW) {
+				genp->is_lossy = 1;
+			} else if ((ievent->mask & (IN_CREATE | IN_MOVED_TO)) &&
+			    (ievent->mask & IN_ISDIR)) {
+				reterr = fluffy_handle_addition(fluffy_handle,
+						ievent, wdinfop);
+				if (reterr) {
+					return reterr;
+				}
+			}
+			continue;
+		}
+
 		/*
 		 * Event has been reported to the client, now handle it to suit
 		 * our functionalities.
@@ -1730,12 +12168,24 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 
 		/* Handle queue overflow */
 		if (ievent->mask & IN_Q_OVERFLOW) {
-			PRINT_STDERR("Queue overflow, " \
-				"reinitiating all watches!\n", "");
-			if (fluffy_handle_qoverflow(fluffy_handle)) {
+			if (!is_dup && fluffy_handle_qoverflow(fluffy_handle)) {
 				return  -1;
 			}
-			break;
+			continue;
+		}
+
+		/* Keep the snapshot of the directory up to date */
+		if (ievent->len > 0				&&
+		    (ievent->mask & SNAP_EVENT_FLAGS)		&&
+		    (ctxinfop->options & FLUFFY_OPT_OVERFLOW_RESCAN)) {
+			fluffy_snap_event(ctxinfop, ievent, wdinfop);
+		}
+
+		/* Active, ranked hot by the watch budget; reads don't count */
+		if ((ievent->mask & LAZY_ACTIVITY_FLAGS) &&
+		    __atomic_load_n(&ctxinfop->is_budget, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&wdinfop->seen, ctxinfop->budget_pass,
+			    __ATOMIC_RELAXED);
 		}
 
 		/*
@@ -1767,21 +12217,27 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 
 		}
 
+		/* Activity at the frontier of a lazy root, deepen it */
+		if (__atomic_load_n(&wdinfop->is_frontier, __ATOMIC_ACQUIRE) &&
+		    (ievent->mask & LAZY_ACTIVITY_FLAGS)) {
+			reterr = fluffy_handle_frontier(fluffy_handle,
+					wdinfop);
+			if (reterr) {
+				return reterr;
+			}
+		}
+
 		/*
 		 * If a root path itself moves, remove the watches set on it
 		 * recursively. This is only for the root path self moves,
 		 * descendant path self moves are handled indirectly.
 		 */
-		if ((ievent->mask & IN_MOVE_SELF)) {
-			reterr = fluffy_is_root_path(fluffy_handle,
+		if ((ievent->mask & IN_MOVE_SELF) &&
+		    __atomic_load_n(&wdinfop->is_root, __ATOMIC_ACQUIRE)) {
+			reterr = fluffy_handle_removal(fluffy_handle,
 					wdinfop->path);
-			if (reterr == 0) {
-				reterr = fluffy_handle_removal(
-						fluffy_handle,
-						wdinfop->path);
-				if (reterr) {
-					return reterr;
-				}
+			if (reterr) {
+				return reterr;
 			}
 		}
 
@@ -1793,14 +12249,193 @@ fluffy_process_inotify_queue(int fluffy_handle, struct epoll_event *evlist)
 			}
 		}
 
-
+		/* A subdirectory deleted, its IN_IGNORED needn't be reported */
+		if ((ievent->mask & IN_DELETE_SELF) &&
+		    !__atomic_load_n(&wdinfop->is_root, __ATOMIC_ACQUIRE)) {
+			reterr = fluffy_handle_delete_self(fluffy_handle,
+					wdinfop);
+			if (reterr) {
+				return reterr;
+			}
+		}
 	}
-	free(iebuf);
+	fluffy_free(iebuf);
 	iebuf = NULL;
+
+	if (ndying > 0) {
+		reterr = fluffy_retire_dying(fluffy_handle, dyingv, ndying);
+		if (reterr) {
+			return reterr;
+		}
+	}
+
+	/* Weighs the bytes queued in events, for the queue pressure */
+	if (nevents > 0) {
+		ctxinfop->event_bytes = (ctxinfop->event_bytes * 7 +
+		    (unsigned int)(nrbytes / nevents)) / 8;
+	}
+
+	/* The last batch may leave it empty, nothing would wake it then */
+	if (ctxinfop->is_pressured &&
+	    evlist->data.fd == ctxinfop->inotify_fd) {
+		reterr = fluffy_check_queue_pressure(fluffy_handle);
+		if (reterr) {
+			return reterr;
+		}
+	}
+
+	/*
+	 * Duplicates of synthesized CREATE events can only be queued up to
+	 * the point the synthesis happened. When nothing is left to be read,
+	 * they have all been seen; forget the synthesized paths.
+	 */
+	if (__atomic_load_n(&ctxinfop->nsynth, __ATOMIC_ACQUIRE) > 0) {
+		int nqueued = 0;
+		if (ctxinfop->backend->nread_fn(ctxinfop->inotify_fd,
+		    &nqueued) == 0 && nqueued == 0) {
+			int m = -1;
+			m = pthread_mutex_lock(&ctxinfop->mutex);
+			if (m != 0) {
+				return -1;
+			}
+
+			pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+			    &ctxinfop->mutex);
+			fluffy_str_table_remove_all(ctxinfop->synth_table);
+			__atomic_store_n(&ctxinfop->nsynth, 0,
+			    __ATOMIC_RELEASE);
+			pthread_cleanup_pop(1);		/* Unlock mutex */
+		}
+	}
+
 	return  0;
 }
 
 
+/*
+ * Function:	fluffy_process_fanotify_queue
+ *
+ * Read the events of the fanotify marks. They're resolved to their paths
+ * and filtered by the root paths with the context mutex held, queued as
+ * pending events, then handed off in order once it's released.
+ *
+ * args:
+ * 	- int:	fluffy context handle
+ * 	- struct epoll_event: structure pointer of the event info from epoll
+ * return:
+ * 	- int:	0 when successful, error value otherwise to terminate context
+ */
+static int
+fluffy_process_fanotify_queue(int fluffy_handle, struct epoll_event *evlist)
+{
+	ssize_t nrbytes;
+	int reterr = 0;
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	if ((evlist->events & EPOLLERR) || (evlist->events & EPOLLHUP)) {
+		PRINT_STDERR("fanotify descriptor failed\n", "");
+		return -1;
+	}
+
+	if (!(evlist->events & EPOLLIN)) {
+		/* Shouldn't be happening */
+		return 0;
+	}
+
+	char *febuf;	/* fanotify events buffer */
+	febuf = fluffy_malloc(FANOTIFY_BUF_SIZE);
+	if (febuf == NULL) {
+		reterr = errno;
+		perror("malloc");
+		return reterr;
+	}
+
+	nrbytes = read(evlist->data.fd, febuf, FANOTIFY_BUF_SIZE);
+	if (nrbytes == -1) {
+		reterr = errno;
+		fluffy_free(febuf);
+		if (reterr == EAGAIN || reterr == EINTR) {
+			return 0;
+		}
+		perror("read");
+		return reterr;
+	}
+
+	int is_overflow = 0;
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		fluffy_free(febuf);
+		return -1;
+	}
+
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &ctxinfop->mutex);
+
+	/* Mounts don't report moves, paths are resolved afresh per batch */
+	if (ctxinfop->fan_mark == FAN_MARK_MOUNT) {
+		fluffy_str_table_remove_all(ctxinfop->fan_dir_table);
+	}
+
+	struct fanotify_event_metadata *metap;
+	for (metap = (struct fanotify_event_metadata *)febuf;
+	    FAN_EVENT_OK(metap, nrbytes);
+	    metap = FAN_EVENT_NEXT(metap, nrbytes)) {
+		if (metap->vers != FANOTIFY_METADATA_VERSION) {
+			PRINT_STDERR("fanotify metadata version mismatch\n",
+			    "");
+			reterr = -1;
+			break;
+		}
+
+		/* Not with file handles, but it must not leak if it's there */
+		if (metap->fd >= 0 && close(metap->fd) == -1) {
+			perror("close");
+		}
+
+		if (metap->mask & FAN_Q_OVERFLOW) {
+			is_overflow = 1;
+			continue;
+		}
+
+		if (fluffy_fan_event(ctxinfop, metap)) {
+			reterr = -1;
+			break;
+		}
+	}
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	fluffy_free(febuf);
+	if (reterr) {
+		return reterr;
+	}
+
+	reterr = fluffy_flush_pending_events(fluffy_handle, 0);
+	if (reterr) {
+		return reterr;
+	}
+
+	/* There's no watch to set again, what's lost is lost */
+	if (is_overflow) {
+		reterr = fluffy_dispatch_event(fluffy_handle, IN_Q_OVERFLOW,
+				NULL);
+		if (reterr) {
+			return reterr;
+		}
+		if (ctxinfop->options & FLUFFY_OPT_OVERFLOW_TERMINATE) {
+			PRINT_STDERR("Queue overflow, terminating the "
+			    "context\n", "");
+			return -1;
+		}
+		PRINT_STDERR("Queue overflow, events were lost\n", "");
+	}
+
+	return 0;
+}
+
 /*
  * Function:	fluffy_thread_cleanup_unlock
  *
@@ -1847,76 +12482,194 @@ fluffy_setup_track()
 		return -1;
 	}
 
-	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
-	    &fluffy_track.mutex);
+	pthread_cleanup_push(fluffy_thread_cleanup_unlock,
+	    &fluffy_track.mutex);
+
+	do {
+		/* Return if fluffy_track has already been setup */
+		if (fluffy_track.is_init != 0) {
+			ret = 0;
+			break;
+		}
+
+		/* The handle registry is static, every slot starts vacant */
+		fluffy_track.idx = 0;		/* Initialize slot cursor */
+		__atomic_store_n(&fluffy_track.is_init, 1,
+		    __ATOMIC_RELEASE);		/* Mark setup success */
+	} while(0);
+
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+	return ret;
+}
+
+
+/*
+ * Function:	fluffy_is_track_setup
+ *
+ * Check if the global fluffy_track has been initialized and setup.
+ *
+ * args:
+ * 	void
+ * return:
+ * 	int - 0 if already setup, -1 otherwise
+ */
+static int
+fluffy_is_track_setup()
+{
+	if (__atomic_load_n(&fluffy_track.is_init, __ATOMIC_ACQUIRE) == 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Function:	fluffy_get_context_info
+ *
+ * Resolve a handle through the handle registry. It's wait-free; the slot
+ * state is read before and after the context pointer, a slot that was
+ * vacated or taken again in between doesn't resolve.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- A pointer to fluffy_context_info when the handle is live, NULL
+ * 	otherwise
+ */
+static struct fluffy_context_info *
+fluffy_get_context_info(int fluffy_handle)
+{
+	if (fluffy_handle < MAX_CONTEXTS) {
+		return NULL;
+	}
+
+	struct fluffy_handle_slot *slotp;
+	slotp = &fluffy_track.handles[fluffy_handle & (MAX_CONTEXTS - 1)];
+	uint32_t state;
+	state = ((uint32_t)fluffy_handle >> HANDLE_INDEX_BITS) << 1 | 1;
+	if (((uint32_t)__atomic_load_n(&slotp->state, __ATOMIC_ACQUIRE) &
+	    ~HANDLE_CLOSING) != state) {
+		return NULL;
+	}
+
+	struct fluffy_context_info *ctxinfop = NULL;
+	ctxinfop = __atomic_load_n(&slotp->ctxinfop, __ATOMIC_ACQUIRE);
+	if (((uint32_t)__atomic_load_n(&slotp->state, __ATOMIC_ACQUIRE) &
+	    ~HANDLE_CLOSING) != state) {
+		return NULL;
+	}
+
+	return ctxinfop;
+}
+
+/*
+ * Function:	fluffy_hold_context_info
+ *
+ * Resolve a handle and hold its context. A context held isn't torn down
+ * till it's released. Taken by calls from threads other than the context
+ * thread for as long as they use the context; the context thread doesn't
+ * need it, the context is torn down by it.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- A pointer to fluffy_context_info, to be released with
+ * 	fluffy_release_context_info(), when the handle is live and not being
+ * 	destroyed, NULL otherwise
+ */
+static struct fluffy_context_info *
+fluffy_hold_context_info(int fluffy_handle)
+{
+	if (fluffy_handle < MAX_CONTEXTS) {
+		return NULL;
+	}
+
+	struct fluffy_handle_slot *slotp;
+	slotp = &fluffy_track.handles[fluffy_handle & (MAX_CONTEXTS - 1)];
+	uint32_t live;
+	live = ((uint32_t)fluffy_handle >> HANDLE_INDEX_BITS) << 1 | 1;
 
+	/* A hold is only taken while the slot is live and not closing */
+	uint64_t state = __atomic_load_n(&slotp->state, __ATOMIC_ACQUIRE);
 	do {
-		/* Return if fluffy_track has already been setup */
-		if (fluffy_track.is_init != 0) {
-			ret = 0;
-			break;
-		}
-
-		/*
-		 * Initialize a table that holds context info of all fluffy
-		 * instances.
-		 */
-		fluffy_track.context_table = g_hash_table_new_full(
-						g_direct_hash,
-						g_direct_equal,
-						NULL,
-						(GDestroyNotify)
-						free_context_table_info_g);
-		if (fluffy_track.context_table == NULL) {
-			ret = -1;
-			break;
+		if ((uint32_t)state != live) {
+			return NULL;
 		}
+	} while (!__atomic_compare_exchange_n(&slotp->state, &state,
+	    state + HANDLE_HOLD, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-		fluffy_track.idx = 1;		/* Initialize fluffy_handle */
-		fluffy_track.is_init = 1;	/* Mark setup success */
-	} while(0);
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = __atomic_load_n(&slotp->ctxinfop, __ATOMIC_ACQUIRE);
+	if (pthread_equal(pthread_self(), ctxinfop->tid)) {
+		__atomic_sub_fetch(&slotp->state, HANDLE_HOLD,
+		    __ATOMIC_ACQ_REL);
+	}
 
-	pthread_cleanup_pop(1);		/* Unlock mutex */
-	return ret;
+	return ctxinfop;
 }
 
-
 /*
- * Function:	fluffy_is_track_setup
+ * Function:	fluffy_release_context_info
  *
- * Check if the global fluffy_track has been initialized and setup.
+ * Release a hold taken with fluffy_hold_context_info(). The context is
+ * freed when it was vacated meanwhile and this is the last hold.
  *
  * args:
- * 	void
+ * 	- struct fluffy_context_info *: context held
  * return:
- * 	int - 0 if already setup, -1 otherwise
+ * 	void
  */
-static int
-fluffy_is_track_setup()
+static void
+fluffy_release_context_info(struct fluffy_context_info *ctxinfop)
 {
-	if (fluffy_track.is_init == 0) {
-		return -1;
+	if (pthread_equal(pthread_self(), ctxinfop->tid)) {
+		return;
 	}
-	if (fluffy_track.context_table == NULL) {
-		return -1;
+
+	struct fluffy_handle_slot *slotp;
+	slotp = &fluffy_track.handles[ctxinfop->handle & (MAX_CONTEXTS - 1)];
+
+	uint64_t state;
+	state = __atomic_sub_fetch(&slotp->state, HANDLE_HOLD,
+		    __ATOMIC_ACQ_REL);
+	if (state >= HANDLE_HOLD || (state & 1)) {
+		return;
 	}
 
-	return 0;
+	/* Vacated while held; fluffy_unref() left it to be freed here */
+	if(pthread_mutex_destroy(&ctxinfop->mutex)) {
+		/* do nothing */
+	}
+	fluffy_context_info_free(ctxinfop);
 }
 
-
-static struct fluffy_context_info *
-fluffy_get_context_info(int fluffy_handle)
+/*
+ * Function:	fluffy_close_context_info
+ *
+ * Close a context off to new holds and wait for the calls holding it to
+ * be done. Called by the context thread before it tears the context down.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * return:
+ * 	void
+ */
+static void
+fluffy_close_context_info(struct fluffy_context_info *ctxinfop)
 {
-	struct fluffy_context_info *ctxinfop = NULL;
-	ctxinfop = (struct fluffy_context_info *)g_hash_table_lookup(
-			fluffy_track.context_table,
-			GINT_TO_POINTER(fluffy_handle));
-
-	return ctxinfop;
+	struct fluffy_handle_slot *slotp;
+	slotp = &fluffy_track.handles[ctxinfop->handle & (MAX_CONTEXTS - 1)];
+
+	__atomic_fetch_or(&slotp->state, (uint64_t)HANDLE_CLOSING,
+	    __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(&slotp->state, __ATOMIC_ACQUIRE) >=
+	    HANDLE_HOLD) {
+		struct timespec ts = {0, 1000000};
+		nanosleep(&ts, NULL);
+	}
 }
 
-
 /*
  * Function:	fluffy_ret
  *
@@ -1946,6 +12699,28 @@ fluffy_ref()
 	    &fluffy_track.mutex);
 
 	do {
+		/*
+		 * Take the next vacant slot after the one taken last, so that
+		 * a slot just vacated isn't reused right away.
+		 */
+		int j, idx = -1;
+		for (j = 0; j < MAX_CONTEXTS; j++) {
+			int k = (fluffy_track.idx + j) & (MAX_CONTEXTS - 1);
+			uint64_t state = __atomic_load_n(
+					     &fluffy_track.handles[k].state,
+					     __ATOMIC_ACQUIRE);
+			if (state == (uint32_t)state && !(state & 1)) {
+				idx = k;
+				break;
+			}
+		}
+		if (idx == -1) {
+			PRINT_STDERR("Too many contexts, %d at most\n",
+			    MAX_CONTEXTS);
+			ret = -1;
+			break;
+		}
+
 		/* Allocate fluffy_context_info */
 		struct fluffy_context_info *ctxinfop = NULL;
 		ctxinfop = fluffy_context_info_new();
@@ -1953,16 +12728,20 @@ fluffy_ref()
 			break;
 		}
 
-		ret = fluffy_track.idx;	/* Get fluffy_handle */
+		struct fluffy_handle_slot *slotp = &fluffy_track.handles[idx];
+		uint32_t gen = ((uint32_t)slotp->state >> 1) + 1;
+		if (gen > HANDLE_GEN_MAX) {
+			gen = 1;
+		}
+
+		ret = (int)(gen << HANDLE_INDEX_BITS) | idx; /* fluffy_handle */
 		ctxinfop->handle = ret;	/* Assign fluffy_handle */
 
-		/* Insert fluffy_context_info for the received fluffy_handle */
-		g_hash_table_replace(
-		    fluffy_track.context_table,
-		    GINT_TO_POINTER(ret),
-		    ctxinfop);
+		/* Publish fluffy_context_info for the fluffy_handle */
+		__atomic_store_n(&slotp->ctxinfop, ctxinfop, __ATOMIC_RELEASE);
+		__atomic_store_n(&slotp->state, gen << 1 | 1, __ATOMIC_RELEASE);
 
-		(fluffy_track.idx)++;	/* Increment handle for the next ref */
+		fluffy_track.idx = idx + 1;	/* Slot to try next */
 		(fluffy_track.nref)++;	/* Increment ref count */
 	} while(0);
 
@@ -2010,19 +12789,255 @@ fluffy_unref(int fluffy_handle)
 	    &fluffy_track.mutex);
 
 	do {
+		/* Vacate the slot; the handle doesn't resolve from now on */
+		struct fluffy_handle_slot *slotp;
+		slotp = &fluffy_track.handles[fluffy_handle &
+		    (MAX_CONTEXTS - 1)];
+		uint32_t live;
+		live = ((uint32_t)fluffy_handle >> HANDLE_INDEX_BITS) << 1 | 1;
+		uint64_t state = __atomic_load_n(&slotp->state,
+				     __ATOMIC_ACQUIRE);
+		do {
+			if (((uint32_t)state & ~HANDLE_CLOSING) != live) {
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(&slotp->state, &state,
+		    state & ~(uint64_t)(HANDLE_CLOSING | 1), 1,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		if (((uint32_t)state & ~HANDLE_CLOSING) != live) {
+			reterr = -1;
+			break;
+		}
+		__atomic_store_n(&slotp->ctxinfop, NULL, __ATOMIC_RELEASE);
+		(fluffy_track.nref)--;
+
+		/* The last hold frees a context still held */
+		if (state >= HANDLE_HOLD) {
+			break;
+		}
+
 		/* Destroy the associated mutex variable */
 		if(pthread_mutex_destroy(&ctxinfop->mutex)) {
 			/* do nothing */
 		}
-		if (!g_hash_table_remove(fluffy_track.context_table,
-		    GINT_TO_POINTER(fluffy_handle))) {
-			reterr = -1;
+		fluffy_context_info_free(ctxinfop);
+	} while(0);
+	pthread_cleanup_pop(1);		/* Unlock mutex */
+
+	return reterr;
+}
+
+/*
+ * Function:	fluffy_storm_event
+ *
+ * Count an event read off inotify towards its subtree. Called by the
+ * context thread.
+ *
+ * args:
+ * 	- struct fluffy_context_info *: the context
+ * 	- const struct fluffy_storm_detection *: as of the batch of events
+ * 	- const struct fluffy_wd_info *: watch the event was read off
+ * return:
+ * 	- int: 1 if the subtree is in a storm and the event is to be held
+ * 		back, 0 otherwise
+ */
+static int
+fluffy_storm_event(struct fluffy_context_info *ctxinfop,
+    const struct fluffy_storm_detection *stormp,
+    const struct fluffy_wd_info *wdinfop)
+{
+	char tp[PATH_MAX];
+	if (strlen(wdinfop->path) >= sizeof(tp)) {
+		return 0;
+	}
+	strcpy(tp, wdinfop->path);
+
+	/* Up to the directory depth levels below its root path */
+	unsigned int depth = wdinfop->depth;
+	while (depth > stormp->depth) {
+		char *slash = strrchr(tp, '/');
+		if (slash == NULL || slash == tp) {
 			break;
 		}
+		*slash = '\0';
+		depth--;
+	}
 
-		(fluffy_track.nref)--;
-	} while(0);
-	pthread_cleanup_pop(1);		/* Unlock mutex */
+	/* The first one counted starts the interval */
+	if (ctxinfop->storm_table->nused == 0) {
+		ctxinfop->storm_from_ms = fluffy_now_ms();
+	}
+
+	struct fluffy_storm_subtree *subtreep = NULL;
+	if (!fluffy_str_table_lookup(ctxinfop->storm_table, tp,
+	    (void **)&subtreep)) {
+		subtreep = fluffy_calloc(1,
+				sizeof(struct fluffy_storm_subtree));
+		if (subtreep == NULL) {
+			return 0;
+		}
+		if (fluffy_str_table_replace(ctxinfop->storm_table, tp,
+		    subtreep)) {
+			fluffy_free(subtreep);
+			return 0;
+		}
+	}
+
+	if (subtreep->nevents < UINT_MAX) {
+		(subtreep->nevents)++;
+	}
+	if (subtreep->is_coarse) {
+		subtreep->is_dirty = 1;
+		return 1;
+	}
+
+	/* The rate is reached before the interval is over, hold back now */
+	unsigned long long limit;
+	limit = (unsigned long long)stormp->rate * stormp->interval_ms / 1000;
+	if (subtreep->nevents >= limit && limit > 0) {
+		subtreep->is_coarse = 1;
+	}
+	return 0;
+}
+
+/*
+ * Function:	fluffy_storm_timeout
+ *
+ * Milliseconds till the end of the storm detection interval, an
+ * epoll_wait() timeout
+ *
+ * return:
+ * 	- int: the timeout, 0 if it's over, -1 if no subtree is counted
+ */
+static int
+fluffy_storm_timeout(struct fluffy_context_info *ctxinfop)
+{
+	if (ctxinfop->storm_table == NULL ||
+	    ctxinfop->storm_table->nused == 0) {
+		return -1;
+	}
+
+	long long due_ms = 0;
+	if (pthread_mutex_lock(&ctxinfop->mutex) == 0) {
+		if (ctxinfop->is_storm) {
+			due_ms = ctxinfop->storm_from_ms +
+			    ctxinfop->storm.interval_ms;
+		}
+		pthread_mutex_unlock(&ctxinfop->mutex);
+	}
+
+	long long now_ms = fluffy_now_ms();
+	if (due_ms <= now_ms) {
+		return 0;
+	}
+	return (due_ms - now_ms > INT_MAX) ? INT_MAX : (int)(due_ms - now_ms);
+}
+
+/*
+ * Function:	end_each_storm_subtree
+ *
+ * str table foreach callback, settle a subtree at the end of a storm
+ * detection interval; gather it to be reported if events were held back,
+ * to be forgotten if none was read.
+ */
+static void
+end_each_storm_subtree(const char *path, void *value, void *pass)
+{
+	struct fluffy_storm_subtree *subtreep = value;
+	struct fluffy_storm_pass *passp = pass;
+
+	if (subtreep->is_dirty) {
+		fluffy_path_list_add(&passp->dirty, path);
+		subtreep->is_dirty = 0;
+	}
+
+	if (passp->limit == 0) {
+		/* Storm detection is off */
+		fluffy_path_list_add(&passp->calm, path);
+	} else if (subtreep->is_coarse) {
+		if (subtreep->nevents < passp->limit / 2) {
+			subtreep->is_coarse = 0;
+		}
+	} else if (subtreep->nevents >= passp->limit) {
+		subtreep->is_coarse = 1;
+	} else if (subtreep->nevents == 0) {
+		fluffy_path_list_add(&passp->calm, path);
+	}
+	subtreep->nevents = 0;
+}
+
+/*
+ * Function:	fluffy_storm_tick
+ *
+ * End the storm detection interval if it's over; report the subtrees that
+ * had events held back with a FLUFFY_SUBTREE_DIRTY event each, and set the
+ * subtrees that calmed down back to events being reported. Called by the
+ * context thread between batches of events.
+ *
+ * args:
+ * 	- int: fluffy context handle
+ * return:
+ * 	- int: 0 when successful or it's not over, error value otherwise
+ */
+static int
+fluffy_storm_tick(int fluffy_handle)
+{
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	struct fluffy_storm_pass pass = {0};
+	long long now_ms = fluffy_now_ms();
+	long long from_ms = ctxinfop->storm_from_ms;
+	struct fluffy_storm_detection storm = {0};
+
+	int m = -1;
+	m = pthread_mutex_lock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	if (ctxinfop->is_storm) {
+		storm = ctxinfop->storm;
+	}
+
+	m = pthread_mutex_unlock(&ctxinfop->mutex);
+	if (m != 0) {
+		return -1;
+	}
+
+	if (storm.rate != 0 && now_ms < from_ms + storm.interval_ms) {
+		return 0;
+	}
+	ctxinfop->storm_from_ms = now_ms;
+
+	/* Scaled to how long the interval took, batches run over it */
+	if (storm.rate != 0 && now_ms > from_ms) {
+		pass.limit = (unsigned long long)storm.rate *
+		    (now_ms - from_ms) / 1000;
+		if (pass.limit == 0) {
+			pass.limit = 1;
+		}
+	}
+	fluffy_str_table_foreach(ctxinfop->storm_table, end_each_storm_subtree,
+	    &pass);
+
+	size_t j;
+	for (j = 0; j < pass.calm.len; j++) {
+		fluffy_str_table_remove(ctxinfop->storm_table,
+		    pass.calm.paths[j]);
+	}
+	fluffy_path_list_clear(&pass.calm);
+
+	int reterr = 0;
+	for (j = 0; j < pass.dirty.len && reterr == 0; j++) {
+		reterr = fluffy_dispatch_event(fluffy_handle,
+			     FLUFFY_SUBTREE_DIRTY | FLUFFY_ISDIR,
+			     pass.dirty.paths[j]);
+	}
+	fluffy_path_list_clear(&pass.dirty);
 
 	return reterr;
 }
@@ -2043,7 +13058,7 @@ fluffy_start_context_thread(void *flhandle)
 {
 	int fluffy_handle = 0;
 	fluffy_handle = *(int *)flhandle;	/* extract int value */
-	free(flhandle);
+	fluffy_free(flhandle);
 	int reterr = 0;
 	int m = -1;
 
@@ -2071,21 +13086,23 @@ fluffy_start_context_thread(void *flhandle)
 
 	/* Listen for events untill terminattion */
 	while (1) {
-		struct epoll_event *evlist = NULL;
-		evlist = calloc(NR_EPOLL_EVENTS, sizeof(struct epoll_event));
-		if (evlist == NULL) {
-			perror("calloc");
-			pthread_exit((void *)-1);
+		struct epoll_event evlist[NR_EPOLL_EVENTS];
+		int nready = 0;
+		int timeout = 0, storm_timeout = 0;
+		timeout = fluffy_poll_timeout(ctxinfop);
+		storm_timeout = fluffy_storm_timeout(ctxinfop);
+		if (storm_timeout != -1 &&
+		    (timeout == -1 || storm_timeout < timeout)) {
+			timeout = storm_timeout;
 		}
 
-		int nready = 0;
 		/* Listen for inotify events; blocks. */
 		nready = epoll_wait(ctxinfop->epoll_fd,
 				evlist,
 				NR_EPOLL_EVENTS,
-				-1);
+				timeout);
 		if (nready == -1) {
-			if (errno == -1) {
+			if (errno == EINTR) {
 				continue;
 			} else {
 				perror("epoll_wait");
@@ -2094,11 +13111,22 @@ fluffy_start_context_thread(void *flhandle)
 		}
 
 		int j;
+		int fanotify_fd = __atomic_load_n(&ctxinfop->fanotify_fd,
+				    __ATOMIC_ACQUIRE);
 		/* Iterate through event queue and process each event */
 		for (j = 0; j < nready; j++) {
-			if (evlist[j].data.fd == ctxinfop->inotify_fd) {
+			if (evlist[j].data.fd == fanotify_fd) {
+				/* Serially processed, like inotify's */
+				reterr = fluffy_process_fanotify_queue(
+						fluffy_handle,
+						&evlist[j]);
+				if (reterr) {
+					pthread_exit((void *)-1);
+				}
+			} else if (evlist[j].data.fd != ctxinfop->wake_fd) {
 				/*
-				 * Serially processed so as to guarantee
+				 * The current inotify instance, or the old
+				 * one. Serially processed so as to guarantee
 				 * event ordering.
 				 */
 				reterr = fluffy_process_inotify_queue(
@@ -2107,10 +13135,46 @@ fluffy_start_context_thread(void *flhandle)
 				if (reterr) {
 					pthread_exit((void *)-1);
 				}
+			} else if (evlist[j].data.fd == ctxinfop->wake_fd) {
+				uint64_t nwake = 0;
+				if (read(ctxinfop->wake_fd, &nwake,
+				    sizeof(nwake)) == -1 && errno != EAGAIN) {
+					perror("read");
+				}
+
+				/* Hand off what walks have queued so far */
+				reterr = fluffy_flush_pending_events(
+						fluffy_handle, 0);
+				if (reterr) {
+					pthread_exit((void *)-1);
+				}
+			}
+		}
+
+		/* Switch over to the new watches of a reinitiation, if set */
+		reterr = fluffy_switch_watch_gen(fluffy_handle);
+		if (reterr) {
+			pthread_exit((void *)-1);
+		}
+
+		/* Directories past the watch budget, if any are due */
+		if (__atomic_load_n(&ctxinfop->npolled, __ATOMIC_ACQUIRE) > 0) {
+			reterr = fluffy_poll_dirs(fluffy_handle);
+			if (reterr) {
+				pthread_exit((void *)-1);
+			}
+		}
+
+		/* Subtrees counted for storms, at the end of an interval */
+		if (ctxinfop->storm_table->nused > 0) {
+			reterr = fluffy_storm_tick(fluffy_handle);
+			if (reterr) {
+				pthread_exit((void *)-1);
 			}
 		}
-		free(evlist);
-		evlist = NULL;
+
+		/* Holds no record now; a quiescent state */
+		fluffy_reclaim_retired(ctxinfop);
 	}
 	pthread_cleanup_pop(1);
 	return (void *)0;
@@ -2160,11 +13224,13 @@ fluffy_init(int (*user_event_fn) (const struct fluffy_event_info *eventinfo,
 
 	reterr = fluffy_setup_context(flhandle);
 	if (reterr) {
+		/* Give the registry slot back, it's not to be used */
+		fluffy_unref(flhandle);
 		return -1;
 	}
 
 	/* Freed by fluffy_destroy_context */
-	int *flh = calloc(1, sizeof(int));
+	int *flh = fluffy_calloc(1, sizeof(int));
 	*flh = flhandle;
 
 	pthread_t tid;
@@ -2175,7 +13241,7 @@ fluffy_init(int (*user_event_fn) (const struct fluffy_event_info *eventinfo,
 			(void *)flh);
 	if (reterr) {
 		fluffy_destroy_context((void *)flh);
-		free(flh);
+		fluffy_free(flh);
 		return -1;
 	}
 
@@ -2204,13 +13270,16 @@ fluffy_wait_until_done(int fluffy_handle)
 	void *ret;
 
 	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
 
+	pthread_t tid = ctxinfop->tid;
+	fluffy_release_context_info(ctxinfop);
+
 	/* Block until the context thread terminates */
-	m = pthread_join(ctxinfop->tid, &ret);
+	m = pthread_join(tid, &ret);
 	if (m != 0) {
 		return -1;
 	}
@@ -2233,13 +13302,16 @@ fluffy_no_wait(int fluffy_handle)
 	int m = 0;
 
 	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
 
+	pthread_t tid = ctxinfop->tid;
+	fluffy_release_context_info(ctxinfop);
+
 	/* Deatch the context thread, can't be joined anymore  */
-	m = pthread_detach(ctxinfop->tid);
+	m = pthread_detach(tid);
 	if (m != 0) {
 		return -1;
 	}
@@ -2254,11 +13326,72 @@ int
 fluffy_add_watch_path(int fluffy_handle, const char *pathtoadd)
 {
 	int reterr = 0;
+	struct fluffy_root_options rootopts = {0};
+
+	/* Held till the watches are set, fluffy_destroy() may be called */
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* Placed on a shard, if the context is sharded */
+	if (__atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE) > 0) {
+		reterr = fluffy_shard_add(fluffy_handle, pathtoadd, &rootopts);
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
+	reterr = fluffy_add_watch(fluffy_handle,
+			pathtoadd,
+			1,		/* Turn it to real path */
+			&rootopts,	/* It's a root path */
+			0,
+			-1);		/* Don't report entries */
+	fluffy_release_context_info(ctxinfop);
+	return reterr;
+}
+
+/*
+ * fluffy.h contains this function description
+ */
+int
+fluffy_add_watch_path_opts(int fluffy_handle, const char *pathtoadd,
+    const struct fluffy_root_options *rootopts)
+{
+	int reterr = 0;
+	uint32_t report_mask = 0;
+
+	struct fluffy_root_options defopts = {0};
+	if (rootopts == NULL) {
+		rootopts = &defopts;
+	}
+
+	/* Held till the watches are set, fluffy_destroy() may be called */
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* Placed on a shard, if the context is sharded */
+	if (__atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE) > 0) {
+		reterr = fluffy_shard_add(fluffy_handle, pathtoadd, rootopts);
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
+	if (rootopts->flags & FLUFFY_ROOT_INVENTORY) {
+		report_mask = FLUFFY_EXISTS;
+	}
 
 	reterr = fluffy_add_watch(fluffy_handle,
 			pathtoadd,
 			1,		/* Turn it to real path */
-			1);		/* It's a root path */
+			rootopts,	/* It's a root path */
+			report_mask,
+			-1);
+	fluffy_release_context_info(ctxinfop);
 	return reterr;
 }
 
@@ -2270,7 +13403,22 @@ int
 fluffy_remove_watch_path(int fluffy_handle, const char *pathtoremove)
 {
 	int reterr = 0;
+
+	struct fluffy_context_info *ctxinfop;
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
+	if (ctxinfop == NULL) {
+		return -1;
+	}
+
+	/* Removed from its shard, if the context is sharded */
+	if (__atomic_load_n(&ctxinfop->nshards, __ATOMIC_ACQUIRE) > 0) {
+		reterr = fluffy_shard_remove(fluffy_handle, pathtoremove);
+		fluffy_release_context_info(ctxinfop);
+		return reterr;
+	}
+
 	reterr = fluffy_handle_removal(fluffy_handle, pathtoremove);
+	fluffy_release_context_info(ctxinfop);
 	return reterr;
 }
 
@@ -2282,7 +13430,7 @@ int
 fluffy_destroy(int fluffy_handle)
 {
 	struct fluffy_context_info *ctxinfop;
-	ctxinfop = fluffy_get_context_info(fluffy_handle);
+	ctxinfop = fluffy_hold_context_info(fluffy_handle);
 	if (ctxinfop == NULL) {
 		return -1;
 	}
@@ -2290,6 +13438,7 @@ fluffy_destroy(int fluffy_handle)
 	int reterr = -1;
 	reterr = pthread_cancel(ctxinfop->tid);
 	
+	fluffy_release_context_info(ctxinfop);
 	return reterr;
 }
 
@@ -2337,6 +13486,18 @@ fluffy_print_event(const struct fluffy_event_info *eventinfo,
 		fprintf(stdout, "ROOT_IGNORED, ");
 	if (eventinfo->event_mask & FLUFFY_WATCH_EMPTY)
 		fprintf(stdout, "WATCH_EMPTY, ");
+	if (eventinfo->event_mask & FLUFFY_EXISTS)
+		fprintf(stdout, "EXISTS, ");
+	if (eventinfo->event_mask & FLUFFY_QUEUE_PRESSURE)
+		fprintf(stdout, "QUEUE_PRESSURE, ");
+	if (eventinfo->event_mask & FLUFFY_QUEUE_RELIEVED)
+		fprintf(stdout, "QUEUE_RELIEVED, ");
+	if (eventinfo->event_mask & FLUFFY_SUBTREE_REMOVED)
+		fprintf(stdout, "SUBTREE_REMOVED, ");
+	if (eventinfo->event_mask & FLUFFY_SUBTREE_DIRTY)
+		fprintf(stdout, "SUBTREE_DIRTY, ");
+	if (eventinfo->event_mask & FLUFFY_SLOW_CONSUMER)
+		fprintf(stdout, "SLOW_CONSUMER, ");
 	fprintf(stdout, "\t");
 	fprintf(stdout, "%s\n", eventinfo->path ? eventinfo->path : "");
 
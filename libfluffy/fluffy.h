@@ -1,6 +1,7 @@
 #ifndef HUMBLE_FLUFFY_H
 #define HUMBLE_FLUFFY_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/inotify.h>
 
@@ -32,6 +33,52 @@
 #define FLUFFY_IGNORED		IN_IGNORED	/* File not watched anymore */ 
 #define FLUFFY_ROOT_IGNORED	0x00010000	/* Root file was ignored */
 #define FLUFFY_WATCH_EMPTY	0x00020000	/* All watches removed */
+#define FLUFFY_EXISTS		0x00040000	/* Found while setting watches */
+#define FLUFFY_QUEUE_PRESSURE	0x00080000	/* Event queue filling up */
+#define FLUFFY_QUEUE_RELIEVED	0x00100000	/* Event queue drained again */
+#define FLUFFY_SUBTREE_REMOVED	0x00200000	/* Watches below dir removed */
+#define FLUFFY_SUBTREE_DIRTY	0x00400000	/* Storm of events below dir */
+#define FLUFFY_SLOW_CONSUMER	0x00800000	/* Callback past its deadline */
+
+/* Context options, fluffy_set_context_options() takes these ORed */
+#define FLUFFY_OPT_SCAN_NEW_DIRS 0x00000001	/* Report missed entries of
+						   newly created dirs */
+#define FLUFFY_OPT_OVERFLOW_TERMINATE 0x00000002 /* End the context on a
+						   queue overflow */
+#define FLUFFY_OPT_OVERFLOW_RESCAN 0x00000004	/* Rescan for what a queue
+						   overflow dropped */
+#define FLUFFY_OPT_SUBTREE_SUMMARY 0x00000008	/* Report a removed tree of
+						   watches once */
+
+/* Root path options, see fluffy_add_watch_path_opts() */
+#define FLUFFY_ROOT_INVENTORY	0x00000001	/* Report FLUFFY_EXISTS events */
+#define FLUFFY_ROOT_LAZY	0x00000002	/* Deepen watches on activity */
+#define FLUFFY_ROOT_POLL	0x00000004	/* Poll, don't watch */
+
+/* Queue pressure actions, see fluffy_set_queue_pressure() */
+#define FLUFFY_PRESSURE_REPORT	0x00000001	/* Report FLUFFY_QUEUE_* */
+#define FLUFFY_PRESSURE_SHED	0x00000002	/* Stop watching for reads */
+#define FLUFFY_PRESSURE_RAISE	0x00000004	/* Raise max_queued_events */
+
+/* Slow callback actions, see fluffy_set_callback_deadline() */
+#define FLUFFY_SLOW_LOG		0x00000001	/* Print a diagnostic */
+#define FLUFFY_SLOW_REPORT	0x00000002	/* Report a slow consumer */
+
+/* Buckets of the callback latency histogram, see fluffy_get_latency() */
+#define FLUFFY_LATENCY_BUCKETS	128
+
+/* Least microseconds a callback counted in bucket b took */
+#define FLUFFY_LATENCY_FLOOR_US(b) ((b) < 4 ? (unsigned long long)(b) : \
+				(4ULL + (b) % 4) << ((b) / 4 - 1))
+
+/* Marks of the fanotify backend, see fluffy_set_fanotify() */
+#define FLUFFY_FANOTIFY_FILESYSTEM 1	/* Mark the filesystem of a root */
+#define FLUFFY_FANOTIFY_MOUNT	2	/* Mark the mount of a root */
+
+/* Exclude pattern types, see fluffy_add_exclude() */
+#define FLUFFY_EXCLUDE_BASENAME	1	/* Entry name, compared as is */
+#define FLUFFY_EXCLUDE_GLOB	2	/* fnmatch(3) pattern */
+#define FLUFFY_EXCLUDE_REGEX	3	/* POSIX extended regex on full path */
 
 
 struct fluffy_event_info {
@@ -48,6 +95,132 @@ struct fluffy_event_info {
 
 	/* Path where event occured. Absolute path. */
 	char *path;
+
+	/* Shard the event was read on, from 1; 0 if the context has none */
+	unsigned int shard;
+
+	/* Order of the event among those of its shard, from 1; 0 if none */
+	unsigned long long seq;
+};
+
+struct fluffy_stats {
+	unsigned long long nwatches;	/* Watches set */
+	unsigned long long watch_bytes;	/* Bytes held by the watch records */
+	unsigned long long snapshot_bytes; /* Directory snapshots */
+	unsigned long long npolled;	/* Directories polled, not watched */
+	unsigned long long backlog;	/* Events held for the callback */
+	unsigned long long ndropped;	/* Shed off a full backlog */
+	unsigned long long ncoalesced;	/* Merged into one held already */
+	unsigned long long spill_bytes;	/* Of the backlog, spilled to disk */
+};
+
+struct fluffy_queue_pressure {
+	/* Any of the above FLUFFY_PRESSURE_* macros ORed, 0 to disable. */
+	uint32_t actions;
+
+	/* Fill of the queue, in percent, that's pressure; 0 for 50. */
+	unsigned int high_water;
+
+	/* Fill of the queue, in percent, that ends pressure; 0 for 10. */
+	unsigned int low_water;
+
+	/* FLUFFY_PRESSURE_RAISE: cap on max_queued_events, 0 for 16x. */
+	unsigned int max_queued_events;
+};
+
+struct fluffy_watch_budget {
+	/* Watches the context may set, 0 for as many as inotify allows. */
+	unsigned int max_watches;
+
+	/* Interval a changed directory is polled at, ms; 0 for 1000. */
+	unsigned int poll_min_ms;
+
+	/* Interval an idle one backs off to, ms; 0 for 30000. */
+	unsigned int poll_max_ms;
+};
+
+struct fluffy_storm_detection {
+	/* Events a second that make a subtree stormy, 0 to disable. */
+	unsigned int rate;
+
+	/* Interval rates are taken and reported at, ms; 0 for 1000. */
+	unsigned int interval_ms;
+
+	/* Levels below its root path a subtree is taken at, 0 for the root. */
+	unsigned int depth;
+};
+
+struct fluffy_backlog {
+	/* Events held for the callback before any is shed; 0 for 65536. */
+	unsigned int max_events;
+
+	/* Dropped once it's full; 0 for ACCESS, OPEN and CLOSE_NOWRITE. */
+	uint32_t drop_mask;
+
+	/* Coalesced once it's full; 0 for MODIFY and CLOSE_WRITE. */
+	uint32_t coalesce_mask;
+
+	/* Directory to spill to once it's full, copied; NULL for none. */
+	const char *spill_dir;
+
+	/* Bytes spilled at most, 0 for 1 GiB. */
+	unsigned long long max_spill_bytes;
+};
+
+struct fluffy_callback_deadline {
+	/* Time a callback may take, ms; 0 to disable. */
+	unsigned int deadline_ms;
+
+	/* Any of the above FLUFFY_SLOW_* macros ORed, 0 to only count. */
+	uint32_t actions;
+};
+
+struct fluffy_latency {
+	unsigned long long ncalls;	/* Callbacks timed */
+	unsigned long long total_us;	/* Time they took altogether */
+	unsigned long long max_us;	/* The longest of them */
+	unsigned long long nslow;	/* Past the deadline */
+	unsigned long long slow_queued;	/* Events queued at the last one */
+
+	/* Callbacks by time taken, see FLUFFY_LATENCY_FLOOR_US() */
+	unsigned long long buckets[FLUFFY_LATENCY_BUCKETS];
+};
+
+struct fluffy_shard_options {
+	/* inotify instances, each read by a thread of its own; 2 or more. */
+	unsigned int nshards;
+
+	/* Events a second that make a root path hot, 0 to never move one. */
+	unsigned int hot_rate;
+};
+
+struct fluffy_exclude {
+	int type;			/* FLUFFY_EXCLUDE_* */
+	const char *pattern;
+};
+
+struct fluffy_root_options {
+	/* Any of the above FLUFFY_ROOT_* macros ORed, 0 for none. */
+	uint32_t flags;
+
+	/* Subtrees to leave out of this root path, NULL for none. */
+	const struct fluffy_exclude *excludes;
+	unsigned int nexcludes;
+
+	/* Deepest level below the root path to watch, 0 for no limit. */
+	unsigned int max_depth;
+
+	/* FLUFFY_ROOT_LAZY: levels watched up front, 0 for the root alone. */
+	unsigned int lazy_depth;
+
+	/* FLUFFY_ROOT_LAZY: cap on the watches deepening may set, 0 for none. */
+	unsigned int lazy_max_watches;
+
+	/* FLUFFY_ROOT_POLL: interval of an active directory, ms; 0 for 1000. */
+	unsigned int poll_min_ms;
+
+	/* FLUFFY_ROOT_POLL: interval an idle one backs off to; 0 for 30000. */
+	unsigned int poll_max_ms;
 };
 
 
@@ -62,6 +235,10 @@ struct fluffy_event_info {
  * fluffy_init() spawns a new context and returns its handle.  Each context is
  * run in a separate thread, a fluffy_wait_until_done() call may be required
  * at some point to join the context.
+ * Up to 1024 contexts can be live at a time, fluffy_init() fails beyond that.
+ * A handle is never reused for a later context once it's destroyed. A call
+ * made on a handle from another thread while it's being destroyed either
+ * fails or sees it through; the context is freed after the call returns.
  *
  * The user_event_fn() pointer passed as the first argument is defined by the
  * user and this function will be called by Fluffy for every event on the
@@ -103,6 +280,62 @@ extern int fluffy_init(int (*user_event_fn) (
 extern int fluffy_add_watch_path(int fluffy_handle,
     const char *pathtoadd);
 
+/*
+ * Function:	fluffy_add_watch_path_opts
+ *
+ * Same as fluffy_add_watch_path(), with options that apply to this root path.
+ * A zeroed struct fluffy_root_options, or NULL, behaves exactly like
+ * fluffy_add_watch_path().
+ *
+ * FLUFFY_ROOT_INVENTORY: Every file and directory found while setting up the
+ * watches is reported with a FLUFFY_EXISTS event, ORed with FLUFFY_ISDIR for
+ * directories, the root path included. This saves the client a separate
+ * crawl of the tree when it needs a full listing as well as the changes that
+ * follow. The FLUFFY_EXISTS events are handed off by the context thread, like
+ * any other event, and strictly before any event Fluffy reads for the tree
+ * afterwards.
+ *
+ * excludes: Subtrees to leave out of this root path, matched the same way as
+ * fluffy_add_exclude() does. Excluded directories are neither watched nor
+ * descended into.
+ *
+ * max_depth: Directories deeper than this many levels below the root path
+ * are not watched. Entries of the deepest directories watched are still
+ * reported, the root path is level 0.
+ *
+ * FLUFFY_ROOT_LAZY: Only lazy_depth levels are watched to begin with. When
+ * a directory at the deepest level watched sees a change, an entry created,
+ * deleted, moved, modified or its attributes changed, its subdirectories are
+ * watched as well; one level at a time. Reads don't count. A directory
+ * created or moved in below lazy_depth is watched by itself. Watches set
+ * below lazy_depth are capped at lazy_max_watches, max_depth still holds.
+ * Suits huge trees, archives say, where only the top levels change.
+ *
+ * FLUFFY_ROOT_POLL: The root path and the directories below it are polled
+ * rather than watched; inotify doesn't see what other clients of an NFS,
+ * CIFS or FUSE mount change. Each directory is listed at every poll and its
+ * entries, inode, size and mtime, compared with the last listing. What
+ * changed is reported as FLUFFY_CREATE, FLUFFY_DELETE and FLUFFY_MODIFY,
+ * ORed with FLUFFY_ISDIR for directories; a move shows as a delete and a
+ * create. A directory is polled every poll_min_ms while it changes, the
+ * interval doubles while it's idle, up to poll_max_ms. The directories due
+ * are listed a few at a time, off the context thread. A root path that's
+ * gone is reported with FLUFFY_ROOT_DELETE and FLUFFY_ROOT_IGNORED. Like a
+ * walk, polling stays on the mount of the root path; a mount below it is
+ * added as a root path of its own. A directory watched already stays
+ * watched. Not supported by the fanotify backend.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const char *:	a path to watch recursively
+ * 	- const struct fluffy_root_options *: options for this root path
+ * return:
+ * 	- int:		0 on success, EINVAL if poll_min_ms is over
+ * 			poll_max_ms, error value otherwise
+ */
+extern int fluffy_add_watch_path_opts(int fluffy_handle,
+    const char *pathtoadd, const struct fluffy_root_options *rootopts);
+
 /*
  * Function:	fluffy_remove_watch_path
  *
@@ -168,24 +401,445 @@ extern int fluffy_no_wait(int fluffy_handle);
 extern int fluffy_destroy(int fluffy_handle);
 
 
+/*
+ * Function:	fluffy_set_context_options
+ *
+ * Set the behaviour of a context with FLUFFY_OPT_* values ORed. Any option
+ * previously set is overridden. No option is set by default.
+ *
+ * FLUFFY_OPT_SCAN_NEW_DIRS: A newly created directory may already hold
+ * entries by the time its watch is set; think mkdir -p, tar -x or cp -r.
+ * inotify never reports those. With this option, Fluffy lists the new
+ * directory tree once the watch is set and reports a FLUFFY_CREATE event
+ * (ORed with FLUFFY_ISDIR for directories) for every entry it finds. An
+ * entry is reported once even if inotify reports its creation as well.
+ *
+ * A queue overflow, FLUFFY_Q_OVERFLOW event, means events were dropped. By
+ * default the context is reinitiated; see fluffy_reinitiate_context().
+ * At most one of the following picks another way, both is EINVAL.
+ *
+ * FLUFFY_OPT_OVERFLOW_TERMINATE: The context is destroyed right after the
+ * FLUFFY_Q_OVERFLOW event is handed off, for clients that rebuild their
+ * state from scratch anyway.
+ *
+ * FLUFFY_OPT_OVERFLOW_RESCAN: Fluffy keeps a snapshot of every watched
+ * directory, name, inode, size and mtime of its entries, up to date with
+ * the events read. On an overflow the watches are kept; the directories
+ * are listed again, the most recently active first, and compared with
+ * their snapshots. The differences are reported as FLUFFY_CREATE,
+ * FLUFFY_DELETE and FLUFFY_MODIFY events, ORed with FLUFFY_ISDIR for
+ * directories, and new directories are watched. A move shows as a delete
+ * and a create; a deleted directory is reported once, not entry by entry.
+ * A directory watched before the option was set is only snapshotted at the
+ * first rescan. The snapshots cost memory for every entry, see
+ * fluffy_stats.snapshot_bytes, and a stat() for every entry created or
+ * written. Should a rescan fail, the context is reinitiated.
+ *
+ * When the watches on a directory tree are removed, by
+ * fluffy_remove_watch_path() or by the tree being moved out, only the
+ * FLUFFY_IGNORED event of the directory itself, and of any root path within,
+ * is reported; the rest die quietly. So do those of directories deleted
+ * below a root path, whose deletion the parent directory reports.
+ *
+ * FLUFFY_OPT_SUBTREE_SUMMARY: A FLUFFY_SUBTREE_REMOVED event, ORed with
+ * FLUFFY_ISDIR, is reported on the directory once for the watches that died
+ * quietly below it.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- uint32_t:	FLUFFY_OPT_* values ORed, 0 to clear all options
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_set_context_options(int fluffy_handle, uint32_t options);
+
+/*
+ * Function:	fluffy_get_stats
+ *
+ * Fill in the current figures of the context. watch_bytes counts the watch
+ * records, paths included, not the tables that index them. snapshot_bytes
+ * counts the directory snapshots of FLUFFY_OPT_OVERFLOW_RESCAN and of the
+ * polled directories. npolled counts the directories polled for want of
+ * watches, see fluffy_set_watch_budget(), and those of FLUFFY_ROOT_POLL.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- struct fluffy_stats *: filled in on success
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_get_stats(int fluffy_handle, struct fluffy_stats *stats);
+
+/*
+ * Function:	fluffy_get_latency
+ *
+ * Fill in the times the client callback of the context took. Every call is
+ * timed, with or without a deadline, and counted in a log-linear histogram:
+ * buckets 0 to 3 take a microsecond each, every power of two past that is
+ * split in four. The last bucket takes whatever's longer still, past two
+ * hours. Events of FLUFFY_SLOW_CONSUMER aren't timed. nslow and slow_queued
+ * are kept once a deadline is set, see fluffy_set_callback_deadline().
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- struct fluffy_latency *: filled in on success
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_get_latency(int fluffy_handle,
+    struct fluffy_latency *latency);
+
+/*
+ * Function:	fluffy_set_queue_pressure
+ *
+ * Have the context act before its inotify queue overflows. Every time the
+ * context thread wakes up to read events, the bytes queued are sampled
+ * with FIONREAD and weighed, in events, against the max_queued_events the
+ * inotify instance was created with. Once the fill reaches high_water the
+ * context is under pressure and the actions are taken; once it's back at
+ * low_water or below they're undone. A call overrides what was set before.
+ *
+ * FLUFFY_PRESSURE_REPORT: A FLUFFY_QUEUE_PRESSURE event is handed off when
+ * the pressure starts, a FLUFFY_QUEUE_RELIEVED event when it ends. Neither
+ * carries a path.
+ *
+ * FLUFFY_PRESSURE_SHED: FLUFFY_ACCESS, FLUFFY_OPEN and FLUFFY_CLOSE_NOWRITE
+ * are left out of the mask of every watch, and of watches set meanwhile,
+ * for the kernel to stop queueing them. These are the bulk of the events
+ * of a busy tree, and what a walk of it raises. They're missed until the
+ * pressure ends, the masks are then restored.
+ *
+ * FLUFFY_PRESSURE_RAISE: max_queued_events is doubled, up to the ceiling,
+ * and the context is reinitiated to pick it up; see
+ * fluffy_set_max_queued_events(). The setting is system wide; contexts
+ * under pressure share the raise, and it's set back once the last of them
+ * is relieved, unless it was changed meanwhile. The instance of a context
+ * keeps its larger queue. It takes the privilege to write to
+ * /proc/sys/fs/inotify/max_queued_events, the other actions are taken
+ * regardless.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_queue_pressure *: NULL, or zeroed actions, to
+ * 	  disable
+ * return:
+ * 	- int:		0 on success, EINVAL if high_water is over 100 or
+ * 			low_water isn't below it, error value otherwise
+ */
+extern int fluffy_set_queue_pressure(int fluffy_handle,
+    const struct fluffy_queue_pressure *pressure);
+
+/*
+ * Function:	fluffy_set_watch_budget
+ *
+ * Cover trees larger than the watches the context may set. By default a
+ * walk that runs out of watches, max_user_watches is per user and shared
+ * by all its processes, fails and leaves the root path partly watched.
+ *
+ * With a budget, a directory that can't be watched, past max_watches or
+ * once inotify_add_watch() fails with ENOSPC, is polled instead; so is
+ * every directory below a polled one. Root paths are always watched. A
+ * polled directory is stat()ed for its mtime, which changes as entries
+ * are created, deleted or moved; it's then listed and compared with its
+ * last listing. The differences are reported as FLUFFY_CREATE,
+ * FLUFFY_DELETE and FLUFFY_MODIFY events, ORed with FLUFFY_ISDIR for
+ * directories, a move shows as a delete and a create. Writes that leave
+ * the entries of a polled directory as they were go unnoticed. The interval
+ * starts at poll_min_ms, doubles while the directory is idle up to
+ * poll_max_ms, and is back to poll_min_ms once it changes.
+ *
+ * Directories are ranked by activity. A polled directory that changes
+ * is promoted, watched again, if a watch is to be had. Past the budget,
+ * one is had by demoting the watched directory that's been idle the
+ * longest; only those without watched subdirectories are demoted, so
+ * cold subtrees end up polled from the bottom up.
+ *
+ * A lower budget than the watches set doesn't remove any, it applies to
+ * the watches set from then on. NULL disables the budget; directories
+ * being polled are then left out until the context is reinitiated.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_watch_budget *: NULL to disable
+ * return:
+ * 	- int:		0 on success, EINVAL if poll_min_ms is over
+ * 			poll_max_ms, error value otherwise
+ */
+extern int fluffy_set_watch_budget(int fluffy_handle,
+    const struct fluffy_watch_budget *budget);
+
+/*
+ * Function:	fluffy_set_storm_detection
+ *
+ * Collapse the events of a subtree in a storm, think git checkout, npm
+ * install or rsync, into one event per interval; a client that would
+ * rescan the directory anyway is spared the rest. Events are counted by
+ * the subtree they fall in, the directory depth levels below its root path;
+ * an event in a directory above that depth counts towards the directory
+ * itself.
+ *
+ * Once rate events a second are read in a subtree, its events are no
+ * longer handed off, they're still acted upon. At the end of the interval
+ * a single FLUFFY_SUBTREE_DIRTY event, ORed with FLUFFY_ISDIR, is reported
+ * on the subtree if any of them was held back. The subtree is reported
+ * event by event again after an interval below half the rate. Events
+ * reported by fluffy itself, FLUFFY_IGNORED and the self events of a root
+ * path are never held back. fanotify contexts aren't covered.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_storm_detection *: NULL to disable
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_set_storm_detection(int fluffy_handle,
+    const struct fluffy_storm_detection *storm);
+
+/*
+ * Function:	fluffy_set_backlog
+ *
+ * Hand events off to the callback from a thread of its own, through a
+ * bounded backlog. By default the callback is called by the context thread
+ * as events are read; a callback that falls behind leaves the inotify
+ * queue to overflow, and all events are lost alike.
+ *
+ * With a backlog, the context thread reads on while the callback catches
+ * up. Once max_events are held, events are shed by their class:
+ *
+ * drop_mask: an event of nothing but these, ORed with FLUFFY_ISDIR or not,
+ * is dropped; see fluffy_stats.ndropped.
+ *
+ * coalesce_mask: an event of nothing but these and drop_mask is merged
+ * into the one held for the same path, if any, its mask ORed in; see
+ * fluffy_stats.ncoalesced. One held from before a later event of the path
+ * that's neither, or of a directory, isn't merged into.
+ *
+ * Any other event, CREATE, DELETE, MOVED_FROM, MOVED_TO and IGNORED among
+ * them, is never shed; the context thread waits for room, as does an event
+ * to be coalesced that has nothing to be merged into. Events are handed
+ * off in order. A non-zero return of the callback ends the context, a few
+ * events later than it would without a backlog.
+ *
+ * spill_dir: rather than shed, events past max_events are appended to
+ * segment files memory mapped in the directory, unlinked from the start,
+ * and handed off from there once the ones held before them are; a stall
+ * of the callback then lasts as long as the disk has room, where the
+ * inotify queue would overflow. Once max_spill_bytes are spilled, events
+ * are shed as above, nothing is coalesced until the spill is handed off.
+ * A segment is released as soon as it's been handed off. See
+ * fluffy_stats.spill_bytes.
+ *
+ * It can be set again to change the limits, not undone. The backlog of a
+ * sharded context holds the events of all its shards.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_backlog *: limits of the backlog
+ * return:
+ * 	- int:		0 on success, EINVAL if it's NULL, ENOTDIR if
+ * 			spill_dir isn't a directory, error value otherwise
+ */
+extern int fluffy_set_backlog(int fluffy_handle,
+    const struct fluffy_backlog *backlog);
+
+/*
+ * Function:	fluffy_set_callback_deadline
+ *
+ * Watch the client callback for calls that take longer than deadline_ms.
+ * A watchdog thread of the context samples the call in progress every half
+ * the deadline, a call that never returns is caught all the same. A slow
+ * call is counted in fluffy_latency.nslow as it returns. The events queued
+ * in the inotify instances of the context as one is caught are kept in
+ * slow_queued; a queue that grows while the callback lags is what ends in
+ * an overflow.
+ *
+ * FLUFFY_SLOW_LOG: A diagnostic with the time taken and the events queued
+ * is printed to stderr.
+ *
+ * FLUFFY_SLOW_REPORT: A FLUFFY_SLOW_CONSUMER event, with no path, is handed
+ * off once the slow call returns, before the next event.
+ *
+ * Actions are taken once as a call first goes past the deadline, not again
+ * until a call returns within it. It can be set again to change the
+ * deadline, the watchdog stays on till the context ends.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_callback_deadline *: NULL, or a zeroed
+ * 	  deadline_ms, to disable
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_set_callback_deadline(int fluffy_handle,
+    const struct fluffy_callback_deadline *deadline);
+
+/*
+ * Function:	fluffy_set_fanotify
+ *
+ * Watch the root paths of the context with fanotify rather than inotify.
+ * inotify takes a watch per directory, set up by a walk of the tree and
+ * kept in records of its own; fanotify takes a single mark per filesystem,
+ * or mount, whatever the size of the tree. Root paths are covered from the
+ * moment they're added, no walk is made.
+ *
+ * Events come with the file handle of the directory and the entry name.
+ * The handle is resolved to a path, cached by directory, when the event is
+ * read; a directory deleted by then, and the events in it, can't be
+ * resolved and aren't reported. Events that fall outside the root paths
+ * of the context, or in a directory their excludes or max_depth leave
+ * out, are dropped in user space. The events reported and their masks are
+ * those of inotify, but for FLUFFY_IGNORED, which is only reported for root
+ * paths, along with FLUFFY_ROOT_IGNORED.
+ *
+ * FLUFFY_FANOTIFY_FILESYSTEM: Every event of the filesystems the root paths
+ * are on is read.
+ *
+ * FLUFFY_FANOTIFY_MOUNT: Only the events of the mounts the root paths are on
+ * are read. fanotify doesn't report entries created, deleted or moved,
+ * attributes changed or root paths deleted or moved on mounts; only
+ * FLUFFY_ACCESS, FLUFFY_MODIFY, FLUFFY_OPEN and FLUFFY_CLOSE_* are. Moves
+ * going unseen, directories are resolved afresh for every batch of events.
+ *
+ * It takes CAP_SYS_ADMIN, and Linux 5.9 or later. It must be set before any
+ * path is added to the context. FLUFFY_ROOT_INVENTORY and FLUFFY_ROOT_POLL
+ * are not supported, FLUFFY_ROOT_LAZY is of no use and ignored. A queue
+ * overflow is reported, and ends the context with
+ * FLUFFY_OPT_OVERFLOW_TERMINATE; nothing else can be done about it, there
+ * is no watch to set again. The watch budget and
+ * the queue pressure apply to inotify and have no effect.
+ * fluffy_remove_watch_path() takes root paths alone.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- int:		FLUFFY_FANOTIFY_* mark, 0 to go back to inotify
+ * return:
+ * 	- int:		0 on success, EBUSY if paths were added already or
+ * 			the context is sharded, EPERM without
+ * 			CAP_SYS_ADMIN, error value otherwise
+ */
+extern int fluffy_set_fanotify(int fluffy_handle, int mark);
+
+/*
+ * Function:	fluffy_set_shards
+ *
+ * Spread the root paths of the context over shards. A shard is a context
+ * of its own, with an inotify instance, its queue and a thread to read it,
+ * that hands its events over to this one; the client callback is still run
+ * by the context thread alone, one event at a time. A noisy root path only
+ * overflows the queue of its shard, and only the root paths of that shard
+ * are reinitiated or rescanned.
+ *
+ * A root path goes to the shard of the root paths it's nested with, if
+ * any, and to the one with the fewest root paths otherwise. Events carry
+ * the shard they were read on and their sequence on it; they're in order
+ * within a shard, not across shards. A shard reads on while the context
+ * thread catches up with up to 16384 events, and waits for it beyond.
+ *
+ * With hot_rate, the events of every root path are counted. Once a second,
+ * the hottest root path at hot_rate or above that shares its shard, and
+ * has no root path nested with it, is moved to a shard that has none. It's
+ * added there, then removed from where it was; a few events around the
+ * move may be reported twice.
+ *
+ * It must be set before any path is added to the context, and can't be
+ * undone. The options, excludes, queue pressure, watch budget and storm
+ * detection of the context are passed on to every shard, when set and when
+ * set later; a watch budget applies to each shard. Stats are summed over
+ * the shards. It doesn't go with fluffy_set_fanotify(), nor with the fake
+ * backend of fluffy_fake.h.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const struct fluffy_shard_options *: shards to set up
+ * return:
+ * 	- int:		0 on success, EBUSY if paths were added already or
+ * 			shards set up, EINVAL if the options aren't valid,
+ * 			error value otherwise
+ */
+extern int fluffy_set_shards(int fluffy_handle,
+    const struct fluffy_shard_options *shardopts);
+
+/*
+ * Function:	fluffy_add_exclude
+ *
+ * Leave out subtrees from every root path of the context. A matching
+ * directory is neither watched nor descended into; a new directory that
+ * matches is not watched either. Matching files are not reported with
+ * FLUFFY_EXISTS or scanned FLUFFY_CREATE events. Root paths themselves are
+ * never excluded. Patterns apply to walks that begin after the call.
+ *
+ * FLUFFY_EXCLUDE_BASENAME: the entry name equals the pattern, node_modules
+ * FLUFFY_EXCLUDE_GLOB: fnmatch(3) with the entry name, *.git; with the full
+ * 	path when the pattern holds a '/', /srv/www/cache?
+ * FLUFFY_EXCLUDE_REGEX: POSIX extended regex searched in the full path
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- int:		FLUFFY_EXCLUDE_* type of the pattern
+ * 	- const char *:	the pattern
+ * return:
+ * 	- int:		0 on success, error value otherwise
+ */
+extern int fluffy_add_exclude(int fluffy_handle, int type,
+    const char *pattern);
+
+/*
+ * Function:	fluffy_set_allocator
+ *
+ * Have Fluffy take its memory from the client's allocator rather than from
+ * malloc(3). Every allocation Fluffy makes goes through alloc_fn and
+ * realloc_fn and is given back through free_fn; the watch records, their
+ * paths and the tables that index them included. alloc_ctx is passed on to
+ * each call as is, to account the memory to a subsystem say. Memory that
+ * libc allocates on its own within the calls Fluffy makes, nftw(3) and
+ * regcomp(3), isn't covered.
+ *
+ * Memory has to go back where it came from, so the allocator can be set
+ * only while no context is live; before the first fluffy_init(), or once
+ * every context has been destroyed. NULL for all three functions restores
+ * malloc(3). An allocator that returns NULL fails the call that needed the
+ * memory, as if malloc(3) had.
+ *
+ * args:
+ * 	- void *(*alloc_fn)(size_t, void *):	malloc(3) alike
+ * 	- void *(*realloc_fn)(void *, size_t, void *):	realloc(3) alike
+ * 	- void (*free_fn)(void *, void *):	free(3) alike, never passed
+ * 						NULL
+ * 	- void *:	alloc_ctx, passed on as the last argument
+ * return:
+ * 	- int:		0 on success, EBUSY while a context is live, EINVAL
+ * 			when some of the functions are NULL but not all
+ */
+extern int fluffy_set_allocator(
+    void *(*alloc_fn)(size_t size, void *alloc_ctx),
+    void *(*realloc_fn)(void *ptr, size_t size, void *alloc_ctx),
+    void (*free_fn)(void *ptr, void *alloc_ctx), void *alloc_ctx);
+
+
 /* Helper functions */
 
 /*
  * Function:	fluffy_reinitiate_context
  *
  * On a queue overflow, FLUFFY_Q_OVERFLOW event, fluffy inherently reinitiates
- * the context. While reinitiation, all watches of the context is removed and
- * then set from scratch. Fluffy reinitiates automatically only on a queue
- * overflow.
+ * the context. While reinitiation, all watches of the context are set from
+ * scratch on a fresh inotify instance, while the old one goes on reporting
+ * events; the context switches over once they're set. Events that both
+ * instances queued meanwhile are reported once. Fluffy reinitiates
+ * automatically only on a queue overflow, unless the context is set to
+ * handle it otherwise; see fluffy_set_context_options().
  *
  * This function is exposed to the client and may be called when a reinitiation
  * is required for any other situation/use case. It's a quite expensive call,
- * avoid unless it's absolutely necessary.
+ * avoid unless it's absolutely necessary. It returns once the context has
+ * switched over, unless called from the event callback; the watches are then
+ * set up by a thread of their own.
  *
  * args:
  * 	- int:	The context handle received from fluffy_init()
  * return:
- * 	- int:	0 on successful reinitiation, error value otherwise
+ * 	- int:	0 on successful reinitiation, error value otherwise; EALREADY
+ * 		if a reinitiation is under way
  */
 extern int fluffy_reinitiate_context(int fluffy_handle);
 
@@ -193,9 +847,9 @@ extern int fluffy_reinitiate_context(int fluffy_handle);
  * Function:	fluffy_reinitiate_all_contexts
  *
  * On a queue overflow, FLUFFY_Q_OVERFLOW event, fluffy inherently reinitiates
- * the context. While reinitiation, all watches of the context is removed and
- * then set from scratch. Fluffy reinitiates a context automatically only on a
- * queue overflow event.
+ * the context. While reinitiation, all watches of the context are set from
+ * scratch on a fresh inotify instance, see fluffy_reinitiate_context().
+ * Fluffy reinitiates a context automatically only on a queue overflow event.
  *
  * This function is exposed to the client and may be called when a reinitiation
  * of all contexts is required. It's a very expensive call, avoid unless it's
@@ -222,7 +876,8 @@ extern int fluffy_reinitiate_all_contexts();
  *
  * Consider calling fluffy_reinitiate_context() or
  * fluffy_reinitate_all_contexts() for the changes to be picked up because the
- * kernel library sets this only at the time of initiation.
+ * kernel library sets this only at the time of initiation. No event is missed
+ * while a context is reinitiated.
  *
  * args:
  * 	- const char *:	a character string representing numerical value.
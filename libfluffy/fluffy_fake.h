@@ -0,0 +1,56 @@
+#ifndef HUMBLE_FLUFFY_FAKE_H
+#define HUMBLE_FLUFFY_FAKE_H
+
+/*
+ * The in-memory stand-in for inotify, for benchmarks and tests of the
+ * library. It's not part of the installed interface.
+ */
+
+#include "fluffy.h"
+
+/*
+ * Function:	fluffy_set_fake_backend
+ *
+ * Put the context on an in-memory stand-in for inotify, for benchmarks of
+ * the user-space side: the reads, the records of the watches and paths,
+ * the dispatch to the callback. No kernel event reaches the context, they
+ * are all made up by fluffy_fake_inject().
+ *
+ * Paths are still walked on the filesystem, and must exist. A watch is
+ * kept per inode, as inotify does, whatever the mask; removing it queues
+ * FLUFFY_IGNORED. Events queued beyond max_queued_events are dropped and
+ * FLUFFY_Q_OVERFLOW is reported, as inotify would.
+ *
+ * It must be set before any path is added to the context, and can't be
+ * undone.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * return:
+ * 	- int:		0 on success, EBUSY if paths were added already or
+ * 			the context is sharded, error value otherwise
+ */
+extern int fluffy_set_fake_backend(int fluffy_handle);
+
+/*
+ * Function:	fluffy_fake_inject
+ *
+ * Queue an event on the fake backend of the context, as inotify would have
+ * for an entry of a watched directory. The call doesn't block; the event
+ * is read and reported by the context thread.
+ *
+ * args:
+ * 	- int:		fluffy context handle
+ * 	- const char *:	watched directory path, NULL for FLUFFY_Q_OVERFLOW
+ * 	- uint32_t:	FLUFFY_* event mask
+ * 	- uint32_t:	cookie tying FLUFFY_MOVED_FROM to FLUFFY_MOVED_TO, or 0
+ * 	- const char *:	entry name, NULL for the directory itself
+ * return:
+ * 	- int:		0 on success, EINVAL if the context isn't on the
+ * 			fake backend, ENOENT if the directory isn't
+ * 			watched, error value otherwise
+ */
+extern int fluffy_fake_inject(int fluffy_handle, const char *dirpath,
+    uint32_t mask, uint32_t cookie, const char *name);
+
+#endif
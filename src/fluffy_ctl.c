@@ -26,6 +26,7 @@ uint32_t events_mask = 0;
 
 int mqsend_watch(char *watch_path);
 int mqsend_ignore(char *ignore_path);
+int mqsend_exclude(char *exclude_pattern);
 int mqsend_max_user_watches(char *max_watches);
 int mqsend_max_queued_events(char *max_events);
 int mqsend_reinitiate();
@@ -102,6 +103,41 @@ mqsend_ignore(char *ignore_path)
 }
 
 
+int
+mqsend_exclude(char *exclude_pattern)
+{
+	int reterr = 0;
+	mqd_t mqexclude = -1;
+	mqexclude = mq_open(mqfluffy, O_WRONLY);
+	if (mqexclude == (mqd_t)-1) {
+		reterr = errno;
+		perror("mq_open");
+		return reterr;
+	}
+
+	char *mqmsg = NULL;
+	mqmsg = calloc(1, strlen(exclude_pattern) + 2);
+	if (mqmsg == NULL) {
+		reterr = errno;
+		perror("calloc");
+		return reterr;
+	}
+	mqmsg[0] = id_mqfluffy_exclude;
+	mqmsg = strncat(mqmsg, exclude_pattern, strlen(exclude_pattern) + 1);
+	if (mq_send(mqexclude, mqmsg, strlen(mqmsg) + 1, 0) == -1) {
+		reterr = errno;
+		perror("mq_send");
+		free(mqmsg);
+		return reterr;
+	}
+	free(mqmsg);
+	if (mq_close(mqexclude)) {
+		perror("mq_close");
+	}
+	return 0;
+}
+
+
 int
 mqsend_events_mask(uint32_t mask)
 {
@@ -316,6 +352,7 @@ main(int argc, char *argv[])
 	*/
 	gchar **watch_paths = NULL;
 	gchar **ignore_paths = NULL;
+	gchar **exclude_patterns = NULL;
 	gchar *max_user_watches = NULL;
 	gchar *max_queued_events = NULL;
 	gboolean watch_glob = FALSE;
@@ -357,6 +394,13 @@ main(int argc, char *argv[])
 				"Any non-option argument passed will be " \
 				"considered as paths. [/hogwarts/*/dungeons]",
 			NULL },
+		{ "exclude", 'x', 0, G_OPTION_ARG_STRING_ARRAY,
+			&exclude_patterns,
+			"Subtrees to leave out while watching: wildcards " \
+				"match names, or full paths when the " \
+				"pattern holds a '/'. Repeat flag for " \
+				"multiple patterns.",
+			"node_modules" },
 		{ "max-user-watches", 'U', 0, G_OPTION_ARG_STRING,
 			&max_user_watches,
 			"Upper limit on the number of watches per uid " \
@@ -596,6 +640,20 @@ main(int argc, char *argv[])
 			max_user_watches = NULL;
 		}
 
+		/* Excludes apply to the watches that follow, send them first */
+		if (exclude_patterns != NULL) {
+			int j = 0;
+			do {
+				if (mqsend_exclude(exclude_patterns[j])) {
+					rc = -1;
+				}
+			} while (exclude_patterns[++j] != NULL);
+
+			g_strfreev(exclude_patterns);
+			exclude_patterns = NULL;
+			done = 1;
+		}
+
 		if (watch_paths != NULL) {
 			int j = 0;
 			do {
@@ -27,6 +27,7 @@ extern const char mqfluffy[];
 extern const char id_mqfluffy_exit;
 extern const char id_mqfluffy_watch;
 extern const char id_mqfluffy_ignore;
+extern const char id_mqfluffy_exclude;
 extern const char id_mqfluffy_reinitiate;
 extern const char id_mqfluffy_list_root_path;
 extern const char id_mqfluffy_max_user_watches;
@@ -191,6 +191,15 @@ process_fluffy_mqueue(struct epoll_event *evlist)
 			}
 		}
 
+		if (mqmsg[0] == id_mqfluffy_exclude) {
+			reterr = fluffy_add_exclude(flh, FLUFFY_EXCLUDE_GLOB,
+					mqmsg + 1);
+			if (reterr) {
+				free(mqmsg);
+				return reterr;
+			}
+		}
+
 		if (mqmsg[0] == id_mqfluffy_max_user_watches) {
 			reterr = fluffy_set_max_user_watches(mqmsg + 1);
 			if (reterr) {